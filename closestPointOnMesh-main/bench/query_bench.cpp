@@ -0,0 +1,737 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "PointQuery.h"
+#include "ClosestPointEngine.h"
+#include "Parallel.h"
+#include "ProcessMemory.h"
+
+namespace
+{
+enum MeshKind
+{
+    kIcosphere,
+    kScan
+};
+
+enum Distribution
+{
+    kNear,
+    kFar,
+    kCoherent,
+    kRandom,
+    kDistributionCount
+};
+
+enum Precision
+{
+    kMixed,
+    kFloat,
+    kDouble,
+    kRefine,
+    kPrecisionCount
+};
+
+const char* kMeshNames[] = {"icosphere", "scan"};
+const char* kDistributionNames[] = {"near", "far", "coherent", "random"};
+const char* kPrecisionNames[] = {"mixed", "float", "double", "refine"};
+
+/**
+ * @brief BenchOptions struct; command line settings of the benchmark
+ */
+struct BenchOptions
+{
+public:
+    size_t m_minTriangles = 1000;
+    size_t m_maxTriangles = 1000000;
+    size_t m_queryCount = 100000;
+    size_t m_checkCount = 0;            // queries per run checked against brute force, 0 for none
+    std::vector<int> m_threads;
+    bool m_meshes[2] = {true, true};
+    bool m_distributions[kDistributionCount] = {true, true, true, true};
+    bool m_precisions[kPrecisionCount] = {true, false, false, false};
+    std::vector<float> m_epsilons = {0.0f};    // approximate query errors, float and double engines only
+    bool m_linear = false;
+    bool m_builds = false;              // time the BVH builders only, no queries
+    uint32_t m_seed = 1;
+    std::string m_objFile;              // real mesh to run instead of the generated ones
+};
+
+/**
+ * @brief Seconds since an earlier time point
+ * @param start Start time
+ * @return double Elapsed seconds
+ */
+double secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Read an obj with the loader's messages sent to stderr, so stdout
+ * only carries the CSV
+ * @param objFile Obj file path
+ * @param threadCount Parser worker count
+ * @param mesh Output mesh
+ * @return true Loaded
+ */
+bool readObjQuietly(const std::string& objFile, const int& threadCount, Mesh& mesh)
+{
+    fflush(stdout);
+#ifdef _WIN32
+    const int saved = _dup(_fileno(stdout));
+    _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    const int saved = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+    const bool ok = mesh.readObj(objFile.c_str(), threadCount);
+    fflush(stdout);
+#ifdef _WIN32
+    _dup2(saved, _fileno(stdout));
+    _close(saved);
+#else
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+#endif
+    return ok;
+}
+
+/**
+ * @brief Build a unit icosphere by subdividing an icosahedron, 20 * 4^level
+ * faces
+ * @param level Subdivision count
+ * @param mesh Output mesh
+ */
+void makeIcosphere(const int& level, Mesh& mesh)
+{
+    const double t = (1.0 + std::sqrt(5.0)) / 2.0;
+    std::vector<Eigen::Vector3d> vertices = {
+        {-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0},
+        {0, -1, t}, {0, 1, t}, {0, -1, -t}, {0, 1, -t},
+        {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1}};
+    std::vector<uint32_t> faces = {
+        0, 11, 5,  0, 5, 1,   0, 1, 7,   0, 7, 10,  0, 10, 11,
+        1, 5, 9,   5, 11, 4,  11, 10, 2, 10, 7, 6,  7, 1, 8,
+        3, 9, 4,   3, 4, 2,   3, 2, 6,   3, 6, 8,   3, 8, 9,
+        4, 9, 5,   2, 4, 11,  6, 2, 10,  8, 6, 7,   9, 8, 1};
+    for (size_t i = 0; i < vertices.size(); i++) vertices[i].normalize();
+
+    // each edge is split once, its midpoint shared by both faces
+    std::unordered_map<uint64_t, uint32_t> midpoints;
+    auto midpoint = [&](const uint32_t& a, const uint32_t& b) {
+        const uint64_t key = (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+        std::unordered_map<uint64_t, uint32_t>::const_iterator it = midpoints.find(key);
+        if (it != midpoints.end()) return it->second;
+        const uint32_t id = static_cast<uint32_t>(vertices.size());
+        vertices.push_back((vertices[a] + vertices[b]).normalized());
+        midpoints.emplace(key, id);
+        return id;
+    };
+
+    for (int l = 0; l < level; l++)
+    {
+        std::vector<uint32_t> next;
+        next.reserve(4 * faces.size());
+        midpoints.clear();
+        midpoints.reserve(faces.size() * 3 / 2);
+        for (size_t f = 0; f < faces.size(); f += 3)
+        {
+            const uint32_t a = faces[f], b = faces[f + 1], c = faces[f + 2];
+            const uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            const uint32_t split[12] = {a, ab, ca,  b, bc, ab,  c, ca, bc,  ab, bc, ca};
+            next.insert(next.end(), split, split + 12);
+        }
+        faces.swap(next);
+    }
+
+    mesh.clear();
+    mesh.reserve(vertices.size(), faces.size() / 3);
+    for (size_t i = 0; i < vertices.size(); i++) mesh.addVertex(vertices[i]);
+    for (size_t f = 0; f < faces.size(); f += 3) mesh.addFace(faces[f], faces[f + 1], faces[f + 2]);
+}
+
+/**
+ * @brief Build a scan like height field over the unit square: a wavy surface
+ * with jittered samples, depth noise and a few holes where the scanner saw
+ * nothing. Roughly targetTriangles faces.
+ * @param targetTriangles Face count to aim for
+ * @param seed Random seed
+ * @param mesh Output mesh
+ */
+void makeScan(const size_t& targetTriangles, const uint32_t& seed, Mesh& mesh)
+{
+    const int side = std::max(1, static_cast<int>(std::lround(std::sqrt(targetTriangles / 2.0))));
+    const double cell = 1.0 / side;
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> jitter(-0.25 * cell, 0.25 * cell);
+    std::normal_distribution<double> noise(0.0, 0.2 * cell);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    mesh.clear();
+    mesh.reserve(static_cast<size_t>(side + 1) * (side + 1), 2 * static_cast<size_t>(side) * side);
+    for (int j = 0; j <= side; j++)
+    {
+        for (int i = 0; i <= side; i++)
+        {
+            const double x = i * cell + jitter(rng), y = j * cell + jitter(rng);
+            const double z = 0.1 * std::sin(6.0 * x) * std::cos(4.0 * y) + 0.05 * std::sin(17.0 * x * y) + noise(rng);
+            mesh.addVertex(x, y, z);
+        }
+    }
+
+    Eigen::Vector2d holes[4];
+    for (int h = 0; h < 4; h++) holes[h] = Eigen::Vector2d(unit(rng), unit(rng));
+    const double holeRadiusSq = 0.04 * 0.04;
+    for (int j = 0; j < side; j++)
+    {
+        for (int i = 0; i < side; i++)
+        {
+            const Eigen::Vector2d center((i + 0.5) * cell, (j + 0.5) * cell);
+            bool inHole = false;
+            for (int h = 0; h < 4; h++) inHole = inHole || (center - holes[h]).squaredNorm() < holeRadiusSq;
+            if (inHole) continue;
+
+            const uint32_t v00 = static_cast<uint32_t>(j * (side + 1) + i), v10 = v00 + 1;
+            const uint32_t v01 = v00 + side + 1, v11 = v01 + 1;
+            mesh.addFace(v00, v10, v11);
+            mesh.addFace(v00, v11, v01);
+        }
+    }
+}
+
+/**
+ * @brief Uniform random point on a random face
+ * @param mesh Mesh
+ * @param rng Random generator
+ * @return Eigen::Vector3d Surface point
+ */
+Eigen::Vector3d randomSurfacePoint(const Mesh& mesh, std::mt19937& rng)
+{
+    std::uniform_int_distribution<uint32_t> face(0, static_cast<uint32_t>(mesh.getFaceCount() - 1));
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    Eigen::Vector3d v1, v2, v3;
+    mesh.getFaceVertices(face(rng), v1, v2, v3);
+    const double s = std::sqrt(unit(rng)), t = unit(rng);
+    return (1.0 - s) * v1 + s * (1.0 - t) * v2 + s * t * v3;
+}
+
+/**
+ * @brief Uniform random unit vector
+ * @param rng Random generator
+ * @return Eigen::Vector3d Direction
+ */
+Eigen::Vector3d randomDirection(std::mt19937& rng)
+{
+    std::normal_distribution<double> normal(0.0, 1.0);
+    Eigen::Vector3d d;
+    do
+    {
+        d = Eigen::Vector3d(normal(rng), normal(rng), normal(rng));
+    } while (d.squaredNorm() < 1e-12);
+    return d.normalized();
+}
+
+/**
+ * @brief Generate query points around a mesh
+ * @param mesh Mesh
+ * @param distribution kNear: up to 1% of the bounding diagonal off the surface;
+ * kFar: a shell 2 to 5 bounding radii from the center; kCoherent: random walks
+ * along the surface in steps of 0.1% of the diagonal, restarted every 1000
+ * points; kRandom: uniform in the bounding box grown by 10%
+ * @param count Number of points
+ * @param seed Random seed
+ * @param points Output points
+ */
+void makeQueries(const Mesh& mesh, const Distribution& distribution, const size_t& count, const uint32_t& seed, std::vector<Eigen::Vector3d>& points)
+{
+    Eigen::Vector3d bmin = mesh.getVertex(0), bmax = bmin;
+    for (uint32_t i = 1; i < mesh.getVertexCount(); i++)
+    {
+        bmin = bmin.cwiseMin(mesh.getVertex(i));
+        bmax = bmax.cwiseMax(mesh.getVertex(i));
+    }
+    const Eigen::Vector3d center = 0.5 * (bmin + bmax);
+    const double diagonal = (bmax - bmin).norm();
+
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    points.resize(count);
+    Eigen::Vector3d walk = Eigen::Vector3d::Zero();
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (distribution)
+        {
+        case kNear:
+            points[i] = randomSurfacePoint(mesh, rng) + randomDirection(rng) * (0.01 * diagonal * unit(rng));
+            break;
+        case kFar:
+            points[i] = center + randomDirection(rng) * (0.5 * diagonal * (2.0 + 3.0 * unit(rng)));
+            break;
+        case kCoherent:
+            if (i % 1000 == 0) walk = randomSurfacePoint(mesh, rng);
+            else walk += randomDirection(rng) * (0.001 * diagonal);
+            points[i] = walk;
+            break;
+        default:
+            {
+                const Eigen::Vector3d lo = bmin - 0.05 * (bmax - bmin), hi = bmax + 0.05 * (bmax - bmin);
+                points[i] = Eigen::Vector3d(lo.x() + unit(rng) * (hi.x() - lo.x()), lo.y() + unit(rng) * (hi.y() - lo.y()), lo.z() + unit(rng) * (hi.z() - lo.z()));
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief BenchEngines struct; what a mesh can be queried with. mixed is the
+ * PointQuery itself, the others its ClosestPointEngines.
+ */
+struct BenchEngines
+{
+public:
+    const PointQuery* m_query;
+    std::unique_ptr<FloatEngine> m_float;
+    std::unique_ptr<DoubleEngine> m_double;
+};
+
+/**
+ * @brief Time all queries of a distribution on a thread count. Coherent walks
+ * run through queryCoherent() in contiguous chunks, so each worker follows its
+ * own part of the walk; the engines have no coherent query and run them as
+ * they are.
+ * @param engines Query object and engines of the mesh
+ * @param precision Which of them to use
+ * @param epsilon Error of the approximate engine query, 0 for the exact query
+ * @param points Query points
+ * @param coherent Use queryCoherent()
+ * @param threadCount Worker count
+ * @param hits Output hit per point
+ * @param bounds Output bound per point of the approximate query, untouched
+ * without an epsilon
+ * @return double Seconds
+ */
+double runQueries(const BenchEngines& engines, const Precision& precision, const float& epsilon, const std::vector<Eigen::Vector3d>& points,
+                  const bool& coherent, const int& threadCount, std::vector<QueryHit>& hits, std::vector<float>& bounds)
+{
+    hits.resize(points.size());
+    if (epsilon > 0.0f) bounds.resize(points.size());
+    const float maxDist = std::numeric_limits<float>::max();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    parallelFor(points.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        for (size_t i = begin; i < end; i++)
+        {
+            switch (precision)
+            {
+            case kFloat:
+                if (epsilon > 0.0f) engines.m_float->queryApproximate(points[i], maxDist, epsilon, context, hits[i], bounds[i]);
+                else engines.m_float->query(points[i], maxDist, context, hits[i]);
+                break;
+            case kDouble:
+                if (epsilon > 0.0f) engines.m_double->queryApproximate(points[i], maxDist, epsilon, context, hits[i], bounds[i]);
+                else engines.m_double->query(points[i], maxDist, context, hits[i]);
+                break;
+            case kRefine:
+                engines.m_float->query(points[i], maxDist, context, hits[i], true);
+                break;
+            default:
+                if (coherent) engines.m_query->queryCoherent(points[i], maxDist, context, hits[i]);
+                else engines.m_query->query(points[i], maxDist, context, hits[i]);
+                break;
+            }
+        }
+    }, coherent ? 1024 : 256);
+    return secondsSince(start);
+}
+
+/**
+ * @brief Compare the first hits with the brute force scan of the same
+ * precision; refined float hits are compared with the double engine's scan.
+ * Approximate hits have to be within the bound they report, and that bound
+ * within 1 + epsilon.
+ * @param engines Query object and engines of the mesh
+ * @param precision Which of them the hits came from
+ * @param epsilon Error of the approximate query, 0 for the exact query
+ * @param points Query points
+ * @param hits Hits of runQueries()
+ * @param bounds Bounds of runQueries() for approximate hits
+ * @param checkCount Number of points to check
+ * @param threadCount Worker count
+ * @return size_t Number of hits that differ in face, vertex or distance, or
+ * break their bound
+ */
+size_t checkQueries(const BenchEngines& engines, const Precision& precision, const float& epsilon, const std::vector<Eigen::Vector3d>& points,
+                    const std::vector<QueryHit>& hits, const std::vector<float>& bounds, const size_t& checkCount, const int& threadCount)
+{
+    const size_t count = std::min(checkCount, points.size());
+    const float maxDist = std::numeric_limits<float>::max();
+    // bounds are float and the distances behind them rounded once more
+    const double slack = 1.0 + 1e-5;
+    std::vector<char> differs(count, 0);
+    parallelFor(count, threadCount, [&](size_t begin, size_t end) {
+        QueryHit reference;
+        for (size_t i = begin; i < end; i++)
+        {
+            if (precision == kFloat) engines.m_float->bruteForce(points[i], maxDist, reference);
+            else if (precision == kMixed) engines.m_query->bruteForce(points[i], maxDist, reference);
+            else engines.m_double->bruteForce(points[i], maxDist, reference);
+            if (epsilon > 0.0f)
+            {
+                differs[i] = reference.m_found != hits[i].m_found || bounds[i] > (1.0 + epsilon) * slack ||
+                             std::sqrt(hits[i].m_distSq) > std::sqrt(reference.m_distSq) * bounds[i] * slack;
+                continue;
+            }
+            differs[i] = reference.m_found != hits[i].m_found || reference.m_faceId != hits[i].m_faceId ||
+                         reference.m_vertexId != hits[i].m_vertexId || reference.m_dist != hits[i].m_dist;
+        }
+    }, 16);
+    return static_cast<size_t>(std::count(differs.begin(), differs.end(), 1));
+}
+
+/**
+ * @brief ErrorSummary struct; accuracy of approximate hits against exact ones
+ */
+struct ErrorSummary
+{
+public:
+    double m_mean;      // mean relative distance error
+    double m_max;       // largest relative distance error
+    double m_maxBound;  // largest bound reported, minus 1
+};
+
+/**
+ * @brief Relative distance errors of approximate hits
+ * @param exact Exact hits
+ * @param hits Approximate hits
+ * @param bounds Bounds they reported
+ * @return ErrorSummary Summary
+ */
+ErrorSummary summarizeErrors(const std::vector<QueryHit>& exact, const std::vector<QueryHit>& hits, const std::vector<float>& bounds)
+{
+    ErrorSummary summary = {0.0, 0.0, 0.0};
+    for (size_t i = 0; i < hits.size(); i++)
+    {
+        const double exactDist = std::sqrt(exact[i].m_distSq), dist = std::sqrt(hits[i].m_distSq);
+        const double error = exactDist > 0.0 ? std::max(0.0, dist / exactDist - 1.0) : 0.0;
+        summary.m_mean += error;
+        summary.m_max = std::max(summary.m_max, error);
+        summary.m_maxBound = std::max(summary.m_maxBound, bounds[i] - 1.0);
+    }
+    if (!hits.empty()) summary.m_mean /= hits.size();
+    return summary;
+}
+
+/**
+ * @brief Parse a comma separated list of thread counts
+ * @param text List, e.g. "1,2,4"
+ * @param threads Output counts
+ * @return true Every entry is a positive number
+ */
+bool parseThreads(const char* text, std::vector<int>& threads)
+{
+    threads.clear();
+    const char* p = text;
+    while (*p)
+    {
+        char* end;
+        const long n = strtol(p, &end, 10);
+        if (end == p || n <= 0) return false;
+        threads.push_back(static_cast<int>(n));
+        if (*end && *end != ',') return false;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return !threads.empty();
+}
+
+/**
+ * @brief Parse a comma separated list of epsilons
+ * @param text List, e.g. "0,0.01,0.1"
+ * @param epsilons Output values
+ * @return true Every entry is a number, not negative
+ */
+bool parseEpsilons(const char* text, std::vector<float>& epsilons)
+{
+    epsilons.clear();
+    const char* p = text;
+    while (*p)
+    {
+        char* end;
+        const double e = strtod(p, &end);
+        if (end == p || !(e >= 0.0)) return false;
+        epsilons.push_back(static_cast<float>(e));
+        if (*end && *end != ',') return false;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return !epsilons.empty();
+}
+
+/**
+ * @brief Parse a comma separated subset of names
+ * @param text List, e.g. "near,far"
+ * @param names Known names
+ * @param count Number of names
+ * @param enabled Output flag per name
+ * @return true Every entry is known
+ */
+bool parseNames(const std::string& text, const char* const* names, const int& count, bool* enabled)
+{
+    std::fill(enabled, enabled + count, false);
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) end = text.size();
+        const std::string name = text.substr(start, end - start);
+        int i = 0;
+        while (i < count && name != names[i]) i++;
+        if (i == count) return false;
+        enabled[i] = true;
+        start = end + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief Mesh sizes of a run: decades from min to max, the icosphere level
+ * closest to each
+ * @param options Benchmark settings
+ * @return std::vector<size_t> Target face counts
+ */
+std::vector<size_t> targetSizes(const BenchOptions& options)
+{
+    std::vector<size_t> sizes;
+    for (size_t n = options.m_minTriangles; n <= options.m_maxTriangles; n *= 10) sizes.push_back(n);
+    return sizes;
+}
+
+/**
+ * @brief Icosphere level whose face count is closest to a target, in log scale
+ * @param targetTriangles Face count to aim for
+ * @return int Subdivision level
+ */
+int icosphereLevel(const size_t& targetTriangles)
+{
+    const double level = std::log(std::max(20.0, static_cast<double>(targetTriangles)) / 20.0) / std::log(4.0);
+    return static_cast<int>(std::lround(level));
+}
+
+void printUsage()
+{
+    printf("usage: query_bench [--min-triangles N] [--max-triangles N] [--queries N] [--threads 1,2,4]\n"
+           "                   [--mesh icosphere,scan] [--dist near,far,coherent,random] [--lbvh]\n"
+           "                   [--precision mixed,float,double,refine] [--epsilon 0,0.01,...]\n"
+           "                   [--check N] [--seed S] [--obj PATH] [--builds]\n");
+}
+
+/**
+ * @brief Time the BVH builders on one mesh, printing one CSV row for the SAH
+ * build and one per thread count for the linear build. The SAH builder runs
+ * on one thread, speedup is its time over the row's.
+ * @param options Benchmark settings
+ * @param meshName Name for the mesh column
+ * @param mesh Mesh, needs at least one face
+ */
+void benchBuilds(const BenchOptions& options, const std::string& meshName, const Mesh& mesh)
+{
+    BVH bvh;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bvh.build(mesh);
+    const double sahSeconds = secondsSince(start);
+    printf("%s,%zu,sah,1,%.4f,1.00,%.3f\n", meshName.c_str(), mesh.getFaceCount(), sahSeconds, bvh.cost());
+
+    for (size_t t = 0; t < options.m_threads.size(); t++)
+    {
+        const int threads = options.m_threads[t];
+        start = std::chrono::steady_clock::now();
+        bvh.buildLinear(mesh, threads);
+        const double seconds = secondsSince(start);
+        printf("%s,%zu,lbvh,%d,%.4f,%.2f,%.3f\n", meshName.c_str(), mesh.getFaceCount(), threads, seconds,
+               seconds > 0.0 ? sahSeconds / seconds : 0.0, bvh.cost());
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Time one mesh: build its tree and engines, then run every enabled
+ * query distribution, precision, epsilon and thread count on it, printing one
+ * CSV row per run
+ * @param options Benchmark settings
+ * @param meshName Name for the mesh column
+ * @param mesh Mesh, needs at least one face
+ * @return size_t Checked queries that differ from the brute force scan
+ */
+size_t benchMesh(const BenchOptions& options, const std::string& meshName, const Mesh& mesh)
+{
+    size_t totalMismatches = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    BVH bvh;
+    if (options.m_linear) bvh.buildLinear(mesh, options.m_threads.back());
+    else bvh.build(mesh);
+    PointQuery query(mesh, std::move(bvh));
+    const double buildSeconds = secondsSince(start);
+    BenchEngines engines;
+    engines.m_query = &query;
+    if (options.m_precisions[kFloat] || options.m_precisions[kRefine]) engines.m_float.reset(new FloatEngine(query));
+    const bool approximate = *std::max_element(options.m_epsilons.begin(), options.m_epsilons.end()) > 0.0f;
+    if (options.m_precisions[kDouble] || options.m_precisions[kRefine]) engines.m_double.reset(new DoubleEngine(query));
+    const double rss = residentMegabytes();
+
+    std::vector<Eigen::Vector3d> points;
+    std::vector<QueryHit> hits, exact;
+    std::vector<float> bounds;
+    for (int d = 0; d < kDistributionCount; d++)
+    {
+        if (!options.m_distributions[d]) continue;
+        makeQueries(mesh, static_cast<Distribution>(d), options.m_queryCount, options.m_seed + d, points);
+        for (int p = 0; p < kPrecisionCount; p++)
+        {
+            if (!options.m_precisions[p]) continue;
+            const Precision precision = static_cast<Precision>(p);
+            // exact distances of the same engine to measure the approximate queries against
+            if (approximate && (precision == kFloat || precision == kDouble)) runQueries(engines, precision, 0.0f, points, false, options.m_threads.back(), exact, bounds);
+            for (size_t e = 0; e < options.m_epsilons.size(); e++)
+            {
+                const float epsilon = options.m_epsilons[e];
+                if (epsilon > 0.0f && precision != kFloat && precision != kDouble) continue;
+
+                double baseQps = 0.0;
+                for (size_t t = 0; t < options.m_threads.size(); t++)
+                {
+                    const int threads = options.m_threads[t];
+                    const double seconds = runQueries(engines, precision, epsilon, points, d == kCoherent, threads, hits, bounds);
+                    const double qps = seconds > 0.0 ? points.size() / seconds : 0.0;
+                    if (t == 0) baseQps = qps;
+
+                    std::string mismatches, errors = ",,";
+                    if (options.m_checkCount > 0)
+                    {
+                        const size_t differ = checkQueries(engines, precision, epsilon, points, hits, bounds, options.m_checkCount, options.m_threads.back());
+                        totalMismatches += differ;
+                        mismatches = std::to_string(differ);
+                    }
+                    if (epsilon > 0.0f)
+                    {
+                        const ErrorSummary summary = summarizeErrors(exact, hits, bounds);
+                        char line[128];
+                        snprintf(line, sizeof(line), "%.3g,%.3g,%.3g", summary.m_mean, summary.m_max, summary.m_maxBound);
+                        errors = line;
+                    }
+                    printf("%s,%zu,%zu,%.4f,%.1f,%.1f,%s,%s,%g,%d,%zu,%.4f,%.0f,%.2f,%s,%s\n", meshName.c_str(), mesh.getFaceCount(), mesh.getVertexCount(),
+                           buildSeconds, rss, peakResidentMegabytes(), kDistributionNames[d], kPrecisionNames[p], epsilon, threads, points.size(), seconds, qps,
+                           baseQps > 0.0 ? qps / baseQps : 0.0, mismatches.c_str(), errors.c_str());
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    return totalMismatches;
+}
+}
+
+/**
+ * @brief Benchmark the closest point query on generated meshes, or on one obj
+ * with --obj. Prints one CSV row per mesh, query distribution and thread
+ * count: build time, queries per second, memory and the speedup over the first
+ * thread count. With --check the first N queries of every run are compared
+ * with the brute force scan and the exit code is 1 if any differ.
+ */
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--min-triangles" && hasValue) options.m_minTriangles = std::max(1L, atol(argv[++i]));
+        else if (arg == "--max-triangles" && hasValue) options.m_maxTriangles = std::max(1L, atol(argv[++i]));
+        else if (arg == "--queries" && hasValue) options.m_queryCount = std::max(1L, atol(argv[++i]));
+        else if (arg == "--check" && hasValue) options.m_checkCount = std::max(0L, atol(argv[++i]));
+        else if (arg == "--seed" && hasValue) options.m_seed = static_cast<uint32_t>(atol(argv[++i]));
+        else if (arg == "--lbvh") options.m_linear = true;
+        else if (arg == "--builds") options.m_builds = true;
+        else if (arg == "--obj" && hasValue) options.m_objFile = argv[++i];
+        else if (arg == "--threads" && hasValue && parseThreads(argv[++i], options.m_threads)) continue;
+        else if (arg == "--mesh" && hasValue && parseNames(argv[++i], kMeshNames, 2, options.m_meshes)) continue;
+        else if (arg == "--precision" && hasValue && parseNames(argv[++i], kPrecisionNames, kPrecisionCount, options.m_precisions)) continue;
+        else if (arg == "--epsilon" && hasValue && parseEpsilons(argv[++i], options.m_epsilons)) continue;
+        else if (arg == "--dist" && hasValue && parseNames(argv[++i], kDistributionNames, kDistributionCount, options.m_distributions)) continue;
+        else
+        {
+            printUsage();
+            return 2;
+        }
+    }
+    if (options.m_threads.empty())
+    {
+        // powers of two up to the hardware thread count, and that count itself
+        const int hw = resolveThreadCount(0);
+        for (int t = 1; t < hw; t *= 2) options.m_threads.push_back(t);
+        options.m_threads.push_back(hw);
+    }
+
+    if (options.m_builds) printf("mesh,triangles,builder,threads,build_s,speedup,cost\n");
+    else printf("mesh,triangles,vertices,build_s,rss_mb,peak_rss_mb,distribution,precision,epsilon,threads,queries,seconds,qps,speedup,mismatches,mean_error,max_error,max_bound\n");
+    fflush(stdout);
+
+    size_t totalMismatches = 0;
+    if (!options.m_objFile.empty())
+    {
+        Mesh mesh;
+        if (!readObjQuietly(options.m_objFile, options.m_threads.back(), mesh) || mesh.getFaceCount() == 0)
+        {
+            fprintf(stderr, "No faces loaded from %s\n", options.m_objFile.c_str());
+            return 2;
+        }
+        const std::string meshName = std::filesystem::path(options.m_objFile).stem().string();
+        if (options.m_builds) benchBuilds(options, meshName, mesh);
+        else totalMismatches += benchMesh(options, meshName, mesh);
+    }
+
+    const std::vector<size_t> sizes = targetSizes(options);
+    for (int kind = kIcosphere; kind <= kScan && options.m_objFile.empty(); kind++)
+    {
+        if (!options.m_meshes[kind]) continue;
+        int lastLevel = -1;
+        for (size_t s = 0; s < sizes.size(); s++)
+        {
+            Mesh mesh;
+            if (kind == kIcosphere)
+            {
+                // neighbouring decades can round to the same level
+                const int level = icosphereLevel(sizes[s]);
+                if (level == lastLevel) continue;
+                lastLevel = level;
+                makeIcosphere(level, mesh);
+            }
+            else
+            {
+                makeScan(sizes[s], options.m_seed, mesh);
+            }
+            if (options.m_builds) benchBuilds(options, kMeshNames[kind], mesh);
+            else totalMismatches += benchMesh(options, kMeshNames[kind], mesh);
+        }
+    }
+
+    if (totalMismatches > 0)
+    {
+        fprintf(stderr, "%zu queries differ from the brute force scan\n", totalMismatches);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <memory>
+#include "Mesh.h"
+#include "TriangleKernel.h"
+
+/**
+ * @brief BVHNode struct; axis aligned bounds plus either a child index
+ * (interior node) or a range into the BVH face index array (leaf node).
+ * Leaf ranges start on a TriangleBlock boundary.
+ * Children of an interior node are stored next to each other, right = left + 1.
+ */
+struct BVHNode
+{
+public:
+    Eigen::Vector3d m_min, m_max;
+    int m_left;     // first child for interior nodes, first face slot for leaves
+    int m_count;    // 0 for interior nodes, face count for leaves
+
+    inline bool isLeaf() const {return m_count > 0;};
+};
+
+/**
+ * @brief BVH class; AABB tree over the faces of a mesh, built either top-down
+ * with binned SAH splits (build()) or in parallel as a linear BVH over Morton
+ * codes (buildLinear()).
+ * Nodes are kept in one flat array with the root at index 0, faces are
+ * referenced through a permuted array of face indices. Leaf triangles are also
+ * copied into TriangleBlocks so leaves can be tested 4 faces at a time; the face
+ * index array is padded with -1 to match the block lanes.
+ * All arrays can borrow from a mapped MeshCache file instead of being built.
+ * For meshes that deform without changing topology the tree can be refit to new
+ * vertex positions; inflation() tells how much the refit tree got worse than a
+ * fresh build.
+ */
+class BVH
+{
+private:
+    Buffer<BVHNode> m_nodes;
+    Buffer<int> m_faceIndices;
+    Buffer<TriangleBlock> m_blocks;
+    int m_leafSize;
+    int m_faceCount;
+    double m_buildCost;
+    bool m_linear;
+    std::shared_ptr<const void> m_storage;
+
+    friend class MeshCache;
+
+    void buildNode(const int& nodeId, const int& first, const int& count, const int& depth,
+                   const std::vector<Eigen::Vector3d>& faceMin,
+                   const std::vector<Eigen::Vector3d>& faceMax,
+                   const std::vector<Eigen::Vector3d>& centroids);
+    void buildBlocks(const Mesh& mesh, const int& threadCount = 0);
+
+public:
+    static const int kMaxDepth = 48;
+
+    BVH() : m_leafSize(8), m_faceCount(0), m_buildCost(0.0), m_linear(false) {};
+    ~BVH() {};
+
+    void build(const Mesh& mesh, const int& leafSize = 8);
+    void buildLinear(const Mesh& mesh, const int& threadCount = 0, const int& leafSize = 8);
+    void rebuild(const Mesh& mesh, const int& threadCount = 0);
+    void refit(const Mesh& mesh, const int& threadCount = 0);
+    double cost() const;
+    double inflation() const;
+    int depth() const;
+
+    inline bool empty() const {return m_nodes.empty();};
+    inline const BVHNode& getNode(const int& id) const {return m_nodes[id];};
+    inline int getNodeCount() const {return static_cast<int>(m_nodes.size());};
+    inline int getLeafSize() const {return m_leafSize;};
+    inline bool isLinear() const {return m_linear;};
+    inline int getFaceIndex(const int& slot) const {return m_faceIndices[slot] < m_faceCount ? m_faceIndices[slot] : -1;};
+    inline int getSlotCount() const {return static_cast<int>(m_faceIndices.size());};
+    inline const TriangleBlock& getBlock(const int& id) const {return m_blocks[id];};
+
+    // a tree mapped from a cache is not checked when it is loaded, that would
+    // read all of it; nodes are checked as they are walked instead
+    inline bool hasChildren(const int& id, const BVHNode& node) const {return !node.isLeaf() && node.m_left > id && node.m_left < getNodeCount() - 1;};
+    inline bool hasSlots(const BVHNode& node) const {return node.m_left >= 0 && node.m_left % kTriangleBlockSize == 0 && node.m_count <= getSlotCount() - node.m_left;};
+
+    static double pointBoxDistanceSq(const Eigen::Vector3d& point, const BVHNode& node);
+    static bool rayBoxIntersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& invDir, const BVHNode& node, const double& tMax, double& tNear);
+    static void refitInterior(BVHNode* nodes, const int& nodeCount, const int& threadCount);
+    static double treeCost(const BVHNode* nodes, const int& nodeCount);
+};
+
+#endif // BVH_H
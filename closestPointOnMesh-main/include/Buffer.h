@@ -0,0 +1,89 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief ArrayView struct; non owning read only view over contiguous data,
+ * stand-in for std::span so accessors can hand out mesh buffers without copying.
+ */
+template <typename T>
+struct ArrayView
+{
+public:
+    const T* m_data;
+    size_t m_size;
+    ArrayView() : m_data(NULL), m_size(0) {};
+    ArrayView(const T* data, const size_t& size) : m_data(data), m_size(size) {};
+
+    inline const T& operator[](const size_t& i) const {return m_data[i];};
+    inline size_t size() const {return m_size;};
+    inline bool empty() const {return m_size == 0;};
+    inline const T* data() const {return m_data;};
+    inline const T* begin() const {return m_data;};
+    inline const T* end() const {return m_data + m_size;};
+};
+
+/**
+ * @brief Buffer class; array that either owns its elements in a std::vector or
+ * borrows them from memory owned by someone else (e.g. a memory mapped cache).
+ * Reads never copy. Any write to a borrowed buffer first copies the borrowed
+ * elements into owned storage (copy on write).
+ */
+template <typename T>
+class Buffer
+{
+private:
+    std::vector<T> m_owned;
+    const T* m_borrowed;
+    size_t m_borrowedSize;
+
+public:
+    Buffer() : m_borrowed(NULL), m_borrowedSize(0) {};
+    ~Buffer() {};
+
+    inline const T* data() const {return m_borrowed ? m_borrowed : m_owned.data();};
+    inline size_t size() const {return m_borrowed ? m_borrowedSize : m_owned.size();};
+    inline bool empty() const {return size() == 0;};
+    inline bool isBorrowed() const {return m_borrowed != NULL;};
+    inline const T& operator[](const size_t& i) const {return data()[i];};
+    inline T& operator[](const size_t& i) {return owned()[i];};
+    inline ArrayView<T> view() const {return ArrayView<T>(data(), size());};
+
+    /**
+     * @brief Owned storage, copying borrowed elements in first if needed
+     * @return std::vector<T>& Owned elements
+     */
+    std::vector<T>& owned()
+    {
+        if (m_borrowed)
+        {
+            m_owned.assign(m_borrowed, m_borrowed + m_borrowedSize);
+            m_borrowed = NULL;
+            m_borrowedSize = 0;
+        }
+        return m_owned;
+    };
+
+    /**
+     * @brief Point the buffer at external memory, dropping owned elements.
+     * The memory has to outlive the buffer and every copy of it.
+     * @param data First element
+     * @param size Element count
+     */
+    void borrow(const T* data, const size_t& size)
+    {
+        std::vector<T>().swap(m_owned);
+        m_borrowed = size ? data : NULL;
+        m_borrowedSize = size ? size : 0;
+    };
+
+    inline void push_back(const T& value) {owned().push_back(value);};
+    inline void reserve(const size_t& count) {owned().reserve(count);};
+    inline void resize(const size_t& count) {owned().resize(count);};
+    inline void swap(std::vector<T>& other) {owned().swap(other);};
+    inline void clear() {borrow(NULL, 0);};
+};
+
+#endif // BUFFER_H
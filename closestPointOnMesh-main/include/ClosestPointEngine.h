@@ -0,0 +1,79 @@
+#ifndef CLOSESTPOINTENGINE_H
+#define CLOSESTPOINTENGINE_H
+
+#include <vector>
+#include "PointQuery.h"
+#include "ScalarPolicy.h"
+
+/**
+ * @brief ClosestPointEngine class; closest point queries with every step of the
+ * search done in one scalar type, picked by the Policy (FloatPolicy or
+ * DoublePolicy). PointQuery stores double coordinates but compares float
+ * distances; the engine instead copies the BVH nodes and triangle blocks of a
+ * PointQuery into the policy's scalar, relative to the center of the mesh
+ * bounds. The float engine halves the memory walked per query and tests a
+ * block per SSE register, the double engine is exact.
+ * The float engine can refine a query in double: the float walk also keeps
+ * every face within the float error of its best distance, and those are
+ * tested again in double to pick the exact closest face. Refined results are
+ * the ones of the double engine.
+ * queryApproximate() trades accuracy for speed: it skips every node that could
+ * only improve the distance by less than a factor 1 + epsilon and reports the
+ * factor it actually achieved.
+ * Unlike PointQuery::query() the engine reports the closest point on the
+ * surface itself: a query point on the surface is found at distance 0, hits
+ * are always faces and equal distances go to the lowest face id.
+ * The mesh is referenced and has to outlive the engine; build a new engine
+ * after the PointQuery was refit.
+ */
+template <typename Policy>
+class ClosestPointEngine
+{
+public:
+    typedef typename Policy::Scalar Scalar;
+
+private:
+    /**
+     * @brief Node struct; BVHNode bounds in Scalar, rounded outwards and grown
+     * by the kernel tolerance, so no face computed in Scalar is ever outside
+     */
+    struct Node
+    {
+    public:
+        Scalar m_min[3], m_max[3];
+        int m_left;
+        int m_count;
+
+        inline bool isLeaf() const {return m_count > 0;};
+    };
+
+    const Mesh& m_mesh;
+    Eigen::Vector3d m_origin;
+    double m_tolerance;
+    std::vector<Node> m_nodes;
+    std::vector<TriangleBlockT<Scalar>> m_blocks;
+    std::vector<int> m_faceIndices;
+
+    double boxDistanceSq(const Eigen::Vector3d& localPoint, const Node& node) const;
+    void localTriangle(const int& faceId, double* o, double* e0, double* e1) const;
+    void traverse(const Eigen::Vector3d& localPoint, const double& margin, const double& epsilon, QueryContext& context, double& bestDistSq, int& bestFace, double& s, double& t, double& prunedDistSq) const;
+    void testExact(const int& faceId, const double* q, double& bestDistSq, int& bestFace, double& s, double& t) const;
+    void refine(const Eigen::Vector3d& localPoint, const double& margin, const double& maxDistSq, QueryContext& context, double& bestDistSq, int& bestFace, double& s, double& t) const;
+    bool fillHit(const Eigen::Vector3d& queryPoint, const float& maxDist, const int& faceId, const double& s, const double& t, QueryHit& hit) const;
+
+public:
+    ClosestPointEngine(const PointQuery& query);
+    ~ClosestPointEngine() {};
+
+    inline const char* getName() const {return Policy::name();};
+    inline size_t getMemoryUsage() const {return m_nodes.size() * sizeof(Node) + m_blocks.size() * sizeof(TriangleBlockT<Scalar>) + m_faceIndices.size() * sizeof(int);};
+
+    bool query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit, const bool& refineHit = false) const;
+    bool queryApproximate(const Eigen::Vector3d& queryPoint, const float& maxDist, const float& epsilon, QueryContext& context, QueryHit& hit, float& bound) const;
+    bool bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const;
+};
+
+typedef ClosestPointEngine<FloatPolicy> FloatEngine;
+typedef ClosestPointEngine<DoublePolicy> DoubleEngine;
+
+#endif // CLOSESTPOINTENGINE_H
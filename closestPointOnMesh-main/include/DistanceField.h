@@ -0,0 +1,58 @@
+#ifndef DISTANCEFIELD_H
+#define DISTANCEFIELD_H
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "PointQuery.h"
+
+/**
+ * @brief DistanceField class; sparse narrow band distance field around a mesh,
+ * for approximate closest point lookups at a fixed cost. Space is divided in
+ * bricks of kBrickSize^3 voxels and only bricks near the surface are stored,
+ * found through a hash map of brick coordinates. Every voxel corner stores the
+ * distance to the mesh and the nearest face, both from the exact query engine.
+ * Corners on a brick border are stored by both bricks, so a lookup never needs
+ * a neighbour brick.
+ * sample() interpolates the distance trilinearly; closestPoint() tests the
+ * nearest faces of the 8 surrounding corners exactly instead, which gives the
+ * exact result whenever the true nearest face is among them (typical once the
+ * voxels are small compared to the faces).
+ * The mesh is referenced, not copied, and has to outlive the field.
+ */
+class DistanceField
+{
+public:
+    static const int kBrickSize = 8;
+    static const int kBrickCorners = kBrickSize + 1;
+    static const int kBrickSamples = kBrickCorners * kBrickCorners * kBrickCorners;
+
+private:
+    const Mesh* m_mesh;
+    Eigen::Vector3d m_origin;
+    double m_voxelSize, m_invVoxelSize;
+    double m_bandWidth;
+    std::unordered_map<uint64_t, uint32_t> m_brickIndex;
+    std::vector<float> m_distances;     // kBrickSamples per brick, x fastest
+    std::vector<int> m_faces;           // nearest face per sample, -1 if unknown
+
+    bool findBrick(const Eigen::Vector3d& point, uint32_t& brick, int& cx, int& cy, int& cz, Eigen::Vector3d& frac) const;
+
+public:
+    DistanceField() : m_mesh(NULL), m_voxelSize(0.0), m_invVoxelSize(0.0), m_bandWidth(0.0) {};
+    ~DistanceField() {};
+
+    bool build(const PointQuery& query, const double& voxelSize, const double& bandWidth, const int& threadCount = 0);
+    void clear();
+
+    inline bool empty() const {return m_brickIndex.empty();};
+    inline size_t getBrickCount() const {return m_brickIndex.size();};
+    inline double getVoxelSize() const {return m_voxelSize;};
+    inline double getBandWidth() const {return m_bandWidth;};
+    size_t getMemoryUsage() const;
+
+    bool sample(const Eigen::Vector3d& point, float& dist) const;
+    bool closestPoint(const Eigen::Vector3d& point, const float& maxDist, QueryHit& hit) const;
+};
+
+#endif // DISTANCEFIELD_H
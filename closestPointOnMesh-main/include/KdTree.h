@@ -0,0 +1,71 @@
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+#include <functional>
+#include "Mesh.h"
+#include "BVH.h"
+
+/**
+ * @brief VertexHit struct; a vertex found by a KdTree search
+ */
+struct VertexHit
+{
+public:
+    uint32_t m_id;
+    float m_dist;
+    Eigen::Vector3d m_point;
+};
+
+/**
+ * @brief Called for every vertex found by KdTree::radiusSearch(), return false
+ * to stop the search
+ */
+typedef std::function<bool(const VertexHit&)> VertexHitCallback;
+
+/**
+ * @brief KdTree class; median split k-d tree over the vertices of a mesh.
+ * Nodes reuse BVHNode (tight bounds, children next to each other, root at 0),
+ * leaves point into copies of the vertex positions stored in tree order so a
+ * leaf is scanned from contiguous memory.
+ * Searches run on a fixed size stack and write into caller owned memory,
+ * nothing is allocated per query.
+ * Distances are float, computed like the rest of the query code.
+ */
+class KdTree
+{
+private:
+    std::vector<BVHNode> m_nodes;
+    std::vector<uint32_t> m_ids;
+    std::vector<double> m_x, m_y, m_z;
+    int m_leafSize;
+    double m_buildCost;
+
+    void buildNode(const int& nodeId, const int& first, const int& count, const int& depth, const Mesh& mesh);
+    template <typename Emit>
+    size_t walkRadius(const Eigen::Vector3d& queryPoint, const float& radius, Emit emit) const;
+
+public:
+    static const int kMaxDepth = 48;
+
+    KdTree() : m_leafSize(16), m_buildCost(0.0) {};
+    ~KdTree() {};
+
+    void build(const Mesh& mesh, const int& leafSize = 16);
+    void refit(const Mesh& mesh, const int& threadCount = 0);
+    double inflation() const;
+
+    inline bool empty() const {return m_nodes.empty();};
+    inline int getNodeCount() const {return static_cast<int>(m_nodes.size());};
+    inline const BVHNode& getNode(const int& id) const {return m_nodes[id];};
+    inline uint32_t getVertexId(const int& slot) const {return m_ids[slot];};
+    inline Eigen::Vector3d getPoint(const int& slot) const {return Eigen::Vector3d(m_x[slot], m_y[slot], m_z[slot]);};
+
+    int closest(const Eigen::Vector3d& queryPoint, float& minDist) const;
+    size_t radiusSearch(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const;
+    size_t radiusSearch(const Eigen::Vector3d& queryPoint, const float& radius, const VertexHitCallback& callback) const;
+    size_t estimateInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const;
+    size_t nearest(const Eigen::Vector3d& queryPoint, const size_t& k, const float& maxDist, VertexHit* hits) const;
+};
+
+#endif // KDTREE_H
@@ -0,0 +1,40 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+
+/**
+ * @brief MappedFile class; read only memory mapping of a whole file.
+ * The mapping is released when the object is destroyed. Parts of it can be
+ * dropped from the process earlier with release(), and parts read in no
+ * particular order marked with adviseRandom().
+ */
+class MappedFile
+{
+private:
+    const char* m_data;
+    size_t m_size;
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_fd;
+#endif
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const char* filename);
+    void close();
+    void release(const void* data, const size_t& size) const;
+    void adviseRandom(const void* data, const size_t& size) const;
+
+    inline const char* data() const {return m_data;};
+    inline size_t size() const {return m_size;};
+};
+
+#endif // MAPPEDFILE_H
@@ -3,18 +3,24 @@
 
 #include <iostream>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
 #include <Eigen3/Eigen/Dense>
 #include "tiny_obj_loader.h"
+#include "Buffer.h"
 
 /**
- * @brief Face class; contains 3 vertices which forms the face and face id.
+ * @brief Face struct; face id and the ids of the 3 vertices which form the face.
+ * Only a lightweight handle into the mesh index buffer, positions are looked up
+ * through the Mesh.
  */
 struct Face
 {
 public:
-    int m_id;
-    Eigen::Vector3d m_v1, m_v2, m_v3;
-    Face(const int& id, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3){
+    uint32_t m_id;
+    uint32_t m_v1, m_v2, m_v3;
+    Face(const uint32_t& id, const uint32_t& v1, const uint32_t& v2, const uint32_t& v3){
         m_id = id;
         m_v1=v1;
         m_v2=v2;
@@ -23,31 +29,46 @@ public:
 };
 
 /**
- * @brief Mesh class; contains std::vectors of vertices and faces of the .obj
- * Getter/setter functions needed to populate mesh object and readObj function
- * to read in mesh data from .obj file
+ * @brief Mesh class; indexed triangle mesh read from an .obj
+ * Vertex positions are stored once in structure of arrays layout (one array per
+ * axis) and faces as a flat uint32 index buffer, 3 entries per triangle.
+ * Getters hand out views over the internal buffers, nothing is copied.
+ * Buffers can also borrow memory from a mapped MeshCache file, which the mesh
+ * then keeps alive.
  */
 class Mesh
 {
 private:
-    std::vector<Eigen::Vector3d> m_vertices;
-    std::vector<Face> m_faces;
+    Buffer<double> m_x, m_y, m_z;
+    Buffer<uint32_t> m_indices;
+    std::shared_ptr<const void> m_storage;
+
+    friend class MeshCache;
 
 public:
     Mesh() {};
     ~Mesh() {};
 
-    inline Eigen::Vector3d& getVertex(const int& id) {return m_vertices[id];};
-    inline std::vector<Eigen::Vector3d> getVertices() {return m_vertices;};
+    inline size_t getVertexCount() const {return m_x.size();};
+    inline Eigen::Vector3d getVertex(const uint32_t& id) const {return Eigen::Vector3d(m_x[id], m_y[id], m_z[id]);};
+    inline ArrayView<double> getX() const {return m_x.view();};
+    inline ArrayView<double> getY() const {return m_y.view();};
+    inline ArrayView<double> getZ() const {return m_z.view();};
     void addVertex(const Eigen::Vector3d& vertex);
     void addVertex(const double x, const double y, const double z);
+    bool setPositions(const ArrayView<double>& x, const ArrayView<double>& y, const ArrayView<double>& z);
+
+    inline size_t getFaceCount() const {return m_indices.size() / 3;};
+    inline Face getFace(const uint32_t& id) const {return Face(id, m_indices[3*id], m_indices[3*id+1], m_indices[3*id+2]);};
+    inline ArrayView<uint32_t> getIndices() const {return m_indices.view();};
+    void getFaceVertices(const uint32_t& id, Eigen::Vector3d& v1, Eigen::Vector3d& v2, Eigen::Vector3d& v3) const;
+    void addFace(const uint32_t& v1, const uint32_t& v2, const uint32_t& v3);
 
-    inline Face getFace(const int& id) {return m_faces[id];};
-    inline std::vector<Face> getFaces() {return m_faces;};
-    void addFace(const Face& face);
-    void addFace(const int& id, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3);
+    void reserve(const size_t& vertexCount, const size_t& faceCount);
+    void clear();
 
-    bool readObj(const char* filename);
+    bool readObj(const char* filename, const int& threadCount = 0);
+    bool readObjTinyObj(const char* filename);
 };
 
-#endif // MESH_H
\ No newline at end of file
+#endif // MESH_H
@@ -0,0 +1,60 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "Mesh.h"
+#include "BVH.h"
+#include "OutOfCoreBVH.h"
+#include "MappedFile.h"
+
+/**
+ * @brief MeshCacheHeader struct; fixed size header at the start of a cache file.
+ * Every section offset is from the start of the file and 64 byte aligned.
+ * Element sizes are recorded so a cache written by an incompatible build is
+ * rejected instead of misread.
+ */
+struct MeshCacheHeader
+{
+public:
+    char m_magic[8];
+    uint32_t m_version;
+    uint32_t m_flags;
+    uint32_t m_endianCheck;
+    uint32_t m_nodeSize, m_blockSize;
+    int32_t m_leafSize;
+    uint64_t m_vertexCount, m_faceCount;
+    uint64_t m_nodeCount, m_slotCount, m_blockCount;
+    uint64_t m_xOffset, m_yOffset, m_zOffset, m_indexOffset;
+    uint64_t m_nodeOffset, m_slotOffset, m_blockOffset;
+    uint32_t m_treeNodeSize, m_treeBlockSize;
+    double m_treeOrigin[3];
+    uint64_t m_treeNodeCount, m_treeBlockCount;
+    uint64_t m_treeNodeOffset, m_treeBlockOffset;
+};
+
+/**
+ * @brief MeshCache class; versioned binary cache of an indexed mesh and
+ * optionally its BVH and an OutOfCoreBVH. The file is memory mapped on read and
+ * the Mesh/BVH buffers point straight into the mapping, nothing is
+ * deserialized. readTree() maps the out of core tree alone, the mesh sections
+ * are never touched.
+ */
+class MeshCache
+{
+public:
+    static const uint32_t kVersion = 3;
+    static const uint32_t kHasBVH = 1;
+    static const uint32_t kHasTree = 2;
+    static const uint32_t kLinearBVH = 4;
+    static const uint32_t kLinearTree = 8;
+
+    static std::string pathFor(const char* objFile);
+    static bool isFresh(const char* objFile, const std::string& cacheFile);
+    static bool write(const std::string& cacheFile, const Mesh& mesh, const BVH* bvh, const OutOfCoreBVH* tree = NULL);
+    static bool read(const std::string& cacheFile, Mesh& mesh, BVH* bvh);
+    static bool readTree(const std::string& cacheFile, OutOfCoreBVH& tree);
+};
+
+#endif // MESHCACHE_H
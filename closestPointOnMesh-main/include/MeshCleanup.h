@@ -0,0 +1,61 @@
+#ifndef MESHCLEANUP_H
+#define MESHCLEANUP_H
+
+#include <cstdint>
+#include <vector>
+#include "Mesh.h"
+
+/**
+ * @brief CleanupReport struct; what a MeshCleanup pass changed
+ */
+struct CleanupReport
+{
+public:
+    size_t m_inputVertices, m_inputFaces;
+    size_t m_outputVertices, m_outputFaces;
+    size_t m_weldedVertices;    // merged into a vertex within the tolerance
+    size_t m_unusedVertices;    // not referenced by any face that was kept
+    size_t m_degenerateFaces;   // two corners welded together, or flatter than the tolerance
+    size_t m_duplicateFaces;    // same 3 vertices as an earlier face, in the same cyclic order
+    size_t m_reversedPairs;     // kept faces with the 3 vertices of another one in the opposite order
+    double m_seconds;
+};
+
+/**
+ * @brief MeshCleanup class; optional load time cleanup for scanned meshes.
+ * Vertices closer than the tolerance are welded through a hash grid of
+ * tolerance sized cells: every vertex goes to the lowest id vertex within the
+ * tolerance in its 27 neighbour cells (following chains of those), computed in
+ * parallel and independent of the thread count. A tolerance of 0 welds exact
+ * duplicates only. Then faces with two corners on the same vertex or a height
+ * below the tolerance, faces repeating an earlier one with the same
+ * orientation and vertices no face uses any more are dropped. Faces reversing
+ * an earlier one are kept and counted. The remap tables lead from the
+ * cleaned mesh back to the ids of the obj.
+ */
+class MeshCleanup
+{
+private:
+    std::vector<uint32_t> m_vertexMap;
+    std::vector<uint32_t> m_originalVertices;
+    std::vector<uint32_t> m_originalFaces;
+    CleanupReport m_report;
+
+public:
+    static const uint32_t kRemoved = 0xffffffffu;
+
+    MeshCleanup();
+    ~MeshCleanup() {};
+
+    bool run(Mesh& mesh, const double& tolerance, const int& threadCount = 0);
+    void printReport() const;
+
+    inline const CleanupReport& getReport() const {return m_report;};
+    inline uint32_t getOriginalFace(const uint32_t& id) const {return m_originalFaces[id];};
+    inline uint32_t getOriginalVertex(const uint32_t& id) const {return m_originalVertices[id];};
+    inline uint32_t getVertex(const uint32_t& originalId) const {return m_vertexMap[originalId];};
+    inline const std::vector<uint32_t>& getVertexMap() const {return m_vertexMap;};
+    inline const std::vector<uint32_t>& getFaceMap() const {return m_originalFaces;};
+};
+
+#endif // MESHCLEANUP_H
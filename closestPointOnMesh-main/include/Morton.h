@@ -0,0 +1,71 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <Eigen3/Eigen/Dense>
+
+/**
+ * @brief Spread the low 10 bits of v so there are two zero bits between each
+ * // https://developer.nvidia.com/blog/thinking-parallel-part-iii-tree-construction-gpu/
+ * @param v Value in [0, 1023]
+ * @return uint32_t Spread bits
+ */
+inline uint32_t expandBits10(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * @brief 30 bit Morton code of a point inside the given bounds
+ * @param point Point
+ * @param bmin Bounds min corner
+ * @param bmax Bounds max corner
+ * @return uint32_t Morton code, 10 bits per axis
+ */
+inline uint32_t mortonCode(const Eigen::Vector3d& point, const Eigen::Vector3d& bmin, const Eigen::Vector3d& bmax)
+{
+    uint32_t cell[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double ext = bmax[axis] - bmin[axis];
+        double u = ext > 0.0 ? (point[axis] - bmin[axis]) / ext : 0.0;
+        cell[axis] = static_cast<uint32_t>(std::min(1023.0, std::max(0.0, u * 1024.0)));
+    }
+    return (expandBits10(cell[0]) << 2) | (expandBits10(cell[1]) << 1) | expandBits10(cell[2]);
+}
+
+/**
+ * @brief Order of the points along the Morton curve over their own bounds;
+ * neighbouring entries of the order are close in space
+ * @param points Points
+ * @param order Output, order[i] is the index of the i-th point along the curve
+ */
+inline void mortonOrder(const std::vector<Eigen::Vector3d>& points, std::vector<uint32_t>& order)
+{
+    order.resize(points.size());
+    if (points.empty()) return;
+
+    Eigen::Vector3d bmin = points[0], bmax = points[0];
+    for (size_t i = 1; i < points.size(); i++)
+    {
+        bmin = bmin.cwiseMin(points[i]);
+        bmax = bmax.cwiseMax(points[i]);
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t> > keys(points.size());
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        keys[i] = std::make_pair(mortonCode(points[i], bmin, bmax), static_cast<uint32_t>(i));
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); i++) order[i] = keys[i].second;
+}
+
+#endif // MORTON_H
@@ -0,0 +1,94 @@
+#ifndef OUTOFCOREBVH_H
+#define OUTOFCOREBVH_H
+
+#include <cstdint>
+#include <memory>
+#include "BVH.h"
+#include "Buffer.h"
+#include "MappedFile.h"
+#include "QueryContext.h"
+#include "ScalarPolicy.h"
+
+/**
+ * @brief OutOfCoreNode struct; 32 byte node of an OutOfCoreBVH. Bounds are
+ * float, relative to the tree origin and rounded outwards. Children are not
+ * adjacent in van Emde Boas order, so both are stored.
+ */
+struct OutOfCoreNode
+{
+public:
+    float m_min[3];
+    int32_t m_left;     // first child, or first block of a leaf
+    float m_max[3];
+    int32_t m_right;    // second child, or minus the block count of a leaf
+
+    inline bool isLeaf() const {return m_right < 0;};
+};
+
+/**
+ * @brief OutOfCoreBlock struct; 4 triangles in the double edge form of the
+ * ClosestPointEngine, relative to the tree origin, with their face ids (-1
+ * for unused lanes), so a leaf needs nothing but its own blocks
+ */
+struct alignas(32) OutOfCoreBlock
+{
+public:
+    TriangleBlockT<double> m_triangles;
+    int32_t m_faces[kTriangleBlockSize];
+};
+
+/**
+ * @brief OutOfCoreBVH class; closest point tree for meshes larger than memory,
+ * stored in the MeshCache and queried straight off its mapping.
+ * The nodes of a BVH are laid out in van Emde Boas order: the top half of the
+ * levels first, recursively, then every subtree hanging below it, recursively.
+ * Any subtree of a few levels then sits in a few consecutive pages, whatever
+ * the page size, and a query faults in a handful of pages per level of the
+ * tree instead of one per node. Leaf triangles are stored in the order their
+ * leaves were laid out, so the triangles of a subtree are clustered as well.
+ * Queries never touch the mesh; they give the results of the double
+ * ClosestPointEngine.
+ * Pages stay in the page cache but count against the process once touched;
+ * releasePages() drops them from the process again, the hot top of the tree
+ * excepted.
+ */
+class OutOfCoreBVH
+{
+private:
+    Eigen::Vector3d m_origin;
+    Buffer<OutOfCoreNode> m_nodes;
+    Buffer<OutOfCoreBlock> m_blocks;
+    std::shared_ptr<MappedFile> m_storage;
+    bool m_linear;      // built from a linear BVH
+
+    friend class MeshCache;
+
+    // a mapped tree is not checked when it is loaded, that would read all of
+    // it; each node is checked as it is walked instead
+    inline bool hasBlocks(const OutOfCoreNode& node) const {return node.m_left >= 0 && node.m_left <= getBlockCount() + node.m_right;};
+    inline bool hasChildren(const int& id, const OutOfCoreNode& node) const {return node.m_left > id && node.m_right > id && node.m_left < getNodeCount() && node.m_right < getNodeCount();};
+
+    double boxDistanceSq(const Eigen::Vector3d& localPoint, const OutOfCoreNode& node) const;
+    bool fillHit(const Eigen::Vector3d& queryPoint, const float& maxDist, const int& block, const int& lane, const double& s, const double& t, QueryHit& hit) const;
+
+public:
+    static const size_t kResidentTopBytes = 64 * 1024;
+
+    OutOfCoreBVH() : m_origin(Eigen::Vector3d::Zero()), m_linear(false) {};
+    ~OutOfCoreBVH() {};
+
+    void build(const Mesh& mesh, const BVH& bvh);
+
+    inline bool empty() const {return m_nodes.empty();};
+    inline bool isLinear() const {return m_linear;};
+    inline int getNodeCount() const {return static_cast<int>(m_nodes.size());};
+    inline int getBlockCount() const {return static_cast<int>(m_blocks.size());};
+    inline const Eigen::Vector3d& getOrigin() const {return m_origin;};
+    inline size_t getMemoryUsage() const {return m_nodes.size() * sizeof(OutOfCoreNode) + m_blocks.size() * sizeof(OutOfCoreBlock);};
+
+    bool query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const;
+    bool bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const;
+    void releasePages() const;
+};
+
+#endif // OUTOFCOREBVH_H
@@ -0,0 +1,179 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Resolve a requested worker count; 0 or less means one per hardware thread
+ * @param threadCount Requested thread count
+ * @return int Thread count to use, at least 1
+ */
+inline int resolveThreadCount(const int& threadCount)
+{
+    if (threadCount > 0) return threadCount;
+    int hw = static_cast<int>(std::thread::hardware_concurrency());
+    return hw > 0 ? hw : 1;
+}
+
+/**
+ * @brief Run fn(begin, end) over [0, count) split in chunks of grain items.
+ * Workers pull the next chunk from a shared atomic counter, so uneven chunk
+ * costs still balance out. The calling thread works as one of the workers.
+ * @param count Number of items
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param fn Callable taking (size_t begin, size_t end)
+ * @param grain Items per chunk
+ */
+template <typename Fn>
+void parallelFor(const size_t& count, const int& threadCount, const Fn& fn, const size_t& grain = 256)
+{
+    if (count == 0) return;
+
+    const size_t chunk = std::max<size_t>(1, grain);
+    const size_t chunkCount = (count + chunk - 1) / chunk;
+    const int workers = static_cast<int>(std::min<size_t>(resolveThreadCount(threadCount), chunkCount));
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t c = next.fetch_add(1); c < chunkCount; c = next.fetch_add(1))
+        {
+            fn(c * chunk, std::min(count, (c + 1) * chunk));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    for (int i = 1; i < workers; i++)
+    {
+        threads.push_back(std::thread(work));
+    }
+    work();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
+
+/**
+ * @brief WorkerPool class; long lived worker threads for processes that run
+ * many small parallel jobs, e.g. a server answering batches, where starting
+ * threads per job as parallelFor() does would cost more than the job.
+ * run() has the semantics of parallelFor(). Jobs from several threads are run
+ * one after the other, each on all workers.
+ */
+class WorkerPool
+{
+private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_runMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    std::function<void(size_t, size_t)> m_fn;
+    size_t m_count, m_chunk, m_chunkCount;
+    std::atomic<size_t> m_next;
+    uint64_t m_generation;
+    int m_active;
+    bool m_stop;
+
+    inline void work()
+    {
+        for (size_t c = m_next.fetch_add(1); c < m_chunkCount; c = m_next.fetch_add(1))
+        {
+            m_fn(c * m_chunk, std::min(m_count, (c + 1) * m_chunk));
+        }
+    };
+
+    inline void workerLoop()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_wake.wait(lock, [&]() {return m_stop || m_generation != seen;});
+            if (m_stop) return;
+            seen = m_generation;
+            lock.unlock();
+            work();
+            lock.lock();
+            if (--m_active == 0) m_done.notify_all();
+        }
+    };
+
+public:
+    /**
+     * @brief Start the workers
+     * @param threadCount Worker count including the calling thread, 0 for one
+     * per hardware thread
+     */
+    WorkerPool(const int& threadCount = 0) : m_count(0), m_chunk(1), m_chunkCount(0), m_next(0), m_generation(0), m_active(0), m_stop(false)
+    {
+        const int workers = resolveThreadCount(threadCount);
+        for (int i = 1; i < workers; i++)
+        {
+            m_threads.push_back(std::thread(&WorkerPool::workerLoop, this));
+        }
+    };
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (size_t i = 0; i < m_threads.size(); i++)
+        {
+            m_threads[i].join();
+        }
+    };
+
+    inline int getThreadCount() const {return static_cast<int>(m_threads.size()) + 1;};
+
+    /**
+     * @brief Run fn(begin, end) over [0, count) split in chunks of grain items,
+     * on the workers and the calling thread. Returns once every chunk is done.
+     * @param count Number of items
+     * @param fn Callable taking (size_t begin, size_t end)
+     * @param grain Items per chunk
+     */
+    template <typename Fn>
+    void run(const size_t& count, const Fn& fn, const size_t& grain = 256)
+    {
+        if (count == 0) return;
+        const size_t chunk = std::max<size_t>(1, grain);
+        if (count <= chunk || m_threads.empty())
+        {
+            // a single chunk is not worth waking anyone
+            for (size_t begin = 0; begin < count; begin += chunk) fn(begin, std::min(count, begin + chunk));
+            return;
+        }
+
+        std::lock_guard<std::mutex> runLock(m_runMutex);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fn = [&fn](size_t begin, size_t end) {fn(begin, end);};
+            m_count = count;
+            m_chunk = chunk;
+            m_chunkCount = (count + m_chunk - 1) / m_chunk;
+            m_next = 0;
+            m_active = static_cast<int>(m_threads.size());
+            m_generation++;
+        }
+        m_wake.notify_all();
+        work();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&]() {return m_active == 0;});
+        m_fn = nullptr;
+    };
+};
+
+#endif // PARALLEL_H
@@ -1,22 +1,102 @@
 #ifndef POINTQUERY_H
 #define POINTQUERY_H
 
+#include <memory>
+#include <mutex>
 #include "Mesh.h"
+#include "BVH.h"
+#include "KdTree.h"
+#include "QueryContext.h"
+#include "TriangleKernel.h"
+#include "RayKernel.h"
+#include "WindingKernel.h"
 
 /**
- * @brief PointQuery class; contains query functions and mesh object.
+ * @brief PointQuery class; contains query functions, the BVH built over the
+ * faces of a mesh and the k-d tree built over its vertices. The mesh is
+ * referenced, not copied, and has to outlive the query.
+ * Each BVH node can also carry a dipole expansion of its faces for fast
+ * winding numbers, see windingNumber(). The dipoles, the vertex to face
+ * adjacency and the BVH parent links are only built by the first call that
+ * needs them (windingNumber(), getVertexFace(), queryCoherent()).
  */
 class PointQuery
 {
 private:
-    Mesh m_mesh;
+    const Mesh& m_mesh;
+    BVH m_bvh;
+    KdTree m_vertexTree;
+    mutable std::vector<uint32_t> m_vertexFaceOffsets, m_vertexFaces;
+    mutable std::once_flag m_vertexFacesBuilt;
+    mutable std::vector<int> m_nodeParents;
+    mutable std::unique_ptr<std::once_flag> m_nodeParentsBuilt;
+    double m_rebuildThreshold;
+    mutable std::vector<WindingNode> m_windingNodes;
+    mutable std::unique_ptr<std::once_flag> m_windingBuilt;
+    double m_windingAccuracy;
+
+    void buildVertexFaces() const;
+    inline void needVertexFaces() const {std::call_once(m_vertexFacesBuilt, &PointQuery::buildVertexFaces, this);};
+    void buildNodeParents() const;
+    inline void needNodeParents() const {std::call_once(*m_nodeParentsBuilt, &PointQuery::buildNodeParents, this);};
+    void buildWinding(const int& threadCount = 0) const;
+    inline void needWinding() const {std::call_once(*m_windingBuilt, &PointQuery::buildWinding, this, 0);};
+    void traverse(const Eigen::Vector3d& queryPoint, const int& root, QueryContext& context, float& bestDist, int& bestFace, int& bestLeaf) const;
+
+    int getClosestVertexLinear(const Eigen::Vector3d& queryPoint, float& minDist) const;
+    void fillHit(const Eigen::Vector3d& queryPoint, const int& vertexId, const int& faceId, const float& dist, QueryHit& hit) const;
+    bool testRayFace(const ShearedRay& ray, const int& faceId, double& bestT, int& bestFace, Eigen::Vector3d& bestBarycentric) const;
+    void fillRayHit(const Eigen::Vector3d& origin, const int& faceId, const double& t, const Eigen::Vector3d& barycentric, RayHit& hit) const;
+    template <bool AnyHit>
+    bool traverseRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const;
+    template <typename Emit>
+    size_t walkFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, Emit emit) const;
 public:
     PointQuery(const Mesh& mesh);
+    PointQuery(const Mesh& mesh, BVH bvh);
     ~PointQuery() {};
 
-    Eigen::Vector3d getClosestVertex(const Eigen::Vector3d& queryPoint, float& minDist);
-    Eigen::Vector3d closestPointOnTriangle(const Face& face, const Eigen::Vector3d& queryPoint);
-    Eigen::Vector3d operator() (const Eigen::Vector3d& queryPoint, float& maxDist);
+    inline const Mesh& getMesh() const {return m_mesh;};
+    inline const BVH& getBVH() const {return m_bvh;};
+    inline const KdTree& getVertexTree() const {return m_vertexTree;};
+    inline int getVertexFace(const uint32_t& vertexId) const {needVertexFaces(); return m_vertexFaceOffsets[vertexId] < m_vertexFaceOffsets[vertexId + 1] ? static_cast<int>(m_vertexFaces[m_vertexFaceOffsets[vertexId]]) : -1;};
+    inline void setRebuildThreshold(const double& threshold) {m_rebuildThreshold = threshold;};
+    inline double getRebuildThreshold() const {return m_rebuildThreshold;};
+    inline void setWindingAccuracy(const double& beta) {m_windingAccuracy = beta;};
+    inline double getWindingAccuracy() const {return m_windingAccuracy;};
+
+    bool refit(const int& threadCount = 0);
+
+    Eigen::Vector3d getClosestVertex(const Eigen::Vector3d& queryPoint, float& minDist) const;
+    int getClosestVertexId(const Eigen::Vector3d& queryPoint, float& minDist) const;
+    size_t getVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const;
+    size_t getVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, const VertexHitCallback& callback) const;
+    size_t estimateVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const;
+    size_t getFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, FaceHit* hits, const size_t& capacity) const;
+    size_t getFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, const FaceHitCallback& callback) const;
+    size_t estimateFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const;
+    size_t getNearestVertices(const Eigen::Vector3d& queryPoint, const size_t& k, const float& maxDist, VertexHit* hits) const;
+    Eigen::Vector3d closestPointOnTriangle(const Face& face, const Eigen::Vector3d& queryPoint) const;
+    static Eigen::Vector3d closestPointOnTriangle(const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3, const Eigen::Vector3d& queryPoint);
+    bool query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const;
+    bool queryCoherent(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const;
+    void queryPacket(const Eigen::Vector3d* queryPoints, const float* maxDists, const int& count, QueryContext& context, QueryHit* hits) const;
+    bool intersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const;
+    bool intersectAny(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const;
+    void intersectPacket(const Eigen::Vector3d* origins, const Eigen::Vector3d* directions, const double* maxDists, const int& count, const bool& anyHit, QueryContext& context, RayHit* hits) const;
+    double windingNumber(const Eigen::Vector3d& queryPoint, QueryContext& context) const;
+    bool isInside(const Eigen::Vector3d& queryPoint, QueryContext& context) const;
+    float signedDistance(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const;
+    float surfaceDistance(const Eigen::Vector3d& queryPoint, const float& maxDist, const float& stopDist, QueryContext& context) const;
+    bool vertexDistances(const Mesh& from, std::vector<float>& errors, MeshDistanceStats& stats, const int& threadCount = 0) const;
+    float hausdorffDistance(const PointQuery& from, int& maxVertex, const int& threadCount = 0) const;
+    Eigen::Vector3d operator() (const Eigen::Vector3d& queryPoint, float& maxDist) const;
+    bool bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const;
+    Eigen::Vector3d bruteForce(const Eigen::Vector3d& queryPoint, float& maxDist) const;
+    double bruteForceWindingNumber(const Eigen::Vector3d& queryPoint) const;
+    bool bruteForceIntersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, RayHit& hit) const;
+    size_t bruteForceFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, FaceHit* hits, const size_t& capacity) const;
+    size_t bruteForceVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const;
 };
 
-#endif // POINTQUERY_H
\ No newline at end of file
+#endif // POINTQUERY_H
@@ -0,0 +1,12 @@
+#ifndef PROCESSMEMORY_H
+#define PROCESSMEMORY_H
+
+/**
+ * @brief Memory use of the calling process, for the out of core budget and
+ * the benchmark. Linux, macOS and Windows report both values; elsewhere the
+ * current resident set is unknown and only the peak may be available.
+ */
+double residentMegabytes();
+double peakResidentMegabytes();
+
+#endif // PROCESSMEMORY_H
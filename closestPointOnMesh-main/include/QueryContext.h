@@ -0,0 +1,125 @@
+#ifndef QUERYCONTEXT_H
+#define QUERYCONTEXT_H
+
+#include <functional>
+#include "BVH.h"
+#include "TriangleKernel.h"
+#include "QueryStats.h"
+
+/**
+ * @brief QueryHit struct; everything a closest point query found.
+ * When nothing is found within the search radius m_point is the query point and
+ * the distances hold the search radius, or 0 if the query point is a mesh vertex.
+ */
+struct QueryHit
+{
+public:
+    bool m_found;
+    int m_faceId;                   // closest face, -1 if the hit is a vertex or nothing was found
+    int m_vertexId;                 // closest vertex if no face beat it, -1 otherwise
+    Eigen::Vector3d m_point;
+    Eigen::Vector3d m_barycentric;  // weights of the face vertices v1 v2 v3, zero without a face
+    double m_distSq;                // squared distance in double precision
+    float m_dist;                   // float distance, as compared during the search
+};
+
+/**
+ * @brief FaceHit struct; a face found by a range query, with the closest point
+ * on it and its distance to the query point
+ */
+struct FaceHit
+{
+public:
+    int m_id;
+    float m_dist;
+    Eigen::Vector3d m_point;
+};
+
+/**
+ * @brief Called for every face found by PointQuery::getFacesInRadius(),
+ * return false to stop the search
+ */
+typedef std::function<bool(const FaceHit&)> FaceHitCallback;
+
+/**
+ * @brief RayHit struct; the intersection found by a ray query
+ */
+struct RayHit
+{
+public:
+    bool m_found;
+    int m_faceId;                   // face hit, -1 if nothing was hit
+    Eigen::Vector3d m_point;        // hit point, the ray origin if nothing was hit
+    Eigen::Vector3d m_barycentric;  // weights of the face vertices v1 v2 v3, zero without a hit
+    double m_t;                     // distance along the ray in direction lengths, the max distance if nothing was hit
+};
+
+/**
+ * @brief MeshDistanceStats struct; distances from the vertices of one mesh to
+ * the surface of another, see PointQuery::vertexDistances()
+ */
+struct MeshDistanceStats
+{
+public:
+    float m_max;        // one sided Hausdorff distance over the vertices
+    int m_maxVertex;    // vertex at m_max, -1 without vertices
+    double m_mean;
+    double m_rms;
+};
+
+/**
+ * @brief TraversalEntry struct; node waiting on the traversal stack and the
+ * squared distance from the query point to its bounds. Ray queries store the
+ * distance along the ray where it enters the bounds instead.
+ */
+struct TraversalEntry
+{
+public:
+    int m_node;
+    double m_distSq;
+};
+
+/**
+ * @brief PacketEntry struct; node waiting on the packet traversal stack and the
+ * lanes of the packet that still need it. Used by point and ray packets.
+ */
+struct PacketEntry
+{
+public:
+    int m_node;
+    uint32_t m_mask;
+};
+
+/**
+ * @brief QueryContext class; scratch memory of one query thread. Holds the
+ * traversal stack and the per block kernel outputs so queries never touch the
+ * heap. Create one per thread and pass it to every query run on that thread.
+ * Also remembers the BVH leaf of the last hit for PointQuery::queryCoherent().
+ * Packets of up to kPacketSize queries share one stack, see PointQuery::queryPacket().
+ * m_stats counts the traversal work in builds with QUERY_STATS.
+ * m_candidates holds the faces a refined ClosestPointEngine query redoes in
+ * double.
+ */
+class QueryContext
+{
+public:
+    static const int kStackSize = 2 * BVH::kMaxDepth + 2;
+    static const int kPacketSize = 8;
+    static const int kCandidateSize = 64;
+
+    TraversalEntry m_stack[kStackSize];
+    PacketEntry m_packetStack[kStackSize];
+    double m_px[kKernelWidth], m_py[kKernelWidth], m_pz[kKernelWidth];
+    float m_dist[kKernelWidth];
+    int m_prevLeaf;
+    int m_candidates[kCandidateSize];
+    int m_candidateCount;   // kCandidateSize + 1 once the candidates overflowed
+    TraversalStats m_stats;
+
+    QueryContext() : m_prevLeaf(-1), m_candidateCount(0) {m_stats.reset();};
+    ~QueryContext() {};
+
+    inline void reset() {m_prevLeaf = -1;};
+};
+
+#endif // QUERYCONTEXT_H
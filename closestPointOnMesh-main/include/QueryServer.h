@@ -0,0 +1,121 @@
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "PointQuery.h"
+#include "Parallel.h"
+
+/**
+ * @brief FrameHeader struct; starts every request and response frame of the
+ * server protocol, followed by m_size payload bytes. All fields are in the
+ * native byte order, clients run on the same machine.
+ */
+struct FrameHeader
+{
+public:
+    uint32_t m_type;        // QueryServer::RequestType, echoed in the response
+    uint32_t m_requestId;   // chosen by the client, echoed in the response
+    uint32_t m_status;      // QueryServer::Status in responses, 0 in requests
+    uint32_t m_size;        // payload bytes
+};
+
+/**
+ * @brief ServerPoint struct; one query point of a kQuery request
+ */
+struct ServerPoint
+{
+public:
+    float m_x, m_y, m_z, m_radius;
+};
+
+/**
+ * @brief ServerHit struct; the answer to one ServerPoint, in request order
+ */
+struct ServerHit
+{
+public:
+    int32_t m_faceId;       // closest face, -1 if the hit is a vertex or nothing was found
+    int32_t m_vertexId;     // closest vertex if no face beat it, -1 otherwise
+    float m_dist;           // distance, the search radius if nothing was found
+    float m_x, m_y, m_z;    // closest point, the query point if nothing was found
+    float m_u, m_v, m_w;    // weights of the face vertices v1 v2 v3, zero without a face
+};
+
+/**
+ * @brief QueryServer class; keeps meshes loaded and indexed between requests
+ * and answers framed binary requests over a pipe (stdin / stdout) or a local
+ * Unix domain socket. Requests and their payloads:
+ *   kLoad      uint32 mesh id, then the obj path; replaces a loaded mesh
+ *   kEvict     uint32 mesh id
+ *   kQuery     uint32 mesh id, uint32 point count, then the ServerPoints;
+ *              answered with one ServerHit per point
+ *   kShutdown  nothing; stops the server once answered
+ * Every request gets exactly one response frame, in order per connection.
+ * Query batches run on a worker pool shared by all connections. Meshes are
+ * reference counted, so evicting or replacing one never disturbs a batch
+ * already running on it.
+ */
+class QueryServer
+{
+public:
+    enum RequestType
+    {
+        kLoad = 1,
+        kEvict = 2,
+        kQuery = 3,
+        kShutdown = 4
+    };
+
+    enum Status
+    {
+        kOk = 0,
+        kBadRequest = 1,
+        kUnknownMesh = 2,
+        kLoadFailed = 3
+    };
+
+    static const uint32_t kMaxPayload = 1u << 30;
+
+private:
+    /**
+     * @brief Entry struct; a loaded mesh and its query object
+     */
+    struct Entry
+    {
+    public:
+        Mesh m_mesh;
+        std::unique_ptr<PointQuery> m_query;
+    };
+
+    std::unordered_map<uint32_t, std::shared_ptr<const Entry>> m_meshes;
+    std::mutex m_meshMutex;
+    WorkerPool m_pool;
+    int m_threadCount;
+    bool m_useCache;
+    std::atomic<bool> m_stopping;
+    std::atomic<int> m_listenFd;
+
+    std::shared_ptr<const Entry> findMesh(const uint32_t& meshId);
+    uint32_t handleQuery(const std::vector<char>& payload, std::vector<char>& response);
+    bool handle(const FrameHeader& request, const std::vector<char>& payload, FrameHeader& reply, std::vector<char>& response);
+
+public:
+    QueryServer(const int& threadCount = 0, const bool& useCache = true);
+    ~QueryServer() {};
+
+    bool load(const uint32_t& meshId, const std::string& objFile);
+    bool evict(const uint32_t& meshId);
+    size_t getMeshCount();
+    inline bool stopping() const {return m_stopping.load();};
+
+    bool serve(const int& inFd, const int& outFd);
+    bool serveSocket(const char* socketPath);
+};
+
+#endif // QUERYSERVER_H
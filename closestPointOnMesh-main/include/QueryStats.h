@@ -0,0 +1,30 @@
+#ifndef QUERYSTATS_H
+#define QUERYSTATS_H
+
+#include <cstdint>
+
+/**
+ * @brief TraversalStats struct; work done by the queries run on one
+ * QueryContext since its last reset. Only counted in builds with QUERY_STATS
+ * defined (cmake -DQUERY_ENABLE_STATS=ON), otherwise the counting statements
+ * are compiled out and the counters stay 0.
+ */
+struct TraversalStats
+{
+public:
+    uint64_t m_nodes;       // BVH nodes visited
+    uint64_t m_triangles;   // faces tested, including coherent seeds
+    uint64_t m_culled;      // nodes dropped from the stack by their bound, the early outs
+
+    inline void reset() {m_nodes = 0; m_triangles = 0; m_culled = 0;};
+};
+
+#ifdef QUERY_STATS
+#define QUERY_STAT(statement) statement
+static const bool kQueryStatsEnabled = true;
+#else
+#define QUERY_STAT(statement)
+static const bool kQueryStatsEnabled = false;
+#endif
+
+#endif // QUERYSTATS_H
@@ -0,0 +1,86 @@
+#ifndef RAYKERNEL_H
+#define RAYKERNEL_H
+
+#include <cmath>
+#include <utility>
+#include <Eigen3/Eigen/Dense>
+
+/**
+ * @brief ShearedRay struct; a ray prepared once for intersectTriangle(). The
+ * axes are permuted so the direction's largest component becomes z, and the
+ * shear maps the direction onto (0, 0, 1), which turns every edge test into a
+ * 2D cross product of vertex positions.
+ */
+struct ShearedRay
+{
+public:
+    Eigen::Vector3d m_origin;
+    int m_kx, m_ky, m_kz;
+    double m_sx, m_sy, m_sz;
+};
+
+/**
+ * @brief Prepare a ray for intersectTriangle()
+ * @param origin Ray origin
+ * @param dir Ray direction, any length but not zero
+ * @return ShearedRay Prepared ray
+ */
+inline ShearedRay shearRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& dir)
+{
+    ShearedRay ray;
+    ray.m_origin = origin;
+    ray.m_kz = 0;
+    if (std::abs(dir.y()) > std::abs(dir[ray.m_kz])) ray.m_kz = 1;
+    if (std::abs(dir.z()) > std::abs(dir[ray.m_kz])) ray.m_kz = 2;
+    ray.m_kx = (ray.m_kz + 1) % 3;
+    ray.m_ky = (ray.m_kx + 1) % 3;
+    // keep the winding so the edge signs don't depend on the ray direction
+    if (dir[ray.m_kz] < 0.0) std::swap(ray.m_kx, ray.m_ky);
+
+    ray.m_sx = dir[ray.m_kx] / dir[ray.m_kz];
+    ray.m_sy = dir[ray.m_ky] / dir[ray.m_kz];
+    ray.m_sz = 1.0 / dir[ray.m_kz];
+    return ray;
+}
+
+/**
+ * @brief Ray / triangle intersection; Möller–Trumbore style scaled barycentrics
+ * and distance, with the watertight edge tests of Woop et al. 2013. Every
+ * vertex is moved to the ray origin and sheared into ray space once, then each
+ * edge is tested with a 2D cross product of its end points only. Triangles
+ * sharing an edge or a vertex compute it from the same numbers, so a ray can't
+ * slip through between them, not even through a shared vertex. Edges and
+ * corners count as inside, both sides of the triangle are hit.
+ * @param ray Prepared ray, see shearRay()
+ * @param v1 First vertex
+ * @param v2 Second vertex
+ * @param v3 Third vertex
+ * @param t Output distance along the ray, in direction lengths; can be negative
+ * @param barycentric Output weights of v1 v2 v3
+ * @return true The line of the ray crosses the triangle
+ */
+inline bool intersectTriangle(const ShearedRay& ray, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3, double& t, Eigen::Vector3d& barycentric)
+{
+    const Eigen::Vector3d a = v1 - ray.m_origin, b = v2 - ray.m_origin, c = v3 - ray.m_origin;
+    const double ax = a[ray.m_kx] - ray.m_sx * a[ray.m_kz], ay = a[ray.m_ky] - ray.m_sy * a[ray.m_kz];
+    const double bx = b[ray.m_kx] - ray.m_sx * b[ray.m_kz], by = b[ray.m_ky] - ray.m_sy * b[ray.m_kz];
+    const double cx = c[ray.m_kx] - ray.m_sx * c[ray.m_kz], cy = c[ray.m_ky] - ray.m_sy * c[ray.m_kz];
+
+    // edge opposite of each vertex, all three must agree in sign
+    const double u = cx*by - cy*bx;
+    const double v = ax*cy - ay*cx;
+    const double w = bx*ay - by*ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) return false;
+
+    // zero for rays parallel to the triangle plane
+    const double det = u + v + w;
+    if (det == 0.0) return false;
+
+    const double invDet = 1.0 / det;
+    const double az = ray.m_sz * a[ray.m_kz], bz = ray.m_sz * b[ray.m_kz], cz = ray.m_sz * c[ray.m_kz];
+    t = (u*az + v*bz + w*cz) * invDet;
+    barycentric = Eigen::Vector3d(u * invDet, v * invDet, w * invDet);
+    return true;
+}
+
+#endif // RAYKERNEL_H
@@ -0,0 +1,137 @@
+#ifndef SCALARPOLICY_H
+#define SCALARPOLICY_H
+
+#include <limits>
+#include "TriangleKernel.h"
+
+/**
+ * @brief TriangleBlockT struct; 4 triangles in structure of arrays layout like
+ * TriangleBlock, stored in the scalar type of a ClosestPointEngine and relative
+ * to its origin. Unused lanes hold NaN and never produce a hit.
+ */
+template <typename Scalar>
+struct alignas(32) TriangleBlockT
+{
+public:
+    Scalar m_ox[kTriangleBlockSize], m_oy[kTriangleBlockSize], m_oz[kTriangleBlockSize];
+    Scalar m_e0x[kTriangleBlockSize], m_e0y[kTriangleBlockSize], m_e0z[kTriangleBlockSize];
+    Scalar m_e1x[kTriangleBlockSize], m_e1y[kTriangleBlockSize], m_e1z[kTriangleBlockSize];
+};
+
+/**
+ * @brief Squared distance from a query point to the closest point on one
+ * triangle in edge form, every operation in Scalar. Reference for the packet
+ * kernels of the policies, same operation order.
+ * @param o First vertex
+ * @param e0 Edge from first to second vertex
+ * @param e1 Edge from first to third vertex
+ * @param q Query point
+ * @param s Output parameter along e0
+ * @param t Output parameter along e1
+ * @return Scalar Squared distance
+ */
+template <typename Scalar>
+inline Scalar closestPointDistanceSq(const Scalar* o, const Scalar* e0, const Scalar* e1, const Scalar* q, Scalar& s, Scalar& t)
+{
+    Scalar wx = o[0] - q[0], wy = o[1] - q[1], wz = o[2] - q[2];
+
+    Scalar a = e0[0]*e0[0] + e0[1]*e0[1] + e0[2]*e0[2];
+    Scalar b = e0[0]*e1[0] + e0[1]*e1[1] + e0[2]*e1[2];
+    Scalar c = e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2];
+    Scalar d = e0[0]*wx + e0[1]*wy + e0[2]*wz;
+    Scalar e = e1[0]*wx + e1[1]*wy + e1[2]*wz;
+
+    closestPointParams(a, b, c, d, e, s, t);
+
+    Scalar rx = o[0] + s*e0[0] + t*e1[0] - q[0];
+    Scalar ry = o[1] + s*e0[1] + t*e1[1] - q[1];
+    Scalar rz = o[2] + s*e0[2] + t*e1[2] - q[2];
+    return rx*rx + ry*ry + rz*rz;
+}
+
+/**
+ * @brief Scalar loop over the lanes of a block with closestPointDistanceSq()
+ * @param block Triangle block
+ * @param q Query point, relative to the block origin
+ * @param distSq Output squared distance per lane, NaN for unused lanes
+ * @param s Output parameter along e0 per lane
+ * @param t Output parameter along e1 per lane
+ */
+template <typename Scalar>
+inline void closestPointsOnBlockScalar(const TriangleBlockT<Scalar>& block, const Scalar* q, Scalar* distSq, Scalar* s, Scalar* t)
+{
+    for (int lane = 0; lane < kTriangleBlockSize; lane++)
+    {
+        const Scalar o[3] = {block.m_ox[lane], block.m_oy[lane], block.m_oz[lane]};
+        const Scalar e0[3] = {block.m_e0x[lane], block.m_e0y[lane], block.m_e0z[lane]};
+        const Scalar e1[3] = {block.m_e1x[lane], block.m_e1y[lane], block.m_e1z[lane]};
+        distSq[lane] = closestPointDistanceSq(o, e0, e1, q, s[lane], t[lane]);
+    }
+}
+
+/**
+ * @brief FloatPolicy struct; single precision engine. Half the memory of the
+ * double policy and a whole block per SSE register, 4 triangles per
+ * instruction instead of 2; distances are good to a few float ulps of the
+ * mesh size.
+ */
+struct FloatPolicy
+{
+public:
+    typedef float Scalar;
+
+    static inline const char* name() {return "float";};
+
+    /**
+     * @brief Squared distances and closest point parameters of the 4 triangles
+     * of a block, same results as closestPointsOnBlockScalar()
+     */
+    static inline void closestPointsOnBlock(const TriangleBlockT<float>& block, const float* q, float* distSq, float* s, float* t)
+    {
+#ifdef QUERY_SIMD_SSE2
+        const __m128 qx = _mm_set1_ps(q[0]), qy = _mm_set1_ps(q[1]), qz = _mm_set1_ps(q[2]);
+        __m128 ox = _mm_load_ps(block.m_ox), oy = _mm_load_ps(block.m_oy), oz = _mm_load_ps(block.m_oz);
+        __m128 e0x = _mm_load_ps(block.m_e0x), e0y = _mm_load_ps(block.m_e0y), e0z = _mm_load_ps(block.m_e0z);
+        __m128 e1x = _mm_load_ps(block.m_e1x), e1y = _mm_load_ps(block.m_e1y), e1z = _mm_load_ps(block.m_e1z);
+        __m128 wx = _mm_sub_ps(ox, qx), wy = _mm_sub_ps(oy, qy), wz = _mm_sub_ps(oz, qz);
+
+        auto dot = [](const __m128& ax, const __m128& ay, const __m128& az, const __m128& bx, const __m128& by, const __m128& bz) {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+        };
+
+        __m128 sv, tv;
+        closestPointParams4(dot(e0x, e0y, e0z, e0x, e0y, e0z), dot(e0x, e0y, e0z, e1x, e1y, e1z),
+                            dot(e1x, e1y, e1z, e1x, e1y, e1z), dot(e0x, e0y, e0z, wx, wy, wz),
+                            dot(e1x, e1y, e1z, wx, wy, wz), sv, tv);
+
+        __m128 rx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(ox, _mm_mul_ps(sv, e0x)), _mm_mul_ps(tv, e1x)), qx);
+        __m128 ry = _mm_sub_ps(_mm_add_ps(_mm_add_ps(oy, _mm_mul_ps(sv, e0y)), _mm_mul_ps(tv, e1y)), qy);
+        __m128 rz = _mm_sub_ps(_mm_add_ps(_mm_add_ps(oz, _mm_mul_ps(sv, e0z)), _mm_mul_ps(tv, e1z)), qz);
+        _mm_storeu_ps(distSq, dot(rx, ry, rz, rx, ry, rz));
+        _mm_storeu_ps(s, sv);
+        _mm_storeu_ps(t, tv);
+#else
+        closestPointsOnBlockScalar(block, q, distSq, s, t);
+#endif
+    };
+};
+
+/**
+ * @brief DoublePolicy struct; double precision engine, every step of the
+ * search in double so the closest face and distance are exact up to double
+ * rounding.
+ */
+struct DoublePolicy
+{
+public:
+    typedef double Scalar;
+
+    static inline const char* name() {return "double";};
+
+    static inline void closestPointsOnBlock(const TriangleBlockT<double>& block, const double* q, double* distSq, double* s, double* t)
+    {
+        closestPointsOnBlockScalar(block, q, distSq, s, t);
+    };
+};
+
+#endif // SCALARPOLICY_H
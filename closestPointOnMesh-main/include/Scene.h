@@ -0,0 +1,74 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <Eigen3/Eigen/Geometry>
+#include "PointQuery.h"
+
+/**
+ * @brief SceneHit struct; closest point found in a scene. The hit record is
+ * the one of the instance's mesh with the point and distances moved to world
+ * space, face, vertex and barycentrics refer to the instance's mesh.
+ */
+struct SceneHit
+{
+public:
+    int m_instanceId;   // instance hit, -1 if nothing was found
+    QueryHit m_hit;
+};
+
+/**
+ * @brief SceneInstance struct; one placement of a scene mesh
+ */
+struct SceneInstance
+{
+public:
+    int m_meshId;
+    Eigen::Affine3d m_transform;    // mesh to world
+    Eigen::Affine3d m_inverse;      // world to mesh
+    double m_scale;                 // uniform scale of m_transform
+};
+
+/**
+ * @brief Scene class; closest point queries over many meshes placed by
+ * instances, a two level tree. Every mesh keeps its own PointQuery (the bottom
+ * level), shared by all instances of it, and the scene builds a small BVH over
+ * the world bounds of the instances (the top level). A query walks the top
+ * level nearest instance first and runs the mesh query in instance space, so
+ * repeated geometry is stored once.
+ * Transforms are limited to rotations, translations, mirroring and uniform
+ * scale, which keep closest points closest; distances are scaled back to world
+ * units.
+ * Mesh queries are referenced, not copied, and have to outlive the scene.
+ */
+class Scene
+{
+private:
+    std::vector<const PointQuery*> m_meshes;
+    std::vector<SceneInstance> m_instances;
+    std::vector<BVHNode> m_nodes;
+    std::vector<int> m_instanceIndices;
+
+    void buildNode(const int& nodeId, const int& first, const int& count, const std::vector<BVHNode>& bounds, const int& depth);
+
+public:
+    static const int kLeafSize = 2;
+    static const int kMaxDepth = 48;
+
+    Scene() {};
+    ~Scene() {};
+
+    int addMesh(const PointQuery& query);
+    int addInstance(const int& meshId, const Eigen::Affine3d& transform);
+    void build();
+
+    inline int getMeshCount() const {return static_cast<int>(m_meshes.size());};
+    inline int getInstanceCount() const {return static_cast<int>(m_instances.size());};
+    inline const SceneInstance& getInstance(const int& id) const {return m_instances[id];};
+    inline const PointQuery& getMesh(const int& id) const {return *m_meshes[id];};
+
+    bool query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, SceneHit& hit) const;
+    bool bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, SceneHit& hit) const;
+};
+
+#endif // SCENE_H
@@ -0,0 +1,536 @@
+#ifndef TRIANGLEKERNEL_H
+#define TRIANGLEKERNEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <Eigen3/Eigen/Dense>
+
+#if defined(__SSE2__) && !defined(QUERY_NO_SIMD)
+#include <immintrin.h>
+#define QUERY_SIMD_SSE2 1
+#if defined(__AVX2__)
+#define QUERY_SIMD_AVX2 1
+#endif
+#endif
+
+/**
+ * @brief Number of triangles tested together by closestPointsOnBlock
+ */
+static const int kTriangleBlockSize = 4;
+
+/**
+ * @brief Most triangles tested by one closestPointsOnBlocks() call; two blocks
+ * under AVX2, where the float region logic runs 8 lanes wide
+ */
+#if defined(QUERY_SIMD_AVX2)
+static const int kKernelWidth = 2 * kTriangleBlockSize;
+#else
+static const int kKernelWidth = kTriangleBlockSize;
+#endif
+
+/**
+ * @brief TriangleBlock struct; 4 triangles in structure of arrays layout, one
+ * lane per triangle. Each triangle is stored as its first vertex and the two
+ * edges leaving it, so the packet kernel can load every component straight into
+ * a SIMD register. Unused lanes hold NaN and never produce a hit.
+ */
+struct alignas(32) TriangleBlock
+{
+public:
+    double m_ox[kTriangleBlockSize], m_oy[kTriangleBlockSize], m_oz[kTriangleBlockSize];
+    double m_e0x[kTriangleBlockSize], m_e0y[kTriangleBlockSize], m_e0z[kTriangleBlockSize];
+    double m_e1x[kTriangleBlockSize], m_e1y[kTriangleBlockSize], m_e1z[kTriangleBlockSize];
+};
+
+/**
+ * @brief Clamp utility function to restrict value to a given range.
+ * NaN clamps to lower, the packet kernel reproduces that.
+ * @param n Value to be clamped
+ * @param lower Min value
+ * @param upper Max value
+ * @return Scalar Clamped Value
+ */
+template <typename Scalar>
+inline Scalar clamp(Scalar n, Scalar lower, Scalar upper) {
+    return std::max(lower, std::min(n, upper));
+}
+
+/**
+ * @brief Get the barycentric parameters (s, t) of the closest point on a triangle
+ * given in edge form, closest point = v1 + s * edge0 + t * edge1. Float for
+ * the query kernels, double for the exact one of ClosestPointEngine.
+ * // https://www.gamedev.net/forums/topic/552906-closest-point-on-triangle/
+ * @param a edge0 . edge0
+ * @param b edge0 . edge1
+ * @param c edge1 . edge1
+ * @param d edge0 . (v1 - queryPoint)
+ * @param e edge1 . (v1 - queryPoint)
+ * @param s Output parameter along edge0
+ * @param t Output parameter along edge1
+ */
+template <typename Scalar>
+inline void closestPointParams(const Scalar& a, const Scalar& b, const Scalar& c, const Scalar& d, const Scalar& e, Scalar& s, Scalar& t)
+{
+    const Scalar zero = 0, one = 1;
+    Scalar det = a*c - b*b;
+    s = b*e - c*d;
+    t = b*d - a*e;
+
+    Scalar numer = (c+e) - (b+d);
+    Scalar denom = a-2*b+c;
+
+    if ( s + t < det )
+    {
+        if ( s < zero )
+        {
+            if ( t < zero )
+            {
+                if ( d < zero )
+                {
+                    s = clamp( -d/a, zero, one );
+                    t = zero;
+                }
+                else
+                {
+                    s = zero;
+                    t = clamp( -e/c, zero, one );
+                }
+            }
+            else
+            {
+                s = zero;
+                t = clamp( -e/c, zero, one );
+            }
+        }
+        else if ( t < zero )
+        {
+            s = clamp( -d/a, zero, one );
+            t = zero;
+        }
+        else
+        {
+            Scalar invDet = one / det;
+            s *= invDet;
+            t *= invDet;
+        }
+    }
+    else
+    {
+        if ( s < zero )
+        {
+            Scalar tmp0 = b+d;
+            Scalar tmp1 = c+e;
+            if ( tmp1 > tmp0 )
+            {
+                s = clamp( numer/denom, zero, one );
+                t = one - s;
+            }
+            else
+            {
+                t = clamp( -e/c, zero, one );
+                s = zero;
+            }
+        }
+        else if ( t < zero )
+        {
+            if ( a+d > b+e )
+            {
+                s = clamp( numer/denom, zero, one );
+                t = one - s;
+            }
+            else
+            {
+                s = clamp( -d/a, zero, one );
+                t = zero;
+            }
+        }
+        else
+        {
+            s = clamp( numer/denom, zero, one );
+            t = one - s;
+        }
+    }
+}
+
+/**
+ * @brief Scalar closest point on one triangle in edge form, plus the distance
+ * to the query point. Reference for the packet kernel, every operation is done
+ * in the same order so both give bit identical results.
+ * @param o First vertex
+ * @param e0 Edge from first to second vertex
+ * @param e1 Edge from first to third vertex
+ * @param queryPoint Query point
+ * @param dist Output distance, float as used by the query
+ * @param s Output parameter along e0
+ * @param t Output parameter along e1
+ * @return Eigen::Vector3d Closest point
+ */
+inline Eigen::Vector3d closestPointOnTriangleEdges(const Eigen::Vector3d& o, const Eigen::Vector3d& e0, const Eigen::Vector3d& e1, const Eigen::Vector3d& queryPoint, float& dist, float& s, float& t)
+{
+    double wx = o.x() - queryPoint.x(), wy = o.y() - queryPoint.y(), wz = o.z() - queryPoint.z();
+
+    float a = static_cast<float>(e0.x()*e0.x() + e0.y()*e0.y() + e0.z()*e0.z());
+    float b = static_cast<float>(e0.x()*e1.x() + e0.y()*e1.y() + e0.z()*e1.z());
+    float c = static_cast<float>(e1.x()*e1.x() + e1.y()*e1.y() + e1.z()*e1.z());
+    float d = static_cast<float>(e0.x()*wx + e0.y()*wy + e0.z()*wz);
+    float e = static_cast<float>(e1.x()*wx + e1.y()*wy + e1.z()*wz);
+
+    closestPointParams(a, b, c, d, e, s, t);
+
+    double sd = s, td = t;
+    Eigen::Vector3d result(o.x() + sd*e0.x() + td*e1.x(),
+                           o.y() + sd*e0.y() + td*e1.y(),
+                           o.z() + sd*e0.z() + td*e1.z());
+
+    double dx = result.x() - queryPoint.x(), dy = result.y() - queryPoint.y(), dz = result.z() - queryPoint.z();
+    dist = sqrtf(static_cast<float>(dx*dx + dy*dy + dz*dz));
+    return result;
+}
+
+/**
+ * @brief closestPointOnTriangleEdges() without the triangle parameters
+ */
+inline Eigen::Vector3d closestPointOnTriangleEdges(const Eigen::Vector3d& o, const Eigen::Vector3d& e0, const Eigen::Vector3d& e1, const Eigen::Vector3d& queryPoint, float& dist)
+{
+    float s, t;
+    return closestPointOnTriangleEdges(o, e0, e1, queryPoint, dist, s, t);
+}
+
+#ifdef QUERY_SIMD_SSE2
+/**
+ * @brief Lane wise select, mask ? a : b. Done with and/andnot/or since blendv
+ * needs SSE4.1.
+ */
+inline __m128 selectPs(const __m128& mask, const __m128& a, const __m128& b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/**
+ * @brief Lane wise clamp to [0, 1] matching the scalar clamp() for NaN/inf.
+ * std::min(n, 1) == minps(1, n) and std::max(0, m) == maxps(m, 0).
+ */
+inline __m128 clamp01Ps(const __m128& n)
+{
+    return _mm_max_ps(_mm_min_ps(_mm_set1_ps(1.f), n), _mm_setzero_ps());
+}
+
+/**
+ * @brief Packet version of closestPointParams() for 4 triangles. Every region
+ * candidate is computed for all lanes and the right one is picked with masks,
+ * so there is no branching on the region.
+ */
+inline void closestPointParams4(const __m128& a, const __m128& b, const __m128& c, const __m128& d, const __m128& e, __m128& s, __m128& t)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 two = _mm_set1_ps(2.f);
+    const __m128 signBit = _mm_set1_ps(-0.f);
+
+    __m128 det = _mm_sub_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, b));
+    __m128 s0 = _mm_sub_ps(_mm_mul_ps(b, e), _mm_mul_ps(c, d));
+    __m128 t0 = _mm_sub_ps(_mm_mul_ps(b, d), _mm_mul_ps(a, e));
+
+    __m128 bd = _mm_add_ps(b, d);
+    __m128 ce = _mm_add_ps(c, e);
+    __m128 numer = _mm_sub_ps(ce, bd);
+    __m128 denom = _mm_add_ps(_mm_sub_ps(a, _mm_mul_ps(two, b)), c);
+
+    // region candidates
+    __m128 sEdgeA = clamp01Ps(_mm_div_ps(_mm_xor_ps(d, signBit), a));  // (s, 0)
+    __m128 tEdgeC = clamp01Ps(_mm_div_ps(_mm_xor_ps(e, signBit), c));  // (0, t)
+    __m128 sEdgeBC = clamp01Ps(_mm_div_ps(numer, denom));              // (s, 1 - s)
+    __m128 invDet = _mm_div_ps(one, det);
+    __m128 sInside = _mm_mul_ps(s0, invDet);
+    __m128 tInside = _mm_mul_ps(t0, invDet);
+
+    __m128 inside = _mm_cmplt_ps(_mm_add_ps(s0, t0), det);
+    __m128 sNeg = _mm_cmplt_ps(s0, zero);
+    __m128 tNeg = _mm_cmplt_ps(t0, zero);
+    __m128 dNeg = _mm_cmplt_ps(d, zero);
+
+    // s + t < det branch; useA picks (sEdgeA, 0), useC picks (0, tEdgeC)
+    __m128 inUseA = _mm_or_ps(_mm_and_ps(sNeg, _mm_and_ps(tNeg, dNeg)), _mm_andnot_ps(sNeg, tNeg));
+    __m128 inUseC = _mm_andnot_ps(inUseA, sNeg);
+    __m128 sIn = selectPs(inUseA, sEdgeA, selectPs(inUseC, zero, sInside));
+    __m128 tIn = selectPs(inUseA, zero, selectPs(inUseC, tEdgeC, tInside));
+
+    // s + t >= det branch; defaults to the (sEdgeBC, 1 - sEdgeBC) edge
+    __m128 outUseC = _mm_andnot_ps(_mm_cmpgt_ps(ce, bd), sNeg);
+    __m128 outUseA = _mm_andnot_ps(sNeg, _mm_andnot_ps(_mm_cmpgt_ps(_mm_add_ps(a, d), _mm_add_ps(b, e)), tNeg));
+    __m128 sOut = selectPs(outUseC, zero, selectPs(outUseA, sEdgeA, sEdgeBC));
+    __m128 tOut = selectPs(outUseC, tEdgeC, selectPs(outUseA, zero, _mm_sub_ps(one, sEdgeBC)));
+
+    s = selectPs(inside, sIn, sOut);
+    t = selectPs(inside, tIn, tOut);
+}
+#endif
+
+#ifdef QUERY_SIMD_AVX2
+/**
+ * @brief 8 lane selectPs(), the masks are all ones or all zeros so blendv
+ * gives the same lanes as and/andnot/or.
+ */
+inline __m256 selectPs8(const __m256& mask, const __m256& a, const __m256& b)
+{
+    return _mm256_blendv_ps(b, a, mask);
+}
+
+/**
+ * @brief 8 lane clamp01Ps(), same operand order for the NaN behaviour.
+ */
+inline __m256 clamp01Ps8(const __m256& n)
+{
+    return _mm256_max_ps(_mm256_min_ps(_mm256_set1_ps(1.f), n), _mm256_setzero_ps());
+}
+
+/**
+ * @brief closestPointParams4() for 8 triangles, the region logic of two blocks
+ * in one pass.
+ */
+inline void closestPointParams8(const __m256& a, const __m256& b, const __m256& c, const __m256& d, const __m256& e, __m256& s, __m256& t)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 two = _mm256_set1_ps(2.f);
+    const __m256 signBit = _mm256_set1_ps(-0.f);
+
+    __m256 det = _mm256_sub_ps(_mm256_mul_ps(a, c), _mm256_mul_ps(b, b));
+    __m256 s0 = _mm256_sub_ps(_mm256_mul_ps(b, e), _mm256_mul_ps(c, d));
+    __m256 t0 = _mm256_sub_ps(_mm256_mul_ps(b, d), _mm256_mul_ps(a, e));
+
+    __m256 bd = _mm256_add_ps(b, d);
+    __m256 ce = _mm256_add_ps(c, e);
+    __m256 numer = _mm256_sub_ps(ce, bd);
+    __m256 denom = _mm256_add_ps(_mm256_sub_ps(a, _mm256_mul_ps(two, b)), c);
+
+    // region candidates
+    __m256 sEdgeA = clamp01Ps8(_mm256_div_ps(_mm256_xor_ps(d, signBit), a));  // (s, 0)
+    __m256 tEdgeC = clamp01Ps8(_mm256_div_ps(_mm256_xor_ps(e, signBit), c));  // (0, t)
+    __m256 sEdgeBC = clamp01Ps8(_mm256_div_ps(numer, denom));                 // (s, 1 - s)
+    __m256 invDet = _mm256_div_ps(one, det);
+    __m256 sInside = _mm256_mul_ps(s0, invDet);
+    __m256 tInside = _mm256_mul_ps(t0, invDet);
+
+    __m256 inside = _mm256_cmp_ps(_mm256_add_ps(s0, t0), det, _CMP_LT_OQ);
+    __m256 sNeg = _mm256_cmp_ps(s0, zero, _CMP_LT_OQ);
+    __m256 tNeg = _mm256_cmp_ps(t0, zero, _CMP_LT_OQ);
+    __m256 dNeg = _mm256_cmp_ps(d, zero, _CMP_LT_OQ);
+
+    // s + t < det branch; useA picks (sEdgeA, 0), useC picks (0, tEdgeC)
+    __m256 inUseA = _mm256_or_ps(_mm256_and_ps(sNeg, _mm256_and_ps(tNeg, dNeg)), _mm256_andnot_ps(sNeg, tNeg));
+    __m256 inUseC = _mm256_andnot_ps(inUseA, sNeg);
+    __m256 sIn = selectPs8(inUseA, sEdgeA, selectPs8(inUseC, zero, sInside));
+    __m256 tIn = selectPs8(inUseA, zero, selectPs8(inUseC, tEdgeC, tInside));
+
+    // s + t >= det branch; defaults to the (sEdgeBC, 1 - sEdgeBC) edge
+    __m256 outUseC = _mm256_andnot_ps(_mm256_cmp_ps(ce, bd, _CMP_GT_OQ), sNeg);
+    __m256 outUseA = _mm256_andnot_ps(sNeg, _mm256_andnot_ps(_mm256_cmp_ps(_mm256_add_ps(a, d), _mm256_add_ps(b, e), _CMP_GT_OQ), tNeg));
+    __m256 sOut = selectPs8(outUseC, zero, selectPs8(outUseA, sEdgeA, sEdgeBC));
+    __m256 tOut = selectPs8(outUseC, tEdgeC, selectPs8(outUseA, zero, _mm256_sub_ps(one, sEdgeBC)));
+
+    s = selectPs8(inside, sIn, sOut);
+    t = selectPs8(inside, tIn, tOut);
+}
+#endif
+
+/**
+ * @brief Closest points and distances from a query point to the 4 triangles of a block.
+ * Uses AVX2 for the double precision parts when available, SSE2 otherwise and a
+ * scalar loop when SIMD is disabled with QUERY_NO_SIMD. All paths give the same
+ * results as closestPointOnTriangleEdges().
+ * @param block Triangle block
+ * @param queryPoint Query point
+ * @param px Output closest point x per lane
+ * @param py Output closest point y per lane
+ * @param pz Output closest point z per lane
+ * @param dist Output distance per lane, NaN for unused lanes
+ */
+inline void closestPointsOnBlock(const TriangleBlock& block, const Eigen::Vector3d& queryPoint,
+                                 double* px, double* py, double* pz, float* dist)
+{
+#if defined(QUERY_SIMD_AVX2)
+    const __m256d qx = _mm256_set1_pd(queryPoint.x());
+    const __m256d qy = _mm256_set1_pd(queryPoint.y());
+    const __m256d qz = _mm256_set1_pd(queryPoint.z());
+
+    __m256d ox = _mm256_load_pd(block.m_ox), oy = _mm256_load_pd(block.m_oy), oz = _mm256_load_pd(block.m_oz);
+    __m256d e0x = _mm256_load_pd(block.m_e0x), e0y = _mm256_load_pd(block.m_e0y), e0z = _mm256_load_pd(block.m_e0z);
+    __m256d e1x = _mm256_load_pd(block.m_e1x), e1y = _mm256_load_pd(block.m_e1y), e1z = _mm256_load_pd(block.m_e1z);
+    __m256d wx = _mm256_sub_pd(ox, qx), wy = _mm256_sub_pd(oy, qy), wz = _mm256_sub_pd(oz, qz);
+
+    auto dot = [](const __m256d& ax, const __m256d& ay, const __m256d& az, const __m256d& bx, const __m256d& by, const __m256d& bz) {
+        return _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax, bx), _mm256_mul_pd(ay, by)), _mm256_mul_pd(az, bz)));
+    };
+
+    __m128 s, t;
+    closestPointParams4(dot(e0x, e0y, e0z, e0x, e0y, e0z), dot(e0x, e0y, e0z, e1x, e1y, e1z),
+                        dot(e1x, e1y, e1z, e1x, e1y, e1z), dot(e0x, e0y, e0z, wx, wy, wz),
+                        dot(e1x, e1y, e1z, wx, wy, wz), s, t);
+
+    __m256d sd = _mm256_cvtps_pd(s), td = _mm256_cvtps_pd(t);
+    __m256d rx = _mm256_add_pd(_mm256_add_pd(ox, _mm256_mul_pd(sd, e0x)), _mm256_mul_pd(td, e1x));
+    __m256d ry = _mm256_add_pd(_mm256_add_pd(oy, _mm256_mul_pd(sd, e0y)), _mm256_mul_pd(td, e1y));
+    __m256d rz = _mm256_add_pd(_mm256_add_pd(oz, _mm256_mul_pd(sd, e0z)), _mm256_mul_pd(td, e1z));
+    _mm256_storeu_pd(px, rx);
+    _mm256_storeu_pd(py, ry);
+    _mm256_storeu_pd(pz, rz);
+
+    __m256d dx = _mm256_sub_pd(rx, qx), dy = _mm256_sub_pd(ry, qy), dz = _mm256_sub_pd(rz, qz);
+    __m256d distSq = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+    _mm_storeu_ps(dist, _mm_sqrt_ps(_mm256_cvtpd_ps(distSq)));
+#elif defined(QUERY_SIMD_SSE2)
+    // double precision parts in two halves of 2 lanes, float region logic in 4 lanes
+    const __m128d qx = _mm_set1_pd(queryPoint.x());
+    const __m128d qy = _mm_set1_pd(queryPoint.y());
+    const __m128d qz = _mm_set1_pd(queryPoint.z());
+
+    __m128d ox[2], oy[2], oz[2], e0x[2], e0y[2], e0z[2], e1x[2], e1y[2], e1z[2], wx[2], wy[2], wz[2];
+    for (int h = 0; h < 2; h++)
+    {
+        ox[h] = _mm_load_pd(block.m_ox + 2*h); oy[h] = _mm_load_pd(block.m_oy + 2*h); oz[h] = _mm_load_pd(block.m_oz + 2*h);
+        e0x[h] = _mm_load_pd(block.m_e0x + 2*h); e0y[h] = _mm_load_pd(block.m_e0y + 2*h); e0z[h] = _mm_load_pd(block.m_e0z + 2*h);
+        e1x[h] = _mm_load_pd(block.m_e1x + 2*h); e1y[h] = _mm_load_pd(block.m_e1y + 2*h); e1z[h] = _mm_load_pd(block.m_e1z + 2*h);
+        wx[h] = _mm_sub_pd(ox[h], qx); wy[h] = _mm_sub_pd(oy[h], qy); wz[h] = _mm_sub_pd(oz[h], qz);
+    }
+
+    auto dot = [](const __m128d* ax, const __m128d* ay, const __m128d* az, const __m128d* bx, const __m128d* by, const __m128d* bz) {
+        __m128 lo = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ax[0], bx[0]), _mm_mul_pd(ay[0], by[0])), _mm_mul_pd(az[0], bz[0])));
+        __m128 hi = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ax[1], bx[1]), _mm_mul_pd(ay[1], by[1])), _mm_mul_pd(az[1], bz[1])));
+        return _mm_movelh_ps(lo, hi);
+    };
+
+    __m128 s, t;
+    closestPointParams4(dot(e0x, e0y, e0z, e0x, e0y, e0z), dot(e0x, e0y, e0z, e1x, e1y, e1z),
+                        dot(e1x, e1y, e1z, e1x, e1y, e1z), dot(e0x, e0y, e0z, wx, wy, wz),
+                        dot(e1x, e1y, e1z, wx, wy, wz), s, t);
+
+    __m128d sd[2] = {_mm_cvtps_pd(s), _mm_cvtps_pd(_mm_movehl_ps(s, s))};
+    __m128d td[2] = {_mm_cvtps_pd(t), _mm_cvtps_pd(_mm_movehl_ps(t, t))};
+    __m128 distHalf[2];
+    for (int h = 0; h < 2; h++)
+    {
+        __m128d rx = _mm_add_pd(_mm_add_pd(ox[h], _mm_mul_pd(sd[h], e0x[h])), _mm_mul_pd(td[h], e1x[h]));
+        __m128d ry = _mm_add_pd(_mm_add_pd(oy[h], _mm_mul_pd(sd[h], e0y[h])), _mm_mul_pd(td[h], e1y[h]));
+        __m128d rz = _mm_add_pd(_mm_add_pd(oz[h], _mm_mul_pd(sd[h], e0z[h])), _mm_mul_pd(td[h], e1z[h]));
+        _mm_storeu_pd(px + 2*h, rx);
+        _mm_storeu_pd(py + 2*h, ry);
+        _mm_storeu_pd(pz + 2*h, rz);
+
+        __m128d dx = _mm_sub_pd(rx, qx), dy = _mm_sub_pd(ry, qy), dz = _mm_sub_pd(rz, qz);
+        distHalf[h] = _mm_cvtpd_ps(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz)));
+    }
+    _mm_storeu_ps(dist, _mm_sqrt_ps(_mm_movelh_ps(distHalf[0], distHalf[1])));
+#else
+    for (int lane = 0; lane < kTriangleBlockSize; lane++)
+    {
+        Eigen::Vector3d p = closestPointOnTriangleEdges(
+            Eigen::Vector3d(block.m_ox[lane], block.m_oy[lane], block.m_oz[lane]),
+            Eigen::Vector3d(block.m_e0x[lane], block.m_e0y[lane], block.m_e0z[lane]),
+            Eigen::Vector3d(block.m_e1x[lane], block.m_e1y[lane], block.m_e1z[lane]),
+            queryPoint, dist[lane]);
+        px[lane] = p.x();
+        py[lane] = p.y();
+        pz[lane] = p.z();
+    }
+#endif
+}
+
+#ifdef QUERY_SIMD_AVX2
+/**
+ * @brief closestPointsOnBlock() for two consecutive blocks. The double parts
+ * stay 4 lanes per block, the float region logic and square root run on all
+ * 8 lanes at once. Same results as two closestPointsOnBlock() calls.
+ * @param blocks First of the two blocks
+ * @param queryPoint Query point
+ * @param px Output closest point x for the 8 lanes
+ * @param py Output closest point y for the 8 lanes
+ * @param pz Output closest point z for the 8 lanes
+ * @param dist Output distance for the 8 lanes, NaN for unused lanes
+ */
+inline void closestPointsOnBlockPair(const TriangleBlock* blocks, const Eigen::Vector3d& queryPoint,
+                                     double* px, double* py, double* pz, float* dist)
+{
+    const __m256d qx = _mm256_set1_pd(queryPoint.x());
+    const __m256d qy = _mm256_set1_pd(queryPoint.y());
+    const __m256d qz = _mm256_set1_pd(queryPoint.z());
+
+    __m256d ox[2], oy[2], oz[2], e0x[2], e0y[2], e0z[2], e1x[2], e1y[2], e1z[2], wx[2], wy[2], wz[2];
+    for (int h = 0; h < 2; h++)
+    {
+        const TriangleBlock& block = blocks[h];
+        ox[h] = _mm256_load_pd(block.m_ox); oy[h] = _mm256_load_pd(block.m_oy); oz[h] = _mm256_load_pd(block.m_oz);
+        e0x[h] = _mm256_load_pd(block.m_e0x); e0y[h] = _mm256_load_pd(block.m_e0y); e0z[h] = _mm256_load_pd(block.m_e0z);
+        e1x[h] = _mm256_load_pd(block.m_e1x); e1y[h] = _mm256_load_pd(block.m_e1y); e1z[h] = _mm256_load_pd(block.m_e1z);
+        wx[h] = _mm256_sub_pd(ox[h], qx); wy[h] = _mm256_sub_pd(oy[h], qy); wz[h] = _mm256_sub_pd(oz[h], qz);
+    }
+
+    auto dot = [](const __m256d* ax, const __m256d* ay, const __m256d* az, const __m256d* bx, const __m256d* by, const __m256d* bz) {
+        __m128 lo = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax[0], bx[0]), _mm256_mul_pd(ay[0], by[0])), _mm256_mul_pd(az[0], bz[0])));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax[1], bx[1]), _mm256_mul_pd(ay[1], by[1])), _mm256_mul_pd(az[1], bz[1])));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    };
+
+    __m256 s, t;
+    closestPointParams8(dot(e0x, e0y, e0z, e0x, e0y, e0z), dot(e0x, e0y, e0z, e1x, e1y, e1z),
+                        dot(e1x, e1y, e1z, e1x, e1y, e1z), dot(e0x, e0y, e0z, wx, wy, wz),
+                        dot(e1x, e1y, e1z, wx, wy, wz), s, t);
+
+    __m256d sd[2] = {_mm256_cvtps_pd(_mm256_castps256_ps128(s)), _mm256_cvtps_pd(_mm256_extractf128_ps(s, 1))};
+    __m256d td[2] = {_mm256_cvtps_pd(_mm256_castps256_ps128(t)), _mm256_cvtps_pd(_mm256_extractf128_ps(t, 1))};
+    __m128 distHalf[2];
+    for (int h = 0; h < 2; h++)
+    {
+        __m256d rx = _mm256_add_pd(_mm256_add_pd(ox[h], _mm256_mul_pd(sd[h], e0x[h])), _mm256_mul_pd(td[h], e1x[h]));
+        __m256d ry = _mm256_add_pd(_mm256_add_pd(oy[h], _mm256_mul_pd(sd[h], e0y[h])), _mm256_mul_pd(td[h], e1y[h]));
+        __m256d rz = _mm256_add_pd(_mm256_add_pd(oz[h], _mm256_mul_pd(sd[h], e0z[h])), _mm256_mul_pd(td[h], e1z[h]));
+        _mm256_storeu_pd(px + kTriangleBlockSize*h, rx);
+        _mm256_storeu_pd(py + kTriangleBlockSize*h, ry);
+        _mm256_storeu_pd(pz + kTriangleBlockSize*h, rz);
+
+        __m256d dx = _mm256_sub_pd(rx, qx), dy = _mm256_sub_pd(ry, qy), dz = _mm256_sub_pd(rz, qz);
+        distHalf[h] = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz)));
+    }
+    _mm256_storeu_ps(dist, _mm256_sqrt_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(distHalf[0]), distHalf[1], 1)));
+}
+#endif
+
+/**
+ * @brief Lanes closestPointsOnBlocks() tests for a run of leaf slots; two
+ * blocks when AVX2 is on and the second one holds a face of the run.
+ * @param slotCount Slots left in the leaf, from the first block on
+ * @return int kKernelWidth or kTriangleBlockSize
+ */
+inline int kernelLanes(const int& slotCount)
+{
+    return slotCount > kTriangleBlockSize ? kKernelWidth : kTriangleBlockSize;
+}
+
+/**
+ * @brief Closest points and distances from a query point to the next
+ * kernelLanes(slotCount) triangles of a leaf. Leaf blocks are consecutive, so
+ * lane k is slot k from the first block.
+ * @param blocks First block to test
+ * @param slotCount Slots left in the leaf, from the first block on
+ * @param queryPoint Query point
+ * @param px Output closest point x per lane, kKernelWidth long
+ * @param py Output closest point y per lane, kKernelWidth long
+ * @param pz Output closest point z per lane, kKernelWidth long
+ * @param dist Output distance per lane, kKernelWidth long, NaN for unused lanes
+ * @return int Lanes written
+ */
+inline int closestPointsOnBlocks(const TriangleBlock* blocks, const int& slotCount, const Eigen::Vector3d& queryPoint,
+                                 double* px, double* py, double* pz, float* dist)
+{
+#if defined(QUERY_SIMD_AVX2)
+    if (kernelLanes(slotCount) > kTriangleBlockSize)
+    {
+        closestPointsOnBlockPair(blocks, queryPoint, px, py, pz, dist);
+        return kKernelWidth;
+    }
+#endif
+    closestPointsOnBlock(*blocks, queryPoint, px, py, pz, dist);
+    return kTriangleBlockSize;
+}
+
+#endif // TRIANGLEKERNEL_H
@@ -0,0 +1,57 @@
+#ifndef WINDINGKERNEL_H
+#define WINDINGKERNEL_H
+
+#include <cmath>
+#include <Eigen3/Eigen/Dense>
+
+/**
+ * @brief WindingNode struct; dipole expansion of the faces below one BVH node,
+ * stored at the same index as the node. Far from the node the faces' winding
+ * number contribution is approximated by a single dipole at m_center.
+ */
+struct WindingNode
+{
+public:
+    Eigen::Vector3d m_center;   // area weighted centroid of the faces
+    Eigen::Vector3d m_normal;   // sum of area weighted face normals, the dipole moment
+    double m_radius;            // distance from m_center to the furthest face vertex
+    double m_area;              // total face area
+};
+
+/**
+ * @brief Exact winding number contribution of one triangle; its signed solid
+ * angle seen from the query point over 4 pi (Van Oosterom and Strackee).
+ * Positive behind the triangle, i.e. inside a mesh with outward facing
+ * (counter clockwise) faces.
+ * @param v1 First vertex
+ * @param v2 Second vertex
+ * @param v3 Third vertex
+ * @param queryPoint Query point
+ * @return double Winding number contribution
+ */
+inline double triangleWinding(const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3, const Eigen::Vector3d& queryPoint)
+{
+    const double kPi = 3.14159265358979323846;
+    const Eigen::Vector3d a = v1 - queryPoint, b = v2 - queryPoint, c = v3 - queryPoint;
+    const double la = a.norm(), lb = b.norm(), lc = c.norm();
+    const double numer = a.dot(b.cross(c));
+    const double denom = la*lb*lc + a.dot(b)*lc + b.dot(c)*la + c.dot(a)*lb;
+    return std::atan2(numer, denom) / (2.0 * kPi);
+}
+
+/**
+ * @brief Winding number contribution of a node's faces seen from far away,
+ * first order (dipole) term of the expansion
+ * @param node Winding data of the node
+ * @param queryPoint Query point, well outside the node's radius
+ * @return double Approximate winding number contribution
+ */
+inline double dipoleWinding(const WindingNode& node, const Eigen::Vector3d& queryPoint)
+{
+    const double kPi = 3.14159265358979323846;
+    const Eigen::Vector3d d = node.m_center - queryPoint;
+    const double dist = d.norm();
+    return d.dot(node.m_normal) / (4.0 * kPi * dist * dist * dist);
+}
+
+#endif // WINDINGKERNEL_H
@@ -0,0 +1,488 @@
+#include "BVH.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+const int kSahBins = 16;
+
+/**
+ * @brief Surface area of an axis aligned box
+ * @param bmin Box min corner
+ * @param bmax Box max corner
+ * @return double Surface area
+ */
+double boxArea(const Eigen::Vector3d& bmin, const Eigen::Vector3d& bmax)
+{
+    Eigen::Vector3d ext = bmax - bmin;
+    return 2.0 * (ext.x()*ext.y() + ext.y()*ext.z() + ext.z()*ext.x());
+}
+
+/**
+ * @brief Copy one face into a lane of a triangle block, face -1 fills the lane
+ * with NaN so it never produces a hit
+ * @param block Triangle block
+ * @param lane Lane in the block
+ * @param mesh Mesh object
+ * @param faceId Face id or -1
+ */
+void writeBlockLane(TriangleBlock& block, const int& lane, const Mesh& mesh, const int& faceId)
+{
+    if (faceId < 0)
+    {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        block.m_ox[lane] = block.m_oy[lane] = block.m_oz[lane] = nan;
+        block.m_e0x[lane] = block.m_e0y[lane] = block.m_e0z[lane] = 0.0;
+        block.m_e1x[lane] = block.m_e1y[lane] = block.m_e1z[lane] = 0.0;
+        return;
+    }
+
+    Eigen::Vector3d v1, v2, v3;
+    mesh.getFaceVertices(faceId, v1, v2, v3);
+    Eigen::Vector3d e0 = v2 - v1;
+    Eigen::Vector3d e1 = v3 - v1;
+    block.m_ox[lane] = v1.x(); block.m_oy[lane] = v1.y(); block.m_oz[lane] = v1.z();
+    block.m_e0x[lane] = e0.x(); block.m_e0y[lane] = e0.y(); block.m_e0z[lane] = e0.z();
+    block.m_e1x[lane] = e1.x(); block.m_e1y[lane] = e1.y(); block.m_e1z[lane] = e1.z();
+}
+
+/**
+ * @brief Bin accumulator used while evaluating SAH split candidates
+ */
+struct SahBin
+{
+    Eigen::Vector3d m_min, m_max;
+    int m_count;
+
+    SahBin()
+    {
+        m_min.setConstant(std::numeric_limits<double>::max());
+        m_max.setConstant(-std::numeric_limits<double>::max());
+        m_count = 0;
+    };
+};
+}
+
+/**
+ * @brief Build the tree over all faces of the given mesh. Any previously built
+ * tree is discarded.
+ * @param mesh Mesh object
+ * @param leafSize Max face count a leaf is allowed to hold before we try to split it
+ */
+void BVH::build(const Mesh& mesh, const int& leafSize)
+{
+    m_nodes.clear();
+    m_faceIndices.clear();
+    m_blocks.clear();
+    m_storage.reset();
+    m_leafSize = std::max(1, leafSize);
+    m_buildCost = 0.0;
+    m_linear = false;
+
+    const int faceCount = static_cast<int>(mesh.getFaceCount());
+    m_faceCount = faceCount;
+    if (faceCount == 0) return;
+
+    // per face bounds and centroids, computed once and shared by every split
+    std::vector<Eigen::Vector3d> faceMin(faceCount), faceMax(faceCount), centroids(faceCount);
+    m_faceIndices.resize(faceCount);
+    Eigen::Vector3d v1, v2, v3;
+    for (int i = 0; i < faceCount; i++)
+    {
+        mesh.getFaceVertices(i, v1, v2, v3);
+        faceMin[i] = v1.cwiseMin(v2).cwiseMin(v3);
+        faceMax[i] = v1.cwiseMax(v2).cwiseMax(v3);
+        centroids[i] = (v1 + v2 + v3) / 3.0;
+        m_faceIndices[i] = i;
+    }
+
+    m_nodes.reserve(2 * (faceCount / m_leafSize + 1));
+    m_nodes.push_back(BVHNode());
+    buildNode(0, 0, faceCount, 0, faceMin, faceMax, centroids);
+    buildBlocks(mesh);
+    m_buildCost = cost();
+}
+
+/**
+ * @brief Build again with the builder last used, e.g. once refits degraded the tree
+ * @param mesh Mesh object
+ * @param threadCount Worker count for the linear builder, 0 for one per hardware thread
+ */
+void BVH::rebuild(const Mesh& mesh, const int& threadCount)
+{
+    if (m_linear)
+    {
+        buildLinear(mesh, threadCount, m_leafSize);
+    }
+    else
+    {
+        build(mesh, m_leafSize);
+    }
+}
+
+/**
+ * @brief Pad every leaf range to a multiple of the block size and copy the leaf
+ * triangles into SoA blocks. Padding slots get face index -1 and NaN positions.
+ * @param mesh Mesh object the tree was built from
+ * @param threadCount Worker count for the block copy, 0 for one per hardware thread
+ */
+void BVH::buildBlocks(const Mesh& mesh, const int& threadCount)
+{
+    std::vector<int> padded;
+    padded.reserve(m_faceIndices.size() + m_nodes.size() * (kTriangleBlockSize - 1) / 2);
+    for (size_t n = 0; n < m_nodes.size(); n++)
+    {
+        BVHNode& node = m_nodes[n];
+        if (!node.isLeaf()) continue;
+
+        int first = static_cast<int>(padded.size());
+        padded.insert(padded.end(), m_faceIndices.data() + node.m_left, m_faceIndices.data() + node.m_left + node.m_count);
+        while (padded.size() % kTriangleBlockSize) padded.push_back(-1);
+        node.m_left = first;
+    }
+    m_faceIndices.swap(padded);
+
+    m_blocks.resize(m_faceIndices.size() / kTriangleBlockSize);
+    TriangleBlock* blocks = m_blocks.owned().data();
+    parallelFor(m_blocks.size(), threadCount, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++)
+        {
+            for (int lane = 0; lane < kTriangleBlockSize; lane++)
+            {
+                writeBlockLane(blocks[b], lane, mesh, m_faceIndices[b * kTriangleBlockSize + lane]);
+            }
+        }
+    }, 4096);
+}
+
+/**
+ * @brief Update the tree to new vertex positions of the mesh it was built from.
+ * Topology has to be unchanged. Leaf bounds and triangle blocks are redone in
+ * parallel, then interior bounds bottom-up. The tree structure is kept, so the
+ * tree gets worse the further the mesh moves away from the built pose, see
+ * inflation().
+ * @param mesh Mesh object the tree was built from, with new positions
+ * @param threadCount Worker count, 0 for one per hardware thread
+ */
+void BVH::refit(const Mesh& mesh, const int& threadCount)
+{
+    if (m_nodes.empty()) return;
+    if (m_buildCost <= 0.0) m_buildCost = cost();
+
+    BVHNode* nodes = m_nodes.owned().data();
+    TriangleBlock* blocks = m_blocks.owned().data();
+    const int nodeCount = getNodeCount();
+    parallelFor(nodeCount, threadCount, [&](size_t begin, size_t end) {
+        Eigen::Vector3d v1, v2, v3;
+        for (size_t n = begin; n < end; n++)
+        {
+            BVHNode& node = nodes[n];
+            if (!node.isLeaf() || !hasSlots(node)) continue;
+
+            node.m_min.setConstant(std::numeric_limits<double>::max());
+            node.m_max.setConstant(-std::numeric_limits<double>::max());
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = getFaceIndex(slot);
+                writeBlockLane(blocks[slot / kTriangleBlockSize], slot % kTriangleBlockSize, mesh, faceId);
+                if (faceId < 0) continue;
+
+                mesh.getFaceVertices(faceId, v1, v2, v3);
+                node.m_min = node.m_min.cwiseMin(v1).cwiseMin(v2).cwiseMin(v3);
+                node.m_max = node.m_max.cwiseMax(v1).cwiseMax(v2).cwiseMax(v3);
+            }
+        }
+    }, 64);
+
+    refitInterior(nodes, nodeCount, threadCount);
+}
+
+/**
+ * @brief Recompute interior node bounds from their children, assuming leaf
+ * bounds are up to date. Children always come after their parent in the node
+ * array, so nodes are grouped by depth and every level is done in parallel,
+ * deepest first.
+ * @param nodes Tree nodes, root at 0
+ * @param nodeCount Node count
+ * @param threadCount Worker count, 0 for one per hardware thread
+ */
+void BVH::refitInterior(BVHNode* nodes, const int& nodeCount, const int& threadCount)
+{
+    if (nodeCount == 0) return;
+
+    // nodes with children out of range, only found in a corrupt cache, are
+    // treated as leaves
+    std::vector<int> depth(nodeCount, 0);
+    std::vector<char> interior(nodeCount, 0);
+    int maxDepth = 0;
+    for (int n = 0; n < nodeCount; n++)
+    {
+        if (nodes[n].isLeaf() || nodes[n].m_left <= n || nodes[n].m_left >= nodeCount - 1) continue;
+        interior[n] = 1;
+        depth[nodes[n].m_left] = depth[nodes[n].m_left + 1] = depth[n] + 1;
+        maxDepth = std::max(maxDepth, depth[n] + 1);
+    }
+
+    // interior nodes bucketed by depth
+    std::vector<int> levelStart(maxDepth + 2, 0), levelNodes;
+    for (int n = 0; n < nodeCount; n++)
+    {
+        if (interior[n]) levelStart[depth[n] + 1]++;
+    }
+    for (int d = 0; d <= maxDepth; d++) levelStart[d + 1] += levelStart[d];
+    levelNodes.resize(levelStart[maxDepth + 1]);
+    std::vector<int> cursor(levelStart.begin(), levelStart.end() - 1);
+    for (int n = 0; n < nodeCount; n++)
+    {
+        if (interior[n]) levelNodes[cursor[depth[n]]++] = n;
+    }
+
+    for (int d = maxDepth; d >= 0; d--)
+    {
+        const int first = levelStart[d];
+        parallelFor(levelStart[d + 1] - first, threadCount, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                BVHNode& node = nodes[levelNodes[first + i]];
+                node.m_min = nodes[node.m_left].m_min.cwiseMin(nodes[node.m_left + 1].m_min);
+                node.m_max = nodes[node.m_left].m_max.cwiseMax(nodes[node.m_left + 1].m_max);
+            }
+        }, 1024);
+    }
+}
+
+/**
+ * @brief Surface area heuristic cost of a tree: node areas relative to the root,
+ * leaves weighted by their slot count
+ * @param nodes Tree nodes, root at 0
+ * @param nodeCount Node count
+ * @return double Tree cost, 0 for an empty tree
+ */
+double BVH::treeCost(const BVHNode* nodes, const int& nodeCount)
+{
+    if (nodeCount == 0) return 0.0;
+    const double rootArea = boxArea(nodes[0].m_min, nodes[0].m_max);
+    if (rootArea <= 0.0) return 0.0;
+
+    double total = 0.0;
+    for (int n = 0; n < nodeCount; n++)
+    {
+        total += boxArea(nodes[n].m_min, nodes[n].m_max) * (nodes[n].isLeaf() ? nodes[n].m_count : 1);
+    }
+    return total / rootArea;
+}
+
+/**
+ * @brief Surface area heuristic cost of this tree
+ * @return double Tree cost
+ */
+double BVH::cost() const
+{
+    return treeCost(m_nodes.data(), getNodeCount());
+}
+
+/**
+ * @brief Depth of the deepest leaf, 1 for a single leaf, 0 for an empty tree.
+ * Children are stored after their parent, so one pass in array order does.
+ * @return int Tree depth
+ */
+int BVH::depth() const
+{
+    std::vector<int> depths(m_nodes.size(), 1);
+    int deepest = m_nodes.empty() ? 0 : 1;
+    for (size_t n = 0; n < m_nodes.size(); n++)
+    {
+        const BVHNode& node = m_nodes[n];
+        if (!hasChildren(static_cast<int>(n), node))
+        {
+            deepest = std::max(deepest, depths[n]);
+            continue;
+        }
+        depths[node.m_left] = depths[n] + 1;
+        depths[node.m_left + 1] = depths[n] + 1;
+    }
+    return deepest;
+}
+
+/**
+ * @brief How much worse the tree is than when it was built, as the ratio of the
+ * current cost to the cost right after build(). 1 for a fresh tree.
+ * @return double Cost ratio
+ */
+double BVH::inflation() const
+{
+    return m_buildCost > 0.0 ? cost() / m_buildCost : 1.0;
+}
+
+/**
+ * @brief Recursively build the subtree for the face slots [first, first + count).
+ * Splits are picked with a binned surface area heuristic; when SAH finds no
+ * split cheaper than a leaf we fall back to a median split along the largest
+ * centroid axis, same as the python prototype in ClosestPoint/engine_bvh.py
+ * @param nodeId Index of the node being built
+ * @param first First face slot
+ * @param count Number of face slots
+ * @param depth Current depth, used to cap the tree height
+ * @param faceMin Per face bounds min
+ * @param faceMax Per face bounds max
+ * @param centroids Per face centroids
+ */
+void BVH::buildNode(const int& nodeId, const int& first, const int& count, const int& depth,
+                    const std::vector<Eigen::Vector3d>& faceMin,
+                    const std::vector<Eigen::Vector3d>& faceMax,
+                    const std::vector<Eigen::Vector3d>& centroids)
+{
+    Eigen::Vector3d bmin = faceMin[m_faceIndices[first]];
+    Eigen::Vector3d bmax = faceMax[m_faceIndices[first]];
+    Eigen::Vector3d cmin = centroids[m_faceIndices[first]];
+    Eigen::Vector3d cmax = cmin;
+    for (int i = first + 1; i < first + count; i++)
+    {
+        int f = m_faceIndices[i];
+        bmin = bmin.cwiseMin(faceMin[f]);
+        bmax = bmax.cwiseMax(faceMax[f]);
+        cmin = cmin.cwiseMin(centroids[f]);
+        cmax = cmax.cwiseMax(centroids[f]);
+    }
+
+    m_nodes[nodeId].m_min = bmin;
+    m_nodes[nodeId].m_max = bmax;
+    m_nodes[nodeId].m_left = first;
+    m_nodes[nodeId].m_count = count;
+
+    if (count <= m_leafSize || depth >= kMaxDepth) return;
+
+    // evaluate binned SAH on every axis with a non degenerate centroid extent
+    Eigen::Vector3d cext = cmax - cmin;
+    double bestCost = std::numeric_limits<double>::max();
+    int bestAxis = -1, bestBin = -1;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (cext[axis] <= 0.0) continue;
+
+        SahBin bins[kSahBins];
+        double scale = kSahBins / cext[axis];
+        for (int i = first; i < first + count; i++)
+        {
+            int f = m_faceIndices[i];
+            int b = std::min(kSahBins - 1, static_cast<int>((centroids[f][axis] - cmin[axis]) * scale));
+            bins[b].m_count++;
+            bins[b].m_min = bins[b].m_min.cwiseMin(faceMin[f]);
+            bins[b].m_max = bins[b].m_max.cwiseMax(faceMax[f]);
+        }
+
+        // sweep from the right to get suffix areas, then from the left to get costs
+        double rightArea[kSahBins];
+        int rightCount[kSahBins];
+        SahBin acc;
+        for (int b = kSahBins - 1; b > 0; b--)
+        {
+            acc.m_count += bins[b].m_count;
+            acc.m_min = acc.m_min.cwiseMin(bins[b].m_min);
+            acc.m_max = acc.m_max.cwiseMax(bins[b].m_max);
+            rightCount[b] = acc.m_count;
+            rightArea[b] = acc.m_count ? boxArea(acc.m_min, acc.m_max) : 0.0;
+        }
+
+        acc = SahBin();
+        for (int b = 0; b < kSahBins - 1; b++)
+        {
+            acc.m_count += bins[b].m_count;
+            acc.m_min = acc.m_min.cwiseMin(bins[b].m_min);
+            acc.m_max = acc.m_max.cwiseMax(bins[b].m_max);
+            if (acc.m_count == 0 || rightCount[b + 1] == 0) continue;
+
+            double cost = boxArea(acc.m_min, acc.m_max) * acc.m_count + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    int* begin = &m_faceIndices[first];
+    int* end = begin + count;
+    int* mid = NULL;
+
+    double leafCost = boxArea(bmin, bmax) * count;
+    if (bestAxis >= 0 && bestCost < leafCost * 0.95)
+    {
+        double scale = kSahBins / cext[bestAxis];
+        mid = std::partition(begin, end, [&](const int& f) {
+            int b = std::min(kSahBins - 1, static_cast<int>((centroids[f][bestAxis] - cmin[bestAxis]) * scale));
+            return b <= bestBin;
+        });
+    }
+    else
+    {
+        // median split along the largest centroid extent
+        int axis = 0;
+        cext.maxCoeff(&axis);
+        if (cext[axis] <= 0.0) return; // all centroids coincide, keep as leaf
+
+        mid = begin + count / 2;
+        std::nth_element(begin, mid, end, [&](const int& a, const int& b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+    }
+
+    int leftCount = static_cast<int>(mid - begin);
+    if (leftCount == 0 || leftCount == count) return;
+
+    int left = static_cast<int>(m_nodes.size());
+    m_nodes.push_back(BVHNode());
+    m_nodes.push_back(BVHNode());
+    m_nodes[nodeId].m_left = left;
+    m_nodes[nodeId].m_count = 0;
+
+    buildNode(left, first, leftCount, depth + 1, faceMin, faceMax, centroids);
+    buildNode(left + 1, first + leftCount, count - leftCount, depth + 1, faceMin, faceMax, centroids);
+}
+
+/**
+ * @brief Squared distance from a point to the bounds of a node, 0 if inside.
+ * Lower bound for the distance to any face stored below the node.
+ * @param point Query point
+ * @param node BVH node
+ * @return double Squared distance
+ */
+double BVH::pointBoxDistanceSq(const Eigen::Vector3d& point, const BVHNode& node)
+{
+    Eigen::Vector3d d = (node.m_min - point).cwiseMax(point - node.m_max).cwiseMax(0.0);
+    return d.squaredNorm();
+}
+
+/**
+ * @brief Slab test of a ray against the bounds of a node. Axes the ray is
+ * parallel to only check the origin lies within the slab, the product with the
+ * infinite inverse direction would be NaN for a ray on a slab plane. The far
+ * end is widened by a few ulps so rounding never culls a box the ray only grazes.
+ * @param origin Ray origin
+ * @param invDir Component wise inverse of the ray direction
+ * @param node BVH node
+ * @param tMax Max distance along the ray
+ * @param tNear Output distance where the ray enters the box, 0 if it starts inside
+ * @return true The ray hits the box between 0 and tMax
+ */
+bool BVH::rayBoxIntersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& invDir, const BVHNode& node, const double& tMax, double& tNear)
+{
+    double tMin = 0.0, tFar = tMax;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (std::isinf(invDir[axis]))
+        {
+            if (origin[axis] < node.m_min[axis] || origin[axis] > node.m_max[axis]) return false;
+            continue;
+        }
+        double t0 = (node.m_min[axis] - origin[axis]) * invDir[axis];
+        double t1 = (node.m_max[axis] - origin[axis]) * invDir[axis];
+        tMin = std::max(tMin, std::min(t0, t1));
+        tFar = std::min(tFar, std::max(t0, t1));
+    }
+    tNear = tMin;
+    return tMin <= tFar * (1.0 + 4.0 * std::numeric_limits<double>::epsilon());
+}
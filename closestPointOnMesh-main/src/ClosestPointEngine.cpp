@@ -0,0 +1,460 @@
+#include "ClosestPointEngine.h"
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+namespace
+{
+/**
+ * @brief Round a double to the nearest Scalar not above it
+ * @param x Value
+ * @return Scalar Rounded value
+ */
+template <typename Scalar>
+inline Scalar roundDown(const double& x)
+{
+    Scalar r = static_cast<Scalar>(x);
+    return static_cast<double>(r) > x ? std::nextafter(r, -std::numeric_limits<Scalar>::infinity()) : r;
+}
+
+/**
+ * @brief Round a double to the nearest Scalar not below it
+ * @param x Value
+ * @return Scalar Rounded value
+ */
+template <typename Scalar>
+inline Scalar roundUp(const double& x)
+{
+    Scalar r = static_cast<Scalar>(x);
+    return static_cast<double>(r) < x ? std::nextafter(r, std::numeric_limits<Scalar>::infinity()) : r;
+}
+}
+
+/**
+ * @brief Construct a new Closest Point Engine:: Closest Point Engine object,
+ * converting the BVH of a query object to the policy's scalar
+ * @param query Query object; its mesh is referenced, its BVH copied
+ */
+template <typename Policy>
+ClosestPointEngine<Policy>::ClosestPointEngine(const PointQuery& query) : m_mesh(query.getMesh()), m_origin(Eigen::Vector3d::Zero()), m_tolerance(0.0)
+{
+    const BVH& bvh = query.getBVH();
+    if (bvh.empty()) return;
+
+    // coordinates relative to the center of the bounds keep the most bits in
+    // float; the kernel then works on values up to extent, rounded to Scalar
+    // and combined a handful of times
+    const BVHNode& root = bvh.getNode(0);
+    m_origin = 0.5 * (root.m_min + root.m_max);
+    const double extent = 0.5 * (root.m_max - root.m_min).norm();
+    m_tolerance = 16.0 * std::numeric_limits<Scalar>::epsilon() * extent;
+
+    // the copy reads every node anyway, so the checks a walk of the BVH makes
+    // are made here once; a node that fails them, only found in a corrupt
+    // cache, is kept with no children and no faces
+    m_nodes.resize(bvh.getNodeCount());
+    std::vector<int> depth(bvh.getNodeCount(), 0);
+    for (int i = 0; i < bvh.getNodeCount(); i++)
+    {
+        const BVHNode& node = bvh.getNode(i);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            m_nodes[i].m_min[axis] = roundDown<Scalar>(node.m_min[axis] - m_origin[axis] - m_tolerance);
+            m_nodes[i].m_max[axis] = roundUp<Scalar>(node.m_max[axis] - m_origin[axis] + m_tolerance);
+        }
+        const bool valid = node.isLeaf() ? bvh.hasSlots(node) : bvh.hasChildren(i, node) && depth[i] < BVH::kMaxDepth;
+        m_nodes[i].m_left = valid ? node.m_left : -1;
+        m_nodes[i].m_count = valid ? node.m_count : 0;
+        if (valid && !node.isLeaf()) depth[node.m_left] = depth[node.m_left + 1] = std::max(depth[node.m_left], depth[i] + 1);
+    }
+
+    m_faceIndices.resize(bvh.getSlotCount());
+    for (int slot = 0; slot < bvh.getSlotCount(); slot++) m_faceIndices[slot] = bvh.getFaceIndex(slot);
+
+    const Scalar nan = std::numeric_limits<Scalar>::quiet_NaN();
+    m_blocks.resize(m_faceIndices.size() / kTriangleBlockSize);
+    for (size_t b = 0; b < m_blocks.size(); b++)
+    {
+        TriangleBlockT<Scalar>& block = m_blocks[b];
+        for (int lane = 0; lane < kTriangleBlockSize; lane++)
+        {
+            const int faceId = m_faceIndices[b * kTriangleBlockSize + lane];
+            double o[3] = {nan, nan, nan}, e0[3] = {nan, nan, nan}, e1[3] = {nan, nan, nan};
+            if (faceId >= 0) localTriangle(faceId, o, e0, e1);
+            block.m_ox[lane] = static_cast<Scalar>(o[0]);
+            block.m_oy[lane] = static_cast<Scalar>(o[1]);
+            block.m_oz[lane] = static_cast<Scalar>(o[2]);
+            block.m_e0x[lane] = static_cast<Scalar>(e0[0]);
+            block.m_e0y[lane] = static_cast<Scalar>(e0[1]);
+            block.m_e0z[lane] = static_cast<Scalar>(e0[2]);
+            block.m_e1x[lane] = static_cast<Scalar>(e1[0]);
+            block.m_e1y[lane] = static_cast<Scalar>(e1[1]);
+            block.m_e1z[lane] = static_cast<Scalar>(e1[2]);
+        }
+    }
+}
+
+/**
+ * @brief Squared distance from a point to the bounds of a node, in double
+ * @param localPoint Point relative to the engine origin
+ * @param node Node
+ * @return double Squared distance, 0 inside
+ */
+template <typename Policy>
+double ClosestPointEngine<Policy>::boxDistanceSq(const Eigen::Vector3d& localPoint, const Node& node) const
+{
+    double distSq = 0.0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const double d = std::max(std::max(static_cast<double>(node.m_min[axis]) - localPoint[axis], localPoint[axis] - static_cast<double>(node.m_max[axis])), 0.0);
+        distSq += d * d;
+    }
+    return distSq;
+}
+
+/**
+ * @brief A face in the edge form the engine stores, relative to its origin,
+ * in double. The blocks are these values rounded to Scalar.
+ * @param faceId Face
+ * @param o Output first vertex
+ * @param e0 Output edge from first to second vertex
+ * @param e1 Output edge from first to third vertex
+ */
+template <typename Policy>
+void ClosestPointEngine<Policy>::localTriangle(const int& faceId, double* o, double* e0, double* e1) const
+{
+    Eigen::Vector3d v1, v2, v3;
+    m_mesh.getFaceVertices(faceId, v1, v2, v3);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        o[axis] = v1[axis] - m_origin[axis];
+        e0[axis] = v2[axis] - v1[axis];
+        e1[axis] = v3[axis] - v1[axis];
+    }
+}
+
+/**
+ * @brief Walk the BVH nearest child first with the policy's block kernel.
+ * Equal distances go to the lowest face id, so the result does not depend on
+ * the order faces are visited in.
+ * With a margin every face within it (plus the relative Scalar error) of the
+ * best distance at the time it is tested is also kept in the context's
+ * candidates; the exact closest face is always one of them.
+ * With an epsilon nodes are already skipped once they are further than the
+ * best distance over 1 + epsilon; the closest of the skipped nodes bounds how
+ * far off the result can be.
+ * @param localPoint Query point relative to the engine origin
+ * @param margin Absolute error bound of the Scalar distances, 0 to keep no candidates
+ * @param epsilon Relative error allowed, 0 for the closest face
+ * @param context Scratch memory of the calling thread
+ * @param bestDistSq Current best squared distance, updated
+ * @param bestFace Current best face, updated
+ * @param s Output parameter along e0 of the best face
+ * @param t Output parameter along e1 of the best face
+ * @param prunedDistSq Output smallest squared distance of a skipped node,
+ * infinity if none
+ */
+template <typename Policy>
+void ClosestPointEngine<Policy>::traverse(const Eigen::Vector3d& localPoint, const double& margin, const double& epsilon, QueryContext& context, double& bestDistSq, int& bestFace, double& s, double& t, double& prunedDistSq) const
+{
+    // box distances are exact, kernel distances are off by a few Scalar ulps
+    const double slack = (1.0 + 64.0 * std::numeric_limits<Scalar>::epsilon()) / (1.0 + epsilon);
+    auto limitFor = [&](const double& distSq) {
+        const double limit = std::sqrt(distSq) * slack + margin;
+        return limit * limit;
+    };
+    double limitSq = limitFor(bestDistSq);
+    const bool collect = margin > 0.0;
+    context.m_candidateCount = 0;
+    prunedDistSq = std::numeric_limits<double>::infinity();
+
+    const Scalar q[3] = {static_cast<Scalar>(localPoint.x()), static_cast<Scalar>(localPoint.y()), static_cast<Scalar>(localPoint.z())};
+    Scalar distSq[kTriangleBlockSize], laneS[kTriangleBlockSize], laneT[kTriangleBlockSize];
+
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_nodes.empty()) stack[stackSize++] = {0, boxDistanceSq(localPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limitSq)
+        {
+            QUERY_STAT(context.m_stats.m_culled++);
+            prunedDistSq = std::min(prunedDistSq, entry.m_distSq);
+            continue;
+        }
+        QUERY_STAT(context.m_stats.m_nodes++);
+
+        const Node& node = m_nodes[entry.m_node];
+        if (node.isLeaf())
+        {
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot += kTriangleBlockSize)
+            {
+                Policy::closestPointsOnBlock(m_blocks[slot / kTriangleBlockSize], q, distSq, laneS, laneT);
+                for (int lane = 0; lane < kTriangleBlockSize; lane++)
+                {
+                    const int faceId = m_faceIndices[slot + lane];
+                    if (faceId < 0) continue;
+                    QUERY_STAT(context.m_stats.m_triangles++);
+
+                    const double d = distSq[lane];
+                    if (collect && d <= limitSq)
+                    {
+                        if (context.m_candidateCount < QueryContext::kCandidateSize) context.m_candidates[context.m_candidateCount++] = faceId;
+                        else context.m_candidateCount = QueryContext::kCandidateSize + 1;
+                    }
+                    if (d < bestDistSq || (d == bestDistSq && bestFace >= 0 && faceId < bestFace))
+                    {
+                        bestDistSq = d;
+                        bestFace = faceId;
+                        s = laneS[lane];
+                        t = laneT[lane];
+                        limitSq = limitFor(bestDistSq);
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (node.m_left < 0) continue;
+        double distL = boxDistanceSq(localPoint, m_nodes[node.m_left]);
+        double distR = boxDistanceSq(localPoint, m_nodes[node.m_left + 1]);
+        if (distL < distR)
+        {
+            stack[stackSize++] = {node.m_left + 1, distR};
+            stack[stackSize++] = {node.m_left, distL};
+        }
+        else
+        {
+            stack[stackSize++] = {node.m_left, distL};
+            stack[stackSize++] = {node.m_left + 1, distR};
+        }
+    }
+}
+
+/**
+ * @brief Test one face in double, from the mesh, with the acceptance rule of
+ * the walk
+ * @param faceId Face
+ * @param q Query point relative to the engine origin
+ * @param bestDistSq Current best squared distance, updated
+ * @param bestFace Current best face, updated
+ * @param s Parameter along e0 of the best face, updated
+ * @param t Parameter along e1 of the best face, updated
+ */
+template <typename Policy>
+void ClosestPointEngine<Policy>::testExact(const int& faceId, const double* q, double& bestDistSq, int& bestFace, double& s, double& t) const
+{
+    double o[3], e0[3], e1[3], faceS, faceT;
+    localTriangle(faceId, o, e0, e1);
+    const double d = closestPointDistanceSq(o, e0, e1, q, faceS, faceT);
+    if (d < bestDistSq || (d == bestDistSq && bestFace >= 0 && faceId < bestFace))
+    {
+        bestDistSq = d;
+        bestFace = faceId;
+        s = faceS;
+        t = faceT;
+    }
+}
+
+/**
+ * @brief Redo the end of a search in double. Usually only the candidates the
+ * walk kept are tested; if there were too many of them the tree is walked
+ * again in double within the Scalar distance plus its error bound, which is
+ * just as exact but slower.
+ * @param localPoint Query point relative to the engine origin
+ * @param margin Margin the walk kept candidates with
+ * @param maxDistSq Squared search radius
+ * @param context Scratch memory of the calling thread, holding the candidates
+ * @param bestDistSq Squared distance found in Scalar, replaced by the exact one
+ * @param bestFace Face found in Scalar, replaced by the exact one, -1 if none
+ * @param s Parameter along e0 of the best face, updated
+ * @param t Parameter along e1 of the best face, updated
+ */
+template <typename Policy>
+void ClosestPointEngine<Policy>::refine(const Eigen::Vector3d& localPoint, const double& margin, const double& maxDistSq, QueryContext& context, double& bestDistSq, int& bestFace, double& s, double& t) const
+{
+    const double q[3] = {localPoint.x(), localPoint.y(), localPoint.z()};
+    double refinedDistSq = maxDistSq, refinedS = 0.0, refinedT = 0.0;
+    int refinedFace = -1;
+
+    if (context.m_candidateCount <= QueryContext::kCandidateSize)
+    {
+        for (int i = 0; i < context.m_candidateCount; i++) testExact(context.m_candidates[i], q, refinedDistSq, refinedFace, refinedS, refinedT);
+    }
+    else
+    {
+        const double bound = std::sqrt(bestDistSq) * (1.0 + 64.0 * std::numeric_limits<Scalar>::epsilon()) + margin;
+        const double boundSq = bound * bound;
+
+        TraversalEntry* stack = context.m_stack;
+        int stackSize = 0;
+        if (!m_nodes.empty()) stack[stackSize++] = {0, boxDistanceSq(localPoint, m_nodes[0])};
+        while (stackSize > 0)
+        {
+            TraversalEntry entry = stack[--stackSize];
+            if (entry.m_distSq > std::min(boundSq, refinedDistSq)) continue;
+
+            const Node& node = m_nodes[entry.m_node];
+            if (node.isLeaf())
+            {
+                for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+                {
+                    if (m_faceIndices[slot] >= 0) testExact(m_faceIndices[slot], q, refinedDistSq, refinedFace, refinedS, refinedT);
+                }
+                continue;
+            }
+            if (node.m_left < 0) continue;
+            stack[stackSize++] = {node.m_left + 1, boxDistanceSq(localPoint, m_nodes[node.m_left + 1])};
+            stack[stackSize++] = {node.m_left, boxDistanceSq(localPoint, m_nodes[node.m_left])};
+        }
+    }
+
+    bestDistSq = refinedDistSq;
+    bestFace = refinedFace;
+    s = refinedS;
+    t = refinedT;
+}
+
+/**
+ * @brief Fill the hit record from the winning face and its parameters
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param faceId Closest face, -1 if none
+ * @param s Parameter along e0
+ * @param t Parameter along e1
+ * @param hit Output hit record
+ * @return true A face was found
+ */
+template <typename Policy>
+bool ClosestPointEngine<Policy>::fillHit(const Eigen::Vector3d& queryPoint, const float& maxDist, const int& faceId, const double& s, const double& t, QueryHit& hit) const
+{
+    hit.m_found = faceId >= 0;
+    hit.m_faceId = faceId;
+    hit.m_vertexId = -1;
+    if (faceId < 0)
+    {
+        hit.m_point = queryPoint;
+        hit.m_barycentric.setZero();
+        hit.m_dist = maxDist;
+        hit.m_distSq = static_cast<double>(maxDist) * maxDist;
+        return false;
+    }
+
+    Eigen::Vector3d v1, v2, v3;
+    m_mesh.getFaceVertices(faceId, v1, v2, v3);
+    hit.m_point = v1 + s * (v2 - v1) + t * (v3 - v1);
+    hit.m_barycentric = Eigen::Vector3d(1.0 - s - t, s, t);
+    hit.m_distSq = (hit.m_point - queryPoint).squaredNorm();
+    hit.m_dist = static_cast<float>(std::sqrt(hit.m_distSq));
+    return true;
+}
+
+/**
+ * @brief Closest point on the surface within a radius.
+ * Does not allocate, all scratch memory lives in the context.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @param refineHit Float engine only: redo the last part of the search in
+ * double, see refine(); ignored by the double engine, which is exact anyway
+ * @return true A face was found within the radius
+ */
+template <typename Policy>
+bool ClosestPointEngine<Policy>::query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit, const bool& refineHit) const
+{
+    const Eigen::Vector3d localPoint = queryPoint - m_origin;
+    const double maxDistSq = static_cast<double>(maxDist) * maxDist;
+    double bestDistSq = maxDistSq, s = 0.0, t = 0.0;
+    double prunedDistSq;
+    int bestFace = -1;
+
+    if (!refineHit || std::is_same<Scalar, double>::value)
+    {
+        traverse(localPoint, 0.0, 0.0, context, bestDistSq, bestFace, s, t, prunedDistSq);
+        return fillHit(queryPoint, maxDist, bestFace, s, t, hit);
+    }
+
+    // error of a Scalar distance: the coordinates rounded by up to the node
+    // padding each, the query point by a few ulps of its own size
+    const double margin = 2.0 * (m_tolerance + 4.0 * std::numeric_limits<Scalar>::epsilon() * localPoint.norm());
+    traverse(localPoint, margin, 0.0, context, bestDistSq, bestFace, s, t, prunedDistSq);
+    refine(localPoint, margin, maxDistSq, context, bestDistSq, bestFace, s, t);
+    return fillHit(queryPoint, maxDist, bestFace, s, t, hit);
+}
+
+/**
+ * @brief Approximate closest point on the surface: the distance found is at
+ * most 1 + epsilon times the true one. Nodes further than the best distance
+ * over 1 + epsilon are skipped, which ends the walk much sooner when many
+ * faces are about as close, e.g. far from the mesh.
+ * Does not allocate, all scratch memory lives in the context.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param epsilon Relative error allowed
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @param bound Output factor actually achieved, the returned distance (maxDist
+ * if nothing was found) over a lower bound of the true one; 1 if no node was
+ * skipped early, never more than 1 + epsilon up to the Scalar error
+ * @return true A face was found within the radius
+ */
+template <typename Policy>
+bool ClosestPointEngine<Policy>::queryApproximate(const Eigen::Vector3d& queryPoint, const float& maxDist, const float& epsilon, QueryContext& context, QueryHit& hit, float& bound) const
+{
+    const Eigen::Vector3d localPoint = queryPoint - m_origin;
+    double bestDistSq = static_cast<double>(maxDist) * maxDist, s = 0.0, t = 0.0;
+    double prunedDistSq;
+    int bestFace = -1;
+
+    traverse(localPoint, 0.0, std::max(epsilon, 0.0f), context, bestDistSq, bestFace, s, t, prunedDistSq);
+    const bool found = fillHit(queryPoint, maxDist, bestFace, s, t, hit);
+
+    // no face can be closer than the best one or a skipped node
+    const double lowerBound = std::sqrt(std::min(prunedDistSq, hit.m_distSq));
+    bound = lowerBound > 0.0 ? static_cast<float>(std::max(1.0, std::sqrt(hit.m_distSq) / lowerBound)) : 1.0f;
+    return found;
+}
+
+/**
+ * @brief Reference query, the linear scan of every block with the same kernel
+ * and acceptance rule. Kept to validate query().
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param hit Output hit record
+ * @return true A face was found within the radius
+ */
+template <typename Policy>
+bool ClosestPointEngine<Policy>::bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const
+{
+    const Eigen::Vector3d localPoint = queryPoint - m_origin;
+    const Scalar q[3] = {static_cast<Scalar>(localPoint.x()), static_cast<Scalar>(localPoint.y()), static_cast<Scalar>(localPoint.z())};
+    Scalar distSq[kTriangleBlockSize], laneS[kTriangleBlockSize], laneT[kTriangleBlockSize];
+    double bestDistSq = static_cast<double>(maxDist) * maxDist, s = 0.0, t = 0.0;
+    int bestFace = -1;
+
+    for (size_t b = 0; b < m_blocks.size(); b++)
+    {
+        Policy::closestPointsOnBlock(m_blocks[b], q, distSq, laneS, laneT);
+        for (int lane = 0; lane < kTriangleBlockSize; lane++)
+        {
+            const int faceId = m_faceIndices[b * kTriangleBlockSize + lane];
+            if (faceId < 0) continue;
+
+            const double d = distSq[lane];
+            if (d < bestDistSq || (d == bestDistSq && bestFace >= 0 && faceId < bestFace))
+            {
+                bestDistSq = d;
+                bestFace = faceId;
+                s = laneS[lane];
+                t = laneT[lane];
+            }
+        }
+    }
+    return fillHit(queryPoint, maxDist, bestFace, s, t, hit);
+}
+
+template class ClosestPointEngine<FloatPolicy>;
+template class ClosestPointEngine<DoublePolicy>;
@@ -0,0 +1,293 @@
+#include "DistanceField.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+namespace
+{
+const int kKeyBits = 21;
+const int64_t kMaxBrickCoord = (int64_t(1) << kKeyBits) - 1;
+
+/**
+ * @brief Pack brick coordinates into a hash key, 21 bits per axis
+ * @param bx Brick x
+ * @param by Brick y
+ * @param bz Brick z
+ * @return uint64_t Key, sorting keys orders bricks z major
+ */
+inline uint64_t brickKey(const int64_t& bx, const int64_t& by, const int64_t& bz)
+{
+    return static_cast<uint64_t>(bx) | (static_cast<uint64_t>(by) << kKeyBits) | (static_cast<uint64_t>(bz) << (2 * kKeyBits));
+}
+
+/**
+ * @brief Index of a sample inside a brick
+ * @param x Corner x, 0 .. kBrickSize
+ * @param y Corner y
+ * @param z Corner z
+ * @return int Sample index, x fastest
+ */
+inline int sampleIndex(const int& x, const int& y, const int& z)
+{
+    return (z * DistanceField::kBrickCorners + y) * DistanceField::kBrickCorners + x;
+}
+}
+
+/**
+ * @brief Build the field around the mesh of a query engine. Every brick within
+ * the band of a face's bounds is stored; the bricks are then filled in
+ * parallel, one closest point query per voxel corner.
+ * @param query Query engine of the mesh, used for the samples
+ * @param voxelSize Voxel edge length
+ * @param bandWidth Distance from the surface that has to be covered
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return true Successful build
+ * @return false Empty mesh, bad parameters, or voxels too small for the mesh bounds
+ */
+bool DistanceField::build(const PointQuery& query, const double& voxelSize, const double& bandWidth, const int& threadCount)
+{
+    clear();
+    const Mesh& mesh = query.getMesh();
+    const size_t faceCount = mesh.getFaceCount();
+    if (!(voxelSize > 0.0) || !(bandWidth >= 0.0) || faceCount == 0) return false;
+
+    ArrayView<double> xs = mesh.getX(), ys = mesh.getY(), zs = mesh.getZ();
+    Eigen::Vector3d bmin = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+    Eigen::Vector3d bmax = -bmin;
+    for (size_t i = 0; i < xs.size(); i++)
+    {
+        Eigen::Vector3d v(xs[i], ys[i], zs[i]);
+        bmin = bmin.cwiseMin(v);
+        bmax = bmax.cwiseMax(v);
+    }
+
+    const double brickExtent = voxelSize * kBrickSize;
+    const Eigen::Vector3d origin = bmin - Eigen::Vector3d::Constant(bandWidth + voxelSize);
+    const Eigen::Vector3d span = (bmax - origin) / brickExtent + Eigen::Vector3d::Constant(bandWidth / brickExtent + 1.0);
+    if (span.maxCoeff() >= static_cast<double>(kMaxBrickCoord))
+    {
+        printf("Distance field voxel size %f is too small for the mesh bounds\n", voxelSize);
+        return false;
+    }
+
+    m_mesh = &mesh;
+    m_origin = origin;
+    m_voxelSize = voxelSize;
+    m_invVoxelSize = 1.0 / voxelSize;
+    m_bandWidth = bandWidth;
+
+    // bricks touched by the face bounds grown by the band, collected per chunk
+    const size_t grain = 4096;
+    std::vector<std::vector<uint64_t>> chunkKeys((faceCount + grain - 1) / grain);
+    parallelFor(faceCount, threadCount, [&](size_t begin, size_t end) {
+        std::vector<uint64_t>& keys = chunkKeys[begin / grain];
+        Eigen::Vector3d v1, v2, v3;
+        for (size_t f = begin; f < end; f++)
+        {
+            mesh.getFaceVertices(static_cast<uint32_t>(f), v1, v2, v3);
+            Eigen::Vector3d lo = (v1.cwiseMin(v2).cwiseMin(v3) - Eigen::Vector3d::Constant(bandWidth) - origin) / brickExtent;
+            Eigen::Vector3d hi = (v1.cwiseMax(v2).cwiseMax(v3) + Eigen::Vector3d::Constant(bandWidth) - origin) / brickExtent;
+            int64_t b0[3], b1[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                b0[axis] = std::max<int64_t>(0, static_cast<int64_t>(std::floor(lo[axis])));
+                b1[axis] = std::min<int64_t>(kMaxBrickCoord, static_cast<int64_t>(std::floor(hi[axis])));
+            }
+            for (int64_t bz = b0[2]; bz <= b1[2]; bz++)
+                for (int64_t by = b0[1]; by <= b1[1]; by++)
+                    for (int64_t bx = b0[0]; bx <= b1[0]; bx++)
+                        keys.push_back(brickKey(bx, by, bz));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }, grain);
+
+    std::vector<uint64_t> keys;
+    for (size_t c = 0; c < chunkKeys.size(); c++)
+    {
+        keys.insert(keys.end(), chunkKeys[c].begin(), chunkKeys[c].end());
+        std::vector<uint64_t>().swap(chunkKeys[c]);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    m_brickIndex.reserve(keys.size());
+    for (size_t b = 0; b < keys.size(); b++) m_brickIndex[keys[b]] = static_cast<uint32_t>(b);
+    m_distances.resize(keys.size() * kBrickSamples);
+    m_faces.resize(keys.size() * kBrickSamples);
+
+    // one exact query per corner, unbounded so every stored sample is real
+    parallelFor(keys.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        QueryHit hit;
+        const float unbounded = std::numeric_limits<float>::max();
+        for (size_t b = begin; b < end; b++)
+        {
+            const uint64_t mask = static_cast<uint64_t>(kMaxBrickCoord);
+            Eigen::Vector3d base = origin + brickExtent * Eigen::Vector3d(static_cast<double>(keys[b] & mask),
+                                                                          static_cast<double>((keys[b] >> kKeyBits) & mask),
+                                                                          static_cast<double>(keys[b] >> (2 * kKeyBits)));
+            float* distances = m_distances.data() + b * kBrickSamples;
+            int* faces = m_faces.data() + b * kBrickSamples;
+            for (int z = 0; z < kBrickCorners; z++)
+                for (int y = 0; y < kBrickCorners; y++)
+                    for (int x = 0; x < kBrickCorners; x++)
+                    {
+                        Eigen::Vector3d point = base + voxelSize * Eigen::Vector3d(x, y, z);
+                        query.query(point, unbounded, context, hit);
+
+                        // a vertex hit lies on all its faces, any of them will do
+                        int face = hit.m_faceId;
+                        if (face < 0 && hit.m_vertexId >= 0) face = query.getVertexFace(hit.m_vertexId);
+                        distances[sampleIndex(x, y, z)] = hit.m_dist;
+                        faces[sampleIndex(x, y, z)] = face;
+                    }
+        }
+    }, 1);
+    return true;
+}
+
+/**
+ * @brief Drop every brick
+ */
+void DistanceField::clear()
+{
+    m_mesh = NULL;
+    m_brickIndex.clear();
+    std::vector<float>().swap(m_distances);
+    std::vector<int>().swap(m_faces);
+}
+
+/**
+ * @brief Approximate memory held by the field, samples plus hash map
+ * @return size_t Bytes
+ */
+size_t DistanceField::getMemoryUsage() const
+{
+    return m_distances.capacity() * sizeof(float) + m_faces.capacity() * sizeof(int) +
+           m_brickIndex.bucket_count() * sizeof(void*) +
+           m_brickIndex.size() * (sizeof(std::pair<uint64_t, uint32_t>) + sizeof(void*));
+}
+
+/**
+ * @brief Find the brick and voxel holding a point
+ * @param point Point
+ * @param brick Output brick index
+ * @param cx Output voxel x inside the brick
+ * @param cy Output voxel y inside the brick
+ * @param cz Output voxel z inside the brick
+ * @param frac Output position inside the voxel, 0 .. 1 per axis
+ * @return true The point lies in a stored brick
+ */
+bool DistanceField::findBrick(const Eigen::Vector3d& point, uint32_t& brick, int& cx, int& cy, int& cz, Eigen::Vector3d& frac) const
+{
+    if (m_brickIndex.empty()) return false;
+
+    const Eigen::Vector3d grid = (point - m_origin) * m_invVoxelSize;
+    int64_t cell[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // also rejects NaN
+        if (!(grid[axis] >= 0.0 && grid[axis] < static_cast<double>(kMaxBrickCoord * kBrickSize))) return false;
+        cell[axis] = static_cast<int64_t>(grid[axis]);
+        frac[axis] = grid[axis] - static_cast<double>(cell[axis]);
+    }
+
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it = m_brickIndex.find(brickKey(cell[0] / kBrickSize, cell[1] / kBrickSize, cell[2] / kBrickSize));
+    if (it == m_brickIndex.end()) return false;
+
+    brick = it->second;
+    cx = static_cast<int>(cell[0] % kBrickSize);
+    cy = static_cast<int>(cell[1] % kBrickSize);
+    cz = static_cast<int>(cell[2] % kBrickSize);
+    return true;
+}
+
+/**
+ * @brief Approximate distance to the mesh, trilinear in the 8 corners of the
+ * voxel holding the point. One hash lookup and 8 samples.
+ * @param point Point
+ * @param dist Output distance
+ * @return true The point lies inside the stored band
+ */
+bool DistanceField::sample(const Eigen::Vector3d& point, float& dist) const
+{
+    uint32_t brick;
+    int cx, cy, cz;
+    Eigen::Vector3d frac;
+    if (!findBrick(point, brick, cx, cy, cz, frac)) return false;
+
+    const float* d = m_distances.data() + static_cast<size_t>(brick) * kBrickSamples;
+    const double fx = frac.x(), fy = frac.y(), fz = frac.z();
+    double c00 = d[sampleIndex(cx, cy, cz)] * (1.0 - fx) + d[sampleIndex(cx + 1, cy, cz)] * fx;
+    double c10 = d[sampleIndex(cx, cy + 1, cz)] * (1.0 - fx) + d[sampleIndex(cx + 1, cy + 1, cz)] * fx;
+    double c01 = d[sampleIndex(cx, cy, cz + 1)] * (1.0 - fx) + d[sampleIndex(cx + 1, cy, cz + 1)] * fx;
+    double c11 = d[sampleIndex(cx, cy + 1, cz + 1)] * (1.0 - fx) + d[sampleIndex(cx + 1, cy + 1, cz + 1)] * fx;
+    double c0 = c00 * (1.0 - fy) + c10 * fy;
+    double c1 = c01 * (1.0 - fy) + c11 * fy;
+    dist = static_cast<float>(c0 * (1.0 - fz) + c1 * fz);
+    return true;
+}
+
+/**
+ * @brief Closest point refined against the nearest faces of the 8 corners of
+ * the voxel holding the point, tested exactly with the same acceptance rule as
+ * PointQuery::query(). The distance is exact for the best candidate and never
+ * below the true distance.
+ * @param point Query point
+ * @param maxDist Max radius
+ * @param hit Output hit record, not found if no candidate is within the radius
+ * @return true The point lies inside the stored band; false leaves hit untouched
+ * so the caller can fall back to PointQuery::query()
+ */
+bool DistanceField::closestPoint(const Eigen::Vector3d& point, const float& maxDist, QueryHit& hit) const
+{
+    uint32_t brick;
+    int cx, cy, cz;
+    Eigen::Vector3d frac;
+    if (!findBrick(point, brick, cx, cy, cz, frac)) return false;
+
+    const int* faces = m_faces.data() + static_cast<size_t>(brick) * kBrickSamples;
+    int candidates[8];
+    int candidateCount = 0;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        int face = faces[sampleIndex(cx + (corner & 1), cy + ((corner >> 1) & 1), cz + (corner >> 2))];
+        if (face >= 0 && std::find(candidates, candidates + candidateCount, face) == candidates + candidateCount)
+        {
+            candidates[candidateCount++] = face;
+        }
+    }
+
+    float bestDist = maxDist;
+    int bestFace = -1;
+    float bestS = 0.0f, bestT = 0.0f;
+    Eigen::Vector3d bestPoint = point;
+    Eigen::Vector3d v1, v2, v3;
+    for (int c = 0; c < candidateCount; c++)
+    {
+        const int faceId = candidates[c];
+        m_mesh->getFaceVertices(faceId, v1, v2, v3);
+        float dist, s, t;
+        Eigen::Vector3d closest = closestPointOnTriangleEdges(v1, v2 - v1, v3 - v1, point, dist, s, t);
+        if ((dist < bestDist || (dist == bestDist && faceId > bestFace)) && closest != point)
+        {
+            bestDist = dist;
+            bestFace = faceId;
+            bestS = s;
+            bestT = t;
+            bestPoint = closest;
+        }
+    }
+
+    hit.m_found = bestFace >= 0;
+    hit.m_faceId = bestFace;
+    hit.m_vertexId = -1;
+    hit.m_point = bestPoint;
+    hit.m_barycentric = hit.m_found ? Eigen::Vector3d(1.0 - bestS - bestT, bestS, bestT) : Eigen::Vector3d::Zero();
+    hit.m_dist = bestDist;
+    hit.m_distSq = hit.m_found ? (bestPoint - point).squaredNorm() : static_cast<double>(bestDist) * bestDist;
+    return true;
+}
@@ -0,0 +1,397 @@
+#include "KdTree.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+// node bounds are compared in double against float distances, keep a little
+// slack so a node holding an equally distant vertex is never pruned
+const double kSlack = 1.0 + 1e-5;
+
+/**
+ * @brief Stack entry of a tree walk, node and its squared box distance
+ */
+struct StackEntry
+{
+    int m_node;
+    double m_distSq;
+};
+
+/**
+ * @brief Push both children of an interior node, the nearer one last so it is
+ * popped first
+ * @param nodes Tree nodes
+ * @param node Interior node
+ * @param queryPoint Query point
+ * @param stack Walk stack
+ * @param stackSize Walk stack size
+ */
+inline void pushChildren(const std::vector<BVHNode>& nodes, const BVHNode& node, const Eigen::Vector3d& queryPoint, StackEntry* stack, int& stackSize)
+{
+    double distL = BVH::pointBoxDistanceSq(queryPoint, nodes[node.m_left]);
+    double distR = BVH::pointBoxDistanceSq(queryPoint, nodes[node.m_left + 1]);
+    if (distL < distR)
+    {
+        stack[stackSize++] = {node.m_left + 1, distR};
+        stack[stackSize++] = {node.m_left, distL};
+    }
+    else
+    {
+        stack[stackSize++] = {node.m_left, distL};
+        stack[stackSize++] = {node.m_left + 1, distR};
+    }
+}
+
+/**
+ * @brief Squared float bound with slack, used to prune nodes
+ */
+inline double pruneDistSq(const float& dist)
+{
+    return static_cast<double>(dist) * dist * kSlack;
+}
+}
+
+/**
+ * @brief Build the tree over all vertices of the given mesh. Any previously
+ * built tree is discarded.
+ * @param mesh Mesh object
+ * @param leafSize Max vertex count of a leaf
+ */
+void KdTree::build(const Mesh& mesh, const int& leafSize)
+{
+    m_nodes.clear();
+    m_ids.clear();
+    m_leafSize = std::max(1, leafSize);
+    m_buildCost = 0.0;
+
+    const int vertexCount = static_cast<int>(mesh.getVertexCount());
+    if (vertexCount == 0) return;
+
+    m_ids.resize(vertexCount);
+    for (int i = 0; i < vertexCount; i++) m_ids[i] = i;
+
+    m_nodes.reserve(2 * (vertexCount / m_leafSize + 1));
+    m_nodes.push_back(BVHNode());
+    buildNode(0, 0, vertexCount, 0, mesh);
+
+    // positions in tree order, leaves read them without going through the ids
+    ArrayView<double> xs = mesh.getX(), ys = mesh.getY(), zs = mesh.getZ();
+    m_x.resize(vertexCount);
+    m_y.resize(vertexCount);
+    m_z.resize(vertexCount);
+    for (int i = 0; i < vertexCount; i++)
+    {
+        m_x[i] = xs[m_ids[i]];
+        m_y[i] = ys[m_ids[i]];
+        m_z[i] = zs[m_ids[i]];
+    }
+    m_buildCost = BVH::treeCost(m_nodes.data(), getNodeCount());
+}
+
+/**
+ * @brief Update the tree to new vertex positions of the mesh it was built from,
+ * keeping its splits. See BVH::refit().
+ * @param mesh Mesh object the tree was built from, with new positions
+ * @param threadCount Worker count, 0 for one per hardware thread
+ */
+void KdTree::refit(const Mesh& mesh, const int& threadCount)
+{
+    if (m_nodes.empty()) return;
+
+    ArrayView<double> xs = mesh.getX(), ys = mesh.getY(), zs = mesh.getZ();
+    parallelFor(m_nodes.size(), threadCount, [&](size_t begin, size_t end) {
+        for (size_t n = begin; n < end; n++)
+        {
+            BVHNode& node = m_nodes[n];
+            if (!node.isLeaf()) continue;
+
+            for (int i = node.m_left; i < node.m_left + node.m_count; i++)
+            {
+                m_x[i] = xs[m_ids[i]];
+                m_y[i] = ys[m_ids[i]];
+                m_z[i] = zs[m_ids[i]];
+                Eigen::Vector3d v(m_x[i], m_y[i], m_z[i]);
+                node.m_min = i == node.m_left ? v : node.m_min.cwiseMin(v);
+                node.m_max = i == node.m_left ? v : node.m_max.cwiseMax(v);
+            }
+        }
+    }, 64);
+
+    BVH::refitInterior(m_nodes.data(), getNodeCount(), threadCount);
+}
+
+/**
+ * @brief How much worse the tree is than when it was built, see BVH::inflation()
+ * @return double Cost ratio
+ */
+double KdTree::inflation() const
+{
+    return m_buildCost > 0.0 ? BVH::treeCost(m_nodes.data(), getNodeCount()) / m_buildCost : 1.0;
+}
+
+/**
+ * @brief Recursively build the subtree for the vertex slots [first, first + count),
+ * split at the median of the largest bounds extent
+ * @param nodeId Index of the node being built
+ * @param first First vertex slot
+ * @param count Number of vertex slots
+ * @param depth Current depth, used to cap the tree height
+ * @param mesh Mesh object
+ */
+void KdTree::buildNode(const int& nodeId, const int& first, const int& count, const int& depth, const Mesh& mesh)
+{
+    Eigen::Vector3d bmin = mesh.getVertex(m_ids[first]);
+    Eigen::Vector3d bmax = bmin;
+    for (int i = first + 1; i < first + count; i++)
+    {
+        Eigen::Vector3d v = mesh.getVertex(m_ids[i]);
+        bmin = bmin.cwiseMin(v);
+        bmax = bmax.cwiseMax(v);
+    }
+
+    m_nodes[nodeId].m_min = bmin;
+    m_nodes[nodeId].m_max = bmax;
+    m_nodes[nodeId].m_left = first;
+    m_nodes[nodeId].m_count = count;
+
+    if (count <= m_leafSize || depth >= kMaxDepth) return;
+
+    int axis = 0;
+    Eigen::Vector3d ext = bmax - bmin;
+    ext.maxCoeff(&axis);
+    if (ext[axis] <= 0.0) return; // all vertices coincide, keep as leaf
+
+    ArrayView<double> coords = axis == 0 ? mesh.getX() : (axis == 1 ? mesh.getY() : mesh.getZ());
+    uint32_t* begin = &m_ids[first];
+    uint32_t* mid = begin + count / 2;
+    std::nth_element(begin, mid, begin + count, [&](const uint32_t& a, const uint32_t& b) {
+        return coords[a] < coords[b];
+    });
+
+    int leftCount = count / 2;
+    int left = static_cast<int>(m_nodes.size());
+    m_nodes.push_back(BVHNode());
+    m_nodes.push_back(BVHNode());
+    m_nodes[nodeId].m_left = left;
+    m_nodes[nodeId].m_count = 0;
+
+    buildNode(left, first, leftCount, depth + 1, mesh);
+    buildNode(left + 1, first + leftCount, count - leftCount, depth + 1, mesh);
+}
+
+/**
+ * @brief Closest vertex within the search radius. On equal distances the lowest
+ * vertex id wins, same as a linear scan in id order with a strict compare.
+ * @param queryPoint Query point
+ * @param minDist Search radius, set to the distance of the found vertex
+ * @return int Vertex id, -1 if no vertex is closer than the radius
+ */
+int KdTree::closest(const Eigen::Vector3d& queryPoint, float& minDist) const
+{
+    int bestId = -1;
+    if (m_nodes.empty()) return bestId;
+
+    StackEntry stack[2 * kMaxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        StackEntry entry = stack[--stackSize];
+        if (entry.m_distSq > pruneDistSq(minDist)) continue;
+
+        const BVHNode& node = m_nodes[entry.m_node];
+        if (!node.isLeaf())
+        {
+            pushChildren(m_nodes, node, queryPoint, stack, stackSize);
+            continue;
+        }
+
+        for (int i = node.m_left; i < node.m_left + node.m_count; i++)
+        {
+            double dx = queryPoint.x() - m_x[i];
+            double dy = queryPoint.y() - m_y[i];
+            double dz = queryPoint.z() - m_z[i];
+            float d = sqrtf(static_cast<float>(dx*dx + dy*dy + dz*dz));
+            int id = static_cast<int>(m_ids[i]);
+            if (d < minDist || (d == minDist && bestId >= 0 && id < bestId))
+            {
+                minDist = d;
+                bestId = id;
+            }
+        }
+    }
+    return bestId;
+}
+
+/**
+ * @brief Shared walk of the radius searches; hands every vertex within the
+ * radius to emit, which returns false to stop
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param emit Called with each hit and the number of hits before it
+ * @return size_t Number of vertices found
+ */
+template <typename Emit>
+size_t KdTree::walkRadius(const Eigen::Vector3d& queryPoint, const float& radius, Emit emit) const
+{
+    size_t found = 0;
+    if (m_nodes.empty()) return found;
+
+    const double limit = pruneDistSq(radius);
+    StackEntry stack[2 * kMaxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        StackEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limit) continue;
+
+        const BVHNode& node = m_nodes[entry.m_node];
+        if (!node.isLeaf())
+        {
+            pushChildren(m_nodes, node, queryPoint, stack, stackSize);
+            continue;
+        }
+
+        for (int i = node.m_left; i < node.m_left + node.m_count; i++)
+        {
+            double dx = queryPoint.x() - m_x[i];
+            double dy = queryPoint.y() - m_y[i];
+            double dz = queryPoint.z() - m_z[i];
+            float d = sqrtf(static_cast<float>(dx*dx + dy*dy + dz*dz));
+            if (d > radius) continue;
+
+            VertexHit hit;
+            hit.m_id = m_ids[i];
+            hit.m_dist = d;
+            hit.m_point = Eigen::Vector3d(m_x[i], m_y[i], m_z[i]);
+            if (!emit(found++, hit)) return found;
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Every vertex within the radius, in no particular order.
+ * When more vertices are found than fit, the extra ones are counted but not
+ * written, so the caller can grow the buffer and search again.
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param hits Output buffer
+ * @param capacity Output buffer size
+ * @return size_t Number of vertices within the radius
+ */
+size_t KdTree::radiusSearch(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const
+{
+    return walkRadius(queryPoint, radius, [&](const size_t& index, const VertexHit& hit) {
+        if (index < capacity) hits[index] = hit;
+        return true;
+    });
+}
+
+/**
+ * @brief Every vertex within the radius handed to a callback, in no particular
+ * order
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param callback Called per vertex, returning false stops the search
+ * @return size_t Number of vertices passed to the callback
+ */
+size_t KdTree::radiusSearch(const Eigen::Vector3d& queryPoint, const float& radius, const VertexHitCallback& callback) const
+{
+    return walkRadius(queryPoint, radius, [&](const size_t&, const VertexHit& hit) {
+        return callback(hit);
+    });
+}
+
+/**
+ * @brief Upper bound of the vertex count within the radius: the size of every
+ * leaf whose bounds reach into it. Only node bounds are tested, so it is much
+ * cheaper than the search itself; use it to size the buffer of radiusSearch().
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @return size_t At least the number of vertices within the radius
+ */
+size_t KdTree::estimateInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const
+{
+    size_t count = 0;
+    if (m_nodes.empty()) return count;
+
+    const double limit = pruneDistSq(radius);
+    StackEntry stack[2 * kMaxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        StackEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limit) continue;
+
+        const BVHNode& node = m_nodes[entry.m_node];
+        if (node.isLeaf())
+        {
+            count += node.m_count;
+            continue;
+        }
+        pushChildren(m_nodes, node, queryPoint, stack, stackSize);
+    }
+    return count;
+}
+
+/**
+ * @brief The k closest vertices within maxDist, sorted by distance then id
+ * @param queryPoint Query point
+ * @param k Number of vertices wanted
+ * @param maxDist Search radius, inclusive
+ * @param hits Output buffer, at least k entries
+ * @return size_t Number of vertices written, less than k if the radius holds fewer
+ */
+size_t KdTree::nearest(const Eigen::Vector3d& queryPoint, const size_t& k, const float& maxDist, VertexHit* hits) const
+{
+    size_t found = 0;
+    if (m_nodes.empty() || k == 0) return found;
+
+    StackEntry stack[2 * kMaxDepth + 2];
+    int stackSize = 0;
+    stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        StackEntry entry = stack[--stackSize];
+        float bound = found == k ? hits[k - 1].m_dist : maxDist;
+        if (entry.m_distSq > pruneDistSq(bound)) continue;
+
+        const BVHNode& node = m_nodes[entry.m_node];
+        if (!node.isLeaf())
+        {
+            pushChildren(m_nodes, node, queryPoint, stack, stackSize);
+            continue;
+        }
+
+        for (int i = node.m_left; i < node.m_left + node.m_count; i++)
+        {
+            double dx = queryPoint.x() - m_x[i];
+            double dy = queryPoint.y() - m_y[i];
+            double dz = queryPoint.z() - m_z[i];
+            float d = sqrtf(static_cast<float>(dx*dx + dy*dy + dz*dz));
+            uint32_t id = m_ids[i];
+            if (d > maxDist) continue;
+            if (found == k && (d > hits[k - 1].m_dist || (d == hits[k - 1].m_dist && id > hits[k - 1].m_id))) continue;
+
+            // insertion into the sorted list, dropping the last entry when full
+            size_t pos = found < k ? found++ : k - 1;
+            while (pos > 0 && (hits[pos - 1].m_dist > d || (hits[pos - 1].m_dist == d && hits[pos - 1].m_id > id)))
+            {
+                hits[pos] = hits[pos - 1];
+                pos--;
+            }
+            hits[pos].m_id = id;
+            hits[pos].m_dist = d;
+            hits[pos].m_point = Eigen::Vector3d(m_x[i], m_y[i], m_z[i]);
+        }
+    }
+    return found;
+}
@@ -0,0 +1,465 @@
+#include "BVH.h"
+#include "Morton.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+// treelets of up to kTreeletSize subtrees are rearranged to the SAH optimal
+// shape, on every node with at least kTreeletMinCount faces below it
+const int kTreeletSize = 5;
+const int kTreeletMinCount = 16;
+const double kTraversalCost = 1.2;
+const double kTriangleCost = 1.0;
+
+/**
+ * @brief Node of the intermediate binary radix tree, one leaf per face.
+ * Internal nodes are [0, n - 1), leaf i of the sorted faces is n - 1 + i.
+ */
+struct RadixNode
+{
+    Eigen::Vector3d m_min, m_max;
+    int m_left, m_right, m_parent;
+    int m_count;        // faces below the node
+    double m_area;
+    double m_cost;      // SAH cost of the subtree
+};
+
+/**
+ * @brief Surface area of an axis aligned box
+ */
+inline double boxArea(const Eigen::Vector3d& bmin, const Eigen::Vector3d& bmax)
+{
+    Eigen::Vector3d ext = bmax - bmin;
+    return 2.0 * (ext.x()*ext.y() + ext.y()*ext.z() + ext.z()*ext.x());
+}
+
+/**
+ * @brief Stable parallel LSD radix sort of 30 bit keys with their values,
+ * 3 passes of 10 bits. Every worker histograms and scatters its own chunk.
+ * @param keys Keys, sorted in place
+ * @param values Values, permuted with the keys
+ * @param threadCount Worker count, 0 for one per hardware thread
+ */
+void radixSort30(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, const int& threadCount)
+{
+    const size_t n = keys.size();
+    const int kBits = 10;
+    const size_t kBuckets = size_t(1) << kBits;
+    const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(resolveThreadCount(threadCount), n / 65536));
+    const size_t chunk = (n + chunkCount - 1) / chunkCount;
+
+    std::vector<uint32_t> tmpKeys(n), tmpValues(n);
+    std::vector<size_t> hist(chunkCount * kBuckets);
+    for (int shift = 0; shift < 30; shift += kBits)
+    {
+        std::fill(hist.begin(), hist.end(), 0);
+        parallelFor(chunkCount, threadCount, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++)
+            {
+                size_t* h = &hist[c * kBuckets];
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) h[(keys[i] >> shift) & (kBuckets - 1)]++;
+            }
+        }, 1);
+
+        // bucket major prefix sum, so chunk c of a bucket lands after chunks < c
+        size_t sum = 0;
+        for (size_t d = 0; d < kBuckets; d++)
+        {
+            for (size_t c = 0; c < chunkCount; c++)
+            {
+                size_t count = hist[c * kBuckets + d];
+                hist[c * kBuckets + d] = sum;
+                sum += count;
+            }
+        }
+
+        parallelFor(chunkCount, threadCount, [&](size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++)
+            {
+                size_t* h = &hist[c * kBuckets];
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++)
+                {
+                    size_t pos = h[(keys[i] >> shift) & (kBuckets - 1)]++;
+                    tmpKeys[pos] = keys[i];
+                    tmpValues[pos] = values[i];
+                }
+            }
+        }, 1);
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+    }
+}
+
+/**
+ * @brief Leading zero bits of a 32 bit value
+ * @param x Value, not 0
+ * @return int Zero bits above the highest set bit
+ */
+inline int countLeadingZeros(const uint32_t& x)
+{
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanReverse(&bit, x);
+    return 31 - static_cast<int>(bit);
+#else
+    return __builtin_clz(x);
+#endif
+}
+
+/**
+ * @brief Trailing zero bits of a 32 bit value
+ * @param x Value, not 0
+ * @return int Zero bits below the lowest set bit
+ */
+inline int countTrailingZeros(const uint32_t& x)
+{
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward(&bit, x);
+    return static_cast<int>(bit);
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+/**
+ * @brief Length of the common prefix of two sorted keys, with the key index
+ * appended so duplicate codes still get a distinct split
+ * // https://research.nvidia.com/publication/2012-06_maximizing-parallelism-construction-bvhs-octrees-and-k-d-trees
+ * @param codes Sorted Morton codes
+ * @param i First key
+ * @param j Second key, may be out of range
+ * @return int Common prefix length, -1 if j is out of range
+ */
+inline int commonPrefix(const std::vector<uint32_t>& codes, const int& i, const int& j)
+{
+    if (j < 0 || j >= static_cast<int>(codes.size())) return -1;
+    uint32_t x = codes[i] ^ codes[j];
+    if (x == 0) return 32 + countLeadingZeros(static_cast<uint32_t>(i ^ j));
+    return countLeadingZeros(x);
+}
+
+/**
+ * @brief Children of internal node i of the binary radix tree (Karras 2012)
+ * @param codes Sorted Morton codes
+ * @param i Internal node
+ * @param left Output left child
+ * @param right Output right child
+ */
+void radixSplit(const std::vector<uint32_t>& codes, const int& i, int& left, int& right)
+{
+    const int n = static_cast<int>(codes.size());
+    const int d = commonPrefix(codes, i, i + 1) - commonPrefix(codes, i, i - 1) > 0 ? 1 : -1;
+
+    // range end: grow exponentially, then binary search
+    const int minPrefix = commonPrefix(codes, i, i - d);
+    int lmax = 2;
+    while (commonPrefix(codes, i, i + lmax * d) > minPrefix) lmax *= 2;
+    int l = 0;
+    for (int t = lmax / 2; t >= 1; t /= 2)
+    {
+        if (commonPrefix(codes, i, i + (l + t) * d) > minPrefix) l += t;
+    }
+    const int j = i + l * d;
+
+    // split: last key sharing more than the node prefix with i
+    const int nodePrefix = commonPrefix(codes, i, j);
+    int s = 0;
+    for (int t = (l + 1) / 2; ; t = (t + 1) / 2)
+    {
+        if (commonPrefix(codes, i, i + (s + t) * d) > nodePrefix) s += t;
+        if (t == 1) break;
+    }
+    const int gamma = i + s * d + std::min(d, 0);
+
+    left = std::min(i, j) == gamma ? n - 1 + gamma : gamma;
+    right = std::max(i, j) == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+}
+
+/**
+ * @brief Recompute bounds, count and SAH cost of an internal node from its children
+ */
+inline void updateNode(std::vector<RadixNode>& nodes, const int& id)
+{
+    RadixNode& node = nodes[id];
+    const RadixNode& l = nodes[node.m_left];
+    const RadixNode& r = nodes[node.m_right];
+    node.m_min = l.m_min.cwiseMin(r.m_min);
+    node.m_max = l.m_max.cwiseMax(r.m_max);
+    node.m_count = l.m_count + r.m_count;
+    node.m_area = boxArea(node.m_min, node.m_max);
+    node.m_cost = kTraversalCost * node.m_area + l.m_cost + r.m_cost;
+}
+
+/**
+ * @brief Rearrange the treelet below a node to its SAH optimal shape (Karras and
+ * Aila 2013). The treelet is grown from the node by opening its largest child
+ * until it has kTreeletSize leaves, then the best binary tree over those leaves
+ * is found by dynamic programming over all leaf subsets. Only nodes inside the
+ * treelet are touched, their subtrees are already final.
+ * @param nodes Radix tree
+ * @param root Treelet root
+ * @param leafStart First leaf node id, nodes from here on can't be opened
+ */
+void optimizeTreelet(std::vector<RadixNode>& nodes, const int& root, const int& leafStart)
+{
+    int leaves[kTreeletSize];
+    int internals[kTreeletSize - 1];
+    int leafCount = 2, internalCount = 0;
+    leaves[0] = nodes[root].m_left;
+    leaves[1] = nodes[root].m_right;
+    while (leafCount < kTreeletSize)
+    {
+        int best = -1;
+        for (int k = 0; k < leafCount; k++)
+        {
+            if (leaves[k] >= leafStart) continue;
+            if (best < 0 || nodes[leaves[k]].m_area > nodes[leaves[best]].m_area) best = k;
+        }
+        if (best < 0) break;
+
+        internals[internalCount++] = leaves[best];
+        int opened = leaves[best];
+        leaves[best] = nodes[opened].m_left;
+        leaves[leafCount++] = nodes[opened].m_right;
+    }
+    if (leafCount < 3) return;
+
+    // best cost of every leaf subset, subsets of a mask are smaller numbers
+    const int full = (1 << leafCount) - 1;
+    double area[1 << kTreeletSize], cost[1 << kTreeletSize];
+    int split[1 << kTreeletSize];
+    for (int mask = 1; mask <= full; mask++)
+    {
+        Eigen::Vector3d bmin = nodes[leaves[countTrailingZeros(mask)]].m_min;
+        Eigen::Vector3d bmax = nodes[leaves[countTrailingZeros(mask)]].m_max;
+        for (int k = 0; k < leafCount; k++)
+        {
+            if (!(mask & (1 << k))) continue;
+            bmin = bmin.cwiseMin(nodes[leaves[k]].m_min);
+            bmax = bmax.cwiseMax(nodes[leaves[k]].m_max);
+        }
+        area[mask] = boxArea(bmin, bmax);
+
+        if ((mask & (mask - 1)) == 0)
+        {
+            cost[mask] = nodes[leaves[countTrailingZeros(mask)]].m_cost;
+            split[mask] = 0;
+            continue;
+        }
+
+        double best = std::numeric_limits<double>::max();
+        int bestSplit = 0;
+        const int low = mask & -mask;
+        for (int part = (mask - 1) & mask; part > 0; part = (part - 1) & mask)
+        {
+            if (!(part & low)) continue; // each split once, the lowest leaf on the left
+            double c = cost[part] + cost[mask ^ part];
+            if (c < best)
+            {
+                best = c;
+                bestSplit = part;
+            }
+        }
+        cost[mask] = kTraversalCost * area[mask] + best;
+        split[mask] = bestSplit;
+    }
+    // NaN costs, from faces of a corrupt cache, keep the treelet as it is
+    if (!(cost[full] < nodes[root].m_cost * (1.0 - 1e-9))) return;
+
+    // rebuild the treelet top-down from the stored splits, reusing its nodes
+    struct Pending { int m_node; int m_mask; };
+    Pending stack[kTreeletSize];
+    int order[kTreeletSize];
+    int stackSize = 0, orderSize = 0, nextInternal = 0;
+    stack[stackSize++] = {root, full};
+    while (stackSize > 0)
+    {
+        Pending p = stack[--stackSize];
+        order[orderSize++] = p.m_node;
+        const int masks[2] = {split[p.m_mask], p.m_mask ^ split[p.m_mask]};
+        int children[2];
+        for (int c = 0; c < 2; c++)
+        {
+            if ((masks[c] & (masks[c] - 1)) == 0)
+            {
+                children[c] = leaves[countTrailingZeros(masks[c])];
+            }
+            else
+            {
+                children[c] = internals[nextInternal++];
+                stack[stackSize++] = {children[c], masks[c]};
+            }
+            nodes[children[c]].m_parent = p.m_node;
+        }
+        nodes[p.m_node].m_left = children[0];
+        nodes[p.m_node].m_right = children[1];
+    }
+
+    // parents come before their children in order, update bottom-up
+    for (int k = orderSize - 1; k >= 0; k--) updateNode(nodes, order[k]);
+}
+}
+
+/**
+ * @brief Build the tree over all faces of the given mesh as a linear BVH, in
+ * parallel. Face centroids are sorted along a 30 bit Morton curve with a radix
+ * sort, a binary radix tree over the sorted faces is emitted in parallel (Karras
+ * 2012), then bounds are propagated bottom-up; on the way up every node with
+ * enough faces below it gets its treelet rearranged to the SAH optimal shape.
+ * Subtrees with at most leafSize faces become leaves.
+ * Much faster to build than build() on large meshes, queries get somewhat slower.
+ * @param mesh Mesh object
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param leafSize Max face count of a leaf
+ */
+void BVH::buildLinear(const Mesh& mesh, const int& threadCount, const int& leafSize)
+{
+    m_nodes.clear();
+    m_faceIndices.clear();
+    m_blocks.clear();
+    m_storage.reset();
+    m_leafSize = std::max(1, leafSize);
+    m_buildCost = 0.0;
+    m_linear = true;
+
+    const int faceCount = static_cast<int>(mesh.getFaceCount());
+    m_faceCount = faceCount;
+    if (faceCount == 0) return;
+
+    // face bounds and centroid bounds, reduced per chunk
+    std::vector<Eigen::Vector3d> faceMin(faceCount), faceMax(faceCount), centroids(faceCount);
+    const size_t chunk = 16384;
+    const size_t chunkCount = (faceCount + chunk - 1) / chunk;
+    std::vector<Eigen::Vector3d> chunkMin(chunkCount), chunkMax(chunkCount);
+    parallelFor(chunkCount, threadCount, [&](size_t begin, size_t end) {
+        Eigen::Vector3d v1, v2, v3;
+        for (size_t c = begin; c < end; c++)
+        {
+            chunkMin[c].setConstant(std::numeric_limits<double>::max());
+            chunkMax[c].setConstant(-std::numeric_limits<double>::max());
+            for (size_t i = c * chunk; i < std::min<size_t>(faceCount, (c + 1) * chunk); i++)
+            {
+                mesh.getFaceVertices(static_cast<uint32_t>(i), v1, v2, v3);
+                faceMin[i] = v1.cwiseMin(v2).cwiseMin(v3);
+                faceMax[i] = v1.cwiseMax(v2).cwiseMax(v3);
+                centroids[i] = (v1 + v2 + v3) / 3.0;
+                chunkMin[c] = chunkMin[c].cwiseMin(centroids[i]);
+                chunkMax[c] = chunkMax[c].cwiseMax(centroids[i]);
+            }
+        }
+    }, 1);
+    Eigen::Vector3d cmin = chunkMin[0], cmax = chunkMax[0];
+    for (size_t c = 1; c < chunkCount; c++)
+    {
+        cmin = cmin.cwiseMin(chunkMin[c]);
+        cmax = cmax.cwiseMax(chunkMax[c]);
+    }
+
+    // Morton order of the centroids
+    std::vector<uint32_t> codes(faceCount), sorted(faceCount);
+    parallelFor(faceCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            codes[i] = mortonCode(centroids[i], cmin, cmax);
+            sorted[i] = static_cast<uint32_t>(i);
+        }
+    }, 16384);
+    radixSort30(codes, sorted, threadCount);
+
+    // binary radix tree, every internal node is independent
+    const int leafStart = faceCount - 1;
+    std::vector<RadixNode> nodes(2 * faceCount - 1);
+    nodes[0].m_parent = -1;
+    parallelFor(leafStart, threadCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            int left, right;
+            radixSplit(codes, static_cast<int>(i), left, right);
+            nodes[i].m_left = left;
+            nodes[i].m_right = right;
+            nodes[left].m_parent = static_cast<int>(i);
+            nodes[right].m_parent = static_cast<int>(i);
+        }
+    }, 4096);
+
+    // bottom-up: each leaf walks up, the second child to reach a node finishes it
+    std::vector<std::atomic<int> > arrivals(std::max(1, leafStart));
+    for (int i = 0; i < leafStart; i++) arrivals[i].store(0, std::memory_order_relaxed);
+    parallelFor(faceCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+        {
+            RadixNode& leaf = nodes[leafStart + i];
+            const uint32_t face = sorted[i];
+            leaf.m_min = faceMin[face];
+            leaf.m_max = faceMax[face];
+            leaf.m_left = leaf.m_right = -1;
+            leaf.m_count = 1;
+            leaf.m_area = boxArea(leaf.m_min, leaf.m_max);
+            leaf.m_cost = kTriangleCost * leaf.m_area;
+
+            int id = faceCount > 1 ? leaf.m_parent : -1;
+            while (id >= 0 && arrivals[id].fetch_add(1, std::memory_order_acq_rel) == 1)
+            {
+                updateNode(nodes, id);
+                if (nodes[id].m_count >= kTreeletMinCount) optimizeTreelet(nodes, id, leafStart);
+                id = nodes[id].m_parent;
+            }
+        }
+    }, 1024);
+
+    // flatten into the adjacent child layout, collapsing small subtrees into leaves
+    struct Pending { int m_radix; int m_node; int m_depth; };
+    std::vector<Pending> stack;
+    std::vector<int> gather;
+    m_nodes.reserve(2 * (faceCount / m_leafSize + 1));
+    m_nodes.push_back(BVHNode());
+    m_faceIndices.reserve(faceCount);
+    std::vector<int>& faceIndices = m_faceIndices.owned();
+    stack.push_back({0, 0, 0});
+    while (!stack.empty())
+    {
+        Pending p = stack.back();
+        stack.pop_back();
+        const RadixNode& radix = nodes[p.m_radix];
+        m_nodes[p.m_node].m_min = radix.m_min;
+        m_nodes[p.m_node].m_max = radix.m_max;
+
+        if (p.m_radix >= leafStart || radix.m_count <= m_leafSize || p.m_depth >= kMaxDepth)
+        {
+            m_nodes[p.m_node].m_left = static_cast<int>(faceIndices.size());
+            m_nodes[p.m_node].m_count = radix.m_count;
+            gather.push_back(p.m_radix);
+            while (!gather.empty())
+            {
+                int id = gather.back();
+                gather.pop_back();
+                if (id >= leafStart)
+                {
+                    faceIndices.push_back(static_cast<int>(sorted[id - leafStart]));
+                    continue;
+                }
+                gather.push_back(nodes[id].m_right);
+                gather.push_back(nodes[id].m_left);
+            }
+            continue;
+        }
+
+        int left = static_cast<int>(m_nodes.size());
+        m_nodes.push_back(BVHNode());
+        m_nodes.push_back(BVHNode());
+        m_nodes[p.m_node].m_left = left;
+        m_nodes[p.m_node].m_count = 0;
+        stack.push_back({radix.m_right, left + 1, p.m_depth + 1});
+        stack.push_back({radix.m_left, left, p.m_depth + 1});
+    }
+
+    buildBlocks(mesh, threadCount);
+    m_buildCost = cost();
+}
@@ -0,0 +1,170 @@
+#include "MappedFile.h"
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+namespace
+{
+/**
+ * @brief Page range of a part of the mapping, shrunk to whole pages
+ * @param data Start of the range
+ * @param size Range size in bytes
+ * @param begin Output first page
+ * @param end Output end of the last page
+ * @return true At least one whole page
+ */
+bool wholePages(const void* data, const size_t& size, uintptr_t& begin, uintptr_t& end)
+{
+    const uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    begin = (reinterpret_cast<uintptr_t>(data) + pageSize - 1) / pageSize * pageSize;
+    end = (reinterpret_cast<uintptr_t>(data) + size) / pageSize * pageSize;
+    return end > begin;
+}
+}
+#endif
+
+/**
+ * @brief Construct an empty mapping
+ */
+MappedFile::MappedFile() : m_data(NULL), m_size(0)
+#ifdef _WIN32
+    , m_file(NULL), m_mapping(NULL)
+#else
+    , m_fd(-1)
+#endif
+{
+}
+
+/**
+ * @brief Release the mapping
+ */
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/**
+ * @brief Map the whole file read only
+ * @param filename Full file path
+ * @return true Successful mapping
+ * @return false File missing, empty or can't be mapped
+ */
+bool MappedFile::open(const char* filename)
+{
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_data = static_cast<const char*>(data);
+    m_size = static_cast<size_t>(size.QuadPart);
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        ::close(fd);
+        return false;
+    }
+    m_fd = fd;
+    m_data = static_cast<const char*>(data);
+    m_size = static_cast<size_t>(st.st_size);
+#endif
+    return true;
+}
+
+/**
+ * @brief Unmap the file if mapped
+ */
+void MappedFile::close()
+{
+    if (!m_data) return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    CloseHandle(m_file);
+    m_file = NULL;
+    m_mapping = NULL;
+#else
+    munmap(const_cast<char*>(m_data), m_size);
+    ::close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = NULL;
+    m_size = 0;
+}
+
+/**
+ * @brief Drop the resident pages of a part of the mapping from the process.
+ * Only whole pages inside the range are dropped; the mapping stays valid and
+ * pages read again are faulted back in from the page cache.
+ * @param data Start of the range, inside the mapping
+ * @param size Range size in bytes
+ */
+void MappedFile::release(const void* data, const size_t& size) const
+{
+    if (!m_data || size == 0) return;
+#ifdef _WIN32
+    // unlocking pages that are not locked takes them out of the working set
+    VirtualUnlock(const_cast<void*>(data), size);
+#else
+    uintptr_t begin, end;
+    if (wholePages(data, size, begin, end)) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+}
+
+/**
+ * @brief Tell the system a part of the mapping is read in no particular
+ * order: no read ahead, and a page fault maps only the page it needs instead
+ * of its neighbours as well, so only pages actually read become resident.
+ * @param data Start of the range, inside the mapping
+ * @param size Range size in bytes
+ */
+void MappedFile::adviseRandom(const void* data, const size_t& size) const
+{
+#ifndef _WIN32
+    uintptr_t begin, end;
+    if (m_data && wholePages(data, size, begin, end)) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_RANDOM);
+#else
+    (void)data;
+    (void)size;
+#endif
+}
@@ -1,17 +1,154 @@
+// needed once for tinyobjloader
+#define TINYOBJLOADER_IMPLEMENTATION
 #include "Mesh.h"
+#include "MappedFile.h"
+#include "Parallel.h"
 #include "stdio.h"
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <string>
+
+namespace
+{
+/**
+ * @brief Per chunk state of the parallel .obj loader
+ */
+struct ObjChunk
+{
+    const char* m_begin;
+    const char* m_end;
+    size_t m_vertexCount, m_triangleCount;     // filled by the counting pass
+    size_t m_vertexOffset, m_triangleOffset;   // prefix sums of the above
+    std::string m_error;
+};
+
+/**
+ * @brief Whitespace within a line
+ */
+inline bool isBlank(const char& c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * @brief Skip blanks, stopping at the line end
+ */
+inline const char* skipBlanks(const char* p, const char* end)
+{
+    while (p < end && isBlank(*p)) p++;
+    return p;
+}
 
 /**
- * @brief Add given vertex to vertices vector
+ * @brief Record type of a line, 'v' for a vertex position, 'f' for a face, 0 for
+ * anything the query does not need (normals, uvs, groups, materials, comments)
+ * @param p Line start, moved past the record keyword
+ * @param end Line end
+ */
+inline char recordType(const char*& p, const char* end)
+{
+    p = skipBlanks(p, end);
+    if (end - p < 2 || !isBlank(p[1])) return 0;
+    if (p[0] != 'v' && p[0] != 'f') return 0;
+    char type = p[0];
+    p += 2;
+    return type;
+}
+
+/**
+ * @brief Parse the next number of a vertex line. Values go through float like
+ * tinyobjloader's real_t, so both loaders give the same mesh.
+ * @param p Read position, moved past the number
+ * @param end Line end
+ * @param value Output value
+ * @return true A number was parsed
+ */
+inline bool parseCoord(const char*& p, const char* end, double& value)
+{
+    p = skipBlanks(p, end);
+    if (p < end && *p == '+') p++;
+    std::from_chars_result res = std::from_chars(p, end, value);
+    if (res.ec != std::errc()) return false;
+    p = res.ptr;
+    value = static_cast<double>(static_cast<float>(value));
+    return true;
+}
+
+/**
+ * @brief Go over the face corners of an 'f' line, only the position index of
+ * each v/vt/vn triplet is read
+ * @param p Position after the 'f' keyword
+ * @param end Line end
+ * @param fn Called with each position index as written in the file
+ * @return int Corner count, -1 on a malformed index
+ */
+template <typename Fn>
+inline int forEachCorner(const char* p, const char* end, const Fn& fn)
+{
+    int corners = 0;
+    while (true)
+    {
+        p = skipBlanks(p, end);
+        if (p >= end || *p == '#') break;
+
+        long long idx = 0;
+        std::from_chars_result res = std::from_chars(p, end, idx);
+        if (res.ec != std::errc()) return -1;
+        fn(idx);
+        corners++;
+
+        p = res.ptr;
+        while (p < end && !isBlank(*p)) p++;
+    }
+    return corners;
+}
+
+/**
+ * @brief Print the first error found by any chunk
+ * @return true No chunk failed
+ */
+bool reportChunkErrors(const std::vector<ObjChunk>& chunks)
+{
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        if (!chunks[c].m_error.empty())
+        {
+            std::cerr << "OBJ LOAD ERROR: " << chunks[c].m_error << std::endl;
+            printf("Failed to load/parse .obj\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Call fn(lineBegin, lineEnd) for every line of a chunk
+ */
+template <typename Fn>
+inline void forEachLine(const char* p, const char* end, const Fn& fn)
+{
+    while (p < end)
+    {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!lineEnd) lineEnd = end;
+        fn(p, lineEnd);
+        p = lineEnd + 1;
+    }
+}
+}
+
+/**
+ * @brief Add given vertex to the position arrays
  * @param vertex Eigen::Vector3d point to be added
  */
 void Mesh::addVertex(const Eigen::Vector3d& vertex)
 {
-    m_vertices.push_back(vertex);
+    addVertex(vertex.x(), vertex.y(), vertex.z());
 }
 
 /**
- * @brief Get point data to init Eigen::Vector3d vertex, later to be added in vertices vector
+ * @brief Add vertex from its coordinates, one value per position array
  * Polymorphed function added for readability
  * @param x X axis coord
  * @param y Y axis coord
@@ -19,40 +156,250 @@ void Mesh::addVertex(const Eigen::Vector3d& vertex)
  */
 void Mesh::addVertex(const double x, const double y, const double z)
 {
-    addVertex(Eigen::Vector3d(x, y, z));
+    m_x.push_back(x);
+    m_y.push_back(y);
+    m_z.push_back(z);
 }
 
 /**
- * @brief Add given face to faces vector
- * @param face Face object
+ * @brief Add a triangle to the index buffer. Face id is its position in the buffer.
+ * @param v1 Vertex id 1
+ * @param v2 Vertex id 2
+ * @param v3 Vertex id 3
  */
-void Mesh::addFace(const Face& face)
+void Mesh::addFace(const uint32_t& v1, const uint32_t& v2, const uint32_t& v3)
 {
-    m_faces.push_back(face);
+    m_indices.push_back(v1);
+    m_indices.push_back(v2);
+    m_indices.push_back(v3);
 }
 
 /**
- * @brief Get vertices to init Face objects, later to be added in faces vector
- * Polymorphed function added for readability
+ * @brief Replace every vertex position, e.g. with the next frame of an animated
+ * mesh. Topology stays as is. The views must not point into this mesh.
+ * @param x New x coordinates, one per vertex
+ * @param y New y coordinates, one per vertex
+ * @param z New z coordinates, one per vertex
+ * @return true Positions replaced
+ * @return false Vertex count does not match, nothing changed
+ */
+bool Mesh::setPositions(const ArrayView<double>& x, const ArrayView<double>& y, const ArrayView<double>& z)
+{
+    const size_t vertexCount = getVertexCount();
+    if (x.size() != vertexCount || y.size() != vertexCount || z.size() != vertexCount) return false;
+
+    m_x.owned().assign(x.begin(), x.end());
+    m_y.owned().assign(y.begin(), y.end());
+    m_z.owned().assign(z.begin(), z.end());
+    return true;
+}
+
+/**
+ * @brief Gather the positions of the 3 vertices of a face. A face or vertex id
+ * out of range, which only a corrupt cache file can hold, gives NaN points
+ * that are never closest to anything.
  * @param id Face id
  * @param v1 Point 1
  * @param v2 Point 2
  * @param v3 Point 3
  */
-void Mesh::addFace(const int& id, const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3)
+void Mesh::getFaceVertices(const uint32_t& id, Eigen::Vector3d& v1, Eigen::Vector3d& v2, Eigen::Vector3d& v3) const
+{
+    const size_t vertexCount = m_x.size();
+    const uint32_t* tri = id < getFaceCount() ? &m_indices[3 * id] : NULL;
+    if (!tri || tri[0] >= vertexCount || tri[1] >= vertexCount || tri[2] >= vertexCount)
+    {
+        v1 = v2 = v3 = Eigen::Vector3d::Constant(std::numeric_limits<double>::quiet_NaN());
+        return;
+    }
+    v1 = Eigen::Vector3d(m_x[tri[0]], m_y[tri[0]], m_z[tri[0]]);
+    v2 = Eigen::Vector3d(m_x[tri[1]], m_y[tri[1]], m_z[tri[1]]);
+    v3 = Eigen::Vector3d(m_x[tri[2]], m_y[tri[2]], m_z[tri[2]]);
+}
+
+/**
+ * @brief Reserve storage up front when the final counts are known
+ * @param vertexCount Vertex count
+ * @param faceCount Face count
+ */
+void Mesh::reserve(const size_t& vertexCount, const size_t& faceCount)
+{
+    m_x.reserve(vertexCount);
+    m_y.reserve(vertexCount);
+    m_z.reserve(vertexCount);
+    m_indices.reserve(3 * faceCount);
+}
+
+/**
+ * @brief Drop all vertices and faces
+ */
+void Mesh::clear()
+{
+    m_x.clear();
+    m_y.clear();
+    m_z.clear();
+    m_indices.clear();
+    m_storage.reset();
+}
+
+/**
+ * @brief Read-in .obj file straight into the position arrays and index buffer.
+ * The file is memory mapped and split into line aligned chunks. A first parallel
+ * pass counts 'v' and 'f' records per chunk, so every chunk knows where its
+ * vertices and triangles go; a second parallel pass parses and writes them in
+ * place. Every other record is skipped. Polygons are triangulated as fans.
+ * @param filename Full file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return true Successful .obj load
+ * @return false Fail if can't load .obj
+ */
+bool Mesh::readObj(const char* filename, const int& threadCount)
 {
-    addFace(Face(id, v1, v2, v3));
+    std::cout << "Loading obj file: " << filename << std::endl;
+
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        std::cerr << "OBJ LOAD ERROR: Cannot open file " << filename << std::endl;
+        printf("Failed to load/parse .obj\n");
+        return false;
+    }
+
+    // line aligned chunks, a few per worker so uneven chunks balance out
+    const char* data = file.data();
+    const char* dataEnd = data + file.size();
+    const size_t minChunk = 1 << 20;
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(file.size() / minChunk, 8 * resolveThreadCount(threadCount)));
+    std::vector<ObjChunk> chunks;
+    const char* begin = data;
+    for (size_t i = 1; i <= chunkCount && begin < dataEnd; i++)
+    {
+        const char* end = (i == chunkCount) ? dataEnd : data + file.size() / chunkCount * i;
+        if (end < begin) end = begin;
+        const char* newline = static_cast<const char*>(memchr(end, '\n', dataEnd - end));
+        end = newline ? newline + 1 : dataEnd;
+
+        ObjChunk chunk;
+        chunk.m_begin = begin;
+        chunk.m_end = end;
+        chunk.m_vertexCount = chunk.m_triangleCount = 0;
+        chunk.m_vertexOffset = chunk.m_triangleOffset = 0;
+        chunks.push_back(chunk);
+        begin = end;
+    }
+
+    // counting pass
+    parallelFor(chunks.size(), threadCount, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; c++)
+        {
+            ObjChunk& chunk = chunks[c];
+            forEachLine(chunk.m_begin, chunk.m_end, [&](const char* p, const char* lineEnd) {
+                const char* line = p;
+                char type = recordType(p, lineEnd);
+                if (type == 'v')
+                {
+                    chunk.m_vertexCount++;
+                }
+                else if (type == 'f')
+                {
+                    int corners = forEachCorner(p, lineEnd, [](const long long&) {});
+                    if (corners < 0 && chunk.m_error.empty()) chunk.m_error = "malformed face: " + std::string(line, lineEnd);
+                    if (corners >= 3) chunk.m_triangleCount += corners - 2;
+                }
+            });
+        }
+    }, 1);
+    if (!reportChunkErrors(chunks)) return false;
+
+    size_t vertexCount = 0, triangleCount = 0;
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        chunks[c].m_vertexOffset = vertexCount;
+        chunks[c].m_triangleOffset = triangleCount;
+        vertexCount += chunks[c].m_vertexCount;
+        triangleCount += chunks[c].m_triangleCount;
+    }
+
+    clear();
+    m_x.resize(vertexCount);
+    m_y.resize(vertexCount);
+    m_z.resize(vertexCount);
+    m_indices.resize(3 * triangleCount);
+    double* xs = m_x.owned().data();
+    double* ys = m_y.owned().data();
+    double* zs = m_z.owned().data();
+    uint32_t* indices = m_indices.owned().data();
+
+    // parsing pass, each chunk writes its own range of the mesh buffers
+    parallelFor(chunks.size(), threadCount, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; c++)
+        {
+            ObjChunk& chunk = chunks[c];
+            size_t v = chunk.m_vertexOffset;
+            size_t t = chunk.m_triangleOffset;
+            forEachLine(chunk.m_begin, chunk.m_end, [&](const char* p, const char* lineEnd) {
+                if (!chunk.m_error.empty()) return;
+
+                const char* line = p;
+                char type = recordType(p, lineEnd);
+                if (type == 'v')
+                {
+                    if (!parseCoord(p, lineEnd, xs[v]) || !parseCoord(p, lineEnd, ys[v]) || !parseCoord(p, lineEnd, zs[v]))
+                    {
+                        chunk.m_error = "malformed vertex: " + std::string(line, lineEnd);
+                    }
+                    v++;
+                }
+                else if (type == 'f')
+                {
+                    // v is the count of vertices defined above this line, negative
+                    // indices are relative to it
+                    long long firstCorner = 0, prevCorner = 0;
+                    int corner = 0;
+                    bool valid = true;
+                    forEachCorner(p, lineEnd, [&](const long long& idx) {
+                        long long resolved = idx > 0 ? idx - 1 : static_cast<long long>(v) + idx;
+                        if (idx == 0 || resolved < 0 || resolved >= static_cast<long long>(vertexCount)) valid = false;
+                        if (corner == 0) firstCorner = resolved;
+                        if (corner >= 2 && valid)
+                        {
+                            indices[3*t+0] = static_cast<uint32_t>(firstCorner);
+                            indices[3*t+1] = static_cast<uint32_t>(prevCorner);
+                            indices[3*t+2] = static_cast<uint32_t>(resolved);
+                            t++;
+                        }
+                        prevCorner = resolved;
+                        corner++;
+                    });
+                    if (!valid)
+                    {
+                        chunk.m_error = "face index out of range: " + std::string(line, lineEnd);
+                    }
+                }
+            });
+        }
+    }, 1);
+
+    if (!reportChunkErrors(chunks))
+    {
+        clear();
+        return false;
+    }
+
+    printf("Obj loaded succesfully. Vertex count: %lu. Face count: %lu\n", getVertexCount(), getFaceCount());
+    return true;
 }
 
 /**
- * @brief Read-in .obj file and serialize mesh data in vertices and faces vectors
+ * @brief Read-in .obj file through tinyobjloader and serialize mesh data in
+ * position arrays and index buffer. Single threaded reference for readObj().
  * // https://github.com/tinyobjloader/tinyobjloader/blob/master/loader_example.cc
  * Assuming we are using triangulated mesh.
  * @param filename Full file path
  * @return true Successful .obj load
  * @return false Fail if can't load .obj
  */
-bool Mesh::readObj(const char* filename)
+bool Mesh::readObjTinyObj(const char* filename)
 {
     bool triangulate = true;
     const char* basepath = NULL;
@@ -81,6 +428,14 @@ bool Mesh::readObj(const char* filename)
         return false;
     }
 
+    clear();
+    size_t faceCount = 0;
+    for (size_t i = 0; i < shapes.size(); i++)
+    {
+        faceCount += shapes[i].mesh.num_face_vertices.size();
+    }
+    reserve(attrib.vertices.size()/3, faceCount);
+
     // add each vertex
     for (size_t i = 0; i<attrib.vertices.size()/3; i++)
     {
@@ -101,15 +456,14 @@ bool Mesh::readObj(const char* filename)
             size_t fnum = shapes[i].mesh.num_face_vertices[f];
 
             // assuming faces to be triangles
-            int v1_id = shapes[i].mesh.indices[index_offset + 0].vertex_index;
-            int v2_id = shapes[i].mesh.indices[index_offset + 1].vertex_index;
-            int v3_id = shapes[i].mesh.indices[index_offset + 2].vertex_index;
-
-            addFace(f, getVertex(v1_id), getVertex(v2_id), getVertex(v3_id));
+            addFace(
+                static_cast<uint32_t>(shapes[i].mesh.indices[index_offset + 0].vertex_index),
+                static_cast<uint32_t>(shapes[i].mesh.indices[index_offset + 1].vertex_index),
+                static_cast<uint32_t>(shapes[i].mesh.indices[index_offset + 2].vertex_index));
             index_offset += fnum;
         }
     }
-    printf("Obj loaded succesfully. Vertex count: %lu. Face count: %lu\n", getVertices().size(), getFaces().size());
+    printf("Obj loaded succesfully. Vertex count: %lu. Face count: %lu\n", getVertexCount(), getFaceCount());
     return true;
 
 }
\ No newline at end of file
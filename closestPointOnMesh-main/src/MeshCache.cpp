@@ -0,0 +1,353 @@
+#include "MeshCache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+const char kMagic[8] = {'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H'};
+const uint32_t kEndianCheck = 0x01020304;
+const uint64_t kAlignment = 64;
+const uint64_t kPageAlignment = 64 * 1024;
+
+/**
+ * @brief Round an offset up to the section alignment
+ * @param offset Offset in bytes
+ * @param alignment Alignment, a multiple of kAlignment
+ * @return uint64_t Aligned offset
+ */
+uint64_t alignOffset(const uint64_t& offset, const uint64_t& alignment = kAlignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+/**
+ * @brief Write one section at its offset, zero padding from the current position
+ * @param out Output stream
+ * @param offset Section offset
+ * @param data Section data
+ * @param bytes Section size
+ */
+void writeSection(std::ofstream& out, const uint64_t& offset, const void* data, const uint64_t& bytes)
+{
+    static const char zeros[kAlignment] = {0};
+    uint64_t pos = static_cast<uint64_t>(out.tellp());
+    while (pos < offset)
+    {
+        uint64_t n = std::min<uint64_t>(kAlignment, offset - pos);
+        out.write(zeros, n);
+        pos += n;
+    }
+    if (bytes) out.write(static_cast<const char*>(data), bytes);
+}
+
+/**
+ * @brief Check a section lies inside the mapped file
+ * @param offset Section offset
+ * @param bytes Section size
+ * @param fileSize File size
+ * @return true Section is in bounds and aligned
+ */
+bool sectionFits(const uint64_t& offset, const uint64_t& bytes, const uint64_t& fileSize)
+{
+    return offset % kAlignment == 0 && offset <= fileSize && bytes <= fileSize - offset;
+}
+
+/**
+ * @brief Write a file to disk and drop it from the page cache. Pages cached
+ * by writing are in large chunks, and a mapping then brings in a whole chunk
+ * per page fault; read back on demand they come in small pages.
+ * @param path File path
+ */
+void dropFromPageCache(const std::string& path)
+{
+#ifndef _WIN32
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+#endif
+}
+
+/**
+ * @brief Map a cache file and check its header was written by a compatible
+ * build
+ * @param cacheFile Cache file path
+ * @param file Mapping to open
+ * @param header Output header
+ * @return true Header is valid
+ */
+bool openCache(const std::string& cacheFile, MappedFile& file, MeshCacheHeader& header)
+{
+    if (!file.open(cacheFile.c_str())) return false;
+    if (file.size() < sizeof(MeshCacheHeader)) return false;
+
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.m_magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.m_version != MeshCache::kVersion ||
+        header.m_endianCheck != kEndianCheck ||
+        header.m_nodeSize != sizeof(BVHNode) ||
+        header.m_blockSize != sizeof(TriangleBlock) ||
+        header.m_treeNodeSize != sizeof(OutOfCoreNode) ||
+        header.m_treeBlockSize != sizeof(OutOfCoreBlock))
+    {
+        printf("Mesh cache %s is from an incompatible build, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+    return true;
+}
+}
+
+/**
+ * @brief Cache file path for an .obj, written next to it
+ * @param objFile .obj file path
+ * @return std::string Cache file path
+ */
+std::string MeshCache::pathFor(const char* objFile)
+{
+    return std::string(objFile) + ".meshcache";
+}
+
+/**
+ * @brief Check the cache exists and is newer than the .obj it was made from
+ * @param objFile .obj file path
+ * @param cacheFile Cache file path
+ * @return true Cache can be used
+ */
+bool MeshCache::isFresh(const char* objFile, const std::string& cacheFile)
+{
+    std::error_code ec;
+    std::filesystem::file_time_type objTime = std::filesystem::last_write_time(objFile, ec);
+    if (ec) return false;
+    std::filesystem::file_time_type cacheTime = std::filesystem::last_write_time(cacheFile, ec);
+    if (ec) return false;
+    return cacheTime > objTime;
+}
+
+/**
+ * @brief Write mesh and optionally BVH and out of core tree to a cache file.
+ * Written to a temp file first and renamed, so a reader never maps a half
+ * written cache.
+ * @param cacheFile Cache file path
+ * @param mesh Mesh object
+ * @param bvh Built BVH of the mesh, NULL to cache the mesh only
+ * @param tree Out of core tree of the mesh, NULL to leave it out
+ * @return true Successful write
+ * @return false Fail if the file can't be written
+ */
+bool MeshCache::write(const std::string& cacheFile, const Mesh& mesh, const BVH* bvh, const OutOfCoreBVH* tree)
+{
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.m_magic, kMagic, sizeof(kMagic));
+    header.m_version = kVersion;
+    header.m_endianCheck = kEndianCheck;
+    header.m_nodeSize = sizeof(BVHNode);
+    header.m_blockSize = sizeof(TriangleBlock);
+    header.m_treeNodeSize = sizeof(OutOfCoreNode);
+    header.m_treeBlockSize = sizeof(OutOfCoreBlock);
+    header.m_vertexCount = mesh.getVertexCount();
+    header.m_faceCount = mesh.getFaceCount();
+
+    const bool withBVH = bvh && !bvh->empty();
+    if (withBVH)
+    {
+        header.m_flags |= kHasBVH;
+        if (bvh->m_linear) header.m_flags |= kLinearBVH;
+        header.m_leafSize = bvh->m_leafSize;
+        header.m_nodeCount = bvh->m_nodes.size();
+        header.m_slotCount = bvh->m_faceIndices.size();
+        header.m_blockCount = bvh->m_blocks.size();
+    }
+    const bool withTree = tree && !tree->empty();
+    if (withTree)
+    {
+        header.m_flags |= kHasTree;
+        if (tree->m_linear) header.m_flags |= kLinearTree;
+        for (int axis = 0; axis < 3; axis++) header.m_treeOrigin[axis] = tree->m_origin[axis];
+        header.m_treeNodeCount = tree->m_nodes.size();
+        header.m_treeBlockCount = tree->m_blocks.size();
+    }
+
+    const uint64_t posBytes = header.m_vertexCount * sizeof(double);
+    header.m_xOffset = alignOffset(sizeof(header));
+    header.m_yOffset = alignOffset(header.m_xOffset + posBytes);
+    header.m_zOffset = alignOffset(header.m_yOffset + posBytes);
+    header.m_indexOffset = alignOffset(header.m_zOffset + posBytes);
+    header.m_nodeOffset = alignOffset(header.m_indexOffset + 3 * header.m_faceCount * sizeof(uint32_t));
+    header.m_slotOffset = alignOffset(header.m_nodeOffset + header.m_nodeCount * sizeof(BVHNode));
+    header.m_blockOffset = alignOffset(header.m_slotOffset + header.m_slotCount * sizeof(int));
+    // page aligned, so releasing tree pages never drops a page of another section
+    header.m_treeNodeOffset = alignOffset(header.m_blockOffset + header.m_blockCount * sizeof(TriangleBlock), kPageAlignment);
+    header.m_treeBlockOffset = alignOffset(header.m_treeNodeOffset + header.m_treeNodeCount * sizeof(OutOfCoreNode), kPageAlignment);
+
+    std::string tmpFile = cacheFile + ".tmp";
+    {
+        std::ofstream out(tmpFile.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+
+        writeSection(out, 0, &header, sizeof(header));
+        writeSection(out, header.m_xOffset, mesh.m_x.data(), posBytes);
+        writeSection(out, header.m_yOffset, mesh.m_y.data(), posBytes);
+        writeSection(out, header.m_zOffset, mesh.m_z.data(), posBytes);
+        writeSection(out, header.m_indexOffset, mesh.m_indices.data(), 3 * header.m_faceCount * sizeof(uint32_t));
+        if (withBVH)
+        {
+            writeSection(out, header.m_nodeOffset, bvh->m_nodes.data(), header.m_nodeCount * sizeof(BVHNode));
+            writeSection(out, header.m_slotOffset, bvh->m_faceIndices.data(), header.m_slotCount * sizeof(int));
+            writeSection(out, header.m_blockOffset, bvh->m_blocks.data(), header.m_blockCount * sizeof(TriangleBlock));
+        }
+        if (withTree)
+        {
+            writeSection(out, header.m_treeNodeOffset, tree->m_nodes.data(), header.m_treeNodeCount * sizeof(OutOfCoreNode));
+            writeSection(out, header.m_treeBlockOffset, tree->m_blocks.data(), header.m_treeBlockCount * sizeof(OutOfCoreBlock));
+        }
+        if (!out)
+        {
+            out.close();
+            std::remove(tmpFile.c_str());
+            return false;
+        }
+    }
+    // the out of core tree is meant to be read a few pages at a time
+    if (withTree) dropFromPageCache(tmpFile);
+
+    std::remove(cacheFile.c_str());
+    if (std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0)
+    {
+        std::remove(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Map a cache file and point the mesh (and BVH if cached and requested)
+ * at its sections. Mesh and BVH keep the mapping alive.
+ * @param cacheFile Cache file path
+ * @param mesh Mesh object to fill
+ * @param bvh BVH to fill, NULL to skip. Left empty if the cache holds no BVH.
+ * @return true Successful load
+ * @return false Missing, truncated, or written by an incompatible build
+ */
+bool MeshCache::read(const std::string& cacheFile, Mesh& mesh, BVH* bvh)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    MeshCacheHeader header;
+    if (!openCache(cacheFile, *file, header)) return false;
+
+    const uint64_t size = file->size();
+    const uint64_t posBytes = header.m_vertexCount * sizeof(double);
+    if (!sectionFits(header.m_xOffset, posBytes, size) ||
+        !sectionFits(header.m_yOffset, posBytes, size) ||
+        !sectionFits(header.m_zOffset, posBytes, size) ||
+        !sectionFits(header.m_indexOffset, 3 * header.m_faceCount * sizeof(uint32_t), size))
+    {
+        printf("Mesh cache %s is truncated, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+
+    const bool withBVH = bvh && (header.m_flags & kHasBVH);
+    if (withBVH &&
+        (!sectionFits(header.m_nodeOffset, header.m_nodeCount * sizeof(BVHNode), size) ||
+         !sectionFits(header.m_slotOffset, header.m_slotCount * sizeof(int), size) ||
+         !sectionFits(header.m_blockOffset, header.m_blockCount * sizeof(TriangleBlock), size)))
+    {
+        printf("Mesh cache %s is truncated, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+
+    // only the header is checked here, reading the sections would page all of
+    // them in; indices and nodes are checked as they are used (see
+    // Mesh::getFaceVertices() and BVH::hasChildren())
+    const char* base = file->data();
+    const uint64_t maxInt = static_cast<uint64_t>(std::numeric_limits<int>::max());
+    if (header.m_vertexCount > std::numeric_limits<uint32_t>::max() || header.m_faceCount > maxInt ||
+        (withBVH && (header.m_nodeCount == 0 || header.m_nodeCount > maxInt || header.m_slotCount > maxInt ||
+                     header.m_slotCount != header.m_blockCount * kTriangleBlockSize || header.m_leafSize <= 0)))
+    {
+        printf("Mesh cache %s is corrupt, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+
+    mesh.clear();
+    mesh.m_x.borrow(reinterpret_cast<const double*>(base + header.m_xOffset), header.m_vertexCount);
+    mesh.m_y.borrow(reinterpret_cast<const double*>(base + header.m_yOffset), header.m_vertexCount);
+    mesh.m_z.borrow(reinterpret_cast<const double*>(base + header.m_zOffset), header.m_vertexCount);
+    mesh.m_indices.borrow(reinterpret_cast<const uint32_t*>(base + header.m_indexOffset), 3 * header.m_faceCount);
+    mesh.m_storage = file;
+
+    if (bvh)
+    {
+        bvh->m_nodes.clear();
+        bvh->m_faceIndices.clear();
+        bvh->m_blocks.clear();
+        bvh->m_storage.reset();
+        bvh->m_buildCost = 0.0;
+        bvh->m_faceCount = 0;
+        bvh->m_linear = false;
+    }
+    if (withBVH)
+    {
+        bvh->m_leafSize = header.m_leafSize;
+        bvh->m_faceCount = static_cast<int>(header.m_faceCount);
+        bvh->m_linear = (header.m_flags & kLinearBVH) != 0;
+        bvh->m_nodes.borrow(reinterpret_cast<const BVHNode*>(base + header.m_nodeOffset), header.m_nodeCount);
+        bvh->m_faceIndices.borrow(reinterpret_cast<const int*>(base + header.m_slotOffset), header.m_slotCount);
+        bvh->m_blocks.borrow(reinterpret_cast<const TriangleBlock*>(base + header.m_blockOffset), header.m_blockCount);
+        bvh->m_storage = file;
+    }
+    return true;
+}
+
+/**
+ * @brief Map a cache file and point an out of core tree at its sections. Only
+ * the tree is read, the mesh and BVH sections stay on disk. The tree keeps the
+ * mapping alive.
+ * @param cacheFile Cache file path
+ * @param tree Tree to fill
+ * @return true Successful load
+ * @return false Missing, truncated, without a tree or written by an
+ * incompatible build
+ */
+bool MeshCache::readTree(const std::string& cacheFile, OutOfCoreBVH& tree)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    MeshCacheHeader header;
+    if (!openCache(cacheFile, *file, header)) return false;
+    if (!(header.m_flags & kHasTree)) return false;
+
+    const uint64_t size = file->size();
+    if (!sectionFits(header.m_treeNodeOffset, header.m_treeNodeCount * sizeof(OutOfCoreNode), size) ||
+        !sectionFits(header.m_treeBlockOffset, header.m_treeBlockCount * sizeof(OutOfCoreBlock), size))
+    {
+        printf("Mesh cache %s is truncated, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+
+    const char* base = file->data();
+    // node and block indices are checked as the tree is walked, see
+    // OutOfCoreBVH::query(); reading every node here would page in the whole tree
+    if (header.m_treeNodeCount > static_cast<uint64_t>(std::numeric_limits<int32_t>::max()) ||
+        header.m_treeBlockCount > static_cast<uint64_t>(std::numeric_limits<int32_t>::max()))
+    {
+        printf("Mesh cache %s is corrupt, ignoring it\n", cacheFile.c_str());
+        return false;
+    }
+
+    tree.m_linear = (header.m_flags & kLinearTree) != 0;
+    tree.m_origin = Eigen::Vector3d(header.m_treeOrigin[0], header.m_treeOrigin[1], header.m_treeOrigin[2]);
+    tree.m_nodes.borrow(reinterpret_cast<const OutOfCoreNode*>(base + header.m_treeNodeOffset), header.m_treeNodeCount);
+    tree.m_blocks.borrow(reinterpret_cast<const OutOfCoreBlock*>(base + header.m_treeBlockOffset), header.m_treeBlockCount);
+    tree.m_storage = file;
+    file->adviseRandom(tree.m_nodes.data(), header.m_treeNodeCount * sizeof(OutOfCoreNode));
+    file->adviseRandom(tree.m_blocks.data(), header.m_treeBlockCount * sizeof(OutOfCoreBlock));
+    return true;
+}
@@ -0,0 +1,307 @@
+#include "MeshCleanup.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+/**
+ * @brief GridEntry struct; a vertex and the hash of the grid cell it is in
+ */
+struct GridEntry
+{
+public:
+    uint64_t m_key;
+    uint32_t m_vertex;
+
+    inline bool operator<(const GridEntry& other) const {return m_key != other.m_key ? m_key < other.m_key : m_vertex < other.m_vertex;};
+};
+
+/**
+ * @brief FaceKey struct; the sorted vertex ids of a face and its orientation,
+ * to find faces that repeat an earlier one. Rotated to start at the smallest
+ * id a face is (v0, v1, v2) or (v0, v2, v1) with v1 < v2; the second is the
+ * reversed one.
+ */
+struct FaceKey
+{
+public:
+    uint32_t m_v[3];
+    uint32_t m_reversed;
+    uint32_t m_face;
+
+    inline bool sameVertices(const FaceKey& other) const {return m_v[0] == other.m_v[0] && m_v[1] == other.m_v[1] && m_v[2] == other.m_v[2];};
+    inline bool sameFace(const FaceKey& other) const {return sameVertices(other) && m_reversed == other.m_reversed;};
+    inline bool operator<(const FaceKey& other) const
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (m_v[i] != other.m_v[i]) return m_v[i] < other.m_v[i];
+        }
+        if (m_reversed != other.m_reversed) return m_reversed < other.m_reversed;
+        return m_face < other.m_face;
+    };
+};
+
+/**
+ * @brief CellRange struct; hash table slot, the range of the sorted grid one
+ * cell hash covers. Empty slots have an empty range.
+ */
+struct CellRange
+{
+public:
+    uint64_t m_key;
+    uint32_t m_begin, m_end;
+};
+
+/**
+ * @brief Hash of integer cell coordinates
+ */
+inline uint64_t cellHash(const int64_t& i, const int64_t& j, const int64_t& k)
+{
+    uint64_t h = static_cast<uint64_t>(i) * 0x9e3779b97f4a7c15ull;
+    h ^= static_cast<uint64_t>(j) * 0xc2b2ae3d27d4eb4full + (h << 6) + (h >> 2);
+    h ^= static_cast<uint64_t>(k) * 0x165667b19e3779f9ull + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return h ^ (h >> 29);
+}
+
+/**
+ * @brief Cell coordinate of a value. With a tolerance the grid has cells of
+ * that size; without one every distinct value is its own cell, so only exact
+ * duplicates share one. -0 and 0 are the same value.
+ */
+inline int64_t cellCoord(const double& value, const double& tolerance)
+{
+    if (tolerance > 0.0) return static_cast<int64_t>(std::floor(value / tolerance));
+    const double normalized = value + 0.0;
+    int64_t bits;
+    memcpy(&bits, &normalized, sizeof(bits));
+    return bits;
+}
+}
+
+const uint32_t MeshCleanup::kRemoved;
+
+/**
+ * @brief Construct a new Mesh Cleanup:: Mesh Cleanup object, nothing run yet
+ */
+MeshCleanup::MeshCleanup()
+{
+    memset(&m_report, 0, sizeof(m_report));
+}
+
+/**
+ * @brief Weld vertices within a tolerance and drop degenerate faces, duplicate
+ * faces and unused vertices, replacing the mesh with the cleaned one. Kept
+ * vertices keep their position and kept faces their order and orientation.
+ * @param mesh Mesh to clean, e.g. right after readObj()
+ * @param tolerance Weld distance and smallest face height, 0 for exact
+ * duplicates and zero area faces only
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return true Mesh cleaned
+ * @return false Negative tolerance, mesh left as is
+ */
+bool MeshCleanup::run(Mesh& mesh, const double& tolerance, const int& threadCount)
+{
+    if (!(tolerance >= 0.0))
+    {
+        printf("Weld tolerance has to be 0 or more\n");
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const size_t vertexCount = mesh.getVertexCount();
+    const size_t faceCount = mesh.getFaceCount();
+    const ArrayView<double> x = mesh.getX(), y = mesh.getY(), z = mesh.getZ();
+    const ArrayView<uint32_t> indices = mesh.getIndices();
+    const double toleranceSq = tolerance * tolerance;
+
+    // hash grid: vertices sorted by cell, so a cell is one range of the array
+    std::vector<GridEntry> grid(vertexCount);
+    parallelFor(vertexCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++)
+        {
+            grid[v].m_key = cellHash(cellCoord(x[v], tolerance), cellCoord(y[v], tolerance), cellCoord(z[v], tolerance));
+            grid[v].m_vertex = static_cast<uint32_t>(v);
+        }
+    }, 4096);
+    std::sort(grid.begin(), grid.end());
+
+    // open addressing table from cell hash to its range, at most half full
+    size_t tableSize = 16;
+    while (tableSize < 2 * vertexCount) tableSize *= 2;
+    const size_t tableMask = tableSize - 1;
+    std::vector<CellRange> table(tableSize, CellRange{0, 0, 0});
+    for (size_t begin = 0, end; begin < vertexCount; begin = end)
+    {
+        for (end = begin + 1; end < vertexCount && grid[end].m_key == grid[begin].m_key; end++) {}
+        size_t slot = grid[begin].m_key & tableMask;
+        while (table[slot].m_end != 0) slot = (slot + 1) & tableMask;
+        table[slot] = CellRange{grid[begin].m_key, static_cast<uint32_t>(begin), static_cast<uint32_t>(end)};
+    }
+
+    // lowest vertex within the tolerance, never above the vertex itself;
+    // cells that share a hash only cost a few extra distance tests
+    std::vector<uint32_t> representative(vertexCount);
+    const int reach = tolerance > 0.0 ? 1 : 0;
+    parallelFor(vertexCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++)
+        {
+            uint32_t best = static_cast<uint32_t>(v);
+            const int64_t ci = cellCoord(x[v], tolerance), cj = cellCoord(y[v], tolerance), ck = cellCoord(z[v], tolerance);
+            for (int di = -reach; di <= reach; di++)
+            {
+                for (int dj = -reach; dj <= reach; dj++)
+                {
+                    for (int dk = -reach; dk <= reach; dk++)
+                    {
+                        const uint64_t key = cellHash(ci + di, cj + dj, ck + dk);
+                        size_t slot = key & tableMask;
+                        while (table[slot].m_end != 0 && table[slot].m_key != key) slot = (slot + 1) & tableMask;
+                        for (uint32_t i = table[slot].m_begin; i < table[slot].m_end && grid[i].m_vertex < best; i++)
+                        {
+                            const uint32_t w = grid[i].m_vertex;
+                            const double dx = x[w] - x[v], dy = y[w] - y[v], dz = z[w] - z[v];
+                            if (dx*dx + dy*dy + dz*dz <= toleranceSq)
+                            {
+                                best = w;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+            representative[v] = best;
+        }
+    }, 1024);
+
+    // representatives are lower ids, so one pass in id order resolves chains
+    size_t weldedCount = 0;
+    for (size_t v = 0; v < vertexCount; v++)
+    {
+        representative[v] = representative[representative[v]];
+        if (representative[v] != v) weldedCount++;
+    }
+
+    // 0 kept, 1 degenerate, 2 duplicate
+    std::vector<char> faceState(faceCount, 0);
+    std::vector<FaceKey> keys(faceCount);
+    parallelFor(faceCount, threadCount, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++)
+        {
+            uint32_t v[3];
+            for (int c = 0; c < 3; c++) v[c] = representative[indices[3 * f + c]];
+            FaceKey& key = keys[f];
+            memcpy(key.m_v, v, sizeof(v));
+            std::sort(key.m_v, key.m_v + 3);
+            const int first = static_cast<int>(std::min_element(v, v + 3) - v);
+            key.m_reversed = v[(first + 1) % 3] > v[(first + 2) % 3];
+            key.m_face = static_cast<uint32_t>(f);
+            if (key.m_v[0] == key.m_v[1] || key.m_v[1] == key.m_v[2])
+            {
+                faceState[f] = 1;
+                continue;
+            }
+
+            // height over the longest edge, |e0 x e1| / |longest edge|
+            const Eigen::Vector3d a(x[v[0]], y[v[0]], z[v[0]]), b(x[v[1]], y[v[1]], z[v[1]]), c(x[v[2]], y[v[2]], z[v[2]]);
+            const double areaSq = (b - a).cross(c - a).squaredNorm();
+            const double longestSq = std::max((b - a).squaredNorm(), std::max((c - b).squaredNorm(), (a - c).squaredNorm()));
+            if (areaSq <= toleranceSq * longestSq) faceState[f] = 1;
+        }
+    }, 4096);
+
+    // the first face of every vertex set and orientation stays; a face and its
+    // reverse both stay, they are the two sides of a thin sheet, and are
+    // only counted
+    std::vector<FaceKey> sortedKeys;
+    sortedKeys.reserve(faceCount);
+    for (size_t f = 0; f < faceCount; f++)
+    {
+        if (faceState[f] == 0) sortedKeys.push_back(keys[f]);
+    }
+    std::sort(sortedKeys.begin(), sortedKeys.end());
+    size_t reversedCount = 0;
+    for (size_t i = 1; i < sortedKeys.size(); i++)
+    {
+        if (sortedKeys[i].sameFace(sortedKeys[i - 1])) faceState[sortedKeys[i].m_face] = 2;
+        else if (sortedKeys[i].sameVertices(sortedKeys[i - 1])) reversedCount++;
+    }
+
+    // number the vertices kept faces use, in their original order
+    std::vector<uint32_t> newId(vertexCount, kRemoved);
+    m_originalFaces.clear();
+    size_t degenerateCount = 0, duplicateCount = 0;
+    for (size_t f = 0; f < faceCount; f++)
+    {
+        if (faceState[f] == 1) degenerateCount++;
+        if (faceState[f] == 2) duplicateCount++;
+        if (faceState[f] != 0) continue;
+        m_originalFaces.push_back(static_cast<uint32_t>(f));
+        for (int c = 0; c < 3; c++) newId[representative[indices[3 * f + c]]] = 0;
+    }
+    m_originalVertices.clear();
+    for (size_t v = 0; v < vertexCount; v++)
+    {
+        if (newId[v] == kRemoved) continue;
+        newId[v] = static_cast<uint32_t>(m_originalVertices.size());
+        m_originalVertices.push_back(static_cast<uint32_t>(v));
+    }
+    m_vertexMap.resize(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++)
+    {
+        m_vertexMap[v] = newId[representative[v]];
+    }
+
+    // gather before clearing, the views may point into the mesh
+    std::vector<double> cleanX(m_originalVertices.size()), cleanY(m_originalVertices.size()), cleanZ(m_originalVertices.size());
+    for (size_t i = 0; i < m_originalVertices.size(); i++)
+    {
+        const uint32_t v = m_originalVertices[i];
+        cleanX[i] = x[v];
+        cleanY[i] = y[v];
+        cleanZ[i] = z[v];
+    }
+    std::vector<uint32_t> cleanIndices(3 * m_originalFaces.size());
+    for (size_t i = 0; i < m_originalFaces.size(); i++)
+    {
+        for (int c = 0; c < 3; c++) cleanIndices[3 * i + c] = m_vertexMap[indices[3 * m_originalFaces[i] + c]];
+    }
+
+    mesh.clear();
+    mesh.reserve(cleanX.size(), m_originalFaces.size());
+    for (size_t i = 0; i < cleanX.size(); i++)
+    {
+        mesh.addVertex(cleanX[i], cleanY[i], cleanZ[i]);
+    }
+    for (size_t i = 0; i < m_originalFaces.size(); i++)
+    {
+        mesh.addFace(cleanIndices[3 * i], cleanIndices[3 * i + 1], cleanIndices[3 * i + 2]);
+    }
+
+    m_report.m_inputVertices = vertexCount;
+    m_report.m_inputFaces = faceCount;
+    m_report.m_outputVertices = mesh.getVertexCount();
+    m_report.m_outputFaces = mesh.getFaceCount();
+    m_report.m_weldedVertices = weldedCount;
+    m_report.m_unusedVertices = vertexCount - weldedCount - mesh.getVertexCount();
+    m_report.m_degenerateFaces = degenerateCount;
+    m_report.m_duplicateFaces = duplicateCount;
+    m_report.m_reversedPairs = reversedCount;
+    m_report.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+/**
+ * @brief Print what the last run() removed
+ */
+void MeshCleanup::printReport() const
+{
+    printf("Mesh cleanup: vertices %lu -> %lu (%lu welded, %lu unused), faces %lu -> %lu (%lu degenerate, %lu duplicate, %lu reversed pairs kept) in %.3f s\n",
+           m_report.m_inputVertices, m_report.m_outputVertices, m_report.m_weldedVertices, m_report.m_unusedVertices,
+           m_report.m_inputFaces, m_report.m_outputFaces, m_report.m_degenerateFaces, m_report.m_duplicateFaces, m_report.m_reversedPairs, m_report.m_seconds);
+}
@@ -0,0 +1,245 @@
+#include "PointQuery.h"
+#include "Parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+/**
+ * @brief Pack a non negative distance and a vertex id into one word that
+ * compares like the distance, so the running maximum of several workers can be
+ * kept in a single atomic
+ * @param dist Distance, not negative
+ * @param vertexId Vertex at that distance
+ * @return uint64_t Packed value
+ */
+inline uint64_t packDistance(const float& dist, const uint32_t& vertexId)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &dist, sizeof(bits));
+    return (static_cast<uint64_t>(bits) << 32) | vertexId;
+}
+
+/**
+ * @brief Distance half of packDistance()
+ * @param packed Packed value
+ * @return float Distance
+ */
+inline float unpackDistance(const uint64_t& packed)
+{
+    uint32_t bits = static_cast<uint32_t>(packed >> 32);
+    float dist;
+    std::memcpy(&dist, &bits, sizeof(dist));
+    return dist;
+}
+}
+
+/**
+ * @brief Unsigned distance from a point to the surface. Unlike query() a face
+ * passing through the query point counts, at distance 0, and no closest point
+ * is kept, only the distance. The walk ends as soon as the distance drops to
+ * stopDist, for callers that only need to know whether it is larger.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param stopDist Stop once the distance is at most this, 0 for the exact distance
+ * @param context Scratch memory of the calling thread
+ * @return float Distance, maxDist if nothing is closer; at most stopDist if
+ * the walk ended early
+ */
+float PointQuery::surfaceDistance(const Eigen::Vector3d& queryPoint, const float& maxDist, const float& stopDist, QueryContext& context) const
+{
+    const double slack = 1.0 + 1e-5;
+    float bestDist = maxDist;
+
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_bvh.empty()) stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(0))};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > static_cast<double>(bestDist) * bestDist * slack) continue;
+
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+        if (node.isLeaf())
+        {
+            if (!m_bvh.hasSlots(node)) continue;
+            const int slotEnd = node.m_left + node.m_count;
+            for (int slot = node.m_left, lanes; slot < slotEnd; slot += lanes)
+            {
+                lanes = closestPointsOnBlocks(&m_bvh.getBlock(slot / kTriangleBlockSize), slotEnd - slot, queryPoint, context.m_px, context.m_py, context.m_pz, context.m_dist);
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    if (m_bvh.getFaceIndex(slot + lane) < 0) continue;
+                    bestDist = std::min(bestDist, context.m_dist[lane]);
+                }
+            }
+            if (bestDist <= stopDist) return bestDist;
+            continue;
+        }
+
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        double distL = BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left));
+        double distR = BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left + 1));
+        if (distL < distR)
+        {
+            stack[stackSize++] = {node.m_left + 1, distR};
+            stack[stackSize++] = {node.m_left, distL};
+        }
+        else
+        {
+            stack[stackSize++] = {node.m_left, distL};
+            stack[stackSize++] = {node.m_left + 1, distR};
+        }
+    }
+    return bestDist;
+}
+
+/**
+ * @brief Distance from every vertex of another mesh to this surface, in
+ * parallel, plus the one sided Hausdorff distance (the largest of them) and
+ * their mean and root mean square. Sums are combined in chunk order, so the
+ * result does not depend on the thread count.
+ * @param from Mesh whose vertices are measured
+ * @param errors Output distance per vertex of from
+ * @param stats Output summary
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return true Success
+ * @return false This mesh has no faces to measure against
+ */
+bool PointQuery::vertexDistances(const Mesh& from, std::vector<float>& errors, MeshDistanceStats& stats, const int& threadCount) const
+{
+    stats.m_max = 0.0f;
+    stats.m_maxVertex = -1;
+    stats.m_mean = 0.0;
+    stats.m_rms = 0.0;
+    if (m_bvh.empty()) return false;
+
+    const size_t vertexCount = from.getVertexCount();
+    errors.resize(vertexCount);
+    const size_t grain = 1024;
+    const size_t chunkCount = (vertexCount + grain - 1) / grain;
+    std::vector<double> sums(chunkCount, 0.0), squareSums(chunkCount, 0.0);
+    parallelFor(vertexCount, threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        const size_t chunk = begin / grain;
+        for (size_t i = begin; i < end; i++)
+        {
+            errors[i] = surfaceDistance(from.getVertex(static_cast<uint32_t>(i)), std::numeric_limits<float>::max(), 0.0f, context);
+            sums[chunk] += errors[i];
+            squareSums[chunk] += static_cast<double>(errors[i]) * errors[i];
+        }
+    }, grain);
+
+    double sum = 0.0, squareSum = 0.0;
+    for (size_t c = 0; c < chunkCount; c++)
+    {
+        sum += sums[c];
+        squareSum += squareSums[c];
+    }
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        if (stats.m_maxVertex < 0 || errors[i] > stats.m_max)
+        {
+            stats.m_max = errors[i];
+            stats.m_maxVertex = static_cast<int>(i);
+        }
+    }
+    if (vertexCount > 0)
+    {
+        stats.m_mean = sum / vertexCount;
+        stats.m_rms = std::sqrt(squareSum / vertexCount);
+    }
+    return true;
+}
+
+/**
+ * @brief One sided Hausdorff distance from the vertices of another mesh to this
+ * surface, without measuring every vertex. The other mesh's vertex k-d tree is
+ * walked by several workers sharing the largest distance found so far. No
+ * vertex of a node is further from this surface than the node's center plus its
+ * radius, so a node whose bound does not exceed the current maximum is skipped
+ * whole; that test itself stops early once the center is close enough. The
+ * vertex distances stop early the same way, once they can't raise the maximum.
+ * Gives the same distance as vertexDistances().
+ * @param from Query object of the mesh whose vertices are measured
+ * @param maxVertex Output vertex of from at the returned distance, one of them
+ * on ties; -1 without vertices or faces
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return float Largest vertex distance, 0 without vertices or faces
+ */
+float PointQuery::hausdorffDistance(const PointQuery& from, int& maxVertex, const int& threadCount) const
+{
+    maxVertex = -1;
+    const KdTree& tree = from.getVertexTree();
+    if (tree.empty() || m_bvh.empty()) return 0.0f;
+
+    // split the top of the tree into enough subtrees to keep every worker busy
+    const size_t target = 16 * static_cast<size_t>(resolveThreadCount(threadCount));
+    std::vector<int> frontier(1, 0), next;
+    bool split = true;
+    while (split && frontier.size() < target)
+    {
+        split = false;
+        next.clear();
+        for (size_t i = 0; i < frontier.size(); i++)
+        {
+            const BVHNode& node = tree.getNode(frontier[i]);
+            if (node.isLeaf())
+            {
+                next.push_back(frontier[i]);
+                continue;
+            }
+            next.push_back(node.m_left);
+            next.push_back(node.m_left + 1);
+            split = true;
+        }
+        frontier.swap(next);
+    }
+
+    // node bounds are compared against float distances, keep a little slack
+    const double slack = 1.0 + 1e-5;
+    std::atomic<uint64_t> best(packDistance(0.0f, tree.getVertexId(tree.getNode(frontier[0]).m_left)));
+    parallelFor(frontier.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        int stack[2 * KdTree::kMaxDepth + 2];
+        for (size_t f = begin; f < end; f++)
+        {
+            int stackSize = 0;
+            stack[stackSize++] = frontier[f];
+            while (stackSize > 0)
+            {
+                const BVHNode& node = tree.getNode(stack[--stackSize]);
+                const double current = unpackDistance(best.load());
+                const Eigen::Vector3d center = 0.5 * (node.m_min + node.m_max);
+                const double radius = 0.5 * (node.m_max - node.m_min).norm();
+                const float stop = static_cast<float>((current - radius) / slack);
+                const float centerDist = surfaceDistance(center, std::numeric_limits<float>::max(), stop, context);
+                if (centerDist * slack + radius <= current) continue;
+
+                if (!node.isLeaf())
+                {
+                    stack[stackSize++] = node.m_left + 1;
+                    stack[stackSize++] = node.m_left;
+                    continue;
+                }
+
+                for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+                {
+                    uint64_t packed = best.load();
+                    const float dist = surfaceDistance(tree.getPoint(slot), std::numeric_limits<float>::max(), unpackDistance(packed), context);
+                    while (dist > unpackDistance(packed) && !best.compare_exchange_weak(packed, packDistance(dist, tree.getVertexId(slot))))
+                    {
+                    }
+                }
+            }
+        }
+    }, 1);
+
+    const uint64_t packed = best.load();
+    maxVertex = static_cast<int>(packed & 0xffffffffu);
+    return unpackDistance(packed);
+}
@@ -0,0 +1,362 @@
+#include "OutOfCoreBVH.h"
+#include <cmath>
+#include <limits>
+
+namespace
+{
+/**
+ * @brief Round a double to the nearest float not above it
+ */
+inline float roundDown(const double& x)
+{
+    float r = static_cast<float>(x);
+    return static_cast<double>(r) > x ? std::nextafter(r, -std::numeric_limits<float>::infinity()) : r;
+}
+
+/**
+ * @brief Round a double to the nearest float not below it
+ */
+inline float roundUp(const double& x)
+{
+    float r = static_cast<float>(x);
+    return static_cast<double>(r) < x ? std::nextafter(r, std::numeric_limits<float>::infinity()) : r;
+}
+
+/**
+ * @brief Append the top levels of a subtree to a van Emde Boas order: the
+ * upper half of its levels first, recursively, then each subtree below them,
+ * recursively
+ * @param bvh Tree
+ * @param levels Levels of every subtree, 1 for a leaf
+ * @param root Subtree root
+ * @param depth Levels to lay out, from the root down
+ * @param order Output node order, appended to
+ * @param below Output roots of the subtrees under the laid out levels, appended to
+ */
+void layoutVanEmdeBoas(const BVH& bvh, const std::vector<int>& levels, const int& root, const int& depth, std::vector<int>& order, std::vector<int>& below)
+{
+    const int height = std::min(depth, levels[root]);
+    const BVHNode& node = bvh.getNode(root);
+    if (height == 1)
+    {
+        order.push_back(root);
+        if (bvh.hasChildren(root, node))
+        {
+            below.push_back(node.m_left);
+            below.push_back(node.m_left + 1);
+        }
+        return;
+    }
+
+    const int top = height / 2;
+    std::vector<int> middle;
+    layoutVanEmdeBoas(bvh, levels, root, top, order, middle);
+    for (size_t i = 0; i < middle.size(); i++)
+    {
+        layoutVanEmdeBoas(bvh, levels, middle[i], height - top, order, below);
+    }
+}
+}
+
+/**
+ * @brief Lay a BVH and the triangles of its leaves out in van Emde Boas order.
+ * Bounds and triangles are relative to the center of the root bounds like in
+ * the ClosestPointEngine, bounds grown by the same tolerance before rounding
+ * them to float.
+ * @param mesh Mesh the BVH was built on
+ * @param bvh Built BVH
+ */
+void OutOfCoreBVH::build(const Mesh& mesh, const BVH& bvh)
+{
+    m_nodes.clear();
+    m_blocks.clear();
+    m_storage.reset();
+    m_linear = bvh.isLinear();
+    if (bvh.empty()) return;
+
+    const BVHNode& root = bvh.getNode(0);
+    m_origin = 0.5 * (root.m_min + root.m_max);
+    const double tolerance = 16.0 * std::numeric_limits<double>::epsilon() * 0.5 * (root.m_max - root.m_min).norm();
+
+    // levels per subtree, children before their parents
+    const int nodeCount = bvh.getNodeCount();
+    std::vector<int> preorder, stack(1, 0);
+    preorder.reserve(nodeCount);
+    while (!stack.empty())
+    {
+        const int id = stack.back();
+        stack.pop_back();
+        preorder.push_back(id);
+        const BVHNode& node = bvh.getNode(id);
+        if (!bvh.hasChildren(id, node)) continue;
+        stack.push_back(node.m_left);
+        stack.push_back(node.m_left + 1);
+    }
+    std::vector<int> levels(nodeCount, 1);
+    for (size_t i = preorder.size(); i-- > 0; )
+    {
+        const BVHNode& node = bvh.getNode(preorder[i]);
+        if (bvh.hasChildren(preorder[i], node)) levels[preorder[i]] = 1 + std::max(levels[node.m_left], levels[node.m_left + 1]);
+    }
+
+    std::vector<int> order, below;
+    order.reserve(nodeCount);
+    layoutVanEmdeBoas(bvh, levels, 0, levels[0], order, below);
+    std::vector<int> newIndex(nodeCount, -1);
+    for (size_t i = 0; i < order.size(); i++) newIndex[order[i]] = static_cast<int>(i);
+
+    std::vector<OutOfCoreNode>& nodes = m_nodes.owned();
+    std::vector<OutOfCoreBlock>& blocks = m_blocks.owned();
+    nodes.resize(order.size());
+    blocks.reserve(bvh.getSlotCount() / kTriangleBlockSize);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const BVHNode& node = bvh.getNode(order[i]);
+        OutOfCoreNode& out = nodes[i];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            out.m_min[axis] = roundDown(node.m_min[axis] - m_origin[axis] - tolerance);
+            out.m_max[axis] = roundUp(node.m_max[axis] - m_origin[axis] + tolerance);
+        }
+        if (bvh.hasChildren(order[i], node))
+        {
+            out.m_left = newIndex[node.m_left];
+            out.m_right = newIndex[node.m_left + 1];
+            continue;
+        }
+
+        // leaf triangles in layout order, so a subtree's triangles are together
+        out.m_left = static_cast<int32_t>(blocks.size());
+        const int slotEnd = node.isLeaf() && bvh.hasSlots(node) ? node.m_left + node.m_count : node.m_left;
+        for (int slot = node.m_left; slot < slotEnd; slot += kTriangleBlockSize)
+        {
+            OutOfCoreBlock block;
+            for (int lane = 0; lane < kTriangleBlockSize; lane++)
+            {
+                const int faceId = bvh.getFaceIndex(slot + lane);
+                double o[3] = {nan, nan, nan}, e0[3] = {nan, nan, nan}, e1[3] = {nan, nan, nan};
+                if (faceId >= 0)
+                {
+                    Eigen::Vector3d v1, v2, v3;
+                    mesh.getFaceVertices(faceId, v1, v2, v3);
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        o[axis] = v1[axis] - m_origin[axis];
+                        e0[axis] = v2[axis] - v1[axis];
+                        e1[axis] = v3[axis] - v1[axis];
+                    }
+                }
+                block.m_faces[lane] = faceId;
+                block.m_triangles.m_ox[lane] = o[0];
+                block.m_triangles.m_oy[lane] = o[1];
+                block.m_triangles.m_oz[lane] = o[2];
+                block.m_triangles.m_e0x[lane] = e0[0];
+                block.m_triangles.m_e0y[lane] = e0[1];
+                block.m_triangles.m_e0z[lane] = e0[2];
+                block.m_triangles.m_e1x[lane] = e1[0];
+                block.m_triangles.m_e1y[lane] = e1[1];
+                block.m_triangles.m_e1z[lane] = e1[2];
+            }
+            blocks.push_back(block);
+        }
+        out.m_right = out.m_left - static_cast<int32_t>(blocks.size());
+    }
+}
+
+/**
+ * @brief Squared distance from a point to the bounds of a node, in double
+ * @param localPoint Point relative to the tree origin
+ * @param node Node
+ * @return double Squared distance, 0 inside
+ */
+double OutOfCoreBVH::boxDistanceSq(const Eigen::Vector3d& localPoint, const OutOfCoreNode& node) const
+{
+    double distSq = 0.0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const double d = std::max(std::max(static_cast<double>(node.m_min[axis]) - localPoint[axis], localPoint[axis] - static_cast<double>(node.m_max[axis])), 0.0);
+        distSq += d * d;
+    }
+    return distSq;
+}
+
+/**
+ * @brief Fill the hit record from the winning lane and its parameters
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param block Block of the closest face, -1 if none
+ * @param lane Lane of the closest face
+ * @param s Parameter along e0
+ * @param t Parameter along e1
+ * @param hit Output hit record
+ * @return true A face was found
+ */
+bool OutOfCoreBVH::fillHit(const Eigen::Vector3d& queryPoint, const float& maxDist, const int& block, const int& lane, const double& s, const double& t, QueryHit& hit) const
+{
+    hit.m_found = block >= 0;
+    hit.m_vertexId = -1;
+    if (block < 0)
+    {
+        hit.m_faceId = -1;
+        hit.m_point = queryPoint;
+        hit.m_barycentric.setZero();
+        hit.m_dist = maxDist;
+        hit.m_distSq = static_cast<double>(maxDist) * maxDist;
+        return false;
+    }
+
+    const TriangleBlockT<double>& triangles = m_blocks[block].m_triangles;
+    const Eigen::Vector3d o(triangles.m_ox[lane], triangles.m_oy[lane], triangles.m_oz[lane]);
+    const Eigen::Vector3d e0(triangles.m_e0x[lane], triangles.m_e0y[lane], triangles.m_e0z[lane]);
+    const Eigen::Vector3d e1(triangles.m_e1x[lane], triangles.m_e1y[lane], triangles.m_e1z[lane]);
+    hit.m_faceId = m_blocks[block].m_faces[lane];
+    hit.m_point = (m_origin + o) + s * e0 + t * e1;
+    hit.m_barycentric = Eigen::Vector3d(1.0 - s - t, s, t);
+    hit.m_distSq = (hit.m_point - queryPoint).squaredNorm();
+    hit.m_dist = static_cast<float>(std::sqrt(hit.m_distSq));
+    return true;
+}
+
+/**
+ * @brief Closest point on the surface within a radius, walking the tree
+ * nearest child first like the double ClosestPointEngine and with the same
+ * result: equal distances go to the lowest face id.
+ * Does not allocate, all scratch memory lives in the context.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @return true A face was found within the radius
+ */
+bool OutOfCoreBVH::query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const
+{
+    const Eigen::Vector3d localPoint = queryPoint - m_origin;
+    const double q[3] = {localPoint.x(), localPoint.y(), localPoint.z()};
+    double distSq[kTriangleBlockSize], laneS[kTriangleBlockSize], laneT[kTriangleBlockSize];
+
+    // box distances are exact, kernel distances are off by a few ulps
+    const double slack = 1.0 + 64.0 * std::numeric_limits<double>::epsilon();
+    double bestDistSq = static_cast<double>(maxDist) * maxDist, s = 0.0, t = 0.0;
+    double limitSq = bestDistSq * slack * slack;
+    int bestFace = -1, bestBlock = -1, bestLane = 0;
+
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_nodes.empty()) stack[stackSize++] = {0, boxDistanceSq(localPoint, m_nodes[0])};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limitSq)
+        {
+            QUERY_STAT(context.m_stats.m_culled++);
+            continue;
+        }
+        QUERY_STAT(context.m_stats.m_nodes++);
+
+        const OutOfCoreNode& node = m_nodes[entry.m_node];
+        if (node.isLeaf())
+        {
+            if (!hasBlocks(node)) continue;
+            for (int b = node.m_left; b < node.m_left - node.m_right; b++)
+            {
+                const OutOfCoreBlock& block = m_blocks[b];
+                DoublePolicy::closestPointsOnBlock(block.m_triangles, q, distSq, laneS, laneT);
+                for (int lane = 0; lane < kTriangleBlockSize; lane++)
+                {
+                    const int faceId = block.m_faces[lane];
+                    if (faceId < 0) continue;
+                    QUERY_STAT(context.m_stats.m_triangles++);
+
+                    const double d = distSq[lane];
+                    if (d < bestDistSq || (d == bestDistSq && bestFace >= 0 && faceId < bestFace))
+                    {
+                        bestDistSq = d;
+                        bestFace = faceId;
+                        bestBlock = b;
+                        bestLane = lane;
+                        s = laneS[lane];
+                        t = laneT[lane];
+                        limitSq = bestDistSq * slack * slack;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // children always come after their parent, so a corrupt tree can't
+        // loop; one deeper than the stack allows is cut off
+        if (!hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        double distL = boxDistanceSq(localPoint, m_nodes[node.m_left]);
+        double distR = boxDistanceSq(localPoint, m_nodes[node.m_right]);
+        if (distL < distR)
+        {
+            stack[stackSize++] = {node.m_right, distR};
+            stack[stackSize++] = {node.m_left, distL};
+        }
+        else
+        {
+            stack[stackSize++] = {node.m_left, distL};
+            stack[stackSize++] = {node.m_right, distR};
+        }
+    }
+    return fillHit(queryPoint, maxDist, bestBlock, bestLane, s, t, hit);
+}
+
+/**
+ * @brief Reference query, the linear scan of every block with the same kernel
+ * and acceptance rule. Kept to validate query(); reads the whole file.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param hit Output hit record
+ * @return true A face was found within the radius
+ */
+bool OutOfCoreBVH::bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const
+{
+    const Eigen::Vector3d localPoint = queryPoint - m_origin;
+    const double q[3] = {localPoint.x(), localPoint.y(), localPoint.z()};
+    double distSq[kTriangleBlockSize], laneS[kTriangleBlockSize], laneT[kTriangleBlockSize];
+    double bestDistSq = static_cast<double>(maxDist) * maxDist, s = 0.0, t = 0.0;
+    int bestFace = -1, bestBlock = -1, bestLane = 0;
+
+    for (int b = 0; b < getBlockCount(); b++)
+    {
+        const OutOfCoreBlock& block = m_blocks[b];
+        DoublePolicy::closestPointsOnBlock(block.m_triangles, q, distSq, laneS, laneT);
+        for (int lane = 0; lane < kTriangleBlockSize; lane++)
+        {
+            const int faceId = block.m_faces[lane];
+            if (faceId < 0) continue;
+
+            const double d = distSq[lane];
+            if (d < bestDistSq || (d == bestDistSq && bestFace >= 0 && faceId < bestFace))
+            {
+                bestDistSq = d;
+                bestFace = faceId;
+                bestBlock = b;
+                bestLane = lane;
+                s = laneS[lane];
+                t = laneT[lane];
+            }
+        }
+    }
+    return fillHit(queryPoint, maxDist, bestBlock, bestLane, s, t, hit);
+}
+
+/**
+ * @brief Drop the pages of a mapped tree from the process, all but the first
+ * kResidentTopBytes of nodes, which every query walks through. The data stays
+ * in the page cache, so pages touched again come back without reading the
+ * disk. Nothing to do for a tree built in memory.
+ */
+void OutOfCoreBVH::releasePages() const
+{
+    if (!m_storage) return;
+    const size_t nodeBytes = m_nodes.size() * sizeof(OutOfCoreNode);
+    if (nodeBytes > kResidentTopBytes)
+    {
+        m_storage->release(reinterpret_cast<const char*>(m_nodes.data()) + kResidentTopBytes, nodeBytes - kResidentTopBytes);
+    }
+    m_storage->release(m_blocks.data(), m_blocks.size() * sizeof(OutOfCoreBlock));
+}
@@ -1,12 +1,110 @@
 #include "PointQuery.h"
+#include <algorithm>
 
 /**
- * @brief Construct a new Point Query:: Point Query object
+ * @brief Construct a new Point Query:: Point Query object and build the BVH
+ * over the mesh faces and the k-d tree over its vertices once, so every
+ * following query can reuse them.
  * @param mesh Mesh object
  */
-PointQuery::PointQuery(const Mesh& mesh)
+PointQuery::PointQuery(const Mesh& mesh) : m_mesh(mesh), m_nodeParentsBuilt(new std::once_flag), m_rebuildThreshold(2.0), m_windingBuilt(new std::once_flag), m_windingAccuracy(2.0)
 {
-    m_mesh = mesh;
+    m_bvh.build(m_mesh);
+    m_vertexTree.build(m_mesh);
+}
+
+/**
+ * @brief Construct a new Point Query:: Point Query object around a BVH that was
+ * already built for this mesh, e.g. one loaded from a MeshCache.
+ * @param mesh Mesh object
+ * @param bvh BVH of the mesh, moved in
+ */
+PointQuery::PointQuery(const Mesh& mesh, BVH bvh) : m_mesh(mesh), m_bvh(std::move(bvh)), m_nodeParentsBuilt(new std::once_flag), m_rebuildThreshold(2.0), m_windingBuilt(new std::once_flag), m_windingAccuracy(2.0)
+{
+    if (m_bvh.empty()) m_bvh.build(m_mesh);
+    m_vertexTree.build(m_mesh);
+}
+
+/**
+ * @brief Catch up with new vertex positions of the mesh, e.g. the next frame of
+ * an animation with fixed topology. Both trees are refit, which is much cheaper
+ * than building them; a tree whose cost grew past the rebuild threshold
+ * (relative to its last build) is rebuilt from scratch instead. The winding
+ * number dipoles are dropped either way, the next windingNumber() rebuilds
+ * them.
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @return true At least one tree was rebuilt
+ */
+bool PointQuery::refit(const int& threadCount)
+{
+    bool rebuilt = false;
+
+    m_bvh.refit(m_mesh, threadCount);
+    if (m_bvh.inflation() > m_rebuildThreshold)
+    {
+        m_bvh.rebuild(m_mesh, threadCount);
+        m_nodeParents.clear();
+        m_nodeParentsBuilt.reset(new std::once_flag);
+        rebuilt = true;
+    }
+
+    m_vertexTree.refit(m_mesh, threadCount);
+    if (m_vertexTree.inflation() > m_rebuildThreshold)
+    {
+        m_vertexTree.build(m_mesh);
+        rebuilt = true;
+    }
+
+    m_windingNodes.clear();
+    m_windingBuilt.reset(new std::once_flag);
+    return rebuilt;
+}
+
+/**
+ * @brief Build the vertex to face adjacency used by queryCoherent(), faces of
+ * vertex v are m_vertexFaces[m_vertexFaceOffsets[v] .. m_vertexFaceOffsets[v + 1]).
+ * Run once through needVertexFaces(), plain queries never pay for it. The
+ * topology is fixed, refits keep it valid.
+ */
+void PointQuery::buildVertexFaces() const
+{
+    const size_t vertexCount = m_mesh.getVertexCount();
+    const size_t faceCount = m_mesh.getFaceCount();
+    ArrayView<uint32_t> indices = m_mesh.getIndices();
+
+    // indices are not checked when a mesh is mapped from a cache, faces using
+    // a vertex out of range are left out
+    m_vertexFaceOffsets.assign(vertexCount + 1, 0);
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        if (indices[i] < vertexCount) m_vertexFaceOffsets[indices[i] + 1]++;
+    }
+    for (size_t v = 0; v < vertexCount; v++) m_vertexFaceOffsets[v + 1] += m_vertexFaceOffsets[v];
+
+    std::vector<uint32_t> cursor(m_vertexFaceOffsets.begin(), m_vertexFaceOffsets.end() - 1);
+    m_vertexFaces.resize(indices.size());
+    for (size_t f = 0; f < faceCount; f++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (indices[3*f+k] < vertexCount) m_vertexFaces[cursor[indices[3*f+k]]++] = static_cast<uint32_t>(f);
+        }
+    }
+}
+
+/**
+ * @brief Build the parent of every BVH node, -1 for the root, so
+ * queryCoherent() can climb from a leaf. Run once through needNodeParents(),
+ * again after a rebuild; refits keep the tree shape.
+ */
+void PointQuery::buildNodeParents() const
+{
+    m_nodeParents.assign(m_bvh.getNodeCount(), -1);
+    for (int n = 0; n < m_bvh.getNodeCount(); n++)
+    {
+        const BVHNode& node = m_bvh.getNode(n);
+        if (m_bvh.hasChildren(n, node)) m_nodeParents[node.m_left] = m_nodeParents[node.m_left + 1] = n;
+    }
 }
 
 /**
@@ -50,175 +148,681 @@ bool isWithin3DManhattanDistance(const Eigen::Vector3d& v1, const Eigen::Vector3
  * @param minDist Search radius
  * @return Eigen::Vector3d Closest point
  */
-Eigen::Vector3d PointQuery::getClosestVertex(const Eigen::Vector3d& queryPoint, float& minDist)
+Eigen::Vector3d PointQuery::getClosestVertex(const Eigen::Vector3d& queryPoint, float& minDist) const
+{
+    int id = m_vertexTree.closest(queryPoint, minDist);
+    return id < 0 ? queryPoint : m_mesh.getVertex(id);
+}
+
+/**
+ * @brief Id of the closest vertex to the query point given max radius
+ * @param queryPoint Query point
+ * @param minDist Search radius, set to the distance of the found vertex
+ * @return int Vertex id, -1 if nothing is closer than the radius
+ */
+int PointQuery::getClosestVertexId(const Eigen::Vector3d& queryPoint, float& minDist) const
+{
+    return m_vertexTree.closest(queryPoint, minDist);
+}
+
+/**
+ * @brief Every vertex within the radius, see KdTree::radiusSearch()
+ * @param queryPoint Query point
+ * @param radius Search radius
+ * @param hits Output buffer
+ * @param capacity Output buffer size
+ * @return size_t Number of vertices within the radius, can exceed capacity
+ */
+size_t PointQuery::getVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const
+{
+    return m_vertexTree.radiusSearch(queryPoint, radius, hits, capacity);
+}
+
+/**
+ * @brief Every vertex within the radius handed to a callback, see KdTree::radiusSearch()
+ * @param queryPoint Query point
+ * @param radius Search radius
+ * @param callback Called per vertex, returning false stops the search
+ * @return size_t Number of vertices passed to the callback
+ */
+size_t PointQuery::getVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, const VertexHitCallback& callback) const
+{
+    return m_vertexTree.radiusSearch(queryPoint, radius, callback);
+}
+
+/**
+ * @brief Upper bound of getVerticesInRadius(), see KdTree::estimateInRadius()
+ * @param queryPoint Query point
+ * @param radius Search radius
+ * @return size_t At least the number of vertices within the radius
+ */
+size_t PointQuery::estimateVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const
+{
+    return m_vertexTree.estimateInRadius(queryPoint, radius);
+}
+
+/**
+ * @brief The k closest vertices within maxDist, see KdTree::nearest()
+ * @param queryPoint Query point
+ * @param k Number of vertices wanted
+ * @param maxDist Search radius
+ * @param hits Output buffer, at least k entries
+ * @return size_t Number of vertices written
+ */
+size_t PointQuery::getNearestVertices(const Eigen::Vector3d& queryPoint, const size_t& k, const float& maxDist, VertexHit* hits) const
+{
+    return m_vertexTree.nearest(queryPoint, k, maxDist, hits);
+}
+
+/**
+ * @brief Linear scan version of getClosestVertexId(), used by bruteForce() so
+ * the reference path does not depend on the k-d tree
+ * @param queryPoint Query point
+ * @param minDist Search radius, set to the distance of the found vertex
+ * @return int Vertex id, -1 if nothing is closer than the radius
+ */
+int PointQuery::getClosestVertexLinear(const Eigen::Vector3d& queryPoint, float& minDist) const
 {
     // first eliminate vertices further away from max distance using
-    // the faster Manhattan distance algorithm since sqrt is expensive
-    std::vector<Eigen::Vector3d> filteredVertices;
-    for(int i=0; i < m_mesh.getVertices().size(); i++)
+    // the faster Manhattan distance algorithm since sqrt is expensive,
+    // then make accurate Euclidean distance comparison
+    const float radius = minDist;
+    int closestId = -1;
+    const size_t vertexCount = m_mesh.getVertexCount();
+    for(uint32_t i=0; i < vertexCount; i++)
     {
-        if(isWithin3DManhattanDistance(m_mesh.getVertex(i), queryPoint, minDist))
-        {
-            filteredVertices.push_back(m_mesh.getVertex(i));
-        }
-    }
+        Eigen::Vector3d vertex = m_mesh.getVertex(i);
+        if(!isWithin3DManhattanDistance(vertex, queryPoint, radius)) continue;
 
-    // now make accurate Euclidean distance comparison with
-    // filtered vertices
-    Eigen::Vector3d currentClosest = queryPoint;
-    for(int i=0; i < filteredVertices.size(); i++)
-    {
-        float d = getDistanceBetweenPts(filteredVertices[i], queryPoint);
+        float d = getDistanceBetweenPts(vertex, queryPoint);
         if(d<minDist)
         {
             minDist = d;
-            currentClosest = filteredVertices[i];
+            closestId = i;
         }
     }
 
-    return currentClosest;
+    return closestId;
 }
 
 /**
- * @brief Clamp utility function to restrict value to a given range
- * @param n Value to be clamped
- * @param lower Min value
- * @param upper Max value
- * @return float Clamped Value
+ * @brief Get closest point on given face of the queried mesh.
+ * @param face Face object
+ * @param queryPoint Query point
+ * @return Eigen::Vector3d Closest point
  */
-float clamp(float n, float lower, float upper) {
-    return std::min(lower, std::max(n, upper));
+Eigen::Vector3d PointQuery::closestPointOnTriangle(const Face& face, const Eigen::Vector3d& queryPoint) const
+{
+    Eigen::Vector3d v1, v2, v3;
+    m_mesh.getFaceVertices(face.m_id, v1, v2, v3);
+    return closestPointOnTriangle(v1, v2, v3, queryPoint);
 }
 
 /**
- * @brief Get closest point on given face. Face object will be triangular.
- * // https://www.gamedev.net/forums/topic/552906-closest-point-on-triangle/
- * @param face Face object
+ * @brief Get closest point on the triangle formed by given points.
+ * See closestPointParams() in TriangleKernel.h for the region logic.
+ * @param v1 Point 1
+ * @param v2 Point 2
+ * @param v3 Point 3
  * @param queryPoint Query point
  * @return Eigen::Vector3d Closest point
  */
-Eigen::Vector3d PointQuery::closestPointOnTriangle(const Face& face, const Eigen::Vector3d& queryPoint)
+Eigen::Vector3d PointQuery::closestPointOnTriangle(const Eigen::Vector3d& v1, const Eigen::Vector3d& v2, const Eigen::Vector3d& v3, const Eigen::Vector3d& queryPoint)
 {
-    Eigen::Vector3d edge0 = face.m_v2 - face.m_v1;
-    Eigen::Vector3d edge1 = face.m_v3 - face.m_v1;
-    Eigen::Vector3d v0 = face.m_v1 - queryPoint;
+    float dist;
+    return closestPointOnTriangleEdges(v1, v2 - v1, v3 - v1, queryPoint, dist);
+}
+
+/**
+ * @brief Fill the hit record once the search is over; looks up the winning
+ * face or vertex and computes the barycentrics of the closest point.
+ * @param queryPoint Query point
+ * @param vertexId Closest vertex found, -1 if none
+ * @param faceId Closest face found, -1 if none
+ * @param dist Distance to the closest vertex or face, the radius if none
+ * @param hit Output hit record
+ */
+void PointQuery::fillHit(const Eigen::Vector3d& queryPoint, const int& vertexId, const int& faceId, const float& dist, QueryHit& hit) const
+{
+    // like faces, a vertex sitting exactly on the query point is no hit, but it
+    // still ends the search at distance 0
+    bool vertexHit = faceId < 0 && vertexId >= 0 && m_mesh.getVertex(vertexId) != queryPoint;
+    hit.m_found = faceId >= 0 || vertexHit;
+    hit.m_faceId = faceId;
+    hit.m_vertexId = vertexHit ? vertexId : -1;
+    hit.m_barycentric.setZero();
+    hit.m_dist = dist;
+
+    if (faceId >= 0)
+    {
+        // redo the winning face alone for its parameters, same arithmetic as
+        // the packet kernel so the point is bit identical
+        Eigen::Vector3d v1, v2, v3;
+        m_mesh.getFaceVertices(faceId, v1, v2, v3);
+        float faceDist, s, t;
+        hit.m_point = closestPointOnTriangleEdges(v1, v2 - v1, v3 - v1, queryPoint, faceDist, s, t);
+        hit.m_barycentric = Eigen::Vector3d(1.0 - s - t, s, t);
+    }
+    else if (vertexHit)
+    {
+        hit.m_point = m_mesh.getVertex(vertexId);
+    }
+    else
+    {
+        hit.m_point = queryPoint;
+    }
+    hit.m_distSq = hit.m_found ? (hit.m_point - queryPoint).squaredNorm() : static_cast<double>(dist) * dist;
+}
 
-    float a = edge0.dot( edge0 );
-    float b = edge0.dot( edge1 );
-    float c = edge1.dot( edge1 );
-    float d = edge0.dot( v0 );
-    float e = edge1.dot( v0 );
+/**
+ * @brief Walk the BVH nearest child first, skipping every node whose bounds are
+ * further away than the current best distance. Faces are accepted the same way
+ * as in bruteForce(): on equal distances the face with the highest index wins,
+ * so the result does not depend on the order faces are visited in.
+ * @param queryPoint Query point
+ * @param root Node to walk from, 0 for the whole tree
+ * @param context Scratch memory of the calling thread
+ * @param bestDist Current best distance, updated
+ * @param bestFace Current best face, updated
+ * @param bestLeaf Leaf holding the best face, updated with it
+ */
+void PointQuery::traverse(const Eigen::Vector3d& queryPoint, const int& root, QueryContext& context, float& bestDist, int& bestFace, int& bestLeaf) const
+{
+    // node bounds are compared in double against a float distance, so keep a
+    // little slack to never prune a node holding an equally distant face
+    const double slack = 1.0 + 1e-5;
 
-    float det = a*c - b*b;
-    float s = b*e - c*d;
-    float t = b*d - a*e;
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_bvh.empty()) stack[stackSize++] = {root, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(root))};
 
-    if ( s + t < det )
+    while (stackSize > 0)
     {
-        if ( s < 0.f )
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > static_cast<double>(bestDist) * bestDist * slack)
+        {
+            QUERY_STAT(context.m_stats.m_culled++);
+            continue;
+        }
+        QUERY_STAT(context.m_stats.m_nodes++);
+
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+        if (node.isLeaf())
         {
-            if ( t < 0.f )
+            if (!m_bvh.hasSlots(node)) continue;
+
+            // test the leaf 4 or 8 faces at a time, then apply the hits in slot order
+            const int slotEnd = node.m_left + node.m_count;
+            for (int slot = node.m_left, lanes; slot < slotEnd; slot += lanes)
             {
-                if ( d < 0.f )
-                {
-                    s = clamp( -d/a, 0.f, 1.f );
-                    t = 0.f;
-                }
-                else
+                lanes = closestPointsOnBlocks(&m_bvh.getBlock(slot / kTriangleBlockSize), slotEnd - slot, queryPoint, context.m_px, context.m_py, context.m_pz, context.m_dist);
+                for (int lane = 0; lane < lanes; lane++)
                 {
-                    s = 0.f;
-                    t = clamp( -e/c, 0.f, 1.f );
+                    int faceId = m_bvh.getFaceIndex(slot + lane);
+                    if (faceId < 0) continue;
+                    QUERY_STAT(context.m_stats.m_triangles++);
+
+                    float tmpDist = context.m_dist[lane];
+                    bool onQueryPoint = context.m_px[lane] == queryPoint.x() && context.m_py[lane] == queryPoint.y() && context.m_pz[lane] == queryPoint.z();
+                    if ((tmpDist < bestDist || (tmpDist == bestDist && faceId > bestFace)) && !onQueryPoint)
+                    {
+                        bestDist = tmpDist;
+                        bestFace = faceId;
+                        bestLeaf = entry.m_node;
+                    }
                 }
             }
-            else
-            {
-                s = 0.f;
-                t = clamp( -e/c, 0.f, 1.f );
-            }
+            continue;
         }
-        else if ( t < 0.f )
+
+        // push the far child first so the near one is popped next
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        double distL = BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left));
+        double distR = BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left + 1));
+        if (distL < distR)
         {
-            s = clamp( -d/a, 0.f, 1.f );
-            t = 0.f;
+            stack[stackSize++] = {node.m_left + 1, distR};
+            stack[stackSize++] = {node.m_left, distL};
         }
         else
         {
-            float invDet = 1.f / det;
-            s *= invDet;
-            t *= invDet;
+            stack[stackSize++] = {node.m_left, distL};
+            stack[stackSize++] = {node.m_left + 1, distR};
+        }
+    }
+}
+
+/**
+ * @brief Main query function. First check within object vertices,
+ * then walk the BVH, see traverse().
+ * Does not allocate, all scratch memory lives in the context.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @return true Something was found within the radius
+ */
+bool PointQuery::query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const
+{
+    // first check all vertices
+    float bestDist = maxDist;
+    int bestVertex = m_vertexTree.closest(queryPoint, bestDist);
+    int bestFace = -1, bestLeaf = -1;
+
+    traverse(queryPoint, 0, context, bestDist, bestFace, bestLeaf);
+
+    fillHit(queryPoint, bestVertex, bestFace, bestDist, hit);
+    return hit.m_found;
+}
+
+/**
+ * @brief Query for streams of nearby points, e.g. a rig vertex animated over
+ * frames or a scan sweep. The walk starts at the BVH leaf of the previous hit
+ * of this context instead of the root and climbs its parent links, opening the
+ * sibling of every node on the way up. The leaf and those siblings cover the
+ * tree once, and the nearby subtrees come first, so the far ones are pruned by
+ * a tight bound. Faces come before vertices here; a vertex then only wins when
+ * it is strictly closer, which gives the same result as query().
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param context Scratch memory of the calling thread, remembers the last leaf
+ * @param hit Output hit record
+ * @return true Something was found within the radius
+ */
+bool PointQuery::queryCoherent(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const
+{
+    float bestDist = maxDist;
+    int bestFace = -1, bestLeaf = -1;
+
+    int node = context.m_prevLeaf;
+    if (node >= 0 && node < m_bvh.getNodeCount() && m_bvh.getNode(node).isLeaf())
+    {
+        needNodeParents();
+        traverse(queryPoint, node, context, bestDist, bestFace, bestLeaf);
+        for (int parent = m_nodeParents[node]; parent >= 0; node = parent, parent = m_nodeParents[node])
+        {
+            const int sibling = m_bvh.getNode(parent).m_left == node ? node + 1 : node - 1;
+            traverse(queryPoint, sibling, context, bestDist, bestFace, bestLeaf);
         }
     }
     else
     {
-        if ( s < 0.f )
+        node = -1;
+    }
+    // no previous leaf, or it was cut off from the root (corrupt cache)
+    if (node != 0) traverse(queryPoint, 0, context, bestDist, bestFace, bestLeaf);
+
+    int bestVertex = m_vertexTree.closest(queryPoint, bestDist);
+    if (bestVertex >= 0) bestFace = -1;
+
+    fillHit(queryPoint, bestVertex, bestFace, bestDist, hit);
+    context.m_prevLeaf = bestLeaf;
+    return hit.m_found;
+}
+
+/**
+ * @brief Query a packet of nearby points together, e.g. neighbours along a
+ * Morton order. The packet walks the BVH once: every node and triangle block is
+ * fetched once for all lanes that still need it, and a lane drops out of a
+ * subtree as soon as the subtree is further away than its own best distance.
+ * Each lane gives the same result as query().
+ * @param queryPoints Query points
+ * @param maxDists Max radius per query point
+ * @param count Number of queries, at most QueryContext::kPacketSize
+ * @param context Scratch memory of the calling thread
+ * @param hits Output hit records, one per query point
+ */
+void PointQuery::queryPacket(const Eigen::Vector3d* queryPoints, const float* maxDists, const int& count, QueryContext& context, QueryHit* hits) const
+{
+    const int lanes = std::min(count, static_cast<int>(QueryContext::kPacketSize));
+    float bestDist[QueryContext::kPacketSize];
+    int bestVertex[QueryContext::kPacketSize], bestFace[QueryContext::kPacketSize];
+
+    // vertex stage per lane
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        bestDist[lane] = maxDists[lane];
+        bestVertex[lane] = m_vertexTree.closest(queryPoints[lane], bestDist[lane]);
+        bestFace[lane] = -1;
+    }
+
+    const double slack = 1.0 + 1e-5;
+    PacketEntry* stack = context.m_packetStack;
+    int stackSize = 0;
+    if (!m_bvh.empty() && lanes > 0) stack[stackSize++] = {0, (1u << lanes) - 1};
+
+    while (stackSize > 0)
+    {
+        PacketEntry entry = stack[--stackSize];
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+
+        // lanes whose best distance still reaches this node
+        uint32_t mask = 0;
+        for (int lane = 0; lane < lanes; lane++)
         {
-            float tmp0 = b+d;
-            float tmp1 = c+e;
-            if ( tmp1 > tmp0 )
+            if (!(entry.m_mask & (1u << lane))) continue;
+            if (BVH::pointBoxDistanceSq(queryPoints[lane], node) <= static_cast<double>(bestDist[lane]) * bestDist[lane] * slack)
             {
-                float numer = tmp1 - tmp0;
-                float denom = a-2*b+c;
-                s = clamp( numer/denom, 0.f, 1.f );
-                t = 1-s;
+                mask |= 1u << lane;
+                QUERY_STAT(context.m_stats.m_nodes++);
             }
             else
             {
-                t = clamp( -e/c, 0.f, 1.f );
-                s = 0.f;
+                QUERY_STAT(context.m_stats.m_culled++);
             }
         }
-        else if ( t < 0.f )
+        if (!mask) continue;
+
+        if (node.isLeaf())
         {
-            if ( a+d > b+e )
-            {
-                float numer = c+e-b-d;
-                float denom = a-2*b+c;
-                s = clamp( numer/denom, 0.f, 1.f );
-                t = 1-s;
-            }
-            else
+            if (!m_bvh.hasSlots(node)) continue;
+            const int slotEnd = node.m_left + node.m_count;
+            for (int slot = node.m_left; slot < slotEnd; slot += kernelLanes(slotEnd - slot))
             {
-                s = clamp( -e/c, 0.f, 1.f );
-                t = 0.f;
+                const TriangleBlock* blocks = &m_bvh.getBlock(slot / kTriangleBlockSize);
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    if (!(mask & (1u << lane))) continue;
+
+                    const Eigen::Vector3d& queryPoint = queryPoints[lane];
+                    const int width = closestPointsOnBlocks(blocks, slotEnd - slot, queryPoint, context.m_px, context.m_py, context.m_pz, context.m_dist);
+                    for (int k = 0; k < width; k++)
+                    {
+                        int faceId = m_bvh.getFaceIndex(slot + k);
+                        if (faceId < 0) continue;
+                        QUERY_STAT(context.m_stats.m_triangles++);
+
+                        float tmpDist = context.m_dist[k];
+                        bool onQueryPoint = context.m_px[k] == queryPoint.x() && context.m_py[k] == queryPoint.y() && context.m_pz[k] == queryPoint.z();
+                        if ((tmpDist < bestDist[lane] || (tmpDist == bestDist[lane] && faceId > bestFace[lane])) && !onQueryPoint)
+                        {
+                            bestDist[lane] = tmpDist;
+                            bestFace[lane] = faceId;
+                        }
+                    }
+                }
             }
+            continue;
+        }
+
+        // order the children by the first active lane, the packet is small and
+        // coherent so it stands in for the others
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        int first = 0;
+        while (!(mask & (1u << first))) first++;
+        double distL = BVH::pointBoxDistanceSq(queryPoints[first], m_bvh.getNode(node.m_left));
+        double distR = BVH::pointBoxDistanceSq(queryPoints[first], m_bvh.getNode(node.m_left + 1));
+        if (distL < distR)
+        {
+            stack[stackSize++] = {node.m_left + 1, mask};
+            stack[stackSize++] = {node.m_left, mask};
         }
         else
         {
-            float numer = c+e-b-d;
-            float denom = a-2*b+c;
-            s = clamp( numer/denom, 0.f, 1.f );
-            t = 1.f - s;
+            stack[stackSize++] = {node.m_left, mask};
+            stack[stackSize++] = {node.m_left + 1, mask};
         }
     }
 
-    return face.m_v1 + s * edge0 + t * edge1;
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        fillHit(queryPoints[lane], bestVertex[lane], bestFace[lane], bestDist[lane], hits[lane]);
+    }
 }
 
 /**
- * @brief Main query function. First check within object vertices,
- * then check within object faces.
+ * @brief Convenience wrapper of query() returning the closest point only
  * @param queryPoint Query point
- * @param maxDist Max radius
- * @return Eigen::Vector3d Closest point
+ * @param maxDist Max radius, set to the distance of the closest point
+ * @return Eigen::Vector3d Closest point, the query point if nothing was found
  */
-Eigen::Vector3d PointQuery::operator()(const Eigen::Vector3d& queryPoint, float& maxDist)
+Eigen::Vector3d PointQuery::operator()(const Eigen::Vector3d& queryPoint, float& maxDist) const
 {
+    QueryContext context;
+    QueryHit hit;
+    query(queryPoint, maxDist, context, hit);
+    maxDist = hit.m_dist;
+    return hit.m_point;
+}
 
+/**
+ * @brief Shared walk of the face range queries. Every node whose bounds reach
+ * into the radius is opened, leaves are tested 4 faces at a time and every
+ * face whose closest point is within the radius is handed to emit. Unlike the
+ * closest point query a face touching the query point is reported, at distance 0.
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param context Scratch memory of the calling thread
+ * @param emit Called with each hit and the number of hits before it, returns false to stop
+ * @return size_t Number of faces found
+ */
+template <typename Emit>
+size_t PointQuery::walkFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, Emit emit) const
+{
+    const double limit = static_cast<double>(radius) * radius * (1.0 + 1e-5);
+    size_t found = 0;
+
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_bvh.empty()) stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(0))};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limit) continue;
+
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+        if (node.isLeaf())
+        {
+            if (!m_bvh.hasSlots(node)) continue;
+            const int slotEnd = node.m_left + node.m_count;
+            for (int slot = node.m_left, lanes; slot < slotEnd; slot += lanes)
+            {
+                lanes = closestPointsOnBlocks(&m_bvh.getBlock(slot / kTriangleBlockSize), slotEnd - slot, queryPoint, context.m_px, context.m_py, context.m_pz, context.m_dist);
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    int faceId = m_bvh.getFaceIndex(slot + lane);
+                    if (faceId < 0 || !(context.m_dist[lane] <= radius)) continue;
+
+                    FaceHit hit;
+                    hit.m_id = faceId;
+                    hit.m_dist = context.m_dist[lane];
+                    hit.m_point = Eigen::Vector3d(context.m_px[lane], context.m_py[lane], context.m_pz[lane]);
+                    if (!emit(found++, hit)) return found;
+                }
+            }
+            continue;
+        }
+
+        // every child within the radius is visited, the order does not matter
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        stack[stackSize++] = {node.m_left, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left))};
+        stack[stackSize++] = {node.m_left + 1, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left + 1))};
+    }
+    return found;
+}
+
+/**
+ * @brief Every face within the radius, in no particular order.
+ * When more faces are found than fit, the extra ones are counted but not
+ * written; size the buffer with estimateFacesInRadius() to get everything in
+ * one pass. Does not allocate.
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param context Scratch memory of the calling thread
+ * @param hits Output buffer
+ * @param capacity Output buffer size
+ * @return size_t Number of faces within the radius, can exceed capacity
+ */
+size_t PointQuery::getFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, FaceHit* hits, const size_t& capacity) const
+{
+    return walkFacesInRadius(queryPoint, radius, context, [&](const size_t& index, const FaceHit& hit) {
+        if (index < capacity) hits[index] = hit;
+        return true;
+    });
+}
+
+/**
+ * @brief Every face within the radius handed to a callback, in no particular order
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param context Scratch memory of the calling thread
+ * @param callback Called per face, returning false stops the search
+ * @return size_t Number of faces passed to the callback
+ */
+size_t PointQuery::getFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, QueryContext& context, const FaceHitCallback& callback) const
+{
+    return walkFacesInRadius(queryPoint, radius, context, [&](const size_t&, const FaceHit& hit) {
+        return callback(hit);
+    });
+}
+
+/**
+ * @brief Upper bound of the face count within the radius: the size of every
+ * BVH leaf whose bounds reach into it. Only node bounds are tested, so this
+ * first pass is much cheaper than the search and the buffer of
+ * getFacesInRadius() can be allocated once from it.
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @return size_t At least the number of faces within the radius
+ */
+size_t PointQuery::estimateFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius) const
+{
+    const double limit = static_cast<double>(radius) * radius * (1.0 + 1e-5);
+    size_t count = 0;
+
+    TraversalEntry stack[QueryContext::kStackSize];
+    int stackSize = 0;
+    if (!m_bvh.empty()) stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(0))};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > limit) continue;
+
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+        if (node.isLeaf())
+        {
+            if (m_bvh.hasSlots(node)) count += node.m_count;
+            continue;
+        }
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        stack[stackSize++] = {node.m_left, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left))};
+        stack[stackSize++] = {node.m_left + 1, BVH::pointBoxDistanceSq(queryPoint, m_bvh.getNode(node.m_left + 1))};
+    }
+    return count;
+}
+
+/**
+ * @brief Reference query function. First check within object vertices,
+ * then check within every object face. Kept to validate the BVH path.
+ * @param queryPoint Query point
+ * @param maxDist Max radius
+ * @param hit Output hit record
+ * @return true Something was found within the radius
+ */
+bool PointQuery::bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryHit& hit) const
+{
     // first check all vertices
-    Eigen::Vector3d result = getClosestVertex(queryPoint, maxDist);
+    float bestDist = maxDist;
+    int bestVertex = getClosestVertexLinear(queryPoint, bestDist);
+    int bestFace = -1;
 
     // next check all faces
-    for(int i=0; i<m_mesh.getFaces().size(); i++)
+    const size_t faceCount = m_mesh.getFaceCount();
+    Eigen::Vector3d v1, v2, v3;
+    for(uint32_t i=0; i<faceCount; i++)
     {
-        Eigen::Vector3d closestVertex = closestPointOnTriangle(m_mesh.getFace(i), queryPoint);
-        float tmpDist = getDistanceBetweenPts(closestVertex, queryPoint);
+        float tmpDist;
+        m_mesh.getFaceVertices(i, v1, v2, v3);
+        Eigen::Vector3d closestVertex = closestPointOnTriangleEdges(v1, v2 - v1, v3 - v1, queryPoint, tmpDist);
 
-        if(maxDist >= tmpDist && closestVertex!=queryPoint)
+        if(bestDist >= tmpDist && closestVertex!=queryPoint)
         {
-            result = closestVertex;
-            maxDist = tmpDist;
+            bestDist = tmpDist;
+            bestFace = i;
         }
 
     }
-    return result;
-}
\ No newline at end of file
+
+    fillHit(queryPoint, bestVertex, bestFace, bestDist, hit);
+    return hit.m_found;
+}
+
+/**
+ * @brief Convenience wrapper of the reference query returning the closest point only
+ * @param queryPoint Query point
+ * @param maxDist Max radius, set to the distance of the closest point
+ * @return Eigen::Vector3d Closest point, the query point if nothing was found
+ */
+Eigen::Vector3d PointQuery::bruteForce(const Eigen::Vector3d& queryPoint, float& maxDist) const
+{
+    QueryHit hit;
+    bruteForce(queryPoint, maxDist, hit);
+    maxDist = hit.m_dist;
+    return hit.m_point;
+}
+
+/**
+ * @brief Reference face range query, tests every face of the mesh. Kept to
+ * validate getFacesInRadius().
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param hits Output buffer, in face order
+ * @param capacity Output buffer size
+ * @return size_t Number of faces within the radius, can exceed capacity
+ */
+size_t PointQuery::bruteForceFacesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, FaceHit* hits, const size_t& capacity) const
+{
+    size_t found = 0;
+    const size_t faceCount = m_mesh.getFaceCount();
+    Eigen::Vector3d v1, v2, v3;
+    for(uint32_t i=0; i<faceCount; i++)
+    {
+        float tmpDist;
+        m_mesh.getFaceVertices(i, v1, v2, v3);
+        Eigen::Vector3d closestVertex = closestPointOnTriangleEdges(v1, v2 - v1, v3 - v1, queryPoint, tmpDist);
+        if(!(tmpDist <= radius)) continue;
+
+        if(found < capacity)
+        {
+            hits[found].m_id = i;
+            hits[found].m_dist = tmpDist;
+            hits[found].m_point = closestVertex;
+        }
+        found++;
+    }
+    return found;
+}
+
+/**
+ * @brief Reference vertex range query, tests every vertex of the mesh. Kept to
+ * validate getVerticesInRadius().
+ * @param queryPoint Query point
+ * @param radius Search radius, inclusive
+ * @param hits Output buffer, in vertex order
+ * @param capacity Output buffer size
+ * @return size_t Number of vertices within the radius, can exceed capacity
+ */
+size_t PointQuery::bruteForceVerticesInRadius(const Eigen::Vector3d& queryPoint, const float& radius, VertexHit* hits, const size_t& capacity) const
+{
+    size_t found = 0;
+    ArrayView<double> xs = m_mesh.getX(), ys = m_mesh.getY(), zs = m_mesh.getZ();
+    for(uint32_t i=0; i<xs.size(); i++)
+    {
+        double dx = queryPoint.x() - xs[i];
+        double dy = queryPoint.y() - ys[i];
+        double dz = queryPoint.z() - zs[i];
+        float d = sqrtf(static_cast<float>(dx*dx + dy*dy + dz*dz));
+        if(d > radius) continue;
+
+        if(found < capacity)
+        {
+            hits[found].m_id = i;
+            hits[found].m_dist = d;
+            hits[found].m_point = Eigen::Vector3d(xs[i], ys[i], zs[i]);
+        }
+        found++;
+    }
+    return found;
+}
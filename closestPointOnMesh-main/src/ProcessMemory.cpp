@@ -0,0 +1,65 @@
+#include "ProcessMemory.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#endif
+
+/**
+ * @brief Resident set size of the process; the working set on Windows
+ * @return double Megabytes, -1 where it can't be measured
+ */
+double residentMegabytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1.0;
+    return counters.WorkingSetSize / (1024.0 * 1024.0);
+#elif defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) return -1.0;
+    return info.resident_size / (1024.0 * 1024.0);
+#elif defined(__linux__)
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) return -1.0;
+    long pages = 0, resident = 0;
+    const bool ok = fscanf(file, "%ld %ld", &pages, &resident) == 2;
+    fclose(file);
+    return ok ? resident * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1024.0 * 1024.0) : -1.0;
+#else
+    return -1.0;
+#endif
+}
+
+/**
+ * @brief Peak resident set size of the process so far
+ * @return double Megabytes, -1 where it can't be measured
+ */
+double peakResidentMegabytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return -1.0;
+    return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1.0;
+#ifdef __APPLE__
+    // bytes on macOS, kilobytes everywhere else
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
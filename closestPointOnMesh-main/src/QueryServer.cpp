@@ -0,0 +1,379 @@
+#include "QueryServer.h"
+#include "MeshCache.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifdef _WIN32
+// _read / _write take an unsigned int count
+const size_t kMaxTransfer = 1u << 30;
+#endif
+
+/**
+ * @brief Read exactly size bytes, retrying short reads
+ * @param fd File descriptor
+ * @param data Output buffer
+ * @param size Bytes to read
+ * @return true All bytes were read; false on end of file or error
+ */
+bool readFully(const int& fd, void* data, const size_t& size)
+{
+    char* bytes = static_cast<char*>(data);
+    size_t done = 0;
+    while (done < size)
+    {
+#ifdef _WIN32
+        const int n = _read(fd, bytes + done, static_cast<unsigned int>(std::min<size_t>(size - done, kMaxTransfer)));
+#else
+        ssize_t n = read(fd, bytes + done, size - done);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/**
+ * @brief Write exactly size bytes, retrying short writes
+ * @param fd File descriptor
+ * @param data Bytes to write
+ * @param size Byte count
+ * @return true All bytes were written
+ */
+bool writeFully(const int& fd, const void* data, const size_t& size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    size_t done = 0;
+    while (done < size)
+    {
+#ifdef _WIN32
+        const int n = _write(fd, bytes + done, static_cast<unsigned int>(std::min<size_t>(size - done, kMaxTransfer)));
+#else
+        ssize_t n = write(fd, bytes + done, size - done);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Connection struct; a socket client and the thread serving it
+ */
+struct Connection
+{
+public:
+    std::thread m_thread;
+    int m_fd;
+    std::shared_ptr<std::atomic<bool>> m_done;
+};
+#endif
+}
+
+/**
+ * @brief Construct a new Query Server:: Query Server object, starting the
+ * worker pool
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param useCache Load meshes from their MeshCache file when it is fresh
+ */
+QueryServer::QueryServer(const int& threadCount, const bool& useCache) : m_pool(threadCount), m_threadCount(threadCount), m_useCache(useCache), m_stopping(false), m_listenFd(-1)
+{
+}
+
+/**
+ * @brief Load and index a mesh under an id, replacing the mesh loaded under
+ * it before. Uses the mesh cache when it is newer than the obj, but never
+ * writes it, several connections may load the same obj at once.
+ * @param meshId Mesh id used by the requests
+ * @param objFile Obj file path
+ * @return true Mesh loaded
+ */
+bool QueryServer::load(const uint32_t& meshId, const std::string& objFile)
+{
+    std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+    BVH bvh;
+    bool loaded = false;
+    std::string cacheFile = MeshCache::pathFor(objFile.c_str());
+    if (m_useCache && MeshCache::isFresh(objFile.c_str(), cacheFile))
+    {
+        loaded = MeshCache::read(cacheFile, entry->m_mesh, &bvh);
+    }
+    if (!loaded)
+    {
+        if (!entry->m_mesh.readObj(objFile.c_str(), m_threadCount)) return false;
+        bvh.build(entry->m_mesh);
+    }
+    entry->m_query.reset(new PointQuery(entry->m_mesh, std::move(bvh)));
+
+    std::lock_guard<std::mutex> lock(m_meshMutex);
+    m_meshes[meshId] = entry;
+    return true;
+}
+
+/**
+ * @brief Drop a mesh. Batches still running on it keep it alive until they
+ * are done.
+ * @param meshId Mesh id
+ * @return true The mesh was loaded
+ */
+bool QueryServer::evict(const uint32_t& meshId)
+{
+    std::lock_guard<std::mutex> lock(m_meshMutex);
+    return m_meshes.erase(meshId) > 0;
+}
+
+/**
+ * @brief Number of loaded meshes
+ * @return size_t Mesh count
+ */
+size_t QueryServer::getMeshCount()
+{
+    std::lock_guard<std::mutex> lock(m_meshMutex);
+    return m_meshes.size();
+}
+
+/**
+ * @brief Look up a mesh, holding a reference for the caller
+ * @param meshId Mesh id
+ * @return std::shared_ptr<const Entry> Mesh entry, empty if not loaded
+ */
+std::shared_ptr<const QueryServer::Entry> QueryServer::findMesh(const uint32_t& meshId)
+{
+    std::lock_guard<std::mutex> lock(m_meshMutex);
+    std::unordered_map<uint32_t, std::shared_ptr<const Entry>>::const_iterator it = m_meshes.find(meshId);
+    return it == m_meshes.end() ? std::shared_ptr<const Entry>() : it->second;
+}
+
+/**
+ * @brief Answer a kQuery request on the worker pool
+ * @param payload Request payload
+ * @param response Output payload, one ServerHit per point
+ * @return uint32_t Status
+ */
+uint32_t QueryServer::handleQuery(const std::vector<char>& payload, std::vector<char>& response)
+{
+    uint32_t meshId, count;
+    if (payload.size() < 2 * sizeof(uint32_t)) return kBadRequest;
+    memcpy(&meshId, payload.data(), sizeof(meshId));
+    memcpy(&count, payload.data() + sizeof(meshId), sizeof(count));
+    const size_t pointOffset = 2 * sizeof(uint32_t);
+    if (payload.size() != pointOffset + static_cast<size_t>(count) * sizeof(ServerPoint)) return kBadRequest;
+
+    std::shared_ptr<const Entry> entry = findMesh(meshId);
+    if (!entry) return kUnknownMesh;
+
+    response.resize(static_cast<size_t>(count) * sizeof(ServerHit));
+    const char* points = payload.data() + pointOffset;
+    char* hits = response.data();
+    const PointQuery& query = *entry->m_query;
+    m_pool.run(count, [&](size_t begin, size_t end) {
+        QueryContext context;
+        QueryHit hit;
+        for (size_t i = begin; i < end; i++)
+        {
+            ServerPoint point;
+            memcpy(&point, points + i * sizeof(ServerPoint), sizeof(point));
+            query.query(Eigen::Vector3d(point.m_x, point.m_y, point.m_z), point.m_radius, context, hit);
+
+            ServerHit out;
+            out.m_faceId = hit.m_faceId;
+            out.m_vertexId = hit.m_vertexId;
+            out.m_dist = hit.m_dist;
+            out.m_x = static_cast<float>(hit.m_point.x());
+            out.m_y = static_cast<float>(hit.m_point.y());
+            out.m_z = static_cast<float>(hit.m_point.z());
+            out.m_u = static_cast<float>(hit.m_barycentric.x());
+            out.m_v = static_cast<float>(hit.m_barycentric.y());
+            out.m_w = static_cast<float>(hit.m_barycentric.z());
+            memcpy(hits + i * sizeof(ServerHit), &out, sizeof(out));
+        }
+    }, 64);
+    return kOk;
+}
+
+/**
+ * @brief Answer one request
+ * @param request Request header
+ * @param payload Request payload
+ * @param reply Output response header
+ * @param response Output response payload
+ * @return true Keep serving; false after a shutdown request
+ */
+bool QueryServer::handle(const FrameHeader& request, const std::vector<char>& payload, FrameHeader& reply, std::vector<char>& response)
+{
+    reply.m_type = request.m_type;
+    reply.m_requestId = request.m_requestId;
+    reply.m_status = kOk;
+    response.clear();
+
+    uint32_t meshId = 0;
+    const bool hasMeshId = payload.size() >= sizeof(meshId);
+    if (hasMeshId) memcpy(&meshId, payload.data(), sizeof(meshId));
+
+    switch (request.m_type)
+    {
+    case kLoad:
+        if (!hasMeshId || payload.size() == sizeof(meshId)) reply.m_status = kBadRequest;
+        else if (!load(meshId, std::string(payload.data() + sizeof(meshId), payload.size() - sizeof(meshId)))) reply.m_status = kLoadFailed;
+        break;
+    case kEvict:
+        if (payload.size() != sizeof(meshId)) reply.m_status = kBadRequest;
+        else if (!evict(meshId)) reply.m_status = kUnknownMesh;
+        break;
+    case kQuery:
+        reply.m_status = handleQuery(payload, response);
+        if (reply.m_status != kOk) response.clear();
+        break;
+    case kShutdown:
+        m_stopping = true;
+        break;
+    default:
+        reply.m_status = kBadRequest;
+        break;
+    }
+    reply.m_size = static_cast<uint32_t>(response.size());
+    return request.m_type != kShutdown;
+}
+
+/**
+ * @brief Serve one connection until it closes or the server is shut down
+ * @param inFd Request stream, e.g. stdin or a socket
+ * @param outFd Response stream, e.g. stdout or the same socket
+ * @return true The connection ended cleanly, between two requests
+ */
+bool QueryServer::serve(const int& inFd, const int& outFd)
+{
+    FrameHeader request, reply;
+    std::vector<char> payload, response;
+    while (!m_stopping)
+    {
+        if (!readFully(inFd, &request, sizeof(request))) return true;
+        if (request.m_size > kMaxPayload)
+        {
+            // can't skip that much, the stream is lost
+            reply.m_type = request.m_type;
+            reply.m_requestId = request.m_requestId;
+            reply.m_status = kBadRequest;
+            reply.m_size = 0;
+            writeFully(outFd, &reply, sizeof(reply));
+            return false;
+        }
+        payload.resize(request.m_size);
+        if (!readFully(inFd, payload.data(), payload.size())) return false;
+
+        const bool keepGoing = handle(request, payload, reply, response);
+        if (!writeFully(outFd, &reply, sizeof(reply)) || !writeFully(outFd, response.data(), response.size())) return false;
+        if (!keepGoing)
+        {
+#ifndef _WIN32
+            // wake the accept loop of serveSocket() only once the shutdown is
+            // answered, it closes every connection on its way out
+            const int listenFd = m_listenFd.load();
+            if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);
+#endif
+            break;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Listen on a Unix domain socket and serve every client on its own
+ * thread until a shutdown request. The socket file is replaced if it exists
+ * and removed on exit. Not available on Windows, use serve() on stdin / stdout
+ * there.
+ * @param socketPath Socket file path
+ * @return true Clean shutdown
+ */
+bool QueryServer::serveSocket(const char* socketPath)
+{
+#ifdef _WIN32
+    fprintf(stderr, "Unix domain sockets are not supported on this platform, could not listen on %s\n", socketPath);
+    return false;
+#else
+    // a client hanging up mid response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return false;
+    }
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listenFd, 64) < 0)
+    {
+        fprintf(stderr, "Could not listen on %s: %s\n", socketPath, strerror(errno));
+        if (listenFd >= 0) close(listenFd);
+        return false;
+    }
+    m_listenFd = listenFd;
+
+    std::vector<Connection> connections;
+    while (!m_stopping)
+    {
+        const int client = accept(listenFd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        // reap finished clients so short lived ones don't pile up
+        for (size_t i = 0; i < connections.size(); )
+        {
+            if (!connections[i].m_done->load())
+            {
+                i++;
+                continue;
+            }
+            connections[i].m_thread.join();
+            close(connections[i].m_fd);
+            connections[i] = std::move(connections.back());
+            connections.pop_back();
+        }
+
+        Connection connection;
+        connection.m_fd = client;
+        connection.m_done = std::make_shared<std::atomic<bool>>(false);
+        std::shared_ptr<std::atomic<bool>> done = connection.m_done;
+        connection.m_thread = std::thread([this, client, done]() {
+            serve(client, client);
+            *done = true;
+        });
+        connections.push_back(std::move(connection));
+    }
+
+    // unblock clients still waiting for a request, then wait for them
+    for (size_t i = 0; i < connections.size(); i++) shutdown(connections[i].m_fd, SHUT_RDWR);
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        connections[i].m_thread.join();
+        close(connections[i].m_fd);
+    }
+    m_listenFd = -1;
+    close(listenFd);
+    unlink(socketPath);
+    return m_stopping;
+#endif
+}
@@ -0,0 +1,308 @@
+#include "PointQuery.h"
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+// box entry distances and triangle distances are computed differently, keep a
+// little slack so a box holding an equally distant hit is never culled
+const double kRaySlack = 1.0 + 1e-7;
+
+/**
+ * @brief Component wise inverse of a ray direction, zero components give inf
+ * @param direction Ray direction
+ * @return Eigen::Vector3d Inverse direction
+ */
+inline Eigen::Vector3d inverseDirection(const Eigen::Vector3d& direction)
+{
+    return Eigen::Vector3d(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z());
+}
+}
+
+/**
+ * @brief Intersect one face and keep it if it is hit closer than the current
+ * best. On equal distances the lowest face id wins, so the result does not
+ * depend on the order faces are visited in.
+ * @param ray Prepared ray
+ * @param faceId Face to test
+ * @param bestT Current best distance along the ray, updated
+ * @param bestFace Current best face, updated
+ * @param bestBarycentric Barycentrics of the current best hit, updated
+ * @return true The face became the best hit
+ */
+bool PointQuery::testRayFace(const ShearedRay& ray, const int& faceId, double& bestT, int& bestFace, Eigen::Vector3d& bestBarycentric) const
+{
+    Eigen::Vector3d v1, v2, v3, barycentric;
+    m_mesh.getFaceVertices(faceId, v1, v2, v3);
+    double t;
+    if (!intersectTriangle(ray, v1, v2, v3, t, barycentric) || t < 0.0) return false;
+    if (t < bestT || (t == bestT && (bestFace < 0 || faceId < bestFace)))
+    {
+        bestT = t;
+        bestFace = faceId;
+        bestBarycentric = barycentric;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Fill the ray hit record once the search is over
+ * @param origin Ray origin
+ * @param faceId Face hit, -1 if none
+ * @param t Distance along the ray of the hit, the max distance if none
+ * @param barycentric Barycentrics of the hit
+ * @param hit Output hit record
+ */
+void PointQuery::fillRayHit(const Eigen::Vector3d& origin, const int& faceId, const double& t, const Eigen::Vector3d& barycentric, RayHit& hit) const
+{
+    hit.m_found = faceId >= 0;
+    hit.m_faceId = faceId;
+    hit.m_t = t;
+    if (faceId >= 0)
+    {
+        // interpolate the face so the point lies on it
+        Eigen::Vector3d v1, v2, v3;
+        m_mesh.getFaceVertices(faceId, v1, v2, v3);
+        hit.m_barycentric = barycentric;
+        hit.m_point = barycentric.x()*v1 + barycentric.y()*v2 + barycentric.z()*v3;
+    }
+    else
+    {
+        hit.m_barycentric.setZero();
+        hit.m_point = origin;
+    }
+}
+
+/**
+ * @brief Walk the BVH along a ray, nearest box first, skipping every node the
+ * ray enters further away than the current best hit.
+ * @tparam AnyHit Stop at the first face hit within the max distance
+ * @param origin Ray origin
+ * @param direction Ray direction
+ * @param maxDist Max distance along the ray, in direction lengths
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @return true A face was hit
+ */
+template <bool AnyHit>
+bool PointQuery::traverseRay(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const
+{
+    const ShearedRay ray = shearRay(origin, direction);
+    const Eigen::Vector3d invDir = inverseDirection(direction);
+    double bestT = maxDist;
+    int bestFace = -1;
+    Eigen::Vector3d bestBarycentric = Eigen::Vector3d::Zero();
+
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    double tNear;
+    if (!m_bvh.empty() && BVH::rayBoxIntersect(origin, invDir, m_bvh.getNode(0), bestT * kRaySlack, tNear)) stack[stackSize++] = {0, tNear};
+
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > bestT * kRaySlack) continue;
+
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+        if (node.isLeaf())
+        {
+            if (!m_bvh.hasSlots(node)) continue;
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = m_bvh.getFaceIndex(slot);
+                if (faceId < 0) continue;
+                if (testRayFace(ray, faceId, bestT, bestFace, bestBarycentric) && AnyHit)
+                {
+                    fillRayHit(origin, bestFace, bestT, bestBarycentric, hit);
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        // push the far child first so the near one is popped next
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        double tL, tR;
+        bool hitL = BVH::rayBoxIntersect(origin, invDir, m_bvh.getNode(node.m_left), bestT * kRaySlack, tL);
+        bool hitR = BVH::rayBoxIntersect(origin, invDir, m_bvh.getNode(node.m_left + 1), bestT * kRaySlack, tR);
+        if (hitL && hitR)
+        {
+            if (tL < tR)
+            {
+                stack[stackSize++] = {node.m_left + 1, tR};
+                stack[stackSize++] = {node.m_left, tL};
+            }
+            else
+            {
+                stack[stackSize++] = {node.m_left, tL};
+                stack[stackSize++] = {node.m_left + 1, tR};
+            }
+        }
+        else if (hitL)
+        {
+            stack[stackSize++] = {node.m_left, tL};
+        }
+        else if (hitR)
+        {
+            stack[stackSize++] = {node.m_left + 1, tR};
+        }
+    }
+
+    fillRayHit(origin, bestFace, bestT, bestBarycentric, hit);
+    return hit.m_found;
+}
+
+/**
+ * @brief First hit ray query; the closest face the ray crosses between its
+ * origin and the max distance. Does not allocate.
+ * @param origin Ray origin
+ * @param direction Ray direction, any length
+ * @param maxDist Max distance along the ray, in direction lengths, inclusive
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @return true A face was hit
+ */
+bool PointQuery::intersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const
+{
+    return traverseRay<false>(origin, direction, maxDist, context, hit);
+}
+
+/**
+ * @brief Any hit ray query; stops at the first face found within the max
+ * distance, which is not necessarily the closest. For visibility and
+ * occlusion tests.
+ * @param origin Ray origin
+ * @param direction Ray direction, any length
+ * @param maxDist Max distance along the ray, in direction lengths, inclusive
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record
+ * @return true A face was hit
+ */
+bool PointQuery::intersectAny(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, QueryContext& context, RayHit& hit) const
+{
+    return traverseRay<true>(origin, direction, maxDist, context, hit);
+}
+
+/**
+ * @brief Intersect a packet of coherent rays together, e.g. neighbouring pins
+ * projected along similar normals. Like queryPacket() every node is fetched
+ * once for all lanes that still need it, and a lane drops out of a subtree as
+ * soon as the subtree lies beyond its own best hit. First hit lanes give the
+ * same result as intersect(); any hit lanes stop as soon as they hit anything.
+ * @param origins Ray origins
+ * @param directions Ray directions
+ * @param maxDists Max distance per ray
+ * @param count Number of rays, at most QueryContext::kPacketSize
+ * @param anyHit Any hit instead of first hit
+ * @param context Scratch memory of the calling thread
+ * @param hits Output hit records, one per ray
+ */
+void PointQuery::intersectPacket(const Eigen::Vector3d* origins, const Eigen::Vector3d* directions, const double* maxDists, const int& count, const bool& anyHit, QueryContext& context, RayHit* hits) const
+{
+    const int lanes = std::min(count, static_cast<int>(QueryContext::kPacketSize));
+    ShearedRay rays[QueryContext::kPacketSize];
+    Eigen::Vector3d invDirs[QueryContext::kPacketSize], bestBarycentric[QueryContext::kPacketSize];
+    double bestT[QueryContext::kPacketSize];
+    int bestFace[QueryContext::kPacketSize];
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        rays[lane] = shearRay(origins[lane], directions[lane]);
+        invDirs[lane] = inverseDirection(directions[lane]);
+        bestT[lane] = maxDists[lane];
+        bestFace[lane] = -1;
+        bestBarycentric[lane].setZero();
+    }
+
+    PacketEntry* stack = context.m_packetStack;
+    int stackSize = 0;
+    uint32_t done = 0;
+    if (!m_bvh.empty() && lanes > 0) stack[stackSize++] = {0, (1u << lanes) - 1};
+
+    while (stackSize > 0)
+    {
+        PacketEntry entry = stack[--stackSize];
+        const BVHNode& node = m_bvh.getNode(entry.m_node);
+
+        // lanes whose ray still reaches this node before its best hit
+        uint32_t mask = 0;
+        double tNear;
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            if (!(entry.m_mask & ~done & (1u << lane))) continue;
+            if (BVH::rayBoxIntersect(origins[lane], invDirs[lane], node, bestT[lane] * kRaySlack, tNear)) mask |= 1u << lane;
+        }
+        if (!mask) continue;
+
+        if (node.isLeaf())
+        {
+            if (!m_bvh.hasSlots(node)) continue;
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = m_bvh.getFaceIndex(slot);
+                if (faceId < 0) continue;
+                for (int lane = 0; lane < lanes; lane++)
+                {
+                    if (!(mask & ~done & (1u << lane))) continue;
+                    if (testRayFace(rays[lane], faceId, bestT[lane], bestFace[lane], bestBarycentric[lane]) && anyHit)
+                    {
+                        done |= 1u << lane;
+                    }
+                }
+            }
+            continue;
+        }
+
+        // order the children by the first active lane, the packet is coherent
+        // so it stands in for the others
+        if (!m_bvh.hasChildren(entry.m_node, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        int first = 0;
+        while (!(mask & (1u << first))) first++;
+        double tL, tR;
+        bool hitL = BVH::rayBoxIntersect(origins[first], invDirs[first], m_bvh.getNode(node.m_left), bestT[first] * kRaySlack, tL);
+        bool hitR = BVH::rayBoxIntersect(origins[first], invDirs[first], m_bvh.getNode(node.m_left + 1), bestT[first] * kRaySlack, tR);
+        if (!hitL) tL = std::numeric_limits<double>::infinity();
+        if (!hitR) tR = std::numeric_limits<double>::infinity();
+        if (tL < tR)
+        {
+            stack[stackSize++] = {node.m_left + 1, mask};
+            stack[stackSize++] = {node.m_left, mask};
+        }
+        else
+        {
+            stack[stackSize++] = {node.m_left, mask};
+            stack[stackSize++] = {node.m_left + 1, mask};
+        }
+    }
+
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        fillRayHit(origins[lane], bestFace[lane], bestT[lane], bestBarycentric[lane], hits[lane]);
+    }
+}
+
+/**
+ * @brief Reference first hit ray query, intersects every face of the mesh.
+ * Kept to validate the BVH path.
+ * @param origin Ray origin
+ * @param direction Ray direction, any length
+ * @param maxDist Max distance along the ray, in direction lengths, inclusive
+ * @param hit Output hit record
+ * @return true A face was hit
+ */
+bool PointQuery::bruteForceIntersect(const Eigen::Vector3d& origin, const Eigen::Vector3d& direction, const double& maxDist, RayHit& hit) const
+{
+    const ShearedRay ray = shearRay(origin, direction);
+    double bestT = maxDist;
+    int bestFace = -1;
+    Eigen::Vector3d bestBarycentric = Eigen::Vector3d::Zero();
+
+    const int faceCount = static_cast<int>(m_mesh.getFaceCount());
+    for(int i=0; i<faceCount; i++)
+    {
+        testRayFace(ray, i, bestT, bestFace, bestBarycentric);
+    }
+
+    fillRayHit(origin, bestFace, bestT, bestBarycentric, hit);
+    return hit.m_found;
+}
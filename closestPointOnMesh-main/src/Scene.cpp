@@ -0,0 +1,270 @@
+#include "Scene.h"
+#include <Eigen3/Eigen/SVD>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+/**
+ * @brief Add a mesh to the scene, through its query object
+ * @param query Query object of the mesh, the bottom level tree
+ * @return int Mesh id, for addInstance()
+ */
+int Scene::addMesh(const PointQuery& query)
+{
+    m_meshes.push_back(&query);
+    return static_cast<int>(m_meshes.size()) - 1;
+}
+
+/**
+ * @brief Place a mesh in the scene. build() has to be called again before
+ * querying.
+ * @param meshId Mesh id from addMesh()
+ * @param transform Mesh to world transform; rotation, translation, mirroring
+ * and uniform scale only, stored re-orthonormalized
+ * @return int Instance id, -1 for an unknown mesh or an unsupported transform
+ */
+int Scene::addInstance(const int& meshId, const Eigen::Affine3d& transform)
+{
+    if (meshId < 0 || meshId >= getMeshCount())
+    {
+        printf("Scene has no mesh %d\n", meshId);
+        return -1;
+    }
+
+    // polar decomposition L = R S of the linear part: a similarity has all
+    // singular values equal. Transforms read from text or chained in float
+    // are off by more than double rounding, so they only have to agree to
+    // 1e-5, and the rotation is then rebuilt orthonormal so the instance is
+    // an exact similarity
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(transform.linear(), Eigen::ComputeFullU | Eigen::ComputeFullV);
+    const Eigen::Vector3d singular = svd.singularValues();
+    const double scale = singular.mean();
+    if (!(scale > 0.0) || singular.maxCoeff() - singular.minCoeff() > 1e-5 * scale)
+    {
+        printf("Scene instance of mesh %d needs a rigid transform with uniform scale\n", meshId);
+        return -1;
+    }
+    const Eigen::Matrix3d rotation = svd.matrixU() * svd.matrixV().transpose();
+
+    SceneInstance instance;
+    instance.m_meshId = meshId;
+    instance.m_transform.setIdentity();
+    instance.m_transform.linear() = scale * rotation;
+    instance.m_transform.translation() = transform.translation();
+    instance.m_inverse.setIdentity();
+    instance.m_inverse.linear() = rotation.transpose() / scale;
+    instance.m_inverse.translation() = -(instance.m_inverse.linear() * transform.translation());
+    instance.m_scale = scale;
+    m_instances.push_back(instance);
+    return static_cast<int>(m_instances.size()) - 1;
+}
+
+/**
+ * @brief Build the top level tree over the world bounds of the instances,
+ * median splits on the longest axis. Instances of empty meshes are left out.
+ */
+void Scene::build()
+{
+    m_nodes.clear();
+    m_instanceIndices.clear();
+
+    // world bounds of each instance, the transformed corners of its mesh bounds
+    std::vector<BVHNode> bounds(m_instances.size());
+    for (size_t i = 0; i < m_instances.size(); i++)
+    {
+        const SceneInstance& instance = m_instances[i];
+        const BVH& bvh = m_meshes[instance.m_meshId]->getBVH();
+        if (bvh.empty()) continue;
+
+        const BVHNode& root = bvh.getNode(0);
+        for (int corner = 0; corner < 8; corner++)
+        {
+            Eigen::Vector3d local((corner & 1) ? root.m_max.x() : root.m_min.x(),
+                                  (corner & 2) ? root.m_max.y() : root.m_min.y(),
+                                  (corner & 4) ? root.m_max.z() : root.m_min.z());
+            Eigen::Vector3d world = instance.m_transform * local;
+            bounds[i].m_min = corner == 0 ? world : Eigen::Vector3d(bounds[i].m_min.cwiseMin(world));
+            bounds[i].m_max = corner == 0 ? world : Eigen::Vector3d(bounds[i].m_max.cwiseMax(world));
+        }
+        m_instanceIndices.push_back(static_cast<int>(i));
+    }
+    if (m_instanceIndices.empty()) return;
+
+    m_nodes.reserve(2 * m_instanceIndices.size());
+    m_nodes.resize(1);
+    buildNode(0, 0, static_cast<int>(m_instanceIndices.size()), bounds, 0);
+}
+
+/**
+ * @brief Recursive top level build step
+ * @param nodeId Node to fill
+ * @param first First slot of the node's instances
+ * @param count Number of instances
+ * @param bounds World bounds per instance
+ * @param depth Depth of the node
+ */
+void Scene::buildNode(const int& nodeId, const int& first, const int& count, const std::vector<BVHNode>& bounds, const int& depth)
+{
+    Eigen::Vector3d bmin = bounds[m_instanceIndices[first]].m_min;
+    Eigen::Vector3d bmax = bounds[m_instanceIndices[first]].m_max;
+    Eigen::Vector3d cmin = 0.5 * (bmin + bmax), cmax = cmin;
+    for (int i = first + 1; i < first + count; i++)
+    {
+        const BVHNode& b = bounds[m_instanceIndices[i]];
+        bmin = bmin.cwiseMin(b.m_min);
+        bmax = bmax.cwiseMax(b.m_max);
+        cmin = cmin.cwiseMin(0.5 * (b.m_min + b.m_max));
+        cmax = cmax.cwiseMax(0.5 * (b.m_min + b.m_max));
+    }
+    m_nodes[nodeId].m_min = bmin;
+    m_nodes[nodeId].m_max = bmax;
+
+    if (count <= kLeafSize || depth >= kMaxDepth - 1)
+    {
+        m_nodes[nodeId].m_left = first;
+        m_nodes[nodeId].m_count = count;
+        return;
+    }
+
+    int axis;
+    (cmax - cmin).maxCoeff(&axis);
+    const int mid = first + count / 2;
+    std::nth_element(m_instanceIndices.begin() + first, m_instanceIndices.begin() + mid, m_instanceIndices.begin() + first + count,
+                     [&](const int& a, const int& b) {
+                         return bounds[a].m_min[axis] + bounds[a].m_max[axis] < bounds[b].m_min[axis] + bounds[b].m_max[axis];
+                     });
+
+    const int left = static_cast<int>(m_nodes.size());
+    m_nodes.resize(left + 2);
+    m_nodes[nodeId].m_left = left;
+    m_nodes[nodeId].m_count = 0;
+    buildNode(left, first, mid - first, bounds, depth + 1);
+    buildNode(left + 1, mid, first + count - mid, bounds, depth + 1);
+}
+
+namespace
+{
+/**
+ * @brief Reset a scene hit to nothing found
+ * @param queryPoint Query point
+ * @param maxDist Search radius
+ * @param hit Output hit record
+ */
+void clearSceneHit(const Eigen::Vector3d& queryPoint, const float& maxDist, SceneHit& hit)
+{
+    hit.m_instanceId = -1;
+    hit.m_hit.m_found = false;
+    hit.m_hit.m_faceId = -1;
+    hit.m_hit.m_vertexId = -1;
+    hit.m_hit.m_point = queryPoint;
+    hit.m_hit.m_barycentric.setZero();
+    hit.m_hit.m_dist = maxDist;
+    hit.m_hit.m_distSq = static_cast<double>(maxDist) * maxDist;
+}
+
+/**
+ * @brief Keep an instance hit if it beats the current best; on equal distances
+ * the lower instance id wins, so the result does not depend on the walk order
+ * @param instance Instance queried
+ * @param instanceId Its id
+ * @param localHit Hit of the mesh query in instance space
+ * @param bestDist Current best world distance, updated
+ * @param hit Scene hit, updated
+ */
+void acceptInstanceHit(const SceneInstance& instance, const int& instanceId, const QueryHit& localHit, float& bestDist, SceneHit& hit)
+{
+    const float dist = static_cast<float>(localHit.m_dist * instance.m_scale);
+    if (!(dist < bestDist || (dist == bestDist && (hit.m_instanceId < 0 || instanceId < hit.m_instanceId)))) return;
+
+    bestDist = dist;
+    hit.m_instanceId = instanceId;
+    hit.m_hit = localHit;
+    hit.m_hit.m_point = instance.m_transform * localHit.m_point;
+    hit.m_hit.m_dist = dist;
+    hit.m_hit.m_distSq = localHit.m_distSq * instance.m_scale * instance.m_scale;
+}
+}
+
+/**
+ * @brief Closest point over all instances. Walks the top level tree nearest
+ * node first and queries the instances of every leaf whose bounds are within
+ * the best distance so far, each in instance space with the radius scaled to
+ * it.
+ * Does not allocate; the mesh queries use the context, the top level walk its
+ * own stack.
+ * @param queryPoint Query point, world space
+ * @param maxDist Max radius, world units
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record, world space
+ * @return true Something was found within the radius
+ */
+bool Scene::query(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, SceneHit& hit) const
+{
+    clearSceneHit(queryPoint, maxDist, hit);
+    float bestDist = maxDist;
+
+    // same slack as the mesh walk, node bounds are double and distances float
+    const double slack = 1.0 + 1e-5;
+    TraversalEntry stack[2 * kMaxDepth + 2];
+    int stackSize = 0;
+    if (!m_nodes.empty()) stack[stackSize++] = {0, BVH::pointBoxDistanceSq(queryPoint, m_nodes[0])};
+
+    QueryHit localHit;
+    while (stackSize > 0)
+    {
+        TraversalEntry entry = stack[--stackSize];
+        if (entry.m_distSq > static_cast<double>(bestDist) * bestDist * slack) continue;
+
+        const BVHNode& node = m_nodes[entry.m_node];
+        if (node.isLeaf())
+        {
+            for (int i = node.m_left; i < node.m_left + node.m_count; i++)
+            {
+                const int instanceId = m_instanceIndices[i];
+                const SceneInstance& instance = m_instances[instanceId];
+                const float localMax = static_cast<float>(bestDist / instance.m_scale * slack);
+                if (!m_meshes[instance.m_meshId]->query(instance.m_inverse * queryPoint, localMax, context, localHit)) continue;
+                acceptInstanceHit(instance, instanceId, localHit, bestDist, hit);
+            }
+            continue;
+        }
+
+        double distL = BVH::pointBoxDistanceSq(queryPoint, m_nodes[node.m_left]);
+        double distR = BVH::pointBoxDistanceSq(queryPoint, m_nodes[node.m_left + 1]);
+        if (distL < distR)
+        {
+            stack[stackSize++] = {node.m_left + 1, distR};
+            stack[stackSize++] = {node.m_left, distL};
+        }
+        else
+        {
+            stack[stackSize++] = {node.m_left, distL};
+            stack[stackSize++] = {node.m_left + 1, distR};
+        }
+    }
+    return hit.m_instanceId >= 0;
+}
+
+/**
+ * @brief Reference scene query, the linear scan of every instance's mesh. Kept
+ * to validate query().
+ * @param queryPoint Query point, world space
+ * @param maxDist Max radius, world units
+ * @param hit Output hit record, world space
+ * @return true Something was found within the radius
+ */
+bool Scene::bruteForce(const Eigen::Vector3d& queryPoint, const float& maxDist, SceneHit& hit) const
+{
+    clearSceneHit(queryPoint, maxDist, hit);
+    float bestDist = maxDist;
+
+    QueryHit localHit;
+    for (int instanceId = 0; instanceId < getInstanceCount(); instanceId++)
+    {
+        const SceneInstance& instance = m_instances[instanceId];
+        const float localMax = static_cast<float>(maxDist / instance.m_scale);
+        if (!m_meshes[instance.m_meshId]->bruteForce(instance.m_inverse * queryPoint, localMax, localHit)) continue;
+        acceptInstanceHit(instance, instanceId, localHit, bestDist, hit);
+    }
+    return hit.m_instanceId >= 0;
+}
@@ -0,0 +1,171 @@
+#include "PointQuery.h"
+#include "Parallel.h"
+#include <algorithm>
+
+/**
+ * @brief Compute the dipole expansion of every BVH node (Barill et al. 2018).
+ * Leaves sum their faces directly, in parallel; interior nodes combine their
+ * children, walking the node array backwards since children always come after
+ * their parent. Run once through needWinding(), again after a refit.
+ * @param threadCount Worker count, 0 for one per hardware thread
+ */
+void PointQuery::buildWinding(const int& threadCount) const
+{
+    const int nodeCount = m_bvh.getNodeCount();
+    m_windingNodes.assign(nodeCount, WindingNode());
+
+    parallelFor(nodeCount, threadCount, [&](size_t begin, size_t end) {
+        Eigen::Vector3d v1, v2, v3;
+        for (size_t n = begin; n < end; n++)
+        {
+            const BVHNode& node = m_bvh.getNode(static_cast<int>(n));
+            if (!node.isLeaf() || !m_bvh.hasSlots(node)) continue;
+
+            WindingNode& winding = m_windingNodes[n];
+            Eigen::Vector3d normal = Eigen::Vector3d::Zero(), weighted = Eigen::Vector3d::Zero();
+            double area = 0.0;
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = m_bvh.getFaceIndex(slot);
+                if (faceId < 0) continue;
+                m_mesh.getFaceVertices(faceId, v1, v2, v3);
+                Eigen::Vector3d n2 = (v2 - v1).cross(v3 - v1);
+                double faceArea = 0.5 * n2.norm();
+                normal += 0.5 * n2;
+                weighted += faceArea * (v1 + v2 + v3) / 3.0;
+                area += faceArea;
+            }
+            winding.m_normal = normal;
+            winding.m_area = area;
+            winding.m_center = area > 0.0 ? Eigen::Vector3d(weighted / area) : Eigen::Vector3d(0.5 * (node.m_min + node.m_max));
+
+            double radiusSq = 0.0;
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = m_bvh.getFaceIndex(slot);
+                if (faceId < 0) continue;
+                m_mesh.getFaceVertices(faceId, v1, v2, v3);
+                radiusSq = std::max(radiusSq, (v1 - winding.m_center).squaredNorm());
+                radiusSq = std::max(radiusSq, (v2 - winding.m_center).squaredNorm());
+                radiusSq = std::max(radiusSq, (v3 - winding.m_center).squaredNorm());
+            }
+            winding.m_radius = std::sqrt(radiusSq);
+        }
+    }, 1024);
+
+    for (int n = nodeCount - 1; n >= 0; n--)
+    {
+        const BVHNode& node = m_bvh.getNode(n);
+        if (!m_bvh.hasChildren(n, node)) continue;
+
+        const WindingNode& left = m_windingNodes[node.m_left];
+        const WindingNode& right = m_windingNodes[node.m_left + 1];
+        WindingNode& winding = m_windingNodes[n];
+
+        const double area = left.m_area + right.m_area;
+        winding.m_normal = left.m_normal + right.m_normal;
+        winding.m_area = area;
+        winding.m_center = area > 0.0 ? Eigen::Vector3d((left.m_area * left.m_center + right.m_area * right.m_center) / area) : Eigen::Vector3d(0.5 * (node.m_min + node.m_max));
+        winding.m_radius = std::max((left.m_center - winding.m_center).norm() + left.m_radius,
+                                    (right.m_center - winding.m_center).norm() + right.m_radius);
+    }
+}
+
+/**
+ * @brief Generalized winding number of the mesh at a point: about 1 inside a
+ * closed mesh with outward facing faces, 0 outside, and a smooth blend near
+ * holes, so it still tells inside from outside on meshes that are not quite
+ * closed. Nodes further away than the accuracy factor (see
+ * setWindingAccuracy(), default 2) times their radius are replaced by their
+ * dipole, closer ones are opened and leaf faces are summed exactly, so a query
+ * costs O(log n) node visits on well shaped meshes. The first call builds the
+ * dipoles, later ones do not allocate.
+ * @param queryPoint Query point
+ * @param context Scratch memory of the calling thread
+ * @return double Winding number
+ */
+double PointQuery::windingNumber(const Eigen::Vector3d& queryPoint, QueryContext& context) const
+{
+    needWinding();
+
+    double winding = 0.0;
+    TraversalEntry* stack = context.m_stack;
+    int stackSize = 0;
+    if (!m_bvh.empty()) stack[stackSize++] = {0, 0.0};
+
+    Eigen::Vector3d v1, v2, v3;
+    while (stackSize > 0)
+    {
+        const int nodeId = stack[--stackSize].m_node;
+        const WindingNode& far = m_windingNodes[nodeId];
+        const double reach = m_windingAccuracy * far.m_radius;
+        if ((far.m_center - queryPoint).squaredNorm() > reach * reach)
+        {
+            winding += dipoleWinding(far, queryPoint);
+            continue;
+        }
+
+        const BVHNode& node = m_bvh.getNode(nodeId);
+        if (node.isLeaf())
+        {
+            if (!m_bvh.hasSlots(node)) continue;
+            for (int slot = node.m_left; slot < node.m_left + node.m_count; slot++)
+            {
+                int faceId = m_bvh.getFaceIndex(slot);
+                if (faceId < 0) continue;
+                m_mesh.getFaceVertices(faceId, v1, v2, v3);
+                winding += triangleWinding(v1, v2, v3, queryPoint);
+            }
+            continue;
+        }
+        if (!m_bvh.hasChildren(nodeId, node) || stackSize + 2 > QueryContext::kStackSize) continue;
+        stack[stackSize++] = {node.m_left + 1, 0.0};
+        stack[stackSize++] = {node.m_left, 0.0};
+    }
+    return winding;
+}
+
+/**
+ * @brief Inside / outside test, the winding number rounded to 0 or 1
+ * @param queryPoint Query point
+ * @param context Scratch memory of the calling thread
+ * @return true The point is inside the mesh
+ */
+bool PointQuery::isInside(const Eigen::Vector3d& queryPoint, QueryContext& context) const
+{
+    return windingNumber(queryPoint, context) > 0.5;
+}
+
+/**
+ * @brief Signed distance to the mesh, negative inside; the closest point query
+ * gives the distance, the winding number the sign.
+ * @param queryPoint Query point
+ * @param maxDist Max radius of the closest point search
+ * @param context Scratch memory of the calling thread
+ * @param hit Output hit record of the closest point search
+ * @return float Signed distance, +-maxDist if nothing is within the radius
+ */
+float PointQuery::signedDistance(const Eigen::Vector3d& queryPoint, const float& maxDist, QueryContext& context, QueryHit& hit) const
+{
+    query(queryPoint, maxDist, context, hit);
+    return isInside(queryPoint, context) ? -hit.m_dist : hit.m_dist;
+}
+
+/**
+ * @brief Reference winding number, sums the solid angle of every face. Kept to
+ * validate windingNumber().
+ * @param queryPoint Query point
+ * @return double Winding number
+ */
+double PointQuery::bruteForceWindingNumber(const Eigen::Vector3d& queryPoint) const
+{
+    double winding = 0.0;
+    const size_t faceCount = m_mesh.getFaceCount();
+    Eigen::Vector3d v1, v2, v3;
+    for(uint32_t i=0; i<faceCount; i++)
+    {
+        m_mesh.getFaceVertices(i, v1, v2, v3);
+        winding += triangleWinding(v1, v2, v3, queryPoint);
+    }
+    return winding;
+}
@@ -1,48 +1,1420 @@
-// needed once for tinyobjloader
-#define TINYOBJLOADER_IMPLEMENTATION
-
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "stdio.h"
 #include "PointQuery.h"
+#include "ClosestPointEngine.h"
+#include "DistanceField.h"
+#include "Scene.h"
+#include "QueryServer.h"
+#include "Parallel.h"
+#include "MeshCache.h"
+#include "MeshCleanup.h"
+#include "OutOfCoreBVH.h"
+#include "Morton.h"
+#include "ProcessMemory.h"
+
+/**
+ * @brief One line of the query file; x y z and search radius
+ */
+struct QueryInput
+{
+    float m_x, m_y, m_z, m_radius;
+};
+
+/**
+ * @brief Append the report for one query to the output buffer. Same text for
+ * the single threaded and batch paths so outputs can be diffed.
+ * @param out Output buffer
+ * @param input Query input
+ * @param hit Query result
+ */
+void appendResult(std::string& out, const QueryInput& input, const QueryHit& hit)
+{
+    char line[512];
+    const Eigen::Vector3d& result = hit.m_point;
+    out += "===============================================\n";
+    if(hit.m_found)
+    {
+        snprintf(line, sizeof(line), "FOUND pt: %f %f %f within distance: %f to query pt: %f %f %f max search radius: %f\n", result.x(), result.y(), result.z(), hit.m_dist, input.m_x, input.m_y, input.m_z, input.m_radius);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "NOT FOUND pt within distance %f to query pt %f %f %f\n", hit.m_dist, input.m_x, input.m_y, input.m_z);
+    }
+    out += line;
+}
+
+/**
+ * @brief Batch mode; load every query up front, spread them over worker
+ * threads and write the results in the original input order.
+ * @param query Query object, shared read only by all workers
+ * @param input Query file stream
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Use the linear scan instead of the BVH
+ * @param coherent Warm start every query from the previous one of its worker
+ * @param packets Sort queries along a Morton curve and walk the BVH in packets
+ * @param stats Output traversal counters per query (per packet with packets) appended, NULL to skip
+ */
+void runBatch(const PointQuery& query, std::ifstream& input, const int& threadCount, const bool& bruteForce, const bool& coherent, const bool& packets, std::vector<TraversalStats>* stats)
+{
+    std::vector<QueryInput> queries;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        queries.push_back(q);
+    }
+
+    std::vector<QueryHit> results(queries.size());
+    const size_t statsOffset = stats ? stats->size() : 0;
+    if(packets && !bruteForce)
+    {
+        // neighbours along the curve go in the same packet, results are
+        // scattered back to input order
+        std::vector<Eigen::Vector3d> points(queries.size());
+        for(size_t i=0; i<queries.size(); i++)
+        {
+            points[i] = Eigen::Vector3d(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+        }
+        std::vector<uint32_t> order;
+        mortonOrder(points, order);
+
+        const size_t packetSize = QueryContext::kPacketSize;
+        const size_t packetCount = (queries.size() + packetSize - 1) / packetSize;
+        if(stats) stats->resize(statsOffset + packetCount);
+        parallelFor(packetCount, threadCount, [&](size_t begin, size_t end) {
+            QueryContext context;
+            Eigen::Vector3d packetPoints[QueryContext::kPacketSize];
+            float packetDists[QueryContext::kPacketSize];
+            QueryHit packetHits[QueryContext::kPacketSize];
+            for(size_t p=begin; p<end; p++)
+            {
+                const size_t first = p * packetSize;
+                const int count = static_cast<int>(std::min(packetSize, queries.size() - first));
+                for(int k=0; k<count; k++)
+                {
+                    packetPoints[k] = points[order[first + k]];
+                    packetDists[k] = queries[order[first + k]].m_radius;
+                }
+                context.m_stats.reset();
+                query.queryPacket(packetPoints, packetDists, count, context, packetHits);
+                if(stats) (*stats)[statsOffset + p] = context.m_stats;
+                for(int k=0; k<count; k++)
+                {
+                    results[order[first + k]] = packetHits[k];
+                }
+            }
+        }, 8);
+    }
+    else
+    {
+        if(stats) stats->resize(statsOffset + queries.size());
+        parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+            QueryContext context;
+            for(size_t i=begin; i<end; i++)
+            {
+                const QueryInput& in = queries[i];
+                Eigen::Vector3d queryPoint(in.m_x, in.m_y, in.m_z);
+                context.m_stats.reset();
+                if(bruteForce)
+                {
+                    query.bruteForce(queryPoint, in.m_radius, results[i]);
+                }
+                else if(coherent)
+                {
+                    query.queryCoherent(queryPoint, in.m_radius, context, results[i]);
+                }
+                else
+                {
+                    query.query(queryPoint, in.m_radius, context, results[i]);
+                }
+                if(stats) (*stats)[statsOffset + i] = context.m_stats;
+            }
+        }, 64);
+    }
+
+    // write in input order, flushing in large blocks instead of per line
+    std::string out;
+    out.reserve(1 << 20);
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        appendResult(out, queries[i], results[i]);
+        if(out.size() > (1 << 20) - 1024)
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Run every query of the query file and print the results
+ * @param query Query object
+ * @param pointQueryFile Query file path
+ * @param batch Use runBatch()
+ * @param threadCount Worker count for batch mode, 0 for one per hardware thread
+ * @param bruteForce Use the linear scan instead of the BVH
+ * @param coherent Warm start every query from the previous one
+ * @param packets Morton sorted packets, batch mode only
+ * @param stats Output traversal counters per query (per packet with packets) appended, NULL to skip
+ */
+void runQueries(const PointQuery& query, const char* pointQueryFile, const bool& batch, const int& threadCount, const bool& bruteForce, const bool& coherent, const bool& packets, std::vector<TraversalStats>* stats)
+{
+    std::ifstream input(pointQueryFile);
+    fflush(stdout);
+
+    if(batch)
+    {
+        runBatch(query, input, threadCount, bruteForce, coherent, packets, stats);
+        return;
+    }
+
+    QueryInput in;
+    QueryContext context;
+    QueryHit hit;
+    std::string out;
+
+    // read input query pts & distance
+    while(input >> in.m_x >> in.m_y >> in.m_z >> in.m_radius)
+    {
+        Eigen::Vector3d queryPoint(in.m_x, in.m_y, in.m_z);
+        context.m_stats.reset();
+        if(bruteForce)
+        {
+            query.bruteForce(queryPoint, in.m_radius, hit);
+        }
+        else if(coherent)
+        {
+            query.queryCoherent(queryPoint, in.m_radius, context, hit);
+        }
+        else
+        {
+            query.query(queryPoint, in.m_radius, context, hit);
+        }
+        if(stats) stats->push_back(context.m_stats);
+
+        out.clear();
+        appendResult(out, in, hit);
+        fputs(out.c_str(), stdout);
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Percentiles and power of two histogram of one traversal counter over
+ * all queries
+ */
+struct CounterSummary
+{
+public:
+    double m_mean;
+    uint64_t m_p50, m_p90, m_p99, m_max;
+    std::vector<uint64_t> m_buckets;    // bucket 0 counts zeros, bucket b values in [2^(b-1), 2^b)
+};
+
+/**
+ * @brief Summarize one counter
+ * @param values Counter value per query, sorted in place
+ * @return CounterSummary Summary
+ */
+CounterSummary summarize(std::vector<uint64_t>& values)
+{
+    CounterSummary summary;
+    summary.m_mean = 0.0;
+    summary.m_p50 = summary.m_p90 = summary.m_p99 = summary.m_max = 0;
+    if(values.empty()) return summary;
+
+    std::sort(values.begin(), values.end());
+    double sum = 0.0;
+    for(size_t i=0; i<values.size(); i++)
+    {
+        sum += static_cast<double>(values[i]);
+        size_t bucket = 0;
+        while(bucket < 64 && (values[i] >> bucket) != 0) bucket++;
+        if(summary.m_buckets.size() <= bucket) summary.m_buckets.resize(bucket + 1, 0);
+        summary.m_buckets[bucket]++;
+    }
+    // nearest rank percentiles
+    const size_t n = values.size();
+    summary.m_mean = sum / n;
+    summary.m_p50 = values[(50 * n + 99) / 100 - 1];
+    summary.m_p90 = values[(90 * n + 99) / 100 - 1];
+    summary.m_p99 = values[(99 * n + 99) / 100 - 1];
+    summary.m_max = values.back();
+    return summary;
+}
+
+/**
+ * @brief Print the build statistics of the BVH and the traversal counters of
+ * the queries, as text histograms and as one line of JSON
+ * @param query Query object
+ * @param buildSeconds BVH build time, negative if the tree came from the cache
+ * @param stats Counters per query (per packet with packets)
+ */
+void printStats(const PointQuery& query, const double& buildSeconds, std::vector<TraversalStats>& stats)
+{
+    const BVH& bvh = query.getBVH();
+    const char* names[3] = {"nodes_visited", "triangles_tested", "early_outs"};
+    CounterSummary summaries[3];
+    std::vector<uint64_t> values(stats.size());
+    for(int c=0; c<3; c++)
+    {
+        for(size_t i=0; i<stats.size(); i++)
+        {
+            values[i] = c == 0 ? stats[i].m_nodes : (c == 1 ? stats[i].m_triangles : stats[i].m_culled);
+        }
+        summaries[c] = summarize(values);
+    }
+
+    printf("Stats: BVH build time: %f s%s, node count: %d, depth: %d, SAH cost: %f\n", std::max(0.0, buildSeconds), buildSeconds < 0.0 ? " (cached)" : "", bvh.getNodeCount(), bvh.depth(), bvh.cost());
+    printf("Stats: query count: %lu%s\n", stats.size(), kQueryStatsEnabled ? "" : ", traversal counters compiled out (configure with -DQUERY_ENABLE_STATS=ON)");
+    std::string json;
+    char text[512];
+    snprintf(text, sizeof(text), "{\"build\": {\"seconds\": %f, \"cached\": %s, \"nodes\": %d, \"depth\": %d, \"sah_cost\": %f}, \"counters\": %s, \"queries\": %lu",
+             std::max(0.0, buildSeconds), buildSeconds < 0.0 ? "true" : "false", bvh.getNodeCount(), bvh.depth(), bvh.cost(), kQueryStatsEnabled ? "true" : "false", stats.size());
+    json += text;
+    for(int c=0; c<3 && kQueryStatsEnabled; c++)
+    {
+        const CounterSummary& summary = summaries[c];
+        printf("Stats: %s mean: %.2f p50: %lu p90: %lu p99: %lu max: %lu\n", names[c], summary.m_mean, summary.m_p50, summary.m_p90, summary.m_p99, summary.m_max);
+        snprintf(text, sizeof(text), ", \"%s\": {\"mean\": %f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu, \"histogram\": [", names[c], summary.m_mean, summary.m_p50, summary.m_p90, summary.m_p99, summary.m_max);
+        json += text;
+        for(size_t b=0; b<summary.m_buckets.size(); b++)
+        {
+            const uint64_t lo = b == 0 ? 0 : (uint64_t(1) << (b - 1));
+            const uint64_t hi = b == 0 ? 1 : (uint64_t(1) << b);
+            snprintf(text, sizeof(text), "%s[%lu, %lu, %lu]", b ? ", " : "", lo, hi, summary.m_buckets[b]);
+            json += text;
+            if(summary.m_buckets[b] == 0) continue;
+
+            // bar scaled to the share of queries, 50 marks for all of them
+            std::string bar(static_cast<size_t>(50.0 * summary.m_buckets[b] / stats.size() + 0.5), '#');
+            printf("Stats:   [%lu, %lu) %lu %s\n", lo, hi, summary.m_buckets[b], bar.c_str());
+        }
+        json += "]}";
+    }
+    json += "}";
+    printf("%s\n", json.c_str());
+    fflush(stdout);
+}
+
+/**
+ * @brief Face id as numbered in the obj, for output of a cleaned mesh
+ * @param cleanup Cleanup the mesh went through, NULL if it wasn't cleaned
+ * @param face Face id of the mesh, -1 for none
+ * @return int Face id of the obj
+ */
+int originalFace(const MeshCleanup* cleanup, const int& face)
+{
+    return cleanup && face >= 0 ? static_cast<int>(cleanup->getOriginalFace(face)) : face;
+}
+
+/**
+ * @brief Vertex id as numbered in the obj, for output of a cleaned mesh
+ * @param cleanup Cleanup the mesh went through, NULL if it wasn't cleaned
+ * @param vertex Vertex id of the mesh, -1 for none
+ * @return int Vertex id of the obj
+ */
+int originalVertex(const MeshCleanup* cleanup, const int& vertex)
+{
+    return cleanup && vertex >= 0 ? static_cast<int>(cleanup->getOriginalVertex(vertex)) : vertex;
+}
+
+/**
+ * @brief Range mode; report every face and vertex within the radius of each
+ * query instead of the closest point. Runs in two passes over all queries: the
+ * first sizes each query's slice of one shared output buffer from the cheap
+ * upper bounds, the second fills the slices in parallel.
+ * @param query Query object
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Use the linear scans instead of the trees
+ * @param cleanup Cleanup the mesh went through, face and vertex ids are
+ * printed as numbered in the obj; NULL if it wasn't cleaned
+ */
+void runRange(const PointQuery& query, const char* pointQueryFile, const int& threadCount, const bool& bruteForce, const MeshCleanup* cleanup)
+{
+    std::ifstream input(pointQueryFile);
+    std::vector<QueryInput> queries;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        queries.push_back(q);
+    }
+    fflush(stdout);
+
+    // pass 1: buffer offsets from the estimates, the linear scans count exactly
+    std::vector<size_t> faceOffsets(queries.size() + 1, 0), vertexOffsets(queries.size() + 1, 0);
+    parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+            const float radius = queries[i].m_radius;
+            faceOffsets[i + 1] = bruteForce ? query.bruteForceFacesInRadius(queryPoint, radius, NULL, 0) : query.estimateFacesInRadius(queryPoint, radius);
+            vertexOffsets[i + 1] = bruteForce ? query.bruteForceVerticesInRadius(queryPoint, radius, NULL, 0) : query.estimateVerticesInRadius(queryPoint, radius);
+        }
+    }, 64);
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        faceOffsets[i + 1] += faceOffsets[i];
+        vertexOffsets[i + 1] += vertexOffsets[i];
+    }
+
+    // pass 2: fill every slice, the estimates are upper bounds so nothing is cut
+    std::vector<FaceHit> faceHits(faceOffsets.back());
+    std::vector<VertexHit> vertexHits(vertexOffsets.back());
+    std::vector<size_t> faceCounts(queries.size()), vertexCounts(queries.size());
+    parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+            const float radius = queries[i].m_radius;
+            FaceHit* faces = faceHits.data() + faceOffsets[i];
+            VertexHit* vertices = vertexHits.data() + vertexOffsets[i];
+            const size_t faceCapacity = faceOffsets[i + 1] - faceOffsets[i];
+            const size_t vertexCapacity = vertexOffsets[i + 1] - vertexOffsets[i];
+            if(bruteForce)
+            {
+                faceCounts[i] = query.bruteForceFacesInRadius(queryPoint, radius, faces, faceCapacity);
+                vertexCounts[i] = query.bruteForceVerticesInRadius(queryPoint, radius, vertices, vertexCapacity);
+            }
+            else
+            {
+                faceCounts[i] = query.getFacesInRadius(queryPoint, radius, context, faces, faceCapacity);
+                vertexCounts[i] = query.getVerticesInRadius(queryPoint, radius, vertices, vertexCapacity);
+            }
+            std::sort(faces, faces + faceCounts[i], [](const FaceHit& a, const FaceHit& b) {return a.m_id < b.m_id;});
+            std::sort(vertices, vertices + vertexCounts[i], [](const VertexHit& a, const VertexHit& b) {return a.m_id < b.m_id;});
+        }
+    }, 64);
+
+    std::string out;
+    char line[512];
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        const QueryInput& in = queries[i];
+        out += "===============================================\n";
+        snprintf(line, sizeof(line), "RANGE query pt: %f %f %f radius: %f faces: %lu vertices: %lu\n", in.m_x, in.m_y, in.m_z, in.m_radius, faceCounts[i], vertexCounts[i]);
+        out += line;
+        out += "faces:";
+        for(size_t k=0; k<faceCounts[i]; k++)
+        {
+            snprintf(line, sizeof(line), " %d", originalFace(cleanup, faceHits[faceOffsets[i] + k].m_id));
+            out += line;
+        }
+        out += "\nvertices:";
+        for(size_t k=0; k<vertexCounts[i]; k++)
+        {
+            snprintf(line, sizeof(line), " %d", originalVertex(cleanup, static_cast<int>(vertexHits[vertexOffsets[i] + k].m_id)));
+            out += line;
+        }
+        out += "\n";
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Signed mode; signed distance and inside / outside state of every
+ * query point, printed in input order
+ * @param query Query object
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Sum every face's solid angle and scan every face
+ */
+void runSigned(const PointQuery& query, const char* pointQueryFile, const int& threadCount, const bool& bruteForce)
+{
+    std::ifstream input(pointQueryFile);
+    std::vector<QueryInput> queries;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        queries.push_back(q);
+    }
+    fflush(stdout);
+
+    std::vector<float> distances(queries.size());
+    std::vector<char> inside(queries.size());
+    parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        QueryHit hit;
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+            if(bruteForce)
+            {
+                query.bruteForce(queryPoint, queries[i].m_radius, hit);
+                inside[i] = query.bruteForceWindingNumber(queryPoint) > 0.5;
+                distances[i] = inside[i] ? -hit.m_dist : hit.m_dist;
+            }
+            else
+            {
+                distances[i] = query.signedDistance(queryPoint, queries[i].m_radius, context, hit);
+                inside[i] = distances[i] < 0.0f || (distances[i] == 0.0f && query.isInside(queryPoint, context));
+            }
+        }
+    }, 64);
+
+    std::string out;
+    char line[512];
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        const QueryInput& in = queries[i];
+        out += "===============================================\n";
+        snprintf(line, sizeof(line), "%s signed distance: %f to query pt: %f %f %f max search radius: %f\n", inside[i] ? "INSIDE" : "OUTSIDE", distances[i], in.m_x, in.m_y, in.m_z, in.m_radius);
+        out += line;
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Field mode; build a sparse distance field around the mesh and answer
+ * the queries from it, refined against the faces stored at the voxel corners.
+ * Queries outside the band fall back to the exact query.
+ * @param query Query object
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param voxelSize Voxel edge length of the field
+ * @param bandWidth Distance from the surface covered by the field
+ */
+void runField(const PointQuery& query, const char* pointQueryFile, const int& threadCount, const double& voxelSize, const double& bandWidth)
+{
+    DistanceField field;
+    if(!field.build(query, voxelSize, bandWidth, threadCount)) return;
+    printf("Distance field built. Brick count: %lu. Memory: %lu bytes\n", field.getBrickCount(), field.getMemoryUsage());
+
+    std::ifstream input(pointQueryFile);
+    std::vector<QueryInput> queries;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        queries.push_back(q);
+    }
+    fflush(stdout);
+
+    std::vector<QueryHit> results(queries.size());
+    parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+            if(!field.closestPoint(queryPoint, queries[i].m_radius, results[i]))
+            {
+                query.query(queryPoint, queries[i].m_radius, context, results[i]);
+            }
+        }
+    }, 64);
+
+    std::string out;
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        appendResult(out, queries[i], results[i]);
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Precision mode; run the queries on a ClosestPointEngine of the given
+ * policy instead of the query object itself
+ * @param query Query object, the engine copies its BVH
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Use the engine's linear scan
+ * @param refine Refine float hits in double
+ * @param epsilon Run approximate queries with this error, 0 for exact ones;
+ * prints the bound each query achieved after its result
+ */
+template <typename Policy>
+void runEngine(const PointQuery& query, const char* pointQueryFile, const int& threadCount, const bool& bruteForce, const bool& refine, const float& epsilon)
+{
+    ClosestPointEngine<Policy> engine(query);
+    printf("%s engine built. Memory: %lu bytes\n", engine.getName(), engine.getMemoryUsage());
+
+    std::ifstream input(pointQueryFile);
+    std::vector<QueryInput> queries;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        queries.push_back(q);
+    }
+    fflush(stdout);
+
+    std::vector<QueryHit> results(queries.size());
+    std::vector<float> bounds(queries.size(), 1.0f);
+    parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+            if(bruteForce)
+            {
+                engine.bruteForce(queryPoint, queries[i].m_radius, results[i]);
+            }
+            else if(epsilon > 0.0f)
+            {
+                engine.queryApproximate(queryPoint, queries[i].m_radius, epsilon, context, results[i], bounds[i]);
+            }
+            else
+            {
+                engine.query(queryPoint, queries[i].m_radius, context, results[i], refine);
+            }
+        }
+    }, 64);
+
+    std::string out;
+    double boundSum = 0.0;
+    float maxBound = 1.0f;
+    for(size_t i=0; i<queries.size(); i++)
+    {
+        appendResult(out, queries[i], results[i]);
+        if(epsilon > 0.0f && results[i].m_found)
+        {
+            char line[64];
+            snprintf(line, sizeof(line), "bound: %f\n", bounds[i]);
+            out += line;
+        }
+        boundSum += bounds[i];
+        maxBound = std::max(maxBound, bounds[i]);
+    }
+    if(epsilon > 0.0f)
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "Approximate queries, epsilon %f: largest bound %f, mean bound %f\n", epsilon, maxBound, queries.empty() ? 1.0 : boundSum / queries.size());
+        out += line;
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Compare mode; distances between the first mesh and a second one,
+ * measured at the vertices both ways. Prints the one sided and symmetric
+ * Hausdorff distances and the mean and RMS chamfer distances (the averages of
+ * both directions), optionally writing the per vertex distances of the first
+ * mesh to the second. With hausdorffOnly only the Hausdorff distances are
+ * computed, skipping every part of the meshes that can't raise them.
+ * @param query Query object of the first mesh
+ * @param targetFile Second obj file
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param hausdorffOnly Skip the per vertex distances and chamfer distances
+ * @param errorFile Output file for the per vertex distances, NULL for none
+ * @param cleanup Cleanup the first mesh went through, its vertex ids and the
+ * lines of the error file follow the obj; NULL if it wasn't cleaned
+ * @return true Success
+ */
+bool runCompare(const PointQuery& query, const char* targetFile, const int& threadCount, const bool& hausdorffOnly, const char* errorFile, const MeshCleanup* cleanup)
+{
+    Mesh target;
+    if(!target.readObj(targetFile, threadCount)) return false;
+    PointQuery targetQuery(target);
+    const Mesh& mesh = query.getMesh();
+    if(mesh.getFaceCount() == 0 || target.getFaceCount() == 0)
+    {
+        printf("Both meshes need faces to be compared\n");
+        return false;
+    }
+
+    if(hausdorffOnly)
+    {
+        int forwardVertex, backwardVertex;
+        float forward = targetQuery.hausdorffDistance(query, forwardVertex, threadCount);
+        float backward = query.hausdorffDistance(targetQuery, backwardVertex, threadCount);
+        printf("Hausdorff first to second: %f at vertex %d\n", forward, originalVertex(cleanup, forwardVertex));
+        printf("Hausdorff second to first: %f at vertex %d\n", backward, backwardVertex);
+        printf("Hausdorff symmetric: %f\n", std::max(forward, backward));
+        return true;
+    }
+
+    std::vector<float> forwardErrors, backwardErrors;
+    MeshDistanceStats forward, backward;
+    targetQuery.vertexDistances(mesh, forwardErrors, forward, threadCount);
+    query.vertexDistances(target, backwardErrors, backward, threadCount);
+    printf("Hausdorff first to second: %f at vertex %d mean: %f rms: %f\n", forward.m_max, originalVertex(cleanup, forward.m_maxVertex), forward.m_mean, forward.m_rms);
+    printf("Hausdorff second to first: %f at vertex %d mean: %f rms: %f\n", backward.m_max, backward.m_maxVertex, backward.m_mean, backward.m_rms);
+    printf("Hausdorff symmetric: %f\n", std::max(forward.m_max, backward.m_max));
+    printf("Chamfer mean: %f rms: %f\n", 0.5 * (forward.m_mean + backward.m_mean), std::sqrt(0.5 * (forward.m_rms * forward.m_rms + backward.m_rms * backward.m_rms)));
+
+    if(errorFile)
+    {
+        FILE* out = fopen(errorFile, "w");
+        if(!out)
+        {
+            printf("Could not write %s\n", errorFile);
+            return false;
+        }
+        if(cleanup)
+        {
+            // one line per obj vertex; welded ones share the distance of the
+            // vertex they were merged into, dropped unused ones have none
+            const std::vector<uint32_t>& vertexMap = cleanup->getVertexMap();
+            for(size_t i=0; i<vertexMap.size(); i++)
+            {
+                if(vertexMap[i] == MeshCleanup::kRemoved) fprintf(out, "nan\n");
+                else fprintf(out, "%f\n", forwardErrors[vertexMap[i]]);
+            }
+        }
+        else
+        {
+            for(size_t i=0; i<forwardErrors.size(); i++)
+            {
+                fprintf(out, "%f\n", forwardErrors[i]);
+            }
+        }
+        fclose(out);
+    }
+    return true;
+}
+
+/**
+ * @brief Scene mode; the first file describes a scene instead of one mesh, one
+ * line per mesh or instance:
+ *   mesh {obj}
+ *   instance {mesh index} {3x4 mesh to world matrix, row major}
+ * Obj paths are relative to the scene file. Prints the instance, face and
+ * closest point of every query.
+ * @param sceneFile Scene file path
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Scan every instance's faces instead of walking the trees
+ * @return true Success
+ */
+bool runScene(const char* sceneFile, const char* pointQueryFile, const int& threadCount, const bool& bruteForce)
+{
+    std::ifstream sceneInput(sceneFile);
+    if(!sceneInput)
+    {
+        printf("Could not open scene file %s\n", sceneFile);
+        return false;
+    }
+    std::string sceneDir(sceneFile);
+    sceneDir = sceneDir.find('/') == std::string::npos ? std::string() : sceneDir.substr(0, sceneDir.rfind('/') + 1);
+
+    // meshes and queries are held by pointer, the scene keeps their addresses
+    std::vector<std::unique_ptr<Mesh>> meshes;
+    std::vector<std::unique_ptr<PointQuery>> queries;
+    Scene scene;
+    std::string line;
+    while(std::getline(sceneInput, line))
+    {
+        std::istringstream tokens(line);
+        std::string kind;
+        if(!(tokens >> kind) || kind[0] == '#') continue;
+        if(kind == "mesh")
+        {
+            std::string path;
+            tokens >> path;
+            if(!path.empty() && path[0] != '/') path = sceneDir + path;
+            meshes.push_back(std::unique_ptr<Mesh>(new Mesh()));
+            if(!meshes.back()->readObj(path.c_str(), threadCount)) return false;
+            queries.push_back(std::unique_ptr<PointQuery>(new PointQuery(*meshes.back())));
+            scene.addMesh(*queries.back());
+        }
+        else if(kind == "instance")
+        {
+            int meshId;
+            Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+            bool valid = static_cast<bool>(tokens >> meshId);
+            for(int r=0; r<3 && valid; r++)
+            {
+                for(int c=0; c<4 && valid; c++)
+                {
+                    valid = static_cast<bool>(tokens >> transform.matrix()(r, c));
+                }
+            }
+            if(!valid || scene.addInstance(meshId, transform) < 0)
+            {
+                printf("Bad scene instance: %s\n", line.c_str());
+                return false;
+            }
+        }
+        else
+        {
+            printf("Unknown scene line: %s\n", line.c_str());
+            return false;
+        }
+    }
+    scene.build();
+    printf("Scene loaded. Mesh count: %d. Instance count: %d\n", scene.getMeshCount(), scene.getInstanceCount());
+
+    std::ifstream input(pointQueryFile);
+    std::vector<QueryInput> points;
+    QueryInput q;
+    while(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)
+    {
+        points.push_back(q);
+    }
+    fflush(stdout);
+
+    std::vector<SceneHit> results(points.size());
+    parallelFor(points.size(), threadCount, [&](size_t begin, size_t end) {
+        QueryContext context;
+        for(size_t i=begin; i<end; i++)
+        {
+            Eigen::Vector3d queryPoint(points[i].m_x, points[i].m_y, points[i].m_z);
+            if(bruteForce)
+            {
+                scene.bruteForce(queryPoint, points[i].m_radius, results[i]);
+            }
+            else
+            {
+                scene.query(queryPoint, points[i].m_radius, context, results[i]);
+            }
+        }
+    }, 64);
+
+    std::string out;
+    char text[512];
+    for(size_t i=0; i<points.size(); i++)
+    {
+        const QueryInput& in = points[i];
+        const QueryHit& hit = results[i].m_hit;
+        out += "===============================================\n";
+        if(results[i].m_instanceId >= 0)
+        {
+            snprintf(text, sizeof(text), "FOUND instance: %d face: %d pt: %f %f %f within distance: %f to query pt: %f %f %f max search radius: %f\n", results[i].m_instanceId, hit.m_faceId, hit.m_point.x(), hit.m_point.y(), hit.m_point.z(), hit.m_dist, in.m_x, in.m_y, in.m_z, in.m_radius);
+        }
+        else
+        {
+            snprintf(text, sizeof(text), "NOT FOUND pt within distance %f to query pt %f %f %f\n", hit.m_dist, in.m_x, in.m_y, in.m_z);
+        }
+        out += text;
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * @brief Out of core mode; run the queries on the OutOfCoreBVH stored in the
+ * mesh cache, straight off its mapping, without loading the mesh. When the
+ * cache is stale, has no tree yet or one from the other BVH builder, the mesh
+ * is loaded once to build one and the cache rewritten with it. Queries are
+ * read and answered in chunks, and the tree pages are dropped again whenever
+ * the resident set grows past the budget.
+ * @param objFile Obj file path, the cache is next to it
+ * @param pointQueryFile Query file path
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Scan every block of the tree instead of walking it
+ * @param residentBudget Resident set size to stay under in megabytes, 0 for no limit
+ * @param linearBuild Build the tree from a linear BVH instead of a SAH one
+ * @param tinyObj Load the obj with tinyobjloader
+ * @return true Success
+ */
+bool runOutOfCore(const char* objFile, const char* pointQueryFile, const int& threadCount, const bool& bruteForce, const double& residentBudget, const bool& linearBuild, const bool& tinyObj)
+{
+    std::string cacheFile = MeshCache::pathFor(objFile);
+    OutOfCoreBVH tree;
+    bool mapped = MeshCache::isFresh(objFile, cacheFile) && MeshCache::readTree(cacheFile, tree);
+    if(mapped && tree.isLinear() != linearBuild)
+    {
+        printf("Mesh cache %s holds the tree of a %s BVH, rebuilding it\n", cacheFile.c_str(), tree.isLinear() ? "linear" : "SAH");
+        tree = OutOfCoreBVH();
+        mapped = false;
+    }
+    if(!mapped)
+    {
+        // mesh, BVH and the tree built from them are gone once it is written
+        {
+            Mesh mesh;
+            BVH bvh;
+            bool loaded = MeshCache::isFresh(objFile, cacheFile) && MeshCache::read(cacheFile, mesh, &bvh);
+            if(!loaded && !(tinyObj ? mesh.readObjTinyObj(objFile) : mesh.readObj(objFile, threadCount))) return false;
+            if(bvh.empty() || bvh.isLinear() != linearBuild)
+            {
+                if(linearBuild)
+                {
+                    bvh.buildLinear(mesh, threadCount);
+                }
+                else
+                {
+                    bvh.build(mesh);
+                }
+            }
+            OutOfCoreBVH built;
+            built.build(mesh, bvh);
+            if(!MeshCache::write(cacheFile, mesh, &bvh, &built))
+            {
+                printf("Could not write mesh cache %s\n", cacheFile.c_str());
+                return false;
+            }
+        }
+        if(!MeshCache::readTree(cacheFile, tree)) return false;
+    }
+    printf("Out of core tree mapped: %s. Node count: %d. Block count: %d. Size: %lu bytes\n", cacheFile.c_str(), tree.getNodeCount(), tree.getBlockCount(), tree.getMemoryUsage());
+    fflush(stdout);
+    if(residentBudget > 0.0 && residentMegabytes() < 0.0)
+    {
+        printf("Resident set size can't be measured on this platform, --max-rss is ignored\n");
+    }
+
+    std::ifstream input(pointQueryFile);
+    const size_t chunkSize = 64;
+    std::vector<QueryInput> queries;
+    std::vector<QueryHit> results;
+    QueryInput q;
+    bool more = true;
+    size_t queryCount = 0, releaseCount = 0;
+    double peakResident = -1.0;
+    while(more)
+    {
+        queries.clear();
+        while(queries.size() < chunkSize && (more = static_cast<bool>(input >> q.m_x >> q.m_y >> q.m_z >> q.m_radius)))
+        {
+            queries.push_back(q);
+        }
+
+        results.resize(queries.size());
+        parallelFor(queries.size(), threadCount, [&](size_t begin, size_t end) {
+            QueryContext context;
+            for(size_t i=begin; i<end; i++)
+            {
+                Eigen::Vector3d queryPoint(queries[i].m_x, queries[i].m_y, queries[i].m_z);
+                if(bruteForce)
+                {
+                    tree.bruteForce(queryPoint, queries[i].m_radius, results[i]);
+                }
+                else
+                {
+                    tree.query(queryPoint, queries[i].m_radius, context, results[i]);
+                }
+            }
+        }, 64);
+
+        std::string out;
+        for(size_t i=0; i<queries.size(); i++)
+        {
+            appendResult(out, queries[i], results[i]);
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        queryCount += queries.size();
+
+        const double resident = residentMegabytes();
+        peakResident = std::max(peakResident, resident);
+        if(residentBudget > 0.0 && resident > residentBudget)
+        {
+            tree.releasePages();
+            releaseCount++;
+        }
+    }
+    if(peakResident < 0.0)
+    {
+        printf("Out of core queries: %lu. Peak resident: unknown, tree pages released %lu times\n", queryCount, releaseCount);
+    }
+    else
+    {
+        printf("Out of core queries: %lu. Peak resident: %.1f MB, tree pages released %lu times\n", queryCount, peakResident, releaseCount);
+    }
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * @brief Server mode; load the given objs as mesh 0, 1, ... and answer framed
+ * requests (see QueryServer) on stdin / stdout, or on a Unix domain socket.
+ * In pipe mode stdout carries the responses only, everything printed goes to
+ * stderr instead.
+ * @param objFiles Objs to load up front
+ * @param socketPath Socket file path, NULL for stdin / stdout
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param useCache Load meshes from fresh mesh caches
+ * @return true Clean shutdown
+ */
+bool runServer(const std::vector<const char*>& objFiles, const char* socketPath, const int& threadCount, const bool& useCache)
+{
+#ifdef _WIN32
+    // the protocol is binary, no newline translation on the pipes
+    const int inFd = _fileno(stdin);
+    int outFd = _fileno(stdout);
+    if(!socketPath)
+    {
+        fflush(stdout);
+        _setmode(inFd, _O_BINARY);
+        _setmode(outFd, _O_BINARY);
+        outFd = _dup(outFd);
+        _dup2(_fileno(stderr), _fileno(stdout));
+    }
+#else
+    const int inFd = STDIN_FILENO;
+    int outFd = STDOUT_FILENO;
+    if(!socketPath)
+    {
+        fflush(stdout);
+        outFd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+#endif
+
+    QueryServer server(threadCount, useCache);
+    for(size_t i=0; i<objFiles.size(); i++)
+    {
+        if(!server.load(static_cast<uint32_t>(i), objFiles[i])) return false;
+    }
+    fprintf(stderr, "Server ready. Mesh count: %lu\n", server.getMeshCount());
+    return socketPath ? server.serveSocket(socketPath) : server.serve(inFd, outFd);
+}
+
+/**
+ * @brief One line of a ray file; origin, direction and max distance
+ */
+struct RayInput
+{
+    double m_ox, m_oy, m_oz, m_dx, m_dy, m_dz, m_maxDist;
+};
+
+/**
+ * @brief Ray mode; intersect every ray of the ray file with the mesh and print
+ * the hits in input order
+ * @param query Query object
+ * @param rayFile Ray file path, one "ox oy oz dx dy dz maxDist" per line
+ * @param threadCount Worker count, 0 for one per hardware thread
+ * @param bruteForce Intersect every face instead of walking the BVH
+ * @param packets Sort rays along a Morton curve of their origins and walk the BVH in packets
+ * @param anyHit Report any hit within the max distance instead of the first one
+ * @param cleanup Cleanup the mesh went through, face ids are printed as
+ * numbered in the obj; NULL if it wasn't cleaned
+ */
+void runRays(const PointQuery& query, const char* rayFile, const int& threadCount, const bool& bruteForce, const bool& packets, const bool& anyHit, const MeshCleanup* cleanup)
+{
+    std::ifstream input(rayFile);
+    std::vector<RayInput> rays;
+    RayInput r;
+    while(input >> r.m_ox >> r.m_oy >> r.m_oz >> r.m_dx >> r.m_dy >> r.m_dz >> r.m_maxDist)
+    {
+        rays.push_back(r);
+    }
+    fflush(stdout);
+
+    std::vector<Eigen::Vector3d> origins(rays.size()), directions(rays.size());
+    std::vector<double> maxDists(rays.size());
+    for(size_t i=0; i<rays.size(); i++)
+    {
+        origins[i] = Eigen::Vector3d(rays[i].m_ox, rays[i].m_oy, rays[i].m_oz);
+        directions[i] = Eigen::Vector3d(rays[i].m_dx, rays[i].m_dy, rays[i].m_dz);
+        maxDists[i] = rays[i].m_maxDist;
+    }
+
+    std::vector<RayHit> results(rays.size());
+    if(packets && !bruteForce)
+    {
+        std::vector<uint32_t> order;
+        mortonOrder(origins, order);
+
+        const size_t packetSize = QueryContext::kPacketSize;
+        const size_t packetCount = (rays.size() + packetSize - 1) / packetSize;
+        parallelFor(packetCount, threadCount, [&](size_t begin, size_t end) {
+            QueryContext context;
+            Eigen::Vector3d packetOrigins[QueryContext::kPacketSize], packetDirections[QueryContext::kPacketSize];
+            double packetDists[QueryContext::kPacketSize];
+            RayHit packetHits[QueryContext::kPacketSize];
+            for(size_t p=begin; p<end; p++)
+            {
+                const size_t first = p * packetSize;
+                const int count = static_cast<int>(std::min(packetSize, rays.size() - first));
+                for(int k=0; k<count; k++)
+                {
+                    packetOrigins[k] = origins[order[first + k]];
+                    packetDirections[k] = directions[order[first + k]];
+                    packetDists[k] = maxDists[order[first + k]];
+                }
+                query.intersectPacket(packetOrigins, packetDirections, packetDists, count, anyHit, context, packetHits);
+                for(int k=0; k<count; k++)
+                {
+                    results[order[first + k]] = packetHits[k];
+                }
+            }
+        }, 8);
+    }
+    else
+    {
+        parallelFor(rays.size(), threadCount, [&](size_t begin, size_t end) {
+            QueryContext context;
+            for(size_t i=begin; i<end; i++)
+            {
+                if(bruteForce)
+                {
+                    query.bruteForceIntersect(origins[i], directions[i], maxDists[i], results[i]);
+                }
+                else if(anyHit)
+                {
+                    query.intersectAny(origins[i], directions[i], maxDists[i], context, results[i]);
+                }
+                else
+                {
+                    query.intersect(origins[i], directions[i], maxDists[i], context, results[i]);
+                }
+            }
+        }, 64);
+    }
+
+    std::string out;
+    char line[512];
+    for(size_t i=0; i<rays.size(); i++)
+    {
+        const RayInput& in = rays[i];
+        const RayHit& hit = results[i];
+        out += "===============================================\n";
+        if(anyHit)
+        {
+            // which face an any hit query stops at depends on the walk, only report if it hit
+            snprintf(line, sizeof(line), "%s ray: %f %f %f dir: %f %f %f max distance: %f\n", hit.m_found ? "HIT" : "MISS", in.m_ox, in.m_oy, in.m_oz, in.m_dx, in.m_dy, in.m_dz, in.m_maxDist);
+        }
+        else if(hit.m_found)
+        {
+            snprintf(line, sizeof(line), "HIT face: %d pt: %f %f %f at t: %f ray: %f %f %f dir: %f %f %f\n", originalFace(cleanup, hit.m_faceId), hit.m_point.x(), hit.m_point.y(), hit.m_point.z(), hit.m_t, in.m_ox, in.m_oy, in.m_oz, in.m_dx, in.m_dy, in.m_dz);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "MISS ray: %f %f %f dir: %f %f %f max distance: %f\n", in.m_ox, in.m_oy, in.m_oz, in.m_dx, in.m_dy, in.m_dz, in.m_maxDist);
+        }
+        out += line;
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
 
 int main(int argc, char** argv)
 {
     Mesh mesh;
     const char * objFile = "../data/teapot.obj";
     const char * pointQueryFile = "../data/teapot_pts.txt";
+    bool bruteForce = false;
+    bool batch = false;
+    bool useCache = true;
+    bool tinyObj = false;
+    bool coherent = false;
+    bool packets = false;
+    int threadCount = 0;
+    std::vector<const char*> frames;
+    double rebuildThreshold = 2.0;
+    bool linearBuild = false;
+    bool range = false;
+    bool rays = false;
+    bool anyHit = false;
+    bool signedMode = false;
+    double fieldVoxelSize = 0.0;
+    bool compare = false;
+    bool hausdorffOnly = false;
+    const char* errorFile = NULL;
+    bool sceneMode = false;
+    bool serverMode = false;
+    bool printStatistics = false;
+    const char* socketPath = NULL;
+    double fieldBandWidth = 0.0;
+    std::string precision;
+    float epsilon = 0.0f;
+    double weldTolerance = -1.0;
+    bool outOfCore = false;
+    double residentBudget = 256.0;
+
+    // split flags from positional obj/query file arguments
+    std::vector<const char*> positional;
+    for(int i=1; i<argc; i++)
+    {
+        std::string arg(argv[i]);
+        if(arg == "--brute-force")
+        {
+            bruteForce = true;
+        }
+        else if(arg == "--no-cache")
+        {
+            useCache = false;
+        }
+        else if(arg == "--coherent")
+        {
+            coherent = true;
+        }
+        else if(arg == "--packets")
+        {
+            batch = true;
+            packets = true;
+        }
+        else if(arg == "--frame" && i+1<argc)
+        {
+            frames.push_back(argv[++i]);
+        }
+        else if(arg == "--rebuild-threshold" && i+1<argc)
+        {
+            rebuildThreshold = atof(argv[++i]);
+        }
+        else if(arg == "--range")
+        {
+            range = true;
+        }
+        else if(arg == "--rays")
+        {
+            rays = true;
+        }
+        else if(arg == "--any-hit")
+        {
+            anyHit = true;
+        }
+        else if(arg == "--signed")
+        {
+            signedMode = true;
+        }
+        else if(arg == "--field" && i+1<argc)
+        {
+            fieldVoxelSize = atof(argv[++i]);
+        }
+        else if(arg == "--band" && i+1<argc)
+        {
+            fieldBandWidth = atof(argv[++i]);
+        }
+        else if(arg == "--compare")
+        {
+            compare = true;
+        }
+        else if(arg == "--hausdorff")
+        {
+            compare = true;
+            hausdorffOnly = true;
+        }
+        else if(arg == "--errors" && i+1<argc)
+        {
+            errorFile = argv[++i];
+        }
+        else if(arg == "--stats")
+        {
+            printStatistics = true;
+        }
+        else if(arg == "--serve")
+        {
+            serverMode = true;
+        }
+        else if(arg == "--socket" && i+1<argc)
+        {
+            serverMode = true;
+            socketPath = argv[++i];
+        }
+        else if(arg == "--precision" && i+1<argc)
+        {
+            precision = argv[++i];
+            if(precision != "float" && precision != "double" && precision != "refine")
+            {
+                printf("Unknown precision %s, expected float, double or refine\n", precision.c_str());
+                return 1;
+            }
+        }
+        else if(arg == "--epsilon" && i+1<argc)
+        {
+            epsilon = static_cast<float>(atof(argv[++i]));
+            if(!(epsilon >= 0.0f))
+            {
+                printf("Epsilon has to be 0 or more\n");
+                return 1;
+            }
+        }
+        else if(arg == "--weld" && i+1<argc)
+        {
+            weldTolerance = atof(argv[++i]);
+            if(!(weldTolerance >= 0.0))
+            {
+                printf("Weld tolerance has to be 0 or more\n");
+                return 1;
+            }
+        }
+        else if(arg == "--out-of-core")
+        {
+            outOfCore = true;
+        }
+        else if(arg == "--max-rss" && i+1<argc)
+        {
+            outOfCore = true;
+            residentBudget = atof(argv[++i]);
+        }
+        else if(arg == "--scene")
+        {
+            sceneMode = true;
+        }
+        else if(arg == "--lbvh")
+        {
+            linearBuild = true;
+        }
+        else if(arg == "--tinyobj")
+        {
+            tinyObj = true;
+        }
+        else if(arg == "--batch")
+        {
+            batch = true;
+        }
+        else if(arg == "--threads" && i+1<argc)
+        {
+            batch = true;
+            threadCount = atoi(argv[++i]);
+        }
+        else
+        {
+            positional.push_back(argv[i]);
+        }
+    }
+
+    if(weldTolerance >= 0.0 && (serverMode || outOfCore || sceneMode || !frames.empty()))
+    {
+        printf("--weld can't be combined with --serve, --socket, --out-of-core, --scene or --frame\n");
+        return 1;
+    }
+
+    if(serverMode)
+    {
+        return runServer(positional, socketPath, threadCount, useCache) ? 0 : 1;
+    }
 
-    if(argc>2)
+    if(positional.size()>1)
     {
-        objFile = argv[1];
-        pointQueryFile = argv[2];
+        objFile = positional[0];
+        pointQueryFile = positional[1];
     }
     else
     {
         printf("No .obj file and/or query .txt file provided, using default test case\n");
     }
 
-    // read obj file
-    if(mesh.readObj(objFile))
+    if(outOfCore)
+    {
+        return runOutOfCore(objFile, pointQueryFile, batch ? threadCount : 1, bruteForce, residentBudget, linearBuild, tinyObj) ? 0 : 1;
+    }
+    if(sceneMode)
     {
-        PointQuery query(mesh);
-        std::ifstream input(pointQueryFile);
-        float x, y, z, querydist, dist;
+        return runScene(objFile, pointQueryFile, batch ? threadCount : 1, bruteForce) ? 0 : 1;
+    }
 
-        // read input query pts & distance
-        while(input >> x >> y >> z >> querydist)
+    // map the binary cache when it is newer than the obj, otherwise read the
+    // obj, build the BVH and write the cache for the next run. The cache holds
+    // the mesh as read, so cleaned meshes skip it. A cached BVH made by the
+    // other builder is rebuilt on the cached mesh and the cache rewritten.
+    if(weldTolerance >= 0.0)
+    {
+        useCache = false;
+    }
+    BVH bvh;
+    MeshCleanup cleanup;
+    const MeshCleanup* remap = weldTolerance >= 0.0 ? &cleanup : NULL;
+    bool loaded = false;
+    double buildSeconds = -1.0;
+    std::string cacheFile = MeshCache::pathFor(objFile);
+    if(useCache && MeshCache::isFresh(objFile, cacheFile))
+    {
+        loaded = MeshCache::read(cacheFile, mesh, &bvh);
+        if(loaded)
         {
-            std::cout << "===============================================" << std::endl;
-            dist = querydist;
-            Eigen::Vector3d queryPoint(x, y, z);
-            Eigen::Vector3d result = query(queryPoint, dist);
-            if(result != queryPoint)
-            {
-                printf("FOUND pt: %f %f %f within distance: %f to query pt: %f %f %f max search radius: %f\n", result.x(), result.y(), result.z(), dist, x, y, z, querydist);
-            }
-            else
+            printf("Mesh cache loaded: %s. Vertex count: %lu. Face count: %lu\n", cacheFile.c_str(), mesh.getVertexCount(), mesh.getFaceCount());
+        }
+        if(loaded && !bvh.empty() && bvh.isLinear() != linearBuild)
+        {
+            printf("Mesh cache %s holds a %s BVH, rebuilding it\n", cacheFile.c_str(), bvh.isLinear() ? "linear" : "SAH");
+            bvh = BVH();
+        }
+    }
+    if(!loaded && (tinyObj ? mesh.readObjTinyObj(objFile) : mesh.readObj(objFile, threadCount)))
+    {
+        loaded = true;
+        if(remap)
+        {
+            cleanup.run(mesh, weldTolerance, threadCount);
+            cleanup.printReport();
+        }
+    }
+    if(loaded && bvh.empty())
+    {
+        std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+        if(linearBuild)
+        {
+            bvh.buildLinear(mesh, threadCount);
+        }
+        else
+        {
+            bvh.build(mesh);
+        }
+        buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+        if(useCache && !MeshCache::write(cacheFile, mesh, &bvh))
+        {
+            printf("Could not write mesh cache %s\n", cacheFile.c_str());
+        }
+    }
+
+    if(loaded)
+    {
+        PointQuery query(mesh, std::move(bvh));
+        query.setRebuildThreshold(rebuildThreshold);
+        if(rays)
+        {
+            runRays(query, pointQueryFile, batch ? threadCount : 1, bruteForce, packets, anyHit, remap);
+            return 0;
+        }
+        if(signedMode)
+        {
+            runSigned(query, pointQueryFile, batch ? threadCount : 1, bruteForce);
+            return 0;
+        }
+        if(compare)
+        {
+            return runCompare(query, pointQueryFile, batch ? threadCount : 1, hausdorffOnly, errorFile, remap) ? 0 : 1;
+        }
+        if(fieldVoxelSize > 0.0)
+        {
+            // default band: half a brick on each side of the surface
+            const double band = fieldBandWidth > 0.0 ? fieldBandWidth : 4.0 * fieldVoxelSize;
+            runField(query, pointQueryFile, batch ? threadCount : 1, fieldVoxelSize, band);
+            return 0;
+        }
+        if(precision == "double" || (precision.empty() && epsilon > 0.0f))
+        {
+            runEngine<DoublePolicy>(query, pointQueryFile, batch ? threadCount : 1, bruteForce, false, epsilon);
+            return 0;
+        }
+        if(!precision.empty())
+        {
+            runEngine<FloatPolicy>(query, pointQueryFile, batch ? threadCount : 1, bruteForce, precision == "refine", epsilon);
+            return 0;
+        }
+        if(range)
+        {
+            runRange(query, pointQueryFile, batch ? threadCount : 1, bruteForce, remap);
+            return 0;
+        }
+        std::vector<TraversalStats> stats;
+        runQueries(query, pointQueryFile, batch, threadCount, bruteForce, coherent, packets, printStatistics ? &stats : NULL);
+
+        // deforming mesh: refit to every frame and query it again
+        for(size_t f=0; f<frames.size(); f++)
+        {
+            Mesh frame;
+            if(!frame.readObj(frames[f], threadCount)) return 1;
+
+            ArrayView<uint32_t> indices = mesh.getIndices(), frameIndices = frame.getIndices();
+            if(frame.getVertexCount() != mesh.getVertexCount() || frameIndices.size() != indices.size() ||
+               !std::equal(indices.begin(), indices.end(), frameIndices.begin()))
             {
-                printf("NOT FOUND pt within distance %f to query pt %f %f %f\n", dist, x, y, z);
+                printf("Frame %s does not have the topology of %s\n", frames[f], objFile);
+                return 1;
             }
+
+            mesh.setPositions(frame.getX(), frame.getY(), frame.getZ());
+            bool rebuilt = query.refit(threadCount);
+            printf("Frame %s: %s, BVH cost ratio %.3f\n", frames[f], rebuilt ? "rebuilt" : "refit", query.getBVH().inflation());
+            runQueries(query, pointQueryFile, batch, threadCount, bruteForce, coherent, packets, printStatistics ? &stats : NULL);
+        }
+        if(printStatistics)
+        {
+            printStats(query, buildSeconds, stats);
         }
     }
-}
\ No newline at end of file
+}